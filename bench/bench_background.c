@@ -0,0 +1,184 @@
+/*
+ Background model benchmark for jit.freenect.background.c.
+
+ Learns an empty scene from noisy frames with flickering holes, then masks
+ frames with objects in front of it. Every kernel level is checked against a
+ straightforward version, over raw and registered depth, with and without
+ a model and through decimated and cropped windows. Then learning and masking
+ a 640x480 frame are timed against what a patch did before: depth converted
+ to float32, then one full-size float matrix per jit.op (subtract the
+ background, compare with the tolerance, convert the result to char).
+
+   bench_background
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "jit.freenect.background.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+#define LEARN 8
+#define FRAMES 200
+
+static uint16_t frame[NPIX], reference_model[NPIX];
+static uint8_t mask[NPIX];
+static float lut[FREENECT_DEPTH_LUT_SIZE];
+static float depth_f[NPIX], background_f[NPIX], difference_f[NPIX], compared_f[NPIX];
+
+// An empty scene, or with a box in front of it
+static void make_frame(long n, int objects, uint16_t invalid){
+	uint32_t seed = 99 + (uint32_t)n * 17;
+	long i, x, y;
+
+	for(i=0;i<NPIX;i++){
+		x = i % WIDTH;
+		y = i / WIDTH;
+		seed = seed * 1103515245u + 12345u;
+		frame[i] = (uint16_t)((invalid ? 600 : 1500) + x / 4 + ((seed >> 20) & 0x3));
+		if(((seed >> 8) & 0x3F) == 0){
+			frame[i] = invalid;
+		}
+		// Never seen while learning
+		if((x >= 600) && (y < 40) && !objects){
+			frame[i] = invalid;
+		}
+		if(objects && (x >= 200) && (x < 330) && (y >= 100) && (y < 300) && (frame[i] != invalid)){
+			frame[i] = (uint16_t)(frame[i] - ((x < 260) ? 100 : 3));
+		}
+	}
+}
+
+static uint8_t reference_mask(const uint16_t *model, long i, uint16_t invalid, uint16_t tolerance){
+	if(frame[i] == invalid){
+		return 0;
+	}
+	if(!model || (model[i] == invalid)){
+		return FREENECT_FOREGROUND;
+	}
+	return (frame[i] + tolerance < model[i]) ? FREENECT_FOREGROUND : 0;
+}
+
+static int check(uint16_t invalid, t_freenect_cpu_level level){
+	static const long rois[3][4] = {{0, 0, 0, 0}, {13, 7, 601, 211}, {590, 0, 0, 64}};
+	t_freenect_background b;
+	t_freenect_window w;
+	uint16_t tolerance = 10;
+	long n, i, r, f, row, col;
+	int learnt;
+
+	memset(&b, 0, sizeof(b));
+	if(freenect_background_init(&b, WIDTH, HEIGHT, invalid)){
+		fprintf(stderr, "FAIL: cannot allocate the model\n");
+		return 1;
+	}
+	for(i=0;i<NPIX;i++){
+		reference_model[i] = invalid;
+	}
+	for(n=0;n<LEARN;n++){
+		make_frame(n, 0, invalid);
+		freenect_background_learn_rows_level(&b, frame, 0, 13, level);
+		freenect_background_learn_rows_level(&b, frame, 13, HEIGHT, level);
+		for(i=0;i<NPIX;i++){
+			if((frame[i] != invalid) && ((reference_model[i] == invalid) || (frame[i] < reference_model[i]))){
+				reference_model[i] = frame[i];
+			}
+		}
+	}
+	make_frame(LEARN, 1, invalid);
+	for(learnt=0;learnt<2;learnt++){
+		for(r=0;r<3;r++){
+			for(f=1;f<=4;f*=2){
+				freenect_window_init(&w, WIDTH, HEIGHT, rois[r], f, FREENECT_DECIMATE_NEAREST);
+				for(row=0;row<w.height;row++){
+					freenect_background_mask_row_level(learnt ? &b : NULL, &w, frame, WIDTH, row, invalid, tolerance, mask, level);
+					for(col=0;col<w.width;col++){
+						i = (w.y + row * f) * WIDTH + w.x + col * f;
+						if(mask[col] != reference_mask(learnt ? reference_model : NULL, i, invalid, tolerance)){
+							fprintf(stderr, "MISMATCH: %s, invalid %u, %s, x%ld at %ld %ld: %u\n", freenect_cpu_level_name(level), invalid,
+									learnt ? "learnt" : "no model", f, i % WIDTH, i / WIDTH, mask[col]);
+							freenect_background_free(&b);
+							return 1;
+						}
+					}
+				}
+			}
+		}
+	}
+	freenect_background_free(&b);
+	return 0;
+}
+
+int main(void){
+	t_freenect_cpu_level best = freenect_cpu_detect(), level;
+	t_freenect_background b;
+	t_freenect_window w;
+	long i, row;
+	int failed = 0, f;
+	double t, learn_ms, mask_ms, chain_ms;
+
+	freenect_kernels_init();
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		failed |= check(FREENECT_DEPTH_MAX, level);
+		failed |= check(0, level);
+	}
+
+	memset(&b, 0, sizeof(b));
+	freenect_background_init(&b, WIDTH, HEIGHT, FREENECT_DEPTH_MAX);
+	make_frame(0, 0, FREENECT_DEPTH_MAX);
+	freenect_window_init(&w, WIDTH, HEIGHT, NULL, 1, FREENECT_DECIMATE_NEAREST);
+	freenect_depth_lut_fill(lut, FREENECT_DEPTH_FLOAT32, 4, NULL);
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		// No SSSE3 versions
+		if(level == FREENECT_CPU_SSSE3){
+			continue;
+		}
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			freenect_background_learn_rows_level(&b, frame, 0, HEIGHT, level);
+		}
+		learn_ms = (bench_now() - t) * 1e3 / FRAMES;
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			for(row=0;row<HEIGHT;row++){
+				freenect_background_mask_row_level(&b, &w, frame, WIDTH, row, FREENECT_DEPTH_MAX, 10, mask + row * WIDTH, level);
+			}
+		}
+		mask_ms = (bench_now() - t) * 1e3 / FRAMES;
+		printf("{\"bench\":\"background\",\"level\":\"%s\",\"learn_ms\":%.3f,\"mask_ms\":%.3f}\n",
+			   freenect_cpu_level_name(level), learn_ms, mask_ms);
+	}
+
+	// The float32 output, then jit.op @op - , jit.op @op > and a char jit.matrix
+	freenect_convert_depth_rows(frame, WIDTH, (char *)background_f, WIDTH * sizeof(float), FREENECT_DEPTH_FLOAT32, lut, FREENECT_DEPTH_MAX, 0, HEIGHT);
+	t = bench_now();
+	for(f=0;f<FRAMES;f++){
+		freenect_convert_depth_rows(frame, WIDTH, (char *)depth_f, WIDTH * sizeof(float), FREENECT_DEPTH_FLOAT32, lut, FREENECT_DEPTH_MAX, 0, HEIGHT);
+		for(i=0;i<NPIX;i++){
+			difference_f[i] = background_f[i] - depth_f[i];
+		}
+		for(i=0;i<NPIX;i++){
+			compared_f[i] = difference_f[i] > 0.05f;
+		}
+		for(i=0;i<NPIX;i++){
+			mask[i] = (uint8_t)(compared_f[i] * 255.f);
+		}
+	}
+	chain_ms = (bench_now() - t) * 1e3 / FRAMES;
+	t = bench_now();
+	for(f=0;f<FRAMES;f++){
+		freenect_convert_depth_rows(frame, WIDTH, (char *)depth_f, WIDTH * sizeof(float), FREENECT_DEPTH_FLOAT32, lut, FREENECT_DEPTH_MAX, 0, HEIGHT);
+		for(row=0;row<HEIGHT;row++){
+			freenect_background_mask_row(&b, &w, frame, WIDTH, row, FREENECT_DEPTH_MAX, 10, mask + row * WIDTH);
+		}
+	}
+	t = (bench_now() - t) * 1e3 / FRAMES;
+	printf("{\"bench\":\"background\",\"float32_and_jit_op_chain_ms\":%.3f,\"float32_and_mask_ms\":%.3f,\"speedup\":%.1f}\n",
+		   chain_ms, t, chain_ms / t);
+	freenect_background_free(&b);
+
+	printf("{\"bench\":\"background\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
@@ -0,0 +1,121 @@
+/*
+ Demosaicing benchmark for jit.freenect.bayer.c.
+
+ Checks both methods at every kernel level against a straightforward
+ version, on the full frame and on small frames that leave SIMD tails, then
+ times a 640x480 frame. libfreenect's own demosaic, which format rgb runs on
+ the USB event thread, is a bilinear one in plain C, close to the scalar
+ level here.
+
+   bench_bayer
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "jit.freenect.bayer.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+#define FRAMES 200
+
+static uint8_t raw[NPIX], rgb[NPIX * 3], expected[NPIX * 3];
+
+static uint8_t at(long x, long y, long width, long height){
+	x = (x < 0) ? -x : ((x >= width) ? 2 * width - 2 - x : x);
+	y = (y < 0) ? -y : ((y >= height) ? 2 * height - 2 - y : y);
+	return raw[y * width + x];
+}
+
+static uint8_t avg(uint8_t a, uint8_t b){
+	return (uint8_t)((a + b + 1) >> 1);
+}
+
+static void reference(long width, long height, int method){
+	long x, y;
+	uint8_t *out, h, v, cross, diag;
+
+	for(y=0;y<height;y++){
+		for(x=0;x<width;x++){
+			out = expected + (y * width + x) * 3;
+			if(method == FREENECT_BAYER_SUPERPIXEL){
+				out[0] = at((x & ~1L) + 1, y & ~1L, width, height);
+				out[1] = avg(at(x & ~1L, y & ~1L, width, height), at((x & ~1L) + 1, (y & ~1L) + 1, width, height));
+				out[2] = at(x & ~1L, (y & ~1L) + 1, width, height);
+				continue;
+			}
+			h = avg(at(x - 1, y, width, height), at(x + 1, y, width, height));
+			v = avg(at(x, y - 1, width, height), at(x, y + 1, width, height));
+			cross = avg(h, v);
+			diag = avg(avg(at(x - 1, y - 1, width, height), at(x + 1, y - 1, width, height)),
+					   avg(at(x - 1, y + 1, width, height), at(x + 1, y + 1, width, height)));
+			// G R / B G
+			if(!(y & 1) && !(x & 1)){
+				out[0] = h; out[1] = at(x, y, width, height); out[2] = v;
+			}
+			else if(!(y & 1)){
+				out[0] = at(x, y, width, height); out[1] = cross; out[2] = diag;
+			}
+			else if(!(x & 1)){
+				out[0] = diag; out[1] = cross; out[2] = at(x, y, width, height);
+			}
+			else{
+				out[0] = v; out[1] = at(x, y, width, height); out[2] = h;
+			}
+		}
+	}
+}
+
+static int check(long width, long height, int method, t_freenect_cpu_level level){
+	long i;
+
+	reference(width, height, method);
+	memset(rgb, 0, width * height * 3);
+	freenect_bayer_rows_level(raw, rgb, width, height, method, 0, 1, level);
+	freenect_bayer_rows_level(raw, rgb, width, height, method, 1, height, level);
+	for(i=0;i<width*height*3;i++){
+		if(rgb[i] != expected[i]){
+			fprintf(stderr, "MISMATCH: %s, %s, %ldx%ld at %ld %ld plane %ld: %u, expected %u\n", freenect_cpu_level_name(level),
+					method ? "superpixel" : "bilinear", width, height, (i / 3) % width, (i / 3) / width, i % 3, rgb[i], expected[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(void){
+	static const long sizes[3][2] = {{WIDTH, HEIGHT}, {38, 6}, {70, 4}};
+	t_freenect_cpu_level best = freenect_cpu_detect(), level;
+	int failed = 0, method, s, f;
+	double t;
+
+	freenect_kernels_init();
+	bench_fill_bytes(raw, NPIX);
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		for(method=FREENECT_BAYER_BILINEAR;method<=FREENECT_BAYER_SUPERPIXEL;method++){
+			for(s=0;s<3;s++){
+				failed |= check(sizes[s][0], sizes[s][1], method, level);
+			}
+		}
+	}
+
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		// No SSE2 versions
+		if(level == FREENECT_CPU_SSE2){
+			continue;
+		}
+		for(method=FREENECT_BAYER_BILINEAR;method<=FREENECT_BAYER_SUPERPIXEL;method++){
+			t = bench_now();
+			for(f=0;f<FRAMES;f++){
+				freenect_bayer_rows_level(raw, rgb, WIDTH, HEIGHT, method, 0, HEIGHT, level);
+			}
+			t = (bench_now() - t) * 1e3 / FRAMES;
+			printf("{\"bench\":\"bayer\",\"level\":\"%s\",\"method\":\"%s\",\"ms\":%.3f}\n", freenect_cpu_level_name(level),
+				   method ? "superpixel" : "bilinear", t);
+		}
+	}
+
+	printf("{\"bench\":\"bayer\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
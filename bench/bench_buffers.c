@@ -0,0 +1,147 @@
+/*
+ Frame buffer pool test for jit.freenect.buffers.c.
+
+ Checks that buffers are aligned, that one given back is handed out again
+ for the same size, that the footprint adds up and that no more than
+ FREENECT_BUFFER_IDLE_MAX bytes stay idle however many grabbers close. Then
+ times taking and giving back a set of 640x480 frame buffers, the way an
+ open and a close do, against malloc and free, and the first pass over a
+ fresh buffer against one over a reused buffer, with and without huge pages.
+
+   bench_buffers
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "jit.freenect.buffers.h"
+#include "bench_util.h"
+
+#define DEPTH_BYTES (640 * 480 * 2)
+#define VIDEO_BYTES (640 * 480 * 3)
+#define SET 6           // raw depth and video, triple buffered
+#define GRABBERS 40
+#define ROUNDS 200
+
+static int check_footprint(uint64_t used, uint64_t idle, long count){
+	t_freenect_buffer_footprint f;
+
+	freenect_buffers_footprint(&f);
+	if((f.used != used) || (f.idle != idle) || (f.buffers != count)){
+		fprintf(stderr, "FAIL: footprint %llu used, %llu idle, %ld buffers, expected %llu, %llu, %ld\n",
+				(unsigned long long)f.used, (unsigned long long)f.idle, f.buffers,
+				(unsigned long long)used, (unsigned long long)idle, count);
+		return 1;
+	}
+	return 0;
+}
+
+static int check(void){
+	void *a, *b, *sets[GRABBERS][SET];
+	size_t size;
+	long i, j;
+	int failed = 0;
+	t_freenect_buffer_footprint f;
+
+	a = freenect_buffer_get(DEPTH_BYTES + 1);
+	size = freenect_buffer_size(a);
+	if(!a || ((uintptr_t)a % FREENECT_BUFFER_ALIGN) || (size < DEPTH_BYTES + 1) || (size % FREENECT_BUFFER_ALIGN)){
+		fprintf(stderr, "FAIL: buffer %p of %zu bytes\n", a, size);
+		return 1;
+	}
+	failed |= check_footprint(size, 0, 1);
+	memset(a, 1, DEPTH_BYTES + 1);
+	freenect_buffer_put(a);
+	failed |= check_footprint(0, size, 0);
+	b = freenect_buffer_get(DEPTH_BYTES + 1);
+	if(b != a){
+		fprintf(stderr, "FAIL: an idle buffer of the same size was not reused\n");
+		failed = 1;
+	}
+	freenect_buffer_put(b);
+	freenect_buffer_put(NULL);
+
+	// Every grabber opens, then every one closes
+	for(i=0;i<GRABBERS;i++){
+		for(j=0;j<SET;j++){
+			sets[i][j] = freenect_buffer_get(j & 1 ? VIDEO_BYTES : DEPTH_BYTES);
+			if(!sets[i][j]){
+				fprintf(stderr, "FAIL: out of memory\n");
+				return 1;
+			}
+		}
+	}
+	for(i=0;i<GRABBERS;i++){
+		for(j=0;j<SET;j++){
+			freenect_buffer_put(sets[i][j]);
+		}
+	}
+	freenect_buffers_footprint(&f);
+	if(f.used || f.buffers || (f.idle > FREENECT_BUFFER_IDLE_MAX)){
+		fprintf(stderr, "FAIL: %llu bytes idle after every grabber closed\n", (unsigned long long)f.idle);
+		failed = 1;
+	}
+	freenect_buffers_trim();
+	failed |= check_footprint(0, 0, 0);
+	return failed;
+}
+
+static double time_sets(int pooled){
+	void *set[SET];
+	double t;
+	int r, j;
+
+	t = bench_now();
+	for(r=0;r<ROUNDS;r++){
+		for(j=0;j<SET;j++){
+			set[j] = pooled ? freenect_buffer_get(j & 1 ? VIDEO_BYTES : DEPTH_BYTES) : malloc(j & 1 ? VIDEO_BYTES : DEPTH_BYTES);
+		}
+		// Touch a byte, or the allocator gives the same untouched pages back
+		for(j=0;j<SET;j++){
+			((char *)set[j])[0] = (char)r;
+			pooled ? freenect_buffer_put(set[j]) : free(set[j]);
+		}
+	}
+	return (bench_now() - t) * 1e6 / ROUNDS;
+}
+
+// ms for a first and for a second pass over a video frame
+static void time_touch(double *first, double *second){
+	double t;
+	char *p;
+	int r;
+
+	*first = *second = 0;
+	for(r=0;r<ROUNDS/10;r++){
+		p = (char *)freenect_buffer_get(VIDEO_BYTES * 4);
+		t = bench_now();
+		memset(p, r, VIDEO_BYTES * 4);
+		*first += bench_now() - t;
+		t = bench_now();
+		memset(p, r + 1, VIDEO_BYTES * 4);
+		*second += bench_now() - t;
+		freenect_buffer_put(p);
+		freenect_buffers_trim();
+	}
+	*first *= 1e3 / (ROUNDS / 10);
+	*second *= 1e3 / (ROUNDS / 10);
+}
+
+int main(void){
+	int failed, huge;
+	double first, second;
+
+	failed = check();
+	printf("{\"bench\":\"buffers\",\"set\":\"%dx640x480\",\"malloc_us\":%.2f,\"pool_us\":%.2f}\n",
+		   SET, time_sets(0), time_sets(1));
+	freenect_buffers_trim();
+	for(huge=0;huge<2;huge++){
+		freenect_buffers_set_huge(huge);
+		time_touch(&first, &second);
+		printf("{\"bench\":\"buffers\",\"huge\":%d,\"bytes\":%d,\"first_touch_ms\":%.3f,\"second_touch_ms\":%.3f}\n",
+			   huge, VIDEO_BYTES * 4, first, second);
+	}
+	freenect_buffers_set_huge(0);
+
+	printf("{\"bench\":\"buffers\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
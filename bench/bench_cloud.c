@@ -0,0 +1,162 @@
+/*
+ Point cloud (mode 4) benchmark for jit.freenect.cloud.c.
+
+ For 3, 5 and 8 planes, and raw as well as registered depth, every kernel
+ level the CPU supports is checked bit for bit against the scalar version,
+ then timed over full 640x480 frames on one thread, where the fastest level has to
+ stay under 2 ms. It is then timed again with the rows spread over the
+ conversion pool. Points are also
+ spot-checked against freenect_depth_metres().
+
+   bench_cloud [threads]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "jit.freenect.cloud.h"
+#include "jit.freenect.pool.h"
+#include "jit.freenect.sim.h"
+#include "jit.freenect.lut.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+#define FRAMES 100
+
+static uint16_t depth[NPIX], depth_mm[NPIX];
+static uint8_t video[NPIX*3];
+static float out[NPIX*FREENECT_CLOUD_MAX_PLANES], ref[NPIX*FREENECT_CLOUD_MAX_PLANES];
+
+typedef struct {
+	t_freenect_cloud    *cloud;
+	const uint16_t      *depth;
+	long                planes;
+} t_cloud_job;
+
+static void cloud_job_rows(void *ctx, long begin, long end){
+	t_cloud_job *job = (t_cloud_job *)ctx;
+	freenect_cloud_rows(job->cloud, job->depth, video, 3, (char *)out, WIDTH * job->planes * sizeof(float), job->planes, begin, end);
+}
+
+// A few points against the formula, away from the kernels
+static int spot_check(t_freenect_cloud *cloud, const uint16_t *in, const float *points, long planes){
+	long p, col, row;
+	const float *pt;
+	float z;
+
+	for(p=0;p<NPIX;p+=7919){
+		col = p % WIDTH;
+		row = p / WIDTH;
+		pt = points + p * planes;
+		if(!cloud->metres){
+			z = in[p] * 0.001f;
+		}
+		else{
+			z = (float)freenect_depth_metres(in[p]);
+		}
+		if((fabsf(pt[2] + z) > 1e-5f) ||
+		   (fabsf(pt[0] - (col - cloud->intrinsics.cx) / cloud->intrinsics.fx * z) > 1e-4f) ||
+		   (fabsf(pt[1] + (row - cloud->intrinsics.cy) / cloud->intrinsics.fy * z) > 1e-4f) ||
+		   ((planes >= 5) && ((fabsf(pt[3] - (float)col / WIDTH) > 1e-6f) || (fabsf(pt[4] - (float)row / HEIGHT) > 1e-6f))) ||
+		   ((planes >= 8) && (fabsf(pt[5] - video[p * 3] / 255.f) > 1e-6f))){
+			fprintf(stderr, "FAIL: point %ld is off\n", p);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv){
+	static const long plane_counts[3] = {3, 5, 8};
+	long threads = argc > 1 ? atol(argv[1]) : 0;
+	t_freenect_cpu_level best, level;
+	const t_freenect_lut *lut;
+	const float *metres;
+	t_freenect_cloud cloud;
+	t_freenect_job job;
+	t_cloud_job ctx;
+	const uint16_t *in;
+	long i, planes, bytes;
+	int f, mm, failed = 0;
+	double t, ms, best_ms;
+
+	freenect_kernels_init();
+	best = freenect_cpu_detect();
+	// Raw depth goes through the default calibration's metres table, as in the external
+	lut = freenect_lut_acquire(FREENECT_DEPTH_FLOAT32, 4, 0, NULL);
+	metres = (const float *)lut->table;
+	freenect_sim_render_depth(depth, WIDTH, HEIGHT, 10);
+	freenect_sim_render_video(video, WIDTH, HEIGHT, 3, 10);
+	for(i=0;i<NPIX;i++){
+		// Registered depth: millimetres, 0 without a reading
+		depth_mm[i] = (uint16_t)(freenect_depth_metres(depth[i]) * 1000.);
+	}
+	memset(&cloud, 0, sizeof(cloud));
+
+	for(mm=0;mm<2;mm++){
+		in = mm ? depth_mm : depth;
+		if(freenect_cloud_init(&cloud, WIDTH, HEIGHT, mm ? &freenect_video_intrinsics : &freenect_depth_intrinsics, mm ? NULL : metres)){
+			fprintf(stderr, "FAIL: out of memory\n");
+			return 1;
+		}
+		for(i=0;i<3;i++){
+			planes = plane_counts[i];
+			bytes = NPIX * planes * sizeof(float);
+			freenect_cloud_rows_level(&cloud, in, video, 3, (char *)ref, WIDTH * planes * sizeof(float), planes, 0, HEIGHT, FREENECT_CPU_SCALAR);
+			failed |= spot_check(&cloud, in, ref, planes);
+			best_ms = 0;
+			for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+				if(level == FREENECT_CPU_SSSE3){
+					continue;
+				}
+				memset(out, 0xAB, bytes);
+				freenect_cloud_rows_level(&cloud, in, video, 3, (char *)out, WIDTH * planes * sizeof(float), planes, 0, HEIGHT, level);
+				if(memcmp(out, ref, bytes)){
+					fprintf(stderr, "MISMATCH: %ld planes %s differs from scalar\n", planes, freenect_cpu_level_name(level));
+					failed = 1;
+				}
+				t = bench_now();
+				for(f=0;f<FRAMES;f++){
+					freenect_cloud_rows_level(&cloud, in, video, 3, (char *)out, WIDTH * planes * sizeof(float), planes, 0, HEIGHT, level);
+				}
+				ms = (bench_now() - t) * 1e3 / FRAMES;
+				if(!best_ms || (ms < best_ms)){
+					best_ms = ms;
+				}
+				printf("{\"bench\":\"cloud\",\"depth\":\"%s\",\"planes\":%ld,\"level\":\"%s\",\"threads\":1,\"ms_per_frame\":%.3f}\n",
+					   mm ? "registered" : "raw", planes, freenect_cpu_level_name(level), ms);
+			}
+			// The budget for a cloud of any plane count on one core
+			if(best_ms > 2.){
+				fprintf(stderr, "FAIL: %ld planes take %.2f ms on one thread, over 2 ms\n", planes, best_ms);
+				failed = 1;
+			}
+
+			ctx.cloud = &cloud;
+			ctx.depth = in;
+			ctx.planes = planes;
+			job.fn = cloud_job_rows;
+			job.ctx = &ctx;
+			job.rows = HEIGHT;
+			job.bytes = bytes;
+			freenect_pool_set_threads(threads);
+			t = bench_now();
+			for(f=0;f<FRAMES;f++){
+				freenect_pool_run(&job, 1);
+			}
+			printf("{\"bench\":\"cloud\",\"depth\":\"%s\",\"planes\":%ld,\"level\":\"%s\",\"threads\":%ld,\"ms_per_frame\":%.3f}\n",
+				   mm ? "registered" : "raw", planes, freenect_cpu_level_name(freenect_kernels.level), freenect_pool_get_threads(),
+				   (bench_now() - t) * 1e3 / FRAMES);
+			if(memcmp(out, ref, bytes)){
+				fprintf(stderr, "MISMATCH: %ld planes differ when spread over the pool\n", planes);
+				failed = 1;
+			}
+		}
+	}
+	freenect_cloud_free(&cloud);
+	freenect_lut_release(lut);
+	printf("{\"bench\":\"cloud\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
@@ -0,0 +1,162 @@
+/*
+ Compression ratio and speed of the depth codec in jit.freenect.codec.c.
+
+ Frames come from a capture file (raw 640x480 16-bit frames back to back, the
+ format 'open sim' reads) or, without one, from the simulated device with
+ Kinect-like noise added: +-1 jitter on most pixels and speckles of invalid
+ samples. Every frame is checked to decode to itself at every kernel level,
+ and truncated or corrupted streams must be rejected without crashing. One
+ JSON line per level:
+
+   bench_codec [depth file] [invalid]
+
+ invalid is the value of pixels without depth, 2047 by default (0 for
+ registered depth).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "jit.freenect.codec.h"
+#include "jit.freenect.sim.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH * HEIGHT)
+#define MAX_FRAMES 300
+#define SIM_FRAMES 60
+#define ROUNDS 5
+
+static uint16_t *load_frames(const char *path, long *count){
+	uint16_t *frames;
+	FILE *f = fopen(path, "rb");
+	long size;
+
+	if(!f){
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	*count = size / (NPIX * 2);
+	if(*count > MAX_FRAMES){
+		*count = MAX_FRAMES;
+	}
+	frames = (uint16_t *)malloc(*count * NPIX * 2);
+	if(!*count || !frames || (fread(frames, NPIX * 2, *count, f) != (size_t)*count)){
+		free(frames);
+		frames = NULL;
+	}
+	fclose(f);
+	return frames;
+}
+
+static uint16_t *make_frames(long *count){
+	uint16_t *frames = (uint16_t *)malloc(SIM_FRAMES * NPIX * 2), *d;
+	uint32_t seed = 4242;
+	long f, i;
+
+	for(f=0;f<SIM_FRAMES;f++){
+		d = frames + f * NPIX;
+		freenect_sim_render_depth(d, WIDTH, HEIGHT, f * 3);
+		for(i=0;i<NPIX;i++){
+			seed = seed * 1103515245u + 12345u;
+			if(d[i] == FREENECT_DEPTH_MAX){
+				continue;
+			}
+			if(((seed >> 16) & 0x7F) == 0){
+				d[i] = FREENECT_DEPTH_MAX;
+			}
+			else{
+				d[i] = (uint16_t)(d[i] + (long)((seed >> 24) % 3) - 1);
+			}
+		}
+	}
+	*count = SIM_FRAMES;
+	return frames;
+}
+
+// Cut-off and damaged streams have to fail cleanly or decode to something, never overrun
+static int check_malformed(const uint8_t *packed, long size, uint16_t *out){
+	uint8_t *copy = (uint8_t *)malloc(size);
+	long cut, i;
+	int level;
+
+	for(level=FREENECT_CPU_SCALAR;level<=(int)freenect_cpu_detect();level++){
+		for(cut=0;cut<size;cut+=size/97+1){
+			memcpy(copy, packed, cut);
+			if(!freenect_depth_decode_level(copy, cut, out, NPIX, level)){
+				fprintf(stderr, "FAIL: %ld of %ld bytes decoded\n", cut, size);
+				free(copy);
+				return 1;
+			}
+		}
+		for(i=0;i<200;i++){
+			memcpy(copy, packed, size);
+			copy[2 + (i * 7919) % (size - 2)] ^= (uint8_t)(i | 1);
+			freenect_depth_decode_level(copy, size, out, NPIX, level);
+		}
+	}
+	free(copy);
+	return 0;
+}
+
+int main(int argc, char **argv){
+	uint16_t invalid = argc > 2 ? (uint16_t)atoi(argv[2]) : FREENECT_DEPTH_MAX;
+	uint16_t *frames, *out;
+	uint8_t *packed;
+	long count = 0, bound = freenect_depth_encode_bound(NPIX), *sizes, f, r;
+	double t, encode_time = 0, decode_time, total = 0;
+	int level, failed = 0;
+
+	freenect_kernels_init();
+	frames = argc > 1 ? load_frames(argv[1], &count) : make_frames(&count);
+	if(!frames){
+		fprintf(stderr, "FAIL: cannot read %s\n", argv[1]);
+		return 1;
+	}
+	packed = (uint8_t *)malloc(count * bound);
+	sizes = (long *)malloc(count * sizeof(long));
+	out = (uint16_t *)malloc(NPIX * 2);
+
+	for(r=0;r<ROUNDS;r++){
+		t = bench_now();
+		for(f=0;f<count;f++){
+			sizes[f] = freenect_depth_encode(frames + f * NPIX, NPIX, invalid, packed + f * bound);
+		}
+		encode_time += bench_now() - t;
+	}
+	for(f=0;f<count;f++){
+		total += sizes[f];
+	}
+
+	for(level=FREENECT_CPU_SCALAR;level<=(int)freenect_cpu_detect();level++){
+		for(f=0;f<count;f++){
+			if(freenect_depth_decode_level(packed + f * bound, sizes[f], out, NPIX, level) ||
+			   memcmp(out, frames + f * NPIX, NPIX * 2)){
+				fprintf(stderr, "FAIL: frame %ld does not survive %s\n", f, freenect_cpu_level_name(level));
+				failed = 1;
+				break;
+			}
+		}
+		decode_time = 0;
+		for(r=0;r<ROUNDS;r++){
+			t = bench_now();
+			for(f=0;f<count;f++){
+				freenect_depth_decode_level(packed + f * bound, sizes[f], out, NPIX, level);
+			}
+			decode_time += bench_now() - t;
+		}
+		printf("{\"bench\":\"codec\",\"source\":\"%s\",\"level\":\"%s\",\"frames\":%ld,\"ratio\":%.2f,"
+			   "\"bytes_per_frame\":%.0f,\"encode_MB_per_s\":%.0f,\"decode_MB_per_s\":%.0f}\n",
+			   argc > 1 ? "file" : "sim", freenect_cpu_level_name(level), count, count * NPIX * 2. / total, total / count,
+			   count * ROUNDS * NPIX * 2. / encode_time / 1e6, count * ROUNDS * NPIX * 2. / decode_time / 1e6);
+	}
+
+	failed |= check_malformed(packed, sizes[0], out);
+	free(frames);
+	free(packed);
+	free(sizes);
+	free(out);
+	return failed;
+}
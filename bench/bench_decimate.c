@@ -0,0 +1,193 @@
+/*
+ Region of interest and decimation benchmark for jit.freenect.decimate.c.
+
+ Every method, factor and kernel level is checked against a straightforward
+ version, over raw and registered depth with holes and with regions of
+ interest that are clipped to the frame. Then a float32 depth frame is timed
+ the way the external converts it: the whole frame, and decimated rows fed
+ to the same lookup table kernel.
+
+   bench_decimate
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "jit.freenect.decimate.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+#define FRAMES 200
+
+static uint16_t depth[NPIX], depth_mm[NPIX];
+static uint8_t video[NPIX*3];
+static float lut[FREENECT_DEPTH_LUT_SIZE];
+static float out[NPIX];
+
+static const char *method_names[3] = {"nearest", "min", "median"};
+
+static int cmp_u16(const void *a, const void *b){
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+// The block at output (col, row), without any of the kernels' tricks
+static uint16_t reference(const t_freenect_window *w, const uint16_t *src, long col, long row, uint16_t invalid){
+	uint16_t v[FREENECT_DECIMATE_MAX * FREENECT_DECIMATE_MAX];
+	long i, j, n = 0, step = 1;
+	long x = w->x + col * w->factor, y = w->y + row * w->factor;
+
+	if(w->method == FREENECT_DECIMATE_NEAREST){
+		return src[y * WIDTH + x];
+	}
+	// The median of an 8x8 block only looks at every other pixel of every other row
+	if((w->method == FREENECT_DECIMATE_MEDIAN) && (w->factor == 8)){
+		step = 2;
+	}
+	for(i=0;i<w->factor;i+=step){
+		for(j=0;j<w->factor;j+=step){
+			if(src[(y + i) * WIDTH + x + j] != invalid){
+				v[n++] = src[(y + i) * WIDTH + x + j];
+			}
+		}
+	}
+	if(!n){
+		return invalid;
+	}
+	qsort(v, n, sizeof(uint16_t), cmp_u16);
+	return (w->method == FREENECT_DECIMATE_MIN) ? v[0] : v[(n - 1) / 2];
+}
+
+static int check_window(const t_freenect_window *w, const long *roi){
+	if((w->width < 1) || (w->height < 1) || (w->x < 0) || (w->y < 0) ||
+	   (w->x + w->width * w->factor > WIDTH) || (w->y + w->height * w->factor > HEIGHT)){
+		fprintf(stderr, "FAIL: roi %ld %ld %ld %ld gives a window outside the frame\n", roi[0], roi[1], roi[2], roi[3]);
+		return 1;
+	}
+	return 0;
+}
+
+static int check_depth(const t_freenect_window *w, const uint16_t *src, uint16_t invalid, t_freenect_cpu_level level){
+	uint16_t scratch[WIDTH];
+	const uint16_t *row;
+	long i, j;
+
+	for(i=0;i<w->height;i++){
+		memset(scratch, 0xAB, sizeof(scratch));
+		row = freenect_decimate_depth_row_level(w, src, WIDTH, scratch, i, invalid, level);
+		for(j=0;j<w->width;j++){
+			if(row[j] != reference(w, src, j, i, invalid)){
+				fprintf(stderr, "MISMATCH: %s x%ld %s at %ld %ld of window %ld %ld, %u for %u\n", method_names[w->method], w->factor,
+						freenect_cpu_level_name(level), j, i, w->x, w->y, row[j], reference(w, src, j, i, invalid));
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int check_video(const t_freenect_window *w){
+	uint8_t scratch[WIDTH * 3];
+	const uint8_t *row;
+	long i, j;
+
+	for(i=0;i<w->height;i++){
+		row = freenect_decimate_video_row(w, video, WIDTH, 3, scratch, i);
+		for(j=0;j<w->width;j++){
+			if(memcmp(row + j * 3, video + ((w->y + i * w->factor) * WIDTH + w->x + j * w->factor) * 3, 3)){
+				fprintf(stderr, "MISMATCH: video x%ld at %ld %ld\n", w->factor, j, i);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+int main(void){
+	static const long rois[5][4] = {
+		{0, 0, 0, 0},           // whole frame
+		{37, 21, 301, 203},     // odd corner and size
+		{600, 400, 200, 200},   // runs off the bottom right
+		{639, 479, 1, 1},       // smaller than a block, in the corner
+		{-5, -5, 64, 48}
+	};
+	t_freenect_cpu_level best = freenect_cpu_detect(), level;
+	t_freenect_window w;
+	uint16_t scratch[WIDTH];
+	const uint16_t *row;
+	long i, j, r, factor;
+	int method, mm, f, failed = 0;
+	double t, full_ms;
+
+	freenect_kernels_init();
+	bench_fill_depth(depth, NPIX);
+	bench_fill_bytes(video, NPIX * 3);
+	// A region without any reading, so some blocks have nothing to give
+	for(i=100;i<140;i++){
+		for(j=200;j<260;j++){
+			depth[i * WIDTH + j] = FREENECT_DEPTH_MAX;
+		}
+	}
+	for(i=0;i<NPIX;i++){
+		// Registered depth: millimetres, 0 without a reading
+		depth_mm[i] = (uint16_t)(freenect_depth_metres(depth[i]) * 1000.);
+	}
+	freenect_depth_lut_fill(lut, FREENECT_DEPTH_FLOAT32, 4, NULL);
+
+	for(r=0;r<5;r++){
+		for(factor=1;factor<=FREENECT_DECIMATE_MAX;factor*=2){
+			for(method=FREENECT_DECIMATE_NEAREST;method<=FREENECT_DECIMATE_MEDIAN;method++){
+				freenect_window_init(&w, WIDTH, HEIGHT, rois[r], factor, method);
+				if(check_window(&w, rois[r])){
+					failed = 1;
+					continue;
+				}
+				failed |= check_video(&w);
+				for(mm=0;mm<2;mm++){
+					for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+						failed |= check_depth(&w, mm ? depth_mm : depth, mm ? 0 : FREENECT_DEPTH_MAX, level);
+					}
+				}
+			}
+		}
+	}
+	freenect_window_init(&w, WIDTH, HEIGHT, rois[0], 1, 0);
+	if(!freenect_window_is_full(&w, WIDTH, HEIGHT) || (w.width != WIDTH) || (w.height != HEIGHT)){
+		fprintf(stderr, "FAIL: the default window is not the whole frame\n");
+		failed = 1;
+	}
+
+	t = bench_now();
+	for(f=0;f<FRAMES;f++){
+		freenect_convert_depth_rows(depth, WIDTH, (char *)out, WIDTH * sizeof(float), FREENECT_DEPTH_FLOAT32, lut, FREENECT_DEPTH_MAX, 0, HEIGHT);
+	}
+	full_ms = (bench_now() - t) * 1e3 / FRAMES;
+	printf("{\"bench\":\"decimate\",\"factor\":1,\"method\":\"full\",\"level\":\"%s\",\"ms_per_frame\":%.3f}\n",
+		   freenect_cpu_level_name(freenect_kernels.level), full_ms);
+
+	for(factor=2;factor<=FREENECT_DECIMATE_MAX;factor*=2){
+		for(method=FREENECT_DECIMATE_NEAREST;method<=FREENECT_DECIMATE_MEDIAN;method++){
+			freenect_window_init(&w, WIDTH, HEIGHT, NULL, factor, method);
+			for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+				// Nearest has no SIMD version
+				if((level == FREENECT_CPU_SSSE3) || ((method == FREENECT_DECIMATE_NEAREST) && (level != FREENECT_CPU_SCALAR))){
+					continue;
+				}
+				t = bench_now();
+				for(f=0;f<FRAMES;f++){
+					for(i=0;i<w.height;i++){
+						row = freenect_decimate_depth_row_level(&w, depth, WIDTH, scratch, i, FREENECT_DEPTH_MAX, level);
+						freenect_convert_depth_rows(row, w.width, (char *)(out + i * w.width), w.width * sizeof(float),
+													FREENECT_DEPTH_FLOAT32, lut, FREENECT_DEPTH_MAX, 0, 1);
+					}
+				}
+				t = (bench_now() - t) * 1e3 / FRAMES;
+				printf("{\"bench\":\"decimate\",\"factor\":%ld,\"method\":\"%s\",\"level\":\"%s\",\"ms_per_frame\":%.3f,\"speedup\":%.1f}\n",
+					   factor, method_names[method], freenect_cpu_level_name(level), t, full_ms / t);
+			}
+		}
+	}
+
+	printf("{\"bench\":\"decimate\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
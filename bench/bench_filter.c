@@ -0,0 +1,222 @@
+/*
+ Depth filter benchmark for jit.freenect.filter.c.
+
+ Feeds a sequence of noisy frames, with a block that jumps back and forth,
+ flickering holes and a region that loses its readings for a while, through
+ every stage at every kernel level and checks each output frame against a
+ straightforward version: the temporal stages pixel by pixel, the medians by
+ sorting the readings of each window. Raw and registered depth are both
+ checked. Then each stage is timed on a 640x480 frame.
+
+   bench_filter
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "jit.freenect.filter.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+#define SEQUENCE 16
+#define FRAMES 200
+
+static uint16_t base[NPIX], frame[NPIX];
+static uint16_t expected[NPIX];
+static float ref_average[NPIX];
+static uint16_t ref_last[NPIX], ref_age[NPIX];
+
+static int cmp_u16(const void *a, const void *b){
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+// Frame n of the sequence, with invalid marking the pixels without a reading
+static void make_frame(long n, uint16_t invalid){
+	uint32_t seed = 777 + (uint32_t)n * 31;
+	long i, x, y;
+
+	for(i=0;i<NPIX;i++){
+		x = i % WIDTH;
+		y = i / WIDTH;
+		seed = seed * 1103515245u + 12345u;
+		frame[i] = (base[i] == 0x7FF) ? invalid : (uint16_t)(base[i] + ((seed >> 20) & 0x7) - 3);
+		if((x >= 300) && (x < 380) && (y >= 200) && (y < 260) && ((n / 4) & 1) && (frame[i] != invalid)){
+			frame[i] = (uint16_t)(frame[i] + 150);
+		}
+		if(((x * 7 + y * 3 + n) % 11) == 0){
+			frame[i] = invalid;
+		}
+		if((x >= 40) && (x < 120) && (y >= 40) && (y < 90) && (n >= 6) && (n < 12)){
+			frame[i] = invalid;
+		}
+	}
+}
+
+static void reference_temporal(const t_freenect_filter_params *p, const uint16_t *src, uint16_t *out){
+	long i;
+	float v, h;
+
+	for(i=0;i<NPIX;i++){
+		out[i] = src[i];
+		if((p->smooth > 0.f) && (src[i] != p->invalid)){
+			v = (float)src[i];
+			h = ref_average[i];
+			if((h < 0.f) || (fabsf(v - h) > p->threshold)){
+				h = v;
+			}
+			else{
+				h = h + (1.f - p->smooth) * (v - h);
+			}
+			ref_average[i] = h;
+			out[i] = (uint16_t)lrintf(floorf(h + 0.5f));
+		}
+		if(p->holefill > 0){
+			if(out[i] != p->invalid){
+				ref_last[i] = out[i];
+				ref_age[i] = 0;
+			}
+			else{
+				if(ref_age[i] < 0xFFFF){
+					ref_age[i]++;
+				}
+				if(ref_age[i] <= p->holefill){
+					out[i] = ref_last[i];
+				}
+			}
+		}
+	}
+}
+
+static void reference_median(const t_freenect_filter_params *p, const uint16_t *src, uint16_t *out){
+	uint16_t v[9];
+	long x, y, i, j, n, r = p->median / 2;
+
+	for(y=0;y<HEIGHT;y++){
+		for(x=0;x<WIDTH;x++){
+			n = 0;
+			for(i=y-r;i<=y+r;i++){
+				for(j=x-r;j<=x+r;j++){
+					if((i >= 0) && (i < HEIGHT) && (j >= 0) && (j < WIDTH) && (src[i * WIDTH + j] != p->invalid)){
+						v[n++] = src[i * WIDTH + j];
+					}
+				}
+			}
+			qsort(v, n, sizeof(uint16_t), cmp_u16);
+			out[y * WIDTH + x] = n ? v[(n - 1) / 2] : p->invalid;
+		}
+	}
+}
+
+static int compare(const uint16_t *got, const uint16_t *want, const char *stage, const t_freenect_filter_params *p,
+				   long n, t_freenect_cpu_level level){
+	long i;
+
+	for(i=0;i<NPIX;i++){
+		if(got[i] != want[i]){
+			fprintf(stderr, "MISMATCH: %s %s, invalid %u, frame %ld at %ld %ld: %u for %u\n", stage, freenect_cpu_level_name(level),
+					p->invalid, n, i % WIDTH, i / WIDTH, got[i], want[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Runs the whole sequence through the filter and the reference side by side
+static int check(const t_freenect_filter_params *p, t_freenect_cpu_level level){
+	static uint16_t temporal[NPIX];
+	t_freenect_filter f;
+	const uint16_t *src;
+	long n, i;
+	int failed = 0;
+
+	memset(&f, 0, sizeof(f));
+	if(freenect_filter_init(&f, WIDTH, HEIGHT)){
+		fprintf(stderr, "FAIL: cannot allocate the filter\n");
+		return 1;
+	}
+	for(i=0;i<NPIX;i++){
+		ref_average[i] = -1.f;
+		ref_age[i] = 0xFFFF;
+		ref_last[i] = 0;
+	}
+	for(n=0;(n<SEQUENCE) && !failed;n++){
+		make_frame(n, p->invalid);
+		src = frame;
+		if(freenect_filter_temporal_enabled(p)){
+			// Split in two, the way the pool hands out rows
+			freenect_filter_temporal_rows_level(&f, p, frame, 0, 101, level);
+			freenect_filter_temporal_rows_level(&f, p, frame, 101, HEIGHT, level);
+			reference_temporal(p, frame, temporal);
+			failed |= compare(f.temporal, temporal, "temporal", p, n, level);
+			src = f.temporal;
+		}
+		if(freenect_filter_median_enabled(p) && !failed){
+			freenect_filter_median_rows_level(&f, p, src, 0, 7, level);
+			freenect_filter_median_rows_level(&f, p, src, 7, HEIGHT, level);
+			reference_median(p, src, expected);
+			failed |= compare(f.median, expected, "median", p, n, level);
+		}
+	}
+	freenect_filter_free(&f);
+	return failed;
+}
+
+int main(void){
+	static const t_freenect_filter_params stages[5] = {
+		{0.7f, 8.f, 0, 0, 0},
+		{0.f, 0.f, 3, 0, 0},
+		{0.9f, 2.f, 4, 0, 0},
+		{0.f, 0.f, 0, 3, 0},
+		{0.5f, 10.f, 2, 3, 0}
+	};
+	t_freenect_cpu_level best = freenect_cpu_detect(), level;
+	t_freenect_filter_params p;
+	t_freenect_filter f;
+	long s, invalid, i;
+	int failed = 0;
+	double t;
+
+	freenect_kernels_init();
+	bench_fill_depth(base, NPIX);
+
+	for(s=0;s<5;s++){
+		for(invalid=0;invalid<2;invalid++){
+			p = stages[s];
+			p.invalid = invalid ? 0 : FREENECT_DEPTH_MAX;
+			for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+				failed |= check(&p, level);
+			}
+		}
+	}
+
+	memset(&f, 0, sizeof(f));
+	freenect_filter_init(&f, WIDTH, HEIGHT);
+	make_frame(0, FREENECT_DEPTH_MAX);
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		// No SSSE3 versions
+		if(level == FREENECT_CPU_SSSE3){
+			continue;
+		}
+		p = stages[2];
+		p.invalid = FREENECT_DEPTH_MAX;
+		t = bench_now();
+		for(i=0;i<FRAMES;i++){
+			freenect_filter_temporal_rows_level(&f, &p, frame, 0, HEIGHT, level);
+		}
+		printf("{\"bench\":\"filter\",\"stage\":\"temporal\",\"level\":\"%s\",\"ms_per_frame\":%.3f}\n",
+			   freenect_cpu_level_name(level), (bench_now() - t) * 1e3 / FRAMES);
+		p.median = 3;
+		t = bench_now();
+		for(i=0;i<FRAMES;i++){
+			freenect_filter_median_rows_level(&f, &p, frame, 0, HEIGHT, level);
+		}
+		printf("{\"bench\":\"filter\",\"stage\":\"median\",\"level\":\"%s\",\"ms_per_frame\":%.3f}\n",
+			   freenect_cpu_level_name(level), (bench_now() - t) * 1e3 / FRAMES);
+	}
+	freenect_filter_free(&f);
+
+	printf("{\"bench\":\"filter\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
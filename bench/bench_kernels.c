@@ -0,0 +1,211 @@
+/*
+ Microbenchmark for the jit.freenect.grab conversion kernels.
+
+ Every kernel level supported by the host CPU is first checked for bit-exact
+ output against the original per-sample loops, then timed over full 640x480
+ frames. Registered (millimetre) frames reaching past FREENECT_DEPTH_MM_MAX are
+ checked in every mode and type against the linear conversions. Output is one
+ line per kernel:
+
+   kernel level ns/frame MB/s
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "jit.freenect.kernels.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+#define FRAMES 200
+
+static uint16_t depth[NPIX];
+static uint8_t rgb[NPIX*3];
+static float lut_f32[FREENECT_DEPTH_LUT_SIZE];
+static double lut_f64[FREENECT_DEPTH_LUT_SIZE];
+static int32_t lut_i32[FREENECT_DEPTH_LUT_SIZE];
+static uint16_t depth_mm[NPIX];
+static float mm_f32[FREENECT_DEPTH_MM_LUT_SIZE];
+static double mm_f64[FREENECT_DEPTH_MM_LUT_SIZE];
+static int32_t mm_i32[FREENECT_DEPTH_MM_LUT_SIZE];
+
+static void make_luts(void){
+	// Centimetres with the default calibration, as the external's mode 3
+	freenect_depth_lut_fill(lut_f32, FREENECT_DEPTH_FLOAT32, 3, NULL);
+	freenect_depth_lut_fill(lut_f64, FREENECT_DEPTH_FLOAT64, 3, NULL);
+	freenect_depth_lut_fill(lut_i32, FREENECT_DEPTH_LONG, 3, NULL);
+}
+
+// Registered depth from 0.5 to 12.5 m, past the end of the table, with dropouts at 0
+static void fill_depth_mm(uint16_t *d, long n){
+	uint32_t seed = 4242;
+	long i;
+	for(i=0;i<n;i++){
+		seed = seed * 1103515245u + 12345u;
+		d[i] = (((seed >> 16) & 0x1F) == 0) ? 0 : (uint16_t)(500 + ((seed >> 8) % 12000));
+	}
+}
+
+// What each mode means for millimetres, computed without the tables
+static double mm_reference(uint16_t d, int mode){
+	double mm = (d > FREENECT_DEPTH_MM_MAX) ? FREENECT_DEPTH_MM_MAX : d;
+	switch(mode){
+		case 1: return mm * (1.0 / (double)FREENECT_DEPTH_MM_MAX);
+		case 2: return (mm > 0.) ? 1.0 - (mm * (1.0 / (double)FREENECT_DEPTH_MM_MAX)) : 0.;
+		case 3: return mm * 0.1;
+		case 4: return mm * 0.001;
+		default: return mm;
+	}
+}
+
+static int32_t mm_reference_i32(uint16_t d, int mode){
+	int32_t mm = (d > FREENECT_DEPTH_MM_MAX) ? FREENECT_DEPTH_MM_MAX : d;
+	switch(mode){
+		case 2: return mm ? FREENECT_DEPTH_MM_MAX - mm : 0;
+		case 3: return (mm + 5) / 10;
+		default: return mm;
+	}
+}
+
+static int check_mm(const t_freenect_kernels *k){
+	static float out_f32[NPIX];
+	static double out_f64[NPIX];
+	static int32_t out_i32[NPIX];
+	int mode, failed = 0;
+	long i;
+
+	for(mode=0;mode<FREENECT_DEPTH_MODES;mode++){
+		freenect_depth_mm_lut_fill(mm_f32, FREENECT_DEPTH_FLOAT32, mode);
+		freenect_depth_mm_lut_fill(mm_f64, FREENECT_DEPTH_FLOAT64, mode);
+		freenect_depth_mm_lut_fill(mm_i32, FREENECT_DEPTH_LONG, mode);
+		k->depth_lut_f32(depth_mm, out_f32, NPIX, mm_f32, FREENECT_DEPTH_MM_MAX);
+		k->depth_lut_f64(depth_mm, out_f64, NPIX, mm_f64, FREENECT_DEPTH_MM_MAX);
+		k->depth_lut_i32(depth_mm, out_i32, NPIX, mm_i32, FREENECT_DEPTH_MM_MAX);
+		for(i=0;i<NPIX;i++){
+			if((out_f32[i] != (float)mm_reference(depth_mm[i], mode)) ||
+			   (out_f64[i] != mm_reference(depth_mm[i], mode)) ||
+			   (out_i32[i] != mm_reference_i32(depth_mm[i], mode))){
+				fprintf(stderr, "MISMATCH: depth mm mode %d %s differs from reference at %u mm\n",
+						mode, freenect_cpu_level_name(k->level), depth_mm[i]);
+				failed = 1;
+				break;
+			}
+		}
+	}
+	return failed;
+}
+
+static int check(const char *name, t_freenect_cpu_level level, const void *got, const void *ref, size_t bytes){
+	if(memcmp(got, ref, bytes)){
+		fprintf(stderr, "MISMATCH: %s %s differs from reference\n", name, freenect_cpu_level_name(level));
+		return 1;
+	}
+	return 0;
+}
+
+static void report(const char *name, t_freenect_cpu_level level, double seconds, size_t bytes_per_frame){
+	double ns = seconds * 1e9 / FRAMES;
+	double mbs = (double)bytes_per_frame * FRAMES / seconds / (1024. * 1024.);
+	printf("%-16s %-7s %10.0f ns/frame %9.1f MB/s\n", name, freenect_cpu_level_name(level), ns, mbs);
+}
+
+int main(void){
+	static float out_f32[NPIX], ref_lut_f32[NPIX];
+	static double out_f64[NPIX], ref_f64[NPIX];
+	static int32_t out_i32[NPIX], ref_i32[NPIX];
+	static uint8_t out_argb[NPIX*4], ref_argb[NPIX*4];
+	t_freenect_cpu_level best = freenect_cpu_detect();
+	t_freenect_kernels k;
+	int level, f, y, failed = 0;
+	long i;
+	double t;
+
+	bench_fill_depth(depth, NPIX);
+	fill_depth_mm(depth_mm, NPIX);
+	bench_fill_bytes(rgb, sizeof(rgb));
+	make_luts();
+
+	// Reference results: the loops copy_depth_data used before the kernels
+	for(i=0;i<NPIX;i++){
+		ref_lut_f32[i] = lut_f32[depth[i]];
+		ref_f64[i] = lut_f64[depth[i]];
+		ref_i32[i] = lut_i32[depth[i]];
+		ref_argb[i*4] = 0xFF;
+		ref_argb[i*4+1] = rgb[i*3];
+		ref_argb[i*4+2] = rgb[i*3+1];
+		ref_argb[i*4+3] = rgb[i*3+2];
+	}
+
+	for(level=FREENECT_CPU_SCALAR;level<=(int)best;level++){
+		freenect_kernels_select(&k, (t_freenect_cpu_level)level);
+
+		memset(out_f32, 0, sizeof(out_f32));
+		k.depth_lut_f32(depth, out_f32, NPIX, lut_f32, FREENECT_DEPTH_MAX);
+		failed |= check("depth float32", k.level, out_f32, ref_lut_f32, sizeof(out_f32));
+
+		memset(out_f64, 0, sizeof(out_f64));
+		k.depth_lut_f64(depth, out_f64, NPIX, lut_f64, FREENECT_DEPTH_MAX);
+		failed |= check("depth float64", k.level, out_f64, ref_f64, sizeof(out_f64));
+
+		memset(out_i32, 0, sizeof(out_i32));
+		k.depth_lut_i32(depth, out_i32, NPIX, lut_i32, FREENECT_DEPTH_MAX);
+		failed |= check("depth long", k.level, out_i32, ref_i32, sizeof(out_i32));
+
+		failed |= check_mm(&k);
+
+		// Odd row lengths exercise the scalar tails
+		memset(out_argb, 0, sizeof(out_argb));
+		for(y=0;y<HEIGHT;y++){
+			k.rgb_to_argb(rgb + y*WIDTH*3, out_argb + y*WIDTH*4, WIDTH - (y % 37));
+		}
+		for(y=0;y<HEIGHT;y++){
+			failed |= check("rgb argb", k.level, out_argb + y*WIDTH*4, ref_argb + y*WIDTH*4, (WIDTH - (y % 37)) * 4);
+		}
+
+		// Row by row, as copy_depth_data calls them
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			for(y=0;y<HEIGHT;y++){
+				k.depth_lut_f32(depth + y*WIDTH, out_f32 + y*WIDTH, WIDTH, lut_f32, FREENECT_DEPTH_MAX);
+			}
+		}
+		report("depth float32", k.level, bench_now() - t, sizeof(out_f32));
+
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			for(y=0;y<HEIGHT;y++){
+				k.depth_lut_f64(depth + y*WIDTH, out_f64 + y*WIDTH, WIDTH, lut_f64, FREENECT_DEPTH_MAX);
+			}
+		}
+		report("depth float64", k.level, bench_now() - t, sizeof(out_f64));
+
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			for(y=0;y<HEIGHT;y++){
+				k.depth_lut_i32(depth + y*WIDTH, out_i32 + y*WIDTH, WIDTH, lut_i32, FREENECT_DEPTH_MAX);
+			}
+		}
+		report("depth long", k.level, bench_now() - t, sizeof(out_i32));
+
+		// Registered depth, centimetres through the larger table
+		freenect_depth_mm_lut_fill(mm_f32, FREENECT_DEPTH_FLOAT32, 3);
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			for(y=0;y<HEIGHT;y++){
+				k.depth_lut_f32(depth_mm + y*WIDTH, out_f32 + y*WIDTH, WIDTH, mm_f32, FREENECT_DEPTH_MM_MAX);
+			}
+		}
+		report("depth mm float32", k.level, bench_now() - t, sizeof(out_f32));
+
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			for(y=0;y<HEIGHT;y++){
+				k.rgb_to_argb(rgb + y*WIDTH*3, out_argb + y*WIDTH*4, WIDTH);
+			}
+		}
+		report("rgb argb", k.level, bench_now() - t, sizeof(out_argb));
+	}
+
+	return failed;
+}
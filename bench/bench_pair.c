@@ -0,0 +1,166 @@
+/*
+ Stress test for the depth/video pairing in jit.freenect.pair.c.
+
+ A producer thread plays the capture thread: it writes depth and video frames
+ into the buffers the pairer hands out, with a fixed offset between the two
+ clocks, some jitter, and a few video frames missing. The device clock starts
+ just before it wraps. A consumer thread takes pairs the way matrix_calc
+ does and checks that:
+
+   - both frames of a pair come from the same capture (same frame number),
+   - the skew is within the tolerance,
+   - a held pair is not overwritten while the consumer works on it.
+
+ Reports pairs/s, drops, |skew| p50/p99 and the time from the second frame
+ of a pair being pushed to the consumer picking it up.
+
+   bench_pair [seconds] [fps]
+
+ fps 0 pushes as fast as possible.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "jit.freenect.pair.h"
+#include "bench_util.h"
+
+#define FRAME_BYTES 4096
+#define PERIOD_TICKS (FREENECT_PAIR_CLOCK / 30)
+#define OFFSET_TICKS 40000          // video lags depth by 0.67 ms
+#define JITTER_TICKS 20000
+#define TOLERANCE_TICKS (PERIOD_TICKS / 2)
+#define MAX_SAMPLES 200000
+
+typedef struct {
+	uint64_t    frame;
+	double      pushed;             // when the frame was handed to the pairer
+	uint64_t    check;
+} t_stamp;
+
+static t_freenect_pairer pairer;
+static t_freenect_sem sem;
+static int stop;
+static double skews[MAX_SAMPLES], latencies[MAX_SAMPLES];
+static long nskews, nlatencies;
+static uint64_t received, bad;
+
+static void write_frame(void *buffer, uint64_t frame){
+	t_stamp *stamp = (t_stamp *)buffer;
+	stamp->frame = frame;
+	stamp->check = frame * 2654435761u;
+	stamp->pushed = bench_now();
+	((uint64_t *)buffer)[FRAME_BYTES / 8 - 1] = frame;
+}
+
+static int frame_intact(const void *buffer, uint64_t frame){
+	const t_stamp *stamp = (const t_stamp *)buffer;
+	return (stamp->frame == frame) && (stamp->check == frame * 2654435761u) &&
+		   (((const uint64_t *)buffer)[FRAME_BYTES / 8 - 1] == frame);
+}
+
+static void *consumer_threadproc(void *arg){
+	t_freenect_pair *pair;
+	t_stamp *depth, *video;
+	volatile uint64_t sink = 0;
+	double now;
+	int i;
+
+	while(1){
+		freenect_sem_wait(&sem);
+		if(__atomic_load_n(&stop, __ATOMIC_ACQUIRE)){
+			break;
+		}
+		if(!freenect_pairer_acquire(&pairer)){
+			continue;
+		}
+		now = bench_now();
+		pair = freenect_pairer_front(&pairer);
+		depth = (t_stamp *)pair->depth.data;
+		video = (t_stamp *)pair->video.data;
+		received++;
+		if((depth->frame != video->frame) || (pair->skew > TOLERANCE_TICKS) || (pair->skew < -TOLERANCE_TICKS)){
+			bad++;
+		}
+		if(nlatencies < MAX_SAMPLES){
+			latencies[nlatencies++] = now - (depth->pushed > video->pushed ? depth->pushed : video->pushed);
+			skews[nskews++] = pair->skew < 0 ? -pair->skew : pair->skew;
+		}
+		// Work on the pair for a while, as a conversion would, then check nothing moved
+		for(i=0;i<2000;i++){
+			sink += ((uint64_t *)depth)[i % (FRAME_BYTES / 8)];
+		}
+		if(!frame_intact(depth, depth->frame) || !frame_intact(video, depth->frame)){
+			bad++;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv){
+	double seconds = argc > 1 ? atof(argv[1]) : 2.;
+	double fps = argc > 2 ? atof(argv[2]) : 30.;
+	uint32_t base = 0xFFFFFFFFu - 50 * PERIOD_TICKS;
+	uint32_t seed = 99, jitter;
+	uint64_t n = 0, missing = 0;
+	pthread_t consumer;
+	t_bench_stats skew, latency;
+	double start, next;
+	void *buffer;
+
+	if(freenect_pairer_init(&pairer, FRAME_BYTES, FRAME_BYTES) || freenect_sem_init(&sem)){
+		fprintf(stderr, "FAIL: init\n");
+		return 1;
+	}
+	freenect_pairer_set_tolerance(&pairer, TOLERANCE_TICKS);
+	pthread_create(&consumer, NULL, consumer_threadproc, NULL);
+
+	start = next = bench_now();
+	while(bench_now() - start < seconds){
+		seed = seed * 1103515245u + 12345u;
+		jitter = (seed >> 16) % JITTER_TICKS;
+
+		buffer = freenect_pairer_fill(&pairer, FREENECT_PAIR_DEPTH);
+		write_frame(buffer, n);
+		freenect_pairer_push(&pairer, FREENECT_PAIR_DEPTH, buffer, base + (uint32_t)(n * PERIOD_TICKS) + jitter, 0);
+		freenect_sem_post(&sem);
+
+		// One video frame in 32 never arrives
+		if(((seed >> 24) & 0x1F) != 0){
+			buffer = freenect_pairer_fill(&pairer, FREENECT_PAIR_VIDEO);
+			write_frame(buffer, n);
+			freenect_pairer_push(&pairer, FREENECT_PAIR_VIDEO, buffer, base + (uint32_t)(n * PERIOD_TICKS) + OFFSET_TICKS + jitter / 2, 0);
+			freenect_sem_post(&sem);
+		}
+		else{
+			missing++;
+		}
+		n++;
+
+		if(fps > 0){
+			next += 1. / fps;
+			while(bench_now() < next){
+				usleep(200);
+			}
+		}
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	freenect_sem_post(&sem);
+	pthread_join(consumer, NULL);
+
+	skew = bench_stats(skews, nskews);
+	latency = bench_stats(latencies, nlatencies);
+	printf("{\"bench\":\"pair\",\"fps\":%.0f,\"frames\":%llu,\"published\":%llu,\"received\":%llu,\"missing_video\":%llu,"
+		   "\"dropped_depth\":%llu,\"dropped_video\":%llu,\"skew_p50_us\":%.0f,\"skew_p99_us\":%.0f,"
+		   "\"latency_p50_us\":%.1f,\"latency_p99_us\":%.1f,\"ok\":%s}\n",
+		   fps, (unsigned long long)n, (unsigned long long)pairer.published, (unsigned long long)received,
+		   (unsigned long long)missing, (unsigned long long)pairer.dropped[FREENECT_PAIR_DEPTH],
+		   (unsigned long long)pairer.dropped[FREENECT_PAIR_VIDEO],
+		   skew.p50 * 1e6 / FREENECT_PAIR_CLOCK, skew.p99 * 1e6 / FREENECT_PAIR_CLOCK,
+		   latency.p50 * 1e6, latency.p99 * 1e6, (bad || !received) ? "false" : "true");
+
+	freenect_sem_destroy(&sem);
+	freenect_pairer_free(&pairer);
+	return bad || !received;
+}
@@ -0,0 +1,282 @@
+/*
+ Regression benchmark suite for the jit.freenect.grab frame pipeline.
+
+ Covers the code matrix_calc runs for every frame, with the same functions
+ the external calls:
+
+   lut      freenect_depth_lut_fill for every type and mode, and a hit in the
+            shared table cache (freenect_lut_acquire), what matrix_calc pays
+   depth    freenect_convert_depth_rows (copy_depth_data) to float32, float64, long
+   rgb      freenect_convert_rgb_rows (copy_rgb_data) to ARGB, packed RGB and IR
+   pool     depth float64 and ARGB converted together on the thread pool
+   handoff  triple buffer hand-off with a producer publishing as fast as it
+            can while the consumer converts every frame it gets
+
+ Every case is timed per iteration. One JSON object per line is printed with
+ the mean (ns_per_frame), throughput (MB_per_s, bytes written) and p50/p99
+ in nanoseconds, so runs can be diffed between releases.
+
+   bench_pipeline [iterations] [handoff seconds]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "jit.freenect.kernels.h"
+#include "jit.freenect.pool.h"
+#include "jit.freenect.sync.h"
+#include "jit.freenect.lut.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+
+static const char *type_names[FREENECT_DEPTH_TYPES] = {"float32", "float64", "long"};
+
+static uint16_t depth[NPIX];
+static uint8_t video[NPIX*3];
+static char out[NPIX*sizeof(double)];
+static char out2[NPIX*4];
+static double *samples;
+
+static void emit(const char *bench, const char *name, long n, double bytes){
+	t_bench_stats st = bench_stats(samples, n);
+	printf("{\"bench\":\"%s\",\"case\":\"%s\",\"level\":\"%s\",\"iterations\":%ld,\"ns_per_frame\":%.0f,"
+		   "\"MB_per_s\":%.1f,\"p50_ns\":%.0f,\"p99_ns\":%.0f}\n",
+		   bench, name, freenect_cpu_level_name(freenect_kernels.level), n, st.mean * 1e9,
+		   st.mean > 0 ? bytes / st.mean / 1e6 : 0., st.p50 * 1e9, st.p99 * 1e9);
+}
+
+static void bench_luts(long iterations){
+	char lut[FREENECT_DEPTH_LUT_SIZE * sizeof(double)];
+	const t_freenect_lut *held;
+	char name[32];
+	int type, mode;
+	long i;
+	double t;
+
+	for(type=0;type<FREENECT_DEPTH_TYPES;type++){
+		for(mode=0;mode<FREENECT_DEPTH_MODES;mode++){
+			for(i=0;i<iterations;i++){
+				t = bench_now();
+				freenect_depth_lut_fill(lut, (t_freenect_depth_type)type, mode, NULL);
+				samples[i] = bench_now() - t;
+			}
+			snprintf(name, sizeof(name), "%s_mode%d", type_names[type], mode);
+			emit("lut", name, iterations, FREENECT_DEPTH_LUT_SIZE * freenect_depth_cellbytes((t_freenect_depth_type)type));
+		}
+	}
+
+	held = freenect_lut_acquire(FREENECT_DEPTH_FLOAT32, 3, 0, NULL);
+	for(i=0;i<iterations;i++){
+		t = bench_now();
+		freenect_lut_release(freenect_lut_acquire(FREENECT_DEPTH_FLOAT32, 3, 0, NULL));
+		samples[i] = bench_now() - t;
+	}
+	freenect_lut_release(held);
+	emit("lut", "cache_hit", iterations, 0);
+}
+
+// Two points of the default fit give back the default curve, since it is linear in
+// inverse depth, and equal curves share their tables
+static int check_calibration(void){
+	static t_freenect_calibration a, b;
+	double raw[2] = {1000., 300.}, metres[2];
+	const t_freenect_lut *la, *lb, *ld;
+	long i, count = freenect_lut_count();
+	int failed = 0;
+
+	metres[0] = freenect_depth_metres(1000);
+	metres[1] = freenect_depth_metres(300);
+	if(freenect_calibration_from_points(&a, raw, metres, 2) || freenect_calibration_from_points(&b, raw, metres, 2)){
+		failed = 1;
+	}
+	for(i=0;(i<FREENECT_DEPTH_LUT_SIZE) && !failed;i++){
+		if(fabs(a.metres[i] - freenect_depth_metres((uint16_t)i)) > 1e-9 * (1. + a.metres[i])){
+			fprintf(stderr, "FAIL: calibration differs from the default fit at %ld\n", i);
+			failed = 1;
+		}
+	}
+	la = freenect_lut_acquire(FREENECT_DEPTH_FLOAT32, 3, 0, &a);
+	lb = freenect_lut_acquire(FREENECT_DEPTH_FLOAT32, 3, 0, &b);
+	ld = freenect_lut_acquire(FREENECT_DEPTH_FLOAT32, 3, 0, NULL);
+	if(!la || (la != lb) || (la == ld) || (freenect_lut_count() != count + 2)){
+		fprintf(stderr, "FAIL: calibrated tables are not shared\n");
+		failed = 1;
+	}
+	freenect_lut_release(la);
+	freenect_lut_release(lb);
+	freenect_lut_release(ld);
+	if(freenect_lut_count() != count){
+		fprintf(stderr, "FAIL: released tables stay cached\n");
+		failed = 1;
+	}
+	printf("{\"bench\":\"lut\",\"case\":\"calibration\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
+
+static void bench_depth(long iterations){
+	char lut[FREENECT_DEPTH_LUT_SIZE * sizeof(double)];
+	long cellbytes, i;
+	int type;
+	double t;
+
+	for(type=0;type<FREENECT_DEPTH_TYPES;type++){
+		freenect_depth_lut_fill(lut, (t_freenect_depth_type)type, 3, NULL);
+		cellbytes = freenect_depth_cellbytes((t_freenect_depth_type)type);
+		for(i=0;i<iterations;i++){
+			t = bench_now();
+			freenect_convert_depth_rows(depth, WIDTH, out, WIDTH * cellbytes, (t_freenect_depth_type)type, lut, FREENECT_DEPTH_MAX, 0, HEIGHT);
+			samples[i] = bench_now() - t;
+		}
+		emit("depth", type_names[type], iterations, NPIX * cellbytes);
+	}
+}
+
+static void bench_rgb(long iterations){
+	static const long planes[3] = {4, 3, 1};
+	static const char *names[3] = {"argb", "rgb", "ir"};
+	long i, p;
+	double t;
+
+	for(p=0;p<3;p++){
+		for(i=0;i<iterations;i++){
+			t = bench_now();
+			freenect_convert_rgb_rows(video, WIDTH, out, WIDTH * planes[p], planes[p], 0, HEIGHT);
+			samples[i] = bench_now() - t;
+		}
+		emit("rgb", names[p], iterations, NPIX * planes[p]);
+	}
+}
+
+typedef struct {
+	double  *lut;
+	char    *depth_out;
+	char    *rgb_out;
+	const uint16_t *depth_in;
+	const uint8_t *rgb_in;
+} t_frame_ctx;
+
+static void depth_rows(void *ctx, long begin, long end){
+	t_frame_ctx *c = (t_frame_ctx *)ctx;
+	freenect_convert_depth_rows(c->depth_in, WIDTH, c->depth_out, WIDTH * sizeof(double), FREENECT_DEPTH_FLOAT64, c->lut, FREENECT_DEPTH_MAX, begin, end);
+}
+
+static void rgb_rows(void *ctx, long begin, long end){
+	t_frame_ctx *c = (t_frame_ctx *)ctx;
+	freenect_convert_rgb_rows(c->rgb_in, WIDTH, c->rgb_out, WIDTH * 4, 4, begin, end);
+}
+
+static void bench_pool(long iterations){
+	double lut[FREENECT_DEPTH_LUT_SIZE];
+	t_frame_ctx ctx = {lut, out, out2, depth, video};
+	t_freenect_job jobs[2] = {
+		{depth_rows, &ctx, HEIGHT, NPIX * sizeof(double)},
+		{rgb_rows, &ctx, HEIGHT, NPIX * 4}
+	};
+	char name[32];
+	long i;
+	double t;
+
+	freenect_depth_lut_fill(lut, FREENECT_DEPTH_FLOAT64, 3, NULL);
+	for(i=0;i<iterations;i++){
+		t = bench_now();
+		freenect_pool_run(jobs, 2);
+		samples[i] = bench_now() - t;
+	}
+	snprintf(name, sizeof(name), "float64_argb_%ldthreads", freenect_pool_get_threads());
+	emit("pool", name, iterations, NPIX * (sizeof(double) + 4));
+}
+
+#pragma mark - Hand-off
+
+typedef struct {
+	t_freenect_tribuf   tb;
+	double              published[3];
+	int                 stop;
+	uint64_t            frames;
+	uint64_t            dropped;
+} t_handoff;
+
+static void *handoff_producer(void *arg){
+	t_handoff *h = (t_handoff *)arg;
+
+	while(!__atomic_load_n(&h->stop, __ATOMIC_ACQUIRE)){
+		memcpy(freenect_tribuf_back(&h->tb), depth, sizeof(depth));
+		h->published[h->tb.back] = bench_now();
+		h->dropped += freenect_tribuf_publish(&h->tb);
+		h->frames++;
+	}
+	return NULL;
+}
+
+// samples holds publish-to-converted latencies here, the mean is reported separately
+static void bench_handoff(double seconds, long max_samples){
+	float lut[FREENECT_DEPTH_LUT_SIZE];
+	t_handoff h;
+	pthread_t thread;
+	uint16_t *buffers[3];
+	t_bench_stats st;
+	long n = 0, i;
+	double start, elapsed;
+
+	freenect_depth_lut_fill(lut, FREENECT_DEPTH_FLOAT32, 3, NULL);
+	for(i=0;i<3;i++){
+		buffers[i] = (uint16_t *)calloc(NPIX, sizeof(uint16_t));
+	}
+	memset(&h, 0, sizeof(h));
+	freenect_tribuf_init(&h.tb, buffers[0], buffers[1], buffers[2]);
+	pthread_create(&thread, NULL, handoff_producer, &h);
+
+	start = bench_now();
+	while((bench_now() - start < seconds) && (n < max_samples)){
+		if(!freenect_tribuf_acquire(&h.tb)){
+			continue;
+		}
+		freenect_convert_depth_rows((const uint16_t *)freenect_tribuf_front(&h.tb), WIDTH, out, WIDTH * sizeof(float),
+									FREENECT_DEPTH_FLOAT32, lut, FREENECT_DEPTH_MAX, 0, HEIGHT);
+		samples[n++] = bench_now() - h.published[h.tb.front];
+	}
+	elapsed = bench_now() - start;
+	__atomic_store_n(&h.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	st = bench_stats(samples, n);
+	printf("{\"bench\":\"handoff\",\"case\":\"depth_float32\",\"level\":\"%s\",\"published\":%llu,\"consumed\":%ld,"
+		   "\"dropped\":%llu,\"ns_per_frame\":%.0f,\"MB_per_s\":%.1f,\"p50_ns\":%.0f,\"p99_ns\":%.0f}\n",
+		   freenect_cpu_level_name(freenect_kernels.level), (unsigned long long)h.frames, n,
+		   (unsigned long long)h.dropped, n ? elapsed / n * 1e9 : 0., n ? NPIX * sizeof(float) * n / elapsed / 1e6 : 0.,
+		   st.p50 * 1e9, st.p99 * 1e9);
+
+	for(i=0;i<3;i++){
+		free(buffers[i]);
+	}
+}
+
+int main(int argc, char **argv){
+	long iterations = argc > 1 ? atol(argv[1]) : 200;
+	double seconds = argc > 2 ? atof(argv[2]) : 1.;
+	long max_samples = 100000;
+	int failed;
+
+	if(iterations < 1){
+		iterations = 1;
+	}
+	samples = (double *)malloc(sizeof(double) * (iterations > max_samples ? iterations : max_samples));
+	freenect_kernels_init();
+	bench_fill_depth(depth, NPIX);
+	bench_fill_bytes(video, sizeof(video));
+
+	failed = check_calibration();
+	bench_luts(iterations);
+	bench_depth(iterations);
+	bench_rgb(iterations);
+	bench_pool(iterations);
+	bench_handoff(seconds, max_samples);
+
+	freenect_pool_shutdown();
+	free(samples);
+	return failed;
+}
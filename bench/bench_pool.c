@@ -0,0 +1,196 @@
+/*
+ Scaling benchmark for the conversion thread pool in jit.freenect.pool.c.
+
+ Converts a 640x480 depth frame to float64 and a video frame to ARGB in one
+ batch, like matrix_calc does, for a range of thread counts. Every result is
+ compared against a single-threaded conversion. Two extra threads then submit
+ batches at the same time to exercise concurrent callers (the async worker of
+ two devices), while the main thread keeps resizing the pool the way another
+ instance's threads attribute would. No pool thread may be left once the pool
+ is shut down. Run "make tsan" to check it under ThreadSanitizer.
+
+   bench_pool [max threads] [frames]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <dirent.h>
+#endif
+#include "jit.freenect.kernels.h"
+#include "jit.freenect.pool.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+
+typedef struct {
+	const uint16_t  *depth;
+	double          *out;
+	const double    *lut;
+} t_depth_ctx;
+
+typedef struct {
+	const uint8_t   *rgb;
+	uint8_t         *out;
+} t_rgb_ctx;
+
+static uint16_t depth[WIDTH * HEIGHT];
+static uint8_t rgb[WIDTH * HEIGHT * 3];
+static double lut[FREENECT_DEPTH_LUT_SIZE];
+
+static void depth_rows(void *ctx, long begin, long end){
+	t_depth_ctx *c = (t_depth_ctx *)ctx;
+	long i;
+	for(i=begin;i<end;i++){
+		freenect_kernels.depth_lut_f64(c->depth + WIDTH * i, c->out + WIDTH * i, WIDTH, c->lut, FREENECT_DEPTH_MAX);
+	}
+}
+
+static void rgb_rows(void *ctx, long begin, long end){
+	t_rgb_ctx *c = (t_rgb_ctx *)ctx;
+	long i;
+	for(i=begin;i<end;i++){
+		freenect_kernels.rgb_to_argb(c->rgb + WIDTH * 3 * i, c->out + WIDTH * 4 * i, WIDTH);
+	}
+}
+
+static void convert(double *depth_out, uint8_t *rgb_out){
+	t_depth_ctx dc = {depth, depth_out, lut};
+	t_rgb_ctx rc = {rgb, rgb_out};
+	t_freenect_job jobs[2] = {
+		{depth_rows, &dc, HEIGHT, WIDTH * HEIGHT * sizeof(double)},
+		{rgb_rows, &rc, HEIGHT, WIDTH * HEIGHT * 4}
+	};
+	freenect_pool_run(jobs, 2);
+}
+
+static double *ref_depth, *test_depth;
+static uint8_t *ref_rgb, *test_rgb;
+
+static int check(const double *d, const uint8_t *c){
+	return memcmp(d, ref_depth, WIDTH * HEIGHT * sizeof(double)) || memcmp(c, ref_rgb, WIDTH * HEIGHT * 4);
+}
+
+typedef struct {
+	double      *depth;
+	uint8_t     *rgb;
+	long        frames;
+	int         failed;
+	int         done;
+} t_submitter;
+
+static void *submitter(void *arg){
+	t_submitter *s = (t_submitter *)arg;
+	long i;
+	for(i=0;i<s->frames && !s->failed;i++){
+		memset(s->depth, 0, WIDTH * HEIGHT * sizeof(double));
+		convert(s->depth, s->rgb);
+		s->failed = check(s->depth, s->rgb);
+	}
+	__atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Threads of the process, or -1 where that cannot be told
+static long count_threads(void){
+	long n = -1;
+#ifdef __linux__
+	DIR *dir = opendir("/proc/self/task");
+	struct dirent *entry;
+
+	if(dir){
+		n = 0;
+		while((entry = readdir(dir))){
+			n += entry->d_name[0] != '.';
+		}
+		closedir(dir);
+	}
+#endif
+	return n;
+}
+
+int main(int argc, char **argv){
+	long max_threads = argc > 1 ? atol(argv[1]) : freenect_pool_cpu_count();
+	long frames = argc > 2 ? atol(argv[2]) : 200;
+	long n, i, resizes, before, after;
+	double start, elapsed, base = 0.;
+	int failed = 0;
+	t_submitter subs[2];
+	pthread_t threads[2];
+
+	freenect_kernels_init();
+	bench_fill_depth(depth, WIDTH * HEIGHT);
+	bench_fill_bytes(rgb, WIDTH * HEIGHT * 3);
+	for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+		lut[i] = 0.1236 * tan(i / 2842.5 + 1.1863);
+	}
+	ref_depth = (double *)malloc(WIDTH * HEIGHT * sizeof(double));
+	test_depth = (double *)malloc(WIDTH * HEIGHT * sizeof(double));
+	ref_rgb = (uint8_t *)malloc(WIDTH * HEIGHT * 4);
+	test_rgb = (uint8_t *)malloc(WIDTH * HEIGHT * 4);
+
+	freenect_pool_set_threads(1);
+	convert(ref_depth, ref_rgb);
+
+	for(n=1;n<=max_threads;n*=2){
+		freenect_pool_set_threads(n);
+		memset(test_depth, 0, WIDTH * HEIGHT * sizeof(double));
+		convert(test_depth, test_rgb);
+		if(check(test_depth, test_rgb)){
+			fprintf(stderr, "FAIL: %ld threads differ from the single-threaded result\n", n);
+			failed = 1;
+			break;
+		}
+		start = bench_now();
+		for(i=0;i<frames;i++){
+			convert(test_depth, test_rgb);
+		}
+		elapsed = (bench_now() - start) / frames;
+		if(n == 1){
+			base = elapsed;
+		}
+		printf("{\"bench\":\"pool\",\"threads\":%ld,\"ns_per_frame\":%.0f,\"MB_per_s\":%.1f,\"speedup\":%.2f}\n",
+			   n, elapsed * 1e9, WIDTH * HEIGHT * (sizeof(double) + 4) / elapsed / 1e6, base / elapsed);
+	}
+
+	// Concurrent callers sharing the pool
+	freenect_pool_shutdown();
+	before = count_threads();
+	freenect_pool_set_threads(max_threads > 1 ? max_threads : 2);
+	for(i=0;i<2;i++){
+		subs[i].depth = (double *)malloc(WIDTH * HEIGHT * sizeof(double));
+		subs[i].rgb = (uint8_t *)malloc(WIDTH * HEIGHT * 4);
+		subs[i].frames = frames / 4 + 1;
+		subs[i].failed = 0;
+		subs[i].done = 0;
+		pthread_create(&threads[i], NULL, submitter, &subs[i]);
+	}
+	for(resizes=0;!__atomic_load_n(&subs[0].done, __ATOMIC_ACQUIRE) || !__atomic_load_n(&subs[1].done, __ATOMIC_ACQUIRE);resizes++){
+		freenect_pool_set_threads(2 + resizes % (max_threads > 2 ? max_threads - 1 : 2));
+	}
+	for(i=0;i<2;i++){
+		pthread_join(threads[i], NULL);
+		if(subs[i].failed){
+			fprintf(stderr, "FAIL: concurrent submitter %ld got a wrong result\n", i);
+			failed = 1;
+		}
+		free(subs[i].depth);
+		free(subs[i].rgb);
+	}
+	freenect_pool_shutdown();
+	after = count_threads();
+	if(after > before){
+		fprintf(stderr, "FAIL: %ld pool threads left after shutdown\n", after - before);
+		failed = 1;
+	}
+	printf("{\"bench\":\"pool_concurrent\",\"submitters\":2,\"resizes\":%ld,\"ok\":%s}\n", resizes, failed ? "false" : "true");
+
+	free(ref_depth);
+	free(test_depth);
+	free(ref_rgb);
+	free(test_rgb);
+	return failed;
+}
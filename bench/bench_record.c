@@ -0,0 +1,162 @@
+/*
+ Recording throughput test for jit.freenect.record.c.
+
+ Pushes procedural depth and video frames at a multiple of the Kinect's
+ 30 fps from a producer thread, the way the capture callbacks do, then reads
+ the file back and checks the header, the index and every payload. Reports
+ the producer's cost per push (p50/p99), the disk rate and the drop count.
+
+   bench_record [file] [seconds] [speed] [compress]
+
+ speed is the multiple of real time, 2 by default; 0 pushes as fast as possible.
+ compress 1 has the writer thread encode depth frames (FREENECT_REC_COMPRESS_DEPTH).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "jit.freenect.record.h"
+#include "jit.freenect.codec.h"
+#include "jit.freenect.sim.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define DEPTH_BYTES (WIDTH * HEIGHT * 2)
+#define VIDEO_BYTES (WIDTH * HEIGHT * 3)
+#define MAX_SAMPLES 100000
+#define PATTERNS 8      // distinct frames, reused in turn
+
+static uint16_t depth[PATTERNS][WIDTH * HEIGHT];
+static uint8_t video[PATTERNS][VIDEO_BYTES];
+static double samples[MAX_SAMPLES];
+
+static int verify(const char *path, uint64_t pushed){
+	t_freenect_rec_header header;
+	t_freenect_rec_index *index;
+	char *payload;
+	uint16_t *decoded;
+	FILE *f;
+	uint64_t i;
+	int failed = 0;
+
+	f = fopen(path, "rb");
+	if(!f || (fread(&header, sizeof(header), 1, f) != 1)){
+		fprintf(stderr, "FAIL: cannot read %s\n", path);
+		return 1;
+	}
+	if(memcmp(header.magic, FREENECT_REC_MAGIC, 8) || !header.index_offset || (header.frame_count != pushed)){
+		fprintf(stderr, "FAIL: bad header, %llu frames indexed for %llu pushed\n",
+				(unsigned long long)header.frame_count, (unsigned long long)pushed);
+		fclose(f);
+		return 1;
+	}
+	index = (t_freenect_rec_index *)malloc(header.frame_count * sizeof(t_freenect_rec_index));
+	payload = (char *)malloc(VIDEO_BYTES);
+	decoded = (uint16_t *)malloc(DEPTH_BYTES);
+	fseek(f, (long)header.index_offset, SEEK_SET);
+	if(fread(index, sizeof(t_freenect_rec_index), header.frame_count, f) != header.frame_count){
+		fprintf(stderr, "FAIL: truncated index\n");
+		failed = 1;
+	}
+	// Frames were pushed depth, video, depth, ... cycling through the patterns
+	for(i=0;(i<header.frame_count) && !failed;i++){
+		int stream = (int)(i & 1);
+		const void *expected = stream == FREENECT_REC_DEPTH ? (const void *)depth[(i / 2) % PATTERNS] : (const void *)video[(i / 2) % PATTERNS];
+		if((index[i].stream != stream) || (index[i].offset % FREENECT_REC_ALIGN) || (index[i].size > VIDEO_BYTES) ||
+		   (index[i].raw_size != (stream == FREENECT_REC_DEPTH ? DEPTH_BYTES : VIDEO_BYTES)) ||
+		   ((index[i].codec == FREENECT_REC_RAW) && (index[i].size != index[i].raw_size))){
+			fprintf(stderr, "FAIL: bad index entry %llu\n", (unsigned long long)i);
+			failed = 1;
+			break;
+		}
+		fseek(f, (long)index[i].offset, SEEK_SET);
+		if(fread(payload, index[i].size, 1, f) != 1){
+			fprintf(stderr, "FAIL: truncated frame %llu\n", (unsigned long long)i);
+			failed = 1;
+		}
+		else if(index[i].codec == FREENECT_REC_PACKED){
+			if(freenect_depth_decode((const uint8_t *)payload, index[i].size, decoded, WIDTH * HEIGHT) || memcmp(decoded, expected, DEPTH_BYTES)){
+				fprintf(stderr, "FAIL: frame %llu does not decode\n", (unsigned long long)i);
+				failed = 1;
+			}
+		}
+		else if(memcmp(payload, expected, index[i].size)){
+			fprintf(stderr, "FAIL: payload of frame %llu differs\n", (unsigned long long)i);
+			failed = 1;
+		}
+	}
+	free(index);
+	free(payload);
+	free(decoded);
+	fclose(f);
+	return failed;
+}
+
+int main(int argc, char **argv){
+	const char *path = argc > 1 ? argv[1] : "/tmp/bench_record.fnrec";
+	double seconds = argc > 2 ? atof(argv[2]) : 3.;
+	double speed = argc > 3 ? atof(argv[3]) : 2.;
+	int compress = argc > 4 ? atoi(argv[4]) : 0;
+	t_freenect_rec_header info;
+	t_freenect_recorder *rec;
+	t_bench_stats st;
+	uint64_t n = 0, pushed, dropped, bytes;
+	long nsamples = 0;
+	double start, next, t, elapsed, period;
+	int failed, i;
+
+	for(i=0;i<PATTERNS;i++){
+		freenect_sim_render_depth(depth[i], WIDTH, HEIGHT, i * 5);
+		freenect_sim_render_video(video[i], WIDTH, HEIGHT, 3, i * 5);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.depth_width = info.video_width = WIDTH;
+	info.depth_height = info.video_height = HEIGHT;
+	info.video_bpp = 3;
+	info.depth_invalid = FREENECT_DEPTH_MAX;
+	info.flags = compress ? FREENECT_REC_COMPRESS_DEPTH : 0;
+	freenect_kernels_init();
+	rec = freenect_recorder_open(path, &info, 0);
+	if(!rec){
+		fprintf(stderr, "FAIL: cannot create %s\n", path);
+		return 1;
+	}
+
+	period = speed > 0 ? 1. / (FREENECT_SIM_DEFAULT_FPS * speed) : 0.;
+	start = next = bench_now();
+	while(bench_now() - start < seconds){
+		t = bench_now();
+		freenect_recorder_push(rec, FREENECT_REC_DEPTH, depth[n % PATTERNS], DEPTH_BYTES, (uint32_t)(n * 2000000));
+		freenect_recorder_push(rec, FREENECT_REC_VIDEO, video[n % PATTERNS], VIDEO_BYTES, (uint32_t)(n * 2000000));
+		if(nsamples < MAX_SAMPLES){
+			samples[nsamples++] = (bench_now() - t) / 2;
+		}
+		n++;
+		if(period > 0){
+			next += period;
+			while(bench_now() < next){
+				usleep(200);
+			}
+		}
+	}
+	pushed = freenect_recorder_frames(rec);
+	dropped = freenect_recorder_dropped(rec);
+	bytes = freenect_recorder_bytes(rec);
+	failed = freenect_recorder_close(rec) != 0;
+	elapsed = bench_now() - start;
+
+	st = bench_stats(samples, nsamples);
+	printf("{\"bench\":\"record\",\"speed\":%.1f,\"compress\":%d,\"frames\":%llu,\"dropped\":%llu,\"MB_per_s\":%.1f,"
+		   "\"push_p50_ns\":%.0f,\"push_p99_ns\":%.0f,",
+		   speed, compress, (unsigned long long)pushed, (unsigned long long)dropped, bytes / elapsed / 1e6, st.p50 * 1e9, st.p99 * 1e9);
+
+	// With drops the pattern sequence has gaps, only check the file when there are none
+	if(!failed && !dropped){
+		failed = verify(path, pushed);
+	}
+	printf("\"ok\":%s}\n", failed ? "false" : "true");
+	unlink(path);
+	return failed || (speed > 0 && dropped);
+}
@@ -0,0 +1,257 @@
+/*
+ Software registration benchmark for jit.freenect.register.c.
+
+ Checks the remap and shift tables against the camera model, and tables
+ copied from a device registration laid out like libfreenect's against those
+ built from the same model, that the bands
+ of a phase never reach the same video row, and every kernel level against a
+ straightforward version: depth scattered into the video camera with a
+ z-buffer, hidden pixels removed, video gathered into the depth camera. The
+ frames are the simulator's, whose moving objects occlude the background.
+ Then a 640x480 frame is timed through each stage.
+
+   bench_register
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "jit.freenect.register.h"
+#include "jit.freenect.sim.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+#define FRAMES 100
+
+static uint16_t depth[NPIX], reference_depth[NPIX];
+static int32_t reference_target[NPIX];
+static uint8_t video[NPIX * 3], reference_video[NPIX * 3];
+static int32_t device_table[NPIX][2], device_shift[FREENECT_REGISTER_DEVICE_MM];
+static uint16_t device_mm[FREENECT_DEPTH_LUT_SIZE];
+
+// Every target within a pixel of the floating point model
+static int check_tables(const t_freenect_register *r){
+	const t_freenect_intrinsics *d = &r->depth_k, *v = &r->video_k;
+	double column, row, z;
+	long i, j, raw;
+	int32_t x;
+
+	for(raw=0;raw<FREENECT_DEPTH_MAX;raw+=97){
+		z = freenect_depth_metres((uint16_t)raw);
+		if(!(z > 0.)){
+			continue;
+		}
+		for(i=0;i<HEIGHT;i+=7){
+			row = v->fy * (i - d->cy) / d->fy + v->cy;
+			for(j=0;j<WIDTH;j+=5){
+				column = v->fx * (j - d->cx) / d->fx + v->cx + v->fx * r->baseline / z;
+				x = (r->column[i * WIDTH + j] + r->shift[raw]) >> 8;
+				if((row < 0.5) || (row > HEIGHT - 1.5) || (column < 0.5) || (column > WIDTH - 1.5)){
+					continue;
+				}
+				if((fabs(x - column) > 0.51) || (fabs(r->row[i * WIDTH + j] / WIDTH - row) > 0.51)){
+					fprintf(stderr, "MISMATCH: table at %ld %ld, raw %ld: %d %d for %.2f %.2f\n",
+							j, i, raw, x, r->row[i * WIDTH + j] / WIDTH, column, row);
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+// Video rows reached by the bands of a phase, which must not meet
+// A device registration of the same camera model lands every pixel within a
+// pixel of the model's tables, with columns truncated like libfreenect
+static int check_device(const t_freenect_register *model){
+	const t_freenect_intrinsics *d = &model->depth_k, *v = &model->video_k;
+	t_freenect_register_device device;
+	t_freenect_register r;
+	long i, j, raw, mm, k;
+	int32_t x, y, mx, my;
+	int failed = 0;
+
+	for(i=0;i<HEIGHT;i++){
+		for(j=0;j<WIDTH;j++){
+			device_table[i * WIDTH + j][0] = (int32_t)((v->fx * (j - d->cx) / d->fx + v->cx) * 256.);
+			device_table[i * WIDTH + j][1] = (int32_t)lrint(v->fy * (i - d->cy) / d->fy + v->cy);
+		}
+	}
+	for(mm=1;mm<FREENECT_REGISTER_DEVICE_MM;mm++){
+		device_shift[mm] = (int32_t)(v->fx * model->baseline * 1000. / mm * 256.);
+	}
+	for(raw=0;raw<FREENECT_DEPTH_LUT_SIZE;raw++){
+		device_mm[raw] = (uint16_t)lrint(freenect_depth_metres((uint16_t)raw) * 1000.);
+	}
+	device.table = (const int32_t (*)[2])device_table;
+	device.shift = device_shift;
+	device.mm = device_mm;
+	device.start_lines = 0;
+
+	memset(&r, 0, sizeof(r));
+	if(freenect_register_init_device(&r, WIDTH, HEIGHT, &device, NULL)){
+		fprintf(stderr, "FAIL: cannot allocate the device tables\n");
+		return 1;
+	}
+	for(raw=0;(raw<FREENECT_DEPTH_MAX) && !failed;raw+=97){
+		if(!device_mm[raw] || (device_mm[raw] >= FREENECT_REGISTER_DEVICE_MM)){
+			continue;
+		}
+		for(k=0;(k<NPIX) && !failed;k+=37){
+			mx = (model->column[k] + model->shift[raw]) >> 8;
+			my = model->row[k] / WIDTH;
+			if((mx < 1) || (mx >= WIDTH - 1) || (my < 1) || (my >= HEIGHT - 1)){
+				continue;
+			}
+			x = (r.column[k] + r.shift[raw]) >> 8;
+			y = r.row[k] / WIDTH;
+			if((abs(x - mx) > 1) || (y != my)){
+				fprintf(stderr, "MISMATCH: device table at %ld %ld, raw %ld: %d %d for %d %d\n",
+						k % WIDTH, k / WIDTH, raw, x, y, mx, my);
+				failed = 1;
+			}
+		}
+	}
+	freenect_register_free(&r);
+	return failed;
+}
+
+static int check_bands(const t_freenect_register *r){
+	long phase, band, first, last, i, previous;
+
+	for(phase=0;phase<2;phase++){
+		previous = -1;
+		for(band=0;band<freenect_register_bands(r, (int)phase);band++){
+			first = HEIGHT;
+			last = -1;
+			for(i=(band * 2 + phase) * FREENECT_REGISTER_BAND * WIDTH;i<NPIX && i<(band * 2 + phase + 1) * FREENECT_REGISTER_BAND * WIDTH;i++){
+				if(r->column[i] >= 0){
+					first = (r->row[i] / WIDTH < first) ? r->row[i] / WIDTH : first;
+					last = (r->row[i] / WIDTH > last) ? r->row[i] / WIDTH : last;
+				}
+			}
+			if((last >= 0) && (first <= previous)){
+				fprintf(stderr, "FAIL: band %ld of phase %ld reaches row %ld\n", band, phase, first);
+				return 1;
+			}
+			previous = (last >= 0) ? last : previous;
+		}
+	}
+	return 0;
+}
+
+static void reference(const t_freenect_register *r){
+	long i;
+	int32_t x, t;
+
+	for(i=0;i<NPIX;i++){
+		reference_depth[i] = FREENECT_DEPTH_MAX;
+	}
+	for(i=0;i<NPIX;i++){
+		x = (r->column[i] + r->shift[depth[i] > FREENECT_DEPTH_MAX ? FREENECT_DEPTH_MAX : depth[i]]) >> 8;
+		reference_target[i] = ((x >= 0) && (x < WIDTH)) ? r->row[i] + x : -1;
+		t = reference_target[i];
+		if((t >= 0) && (depth[i] < reference_depth[t])){
+			reference_depth[t] = depth[i];
+		}
+	}
+	for(i=0;i<NPIX;i++){
+		t = reference_target[i];
+		if((t >= 0) && (depth[i] > reference_depth[t] + FREENECT_REGISTER_OCCLUSION)){
+			t = -1;
+		}
+		reference_video[i * 3] = (t >= 0) ? video[t * 3] : 0;
+		reference_video[i * 3 + 1] = (t >= 0) ? video[t * 3 + 1] : 0;
+		reference_video[i * 3 + 2] = (t >= 0) ? video[t * 3 + 2] : 0;
+	}
+}
+
+static void run(t_freenect_register *r, t_freenect_cpu_level level){
+	freenect_register_depth_clear(r);
+	freenect_register_depth_bands_level(r, depth, 0, 0, freenect_register_bands(r, 0), level);
+	freenect_register_depth_bands_level(r, depth, 1, 0, freenect_register_bands(r, 1), level);
+}
+
+static int check(t_freenect_register *r, t_freenect_cpu_level level){
+	long i, hidden = 0, seen = 0;
+
+	run(r, level);
+	freenect_register_occlude_rows_level(r, depth, 0, 5, level);
+	freenect_register_occlude_rows_level(r, depth, 5, HEIGHT, level);
+	freenect_register_video_rows(r, video, 3, 0, HEIGHT);
+	for(i=0;i<NPIX;i++){
+		if(r->depth[i] != reference_depth[i]){
+			fprintf(stderr, "MISMATCH: %s, depth at %ld %ld: %u, expected %u\n", freenect_cpu_level_name(level),
+					i % WIDTH, i / WIDTH, r->depth[i], reference_depth[i]);
+			return 1;
+		}
+		seen += r->depth[i] != FREENECT_DEPTH_MAX;
+		hidden += (reference_target[i] >= 0) && (r->target[i] < 0);
+	}
+	if(memcmp(r->video, reference_video, sizeof(reference_video))){
+		fprintf(stderr, "MISMATCH: %s, video\n", freenect_cpu_level_name(level));
+		return 1;
+	}
+	// Nothing is checked if nothing is in front of anything
+	if(!hidden || (seen < NPIX / 2)){
+		fprintf(stderr, "FAIL: %ld pixels warped, %ld hidden\n", seen, hidden);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void){
+	t_freenect_cpu_level best = freenect_cpu_detect(), level;
+	t_freenect_register r;
+	int failed = 0, f;
+	double t, depth_ms, occlude_ms, video_ms;
+
+	freenect_kernels_init();
+	memset(&r, 0, sizeof(r));
+	if(freenect_register_init(&r, WIDTH, HEIGHT, &freenect_depth_intrinsics, &freenect_video_intrinsics,
+							  FREENECT_REGISTER_BASELINE, NULL)){
+		fprintf(stderr, "FAIL: cannot allocate the tables\n");
+		return 1;
+	}
+	failed |= check_tables(&r);
+	failed |= check_device(&r);
+	failed |= check_bands(&r);
+
+	freenect_sim_render_depth(depth, WIDTH, HEIGHT, 40);
+	freenect_sim_render_video(video, WIDTH, HEIGHT, 3, 40);
+	reference(&r);
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		failed |= check(&r, level);
+	}
+
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		// No SSSE3 versions
+		if(level == FREENECT_CPU_SSSE3){
+			continue;
+		}
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			run(&r, level);
+		}
+		depth_ms = (bench_now() - t) * 1e3 / FRAMES;
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			freenect_register_occlude_rows_level(&r, depth, 0, HEIGHT, level);
+		}
+		occlude_ms = (bench_now() - t) * 1e3 / FRAMES;
+		t = bench_now();
+		for(f=0;f<FRAMES;f++){
+			freenect_register_video_rows(&r, video, 3, 0, HEIGHT);
+		}
+		video_ms = (bench_now() - t) * 1e3 / FRAMES;
+		printf("{\"bench\":\"register\",\"level\":\"%s\",\"depth_to_video_ms\":%.3f,\"video_to_depth_ms\":%.3f}\n",
+			   freenect_cpu_level_name(level), depth_ms, depth_ms + occlude_ms + video_ms);
+	}
+	freenect_register_free(&r);
+
+	printf("{\"bench\":\"register\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
@@ -0,0 +1,237 @@
+/*
+ Replay test for jit.freenect.replay.c.
+
+ Records procedural depth and video frames with jit.freenect.record.c, then
+ plays the file back through a triple buffer the way the external does: the
+ callback points the back buffer at the frame in the mapping and publishes it,
+ a consumer thread picks up the front. Checks that every payload is a pointer
+ into the mapping (nothing copied) and holds the frame that was recorded.
+
+ First pass plays as fast as possible and reports frames/s and MB/s, second
+ pass plays at the recorded pace and reports how late frames were (p50/p99).
+ Then copies of the file with sizes that wrap around 64 bits, in the header
+ and in an index entry, must be rebuilt from the records or refused.
+
+   bench_replay [file] [seconds]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include "jit.freenect.replay.h"
+#include "jit.freenect.sim.h"
+#include "jit.freenect.sync.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define DEPTH_BYTES (WIDTH * HEIGHT * 2)
+#define VIDEO_BYTES (WIDTH * HEIGHT * 3)
+#define MAX_SAMPLES 100000
+#define PATTERNS 8
+#define PAIRS 30        // one second at 30 fps
+
+static uint16_t depth[PATTERNS][WIDTH * HEIGHT];
+static uint8_t video[PATTERNS][VIDEO_BYTES];
+static double samples[MAX_SAMPLES];
+
+typedef struct {
+	t_freenect_replay   replay;
+	t_freenect_tribuf   frames;
+	t_freenect_sem      sem;
+	uint64_t            delivered;
+	uint64_t            consumed;
+	uint64_t            bytes;
+	double              first;          // wall clock of the pass's first frame minus its recorded time
+	long                nsamples;
+	int                 failed;
+	int                 stop;
+} t_state;
+
+static void replay_cb(void *user, void *payload, const t_freenect_rec_index *frame){
+	t_state *s = (t_state *)user;
+	uint64_t n = frame->timestamp / 2000000;
+	const void *expected = frame->stream == FREENECT_REC_DEPTH ? (const void *)depth[n % PATTERNS] : (const void *)video[n % PATTERNS];
+	double now = bench_now(), due;
+
+	if(((char *)payload < s->replay.map) || ((char *)payload + frame->size > s->replay.map + s->replay.map_size) ||
+	   memcmp(payload, expected, frame->size)){
+		s->failed = 1;
+	}
+	if(s->replay.speed > 0){
+		// The replay loops, each pass is timed from its first frame
+		if(frame == s->replay.index){
+			s->first = now - frame->time_ns * 1e-9;
+		}
+		due = s->first + frame->time_ns * 1e-9 / s->replay.speed;
+		if(s->nsamples < MAX_SAMPLES){
+			samples[s->nsamples++] = now > due ? now - due : 0.;
+		}
+	}
+	s->bytes += frame->size;
+	s->delivered++;
+	if(frame->stream == FREENECT_REC_DEPTH){
+		freenect_tribuf_set_back(&s->frames, payload);
+		freenect_tribuf_publish(&s->frames);
+		freenect_sem_post(&s->sem);
+	}
+}
+
+static void *consumer_threadproc(void *arg){
+	t_state *s = (t_state *)arg;
+	volatile uint16_t sink;
+
+	while(1){
+		freenect_sem_wait(&s->sem);
+		if(__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)){
+			break;
+		}
+		if(freenect_tribuf_acquire(&s->frames)){
+			sink = ((uint16_t *)freenect_tribuf_front(&s->frames))[WIDTH * HEIGHT / 2];
+			(void)sink;
+			s->consumed++;
+		}
+	}
+	return NULL;
+}
+
+static int play(t_state *s, double speed, double seconds, double *elapsed){
+	pthread_t consumer;
+	double start;
+
+	s->delivered = s->consumed = s->bytes = 0;
+	s->nsamples = 0;
+	s->stop = 0;
+	freenect_tribuf_init(&s->frames, NULL, NULL, NULL);
+	freenect_sem_init(&s->sem);
+	pthread_create(&consumer, NULL, consumer_threadproc, s);
+
+	start = bench_now();
+	if(freenect_replay_start(&s->replay, speed, s, replay_cb, replay_cb)){
+		fprintf(stderr, "FAIL: cannot start replay\n");
+		return 1;
+	}
+	while(bench_now() - start < seconds){
+		usleep(10000);
+	}
+	freenect_replay_stop(&s->replay);
+	*elapsed = bench_now() - start;
+
+	__atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+	freenect_sem_post(&s->sem);
+	pthread_join(consumer, NULL);
+	freenect_sem_destroy(&s->sem);
+	return 0;
+}
+
+// Copies path to copy with the 64-bit value at offset replaced by value
+static int patch_copy(const char *path, const char *copy, long offset, uint64_t value){
+	FILE *in = fopen(path, "rb"), *out = fopen(copy, "wb");
+	char buffer[65536];
+	size_t n;
+	int failed = !in || !out;
+
+	while(!failed && (n = fread(buffer, 1, sizeof(buffer), in))){
+		failed = fwrite(buffer, 1, n, out) != n;
+	}
+	if(!failed){
+		failed = fseek(out, offset, SEEK_SET) || (fwrite(&value, sizeof(value), 1, out) != 1);
+	}
+	if(in){
+		fclose(in);
+	}
+	if(out){
+		failed |= fclose(out) != 0;
+	}
+	return failed;
+}
+
+// A frame count whose index size wraps around must not be trusted, the records are
+// scanned instead; an index entry whose end wraps around must be refused
+static int check_corrupt(const char *path, const t_freenect_replay *good){
+	t_freenect_replay r;
+	char copy[1024];
+	uint64_t count = ((uint64_t)1 << 63) / sizeof(t_freenect_rec_index) * 2 + 1;
+	long entry = (long)good->header.index_offset + (long)offsetof(t_freenect_rec_index, offset);
+	int failed = 0;
+
+	snprintf(copy, sizeof(copy), "%s.corrupt", path);
+	if(patch_copy(path, copy, (long)offsetof(t_freenect_rec_header, frame_count), count) ||
+	   freenect_replay_open(&r, copy) || (r.count != good->count) || !r.own_index){
+		fprintf(stderr, "FAIL: a wrapping frame count is not rebuilt from the records\n");
+		failed = 1;
+	}
+	freenect_replay_close(&r);
+	if(patch_copy(path, copy, entry, ~(uint64_t)0 - 15) || !freenect_replay_open(&r, copy)){
+		fprintf(stderr, "FAIL: an index entry that wraps around is accepted\n");
+		failed = 1;
+	}
+	freenect_replay_close(&r);
+	unlink(copy);
+	return failed;
+}
+
+int main(int argc, char **argv){
+	const char *path = argc > 1 ? argv[1] : "/tmp/bench_replay.fnrec";
+	double seconds = argc > 2 ? atof(argv[2]) : 2.;
+	t_freenect_rec_header info;
+	t_freenect_recorder *rec;
+	t_bench_stats st;
+	static t_state s;
+	double next, elapsed;
+	int failed, i;
+
+	for(i=0;i<PATTERNS;i++){
+		freenect_sim_render_depth(depth[i], WIDTH, HEIGHT, i * 5);
+		freenect_sim_render_video(video[i], WIDTH, HEIGHT, 3, i * 5);
+	}
+
+	// Recorded in real time so the second pass has a pace to follow
+	memset(&info, 0, sizeof(info));
+	info.depth_width = info.video_width = WIDTH;
+	info.depth_height = info.video_height = HEIGHT;
+	info.video_bpp = 3;
+	rec = freenect_recorder_open(path, &info, 0);
+	if(!rec){
+		fprintf(stderr, "FAIL: cannot create %s\n", path);
+		return 1;
+	}
+	next = bench_now();
+	for(i=0;i<PAIRS;i++){
+		freenect_recorder_push(rec, FREENECT_REC_DEPTH, depth[i % PATTERNS], DEPTH_BYTES, (uint32_t)(i * 2000000));
+		freenect_recorder_push(rec, FREENECT_REC_VIDEO, video[i % PATTERNS], VIDEO_BYTES, (uint32_t)(i * 2000000));
+		next += 1. / FREENECT_SIM_DEFAULT_FPS;
+		while(bench_now() < next){
+			usleep(200);
+		}
+	}
+	failed = freenect_recorder_close(rec) != 0;
+	if(failed || freenect_replay_open(&s.replay, path) || (s.replay.count != 2 * PAIRS)){
+		fprintf(stderr, "FAIL: cannot replay %s\n", path);
+		unlink(path);
+		return 1;
+	}
+
+	failed = play(&s, 0, seconds, &elapsed);
+	printf("{\"bench\":\"replay\",\"speed\":0,\"frames\":%llu,\"consumed\":%llu,\"fps\":%.0f,\"MB_per_s\":%.0f,\"ok\":%s}\n",
+		   (unsigned long long)s.delivered, (unsigned long long)s.consumed, s.delivered / elapsed,
+		   s.bytes / elapsed / 1e6, (failed || s.failed || !s.consumed) ? "false" : "true");
+	failed |= s.failed || !s.consumed;
+
+	failed |= play(&s, 1, seconds, &elapsed);
+	st = bench_stats(samples, s.nsamples);
+	printf("{\"bench\":\"replay\",\"speed\":1,\"frames\":%llu,\"consumed\":%llu,\"fps\":%.1f,"
+		   "\"late_p50_us\":%.0f,\"late_p99_us\":%.0f,\"ok\":%s}\n",
+		   (unsigned long long)s.delivered, (unsigned long long)s.consumed, s.delivered / elapsed,
+		   st.p50 * 1e6, st.p99 * 1e6, s.failed ? "false" : "true");
+	failed |= s.failed;
+
+	i = check_corrupt(path, &s.replay);
+	printf("{\"bench\":\"replay\",\"corrupt\":2,\"ok\":%s}\n", i ? "false" : "true");
+	failed |= i;
+
+	freenect_replay_close(&s.replay);
+	unlink(path);
+	return failed;
+}
@@ -0,0 +1,182 @@
+/*
+ End-to-end benchmark of the capture pipeline, driven by the simulated device.
+
+ jit.freenect.sim produces depth and video frames at the requested rate and
+ hands them to callbacks that publish them through triple buffers, exactly
+ like depth_callback and rgb_callback do. The consumer stands in for
+ matrix_calc: it picks up the newest depth frame (and the video frame with
+ it), converts both on the thread pool and records the latency from publish
+ to converted output. Frames the consumer never saw are reported as dropped.
+
+   bench_sim [fps] [seconds] [consumer fps] [video]
+
+ fps 0 runs the device as fast as possible, consumer fps 0 polls continuously.
+ video 0 disables the video stream, as video_enable 0 does: none is produced
+ and only depth is converted.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "jit.freenect.sim.h"
+#include "jit.freenect.sync.h"
+#include "jit.freenect.kernels.h"
+#include "jit.freenect.pool.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define MAX_SAMPLES 1000000
+
+typedef struct {
+	t_freenect_tribuf   depth;
+	t_freenect_tribuf   video;
+	double              depth_published[3];     // publish time of each depth buffer
+	uint64_t            depth_frames;
+	uint64_t            video_frames;
+	uint64_t            depth_dropped;
+	uint64_t            video_dropped;
+} t_pipeline;
+
+static t_pipeline pipe_state;
+static double latency[MAX_SAMPLES];
+static long nlatency;
+
+static void *depth_ready(void *user, void *pixels, uint32_t timestamp){
+	t_pipeline *p = (t_pipeline *)user;
+	p->depth_published[p->depth.back] = bench_now();
+	p->depth_dropped += freenect_tribuf_publish(&p->depth);
+	p->depth_frames++;
+	return freenect_tribuf_back(&p->depth);
+}
+
+static void *video_ready(void *user, void *pixels, uint32_t timestamp){
+	t_pipeline *p = (t_pipeline *)user;
+	p->video_dropped += freenect_tribuf_publish(&p->video);
+	p->video_frames++;
+	return freenect_tribuf_back(&p->video);
+}
+
+typedef struct {
+	const uint16_t  *in;
+	float           *out;
+	const float     *lut;
+} t_depth_ctx;
+
+typedef struct {
+	const uint8_t   *in;
+	uint8_t         *out;
+} t_video_ctx;
+
+static void depth_rows(void *ctx, long begin, long end){
+	t_depth_ctx *c = (t_depth_ctx *)ctx;
+	long i;
+	for(i=begin;i<end;i++){
+		freenect_kernels.depth_lut_f32(c->in + WIDTH * i, c->out + WIDTH * i, WIDTH, c->lut, FREENECT_DEPTH_MAX);
+	}
+}
+
+static void video_rows(void *ctx, long begin, long end){
+	t_video_ctx *c = (t_video_ctx *)ctx;
+	long i;
+	for(i=begin;i<end;i++){
+		freenect_kernels.rgb_to_argb(c->in + WIDTH * 3 * i, c->out + WIDTH * 4 * i, WIDTH);
+	}
+}
+
+static int cmp_double(const void *a, const void *b){
+	double d = *(const double *)a - *(const double *)b;
+	return (d > 0) - (d < 0);
+}
+
+int main(int argc, char **argv){
+	double fps = argc > 1 ? atof(argv[1]) : FREENECT_SIM_DEFAULT_FPS;
+	double seconds = argc > 2 ? atof(argv[2]) : 2.;
+	double consumer_fps = argc > 3 ? atof(argv[3]) : 0.;
+	int video = argc > 4 ? atoi(argv[4]) : 1;
+	t_freenect_sim sim;
+	void *depth_buffers[3], *video_buffers[3];
+	static float lut[FREENECT_DEPTH_LUT_SIZE];
+	float *depth_out;
+	uint8_t *video_out;
+	t_depth_ctx dc;
+	t_video_ctx vc;
+	t_freenect_job jobs[2];
+	uint64_t output = 0;
+	double start, now, next, elapsed;
+	long i;
+
+	freenect_kernels_init();
+	for(i=0;i<3;i++){
+		depth_buffers[i] = calloc(WIDTH * HEIGHT, sizeof(uint16_t));
+		video_buffers[i] = calloc(WIDTH * HEIGHT, 3);
+	}
+	depth_out = (float *)malloc(WIDTH * HEIGHT * sizeof(float));
+	video_out = (uint8_t *)malloc(WIDTH * HEIGHT * 4);
+	memset(&pipe_state, 0, sizeof(pipe_state));
+	freenect_tribuf_init(&pipe_state.depth, depth_buffers[0], depth_buffers[1], depth_buffers[2]);
+	freenect_tribuf_init(&pipe_state.video, video_buffers[0], video_buffers[1], video_buffers[2]);
+
+	// Distance in cm, matrix_calc's default mode
+	freenect_depth_lut_fill(lut, FREENECT_DEPTH_FLOAT32, 3, NULL);
+	dc.out = depth_out;
+	dc.lut = lut;
+	vc.out = video_out;
+	jobs[0].fn = depth_rows;
+	jobs[0].ctx = &dc;
+	jobs[0].rows = HEIGHT;
+	jobs[0].bytes = WIDTH * HEIGHT * sizeof(float);
+	jobs[1].fn = video_rows;
+	jobs[1].ctx = &vc;
+	jobs[1].rows = HEIGHT;
+	jobs[1].bytes = WIDTH * HEIGHT * 4;
+
+	freenect_sim_init(&sim, WIDTH, HEIGHT, 3);
+	freenect_sim_set_buffers(&sim, freenect_tribuf_back(&pipe_state.depth), freenect_tribuf_back(&pipe_state.video));
+	freenect_sim_enable(&sim, 1, video);
+	if(freenect_sim_start(&sim, fps, &pipe_state, depth_ready, video_ready)){
+		fprintf(stderr, "FAIL: could not start the simulated device\n");
+		return 1;
+	}
+
+	start = next = bench_now();
+	while((now = bench_now()) - start < seconds){
+		if(consumer_fps > 0){
+			next += 1. / consumer_fps;
+			while(bench_now() < next);
+		}
+		// Same order as matrix_calc: video is only taken along with a new depth frame
+		if(!freenect_tribuf_acquire(&pipe_state.depth)){
+			continue;
+		}
+		freenect_tribuf_acquire(&pipe_state.video);
+		dc.in = (const uint16_t *)freenect_tribuf_front(&pipe_state.depth);
+		vc.in = (const uint8_t *)freenect_tribuf_front(&pipe_state.video);
+		freenect_pool_run(jobs, video ? 2 : 1);
+		if(nlatency < MAX_SAMPLES){
+			latency[nlatency++] = bench_now() - pipe_state.depth_published[pipe_state.depth.front];
+		}
+		output++;
+	}
+	freenect_sim_stop(&sim);
+	elapsed = bench_now() - start;
+
+	qsort(latency, nlatency, sizeof(double), cmp_double);
+	printf("{\"bench\":\"sim_pipeline\",\"fps\":%.1f,\"consumer_fps\":%.1f,\"video\":%d,\"depth_frames\":%llu,\"video_frames\":%llu,"
+		   "\"output\":%llu,\"output_fps\":%.1f,\"depth_dropped\":%llu,\"video_dropped\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+		   fps, consumer_fps, video, (unsigned long long)pipe_state.depth_frames, (unsigned long long)pipe_state.video_frames,
+		   (unsigned long long)output, output / elapsed,
+		   (unsigned long long)pipe_state.depth_dropped, (unsigned long long)pipe_state.video_dropped,
+		   nlatency ? latency[nlatency/2] * 1e6 : 0., nlatency ? latency[nlatency*99/100] * 1e6 : 0.);
+
+	freenect_sim_free(&sim);
+	freenect_pool_shutdown();
+	for(i=0;i<3;i++){
+		free(depth_buffers[i]);
+		free(video_buffers[i]);
+	}
+	free(depth_out);
+	free(video_out);
+	return (output == 0) || (!video && pipe_state.video_frames);
+}
@@ -0,0 +1,116 @@
+/*
+ Cost and accuracy of the frame statistics in jit.freenect.stats.c.
+
+ Measures what the statistics add to each frame: the clock read, a received
+ update on the capture side and an output update (histogram included) on the
+ consumer side. Then checks the histogram's p50/p95/p99 against the exact
+ quantiles of a skewed latency distribution, and has several threads update
+ the same stream at once to check that no count is lost.
+
+   bench_stats [threads]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "jit.freenect.stats.h"
+#include "bench_util.h"
+
+#define ITERATIONS 2000000
+#define SAMPLES 100000
+#define PER_THREAD 200000
+#define MAX_THREADS 16
+
+static t_freenect_stream_stats shared;
+static double samples[SAMPLES];
+
+static void *update_threadproc(void *arg){
+	uint64_t now = 1000000 * (uint64_t)(long)arg;
+	int i;
+
+	for(i=0;i<PER_THREAD;i++){
+		freenect_stats_output(&shared, now, now + (uint64_t)(i & 0xFFFF) * 100);
+		freenect_stats_dropped(&shared, 1);
+		freenect_stats_copied(&shared, 10);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv){
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	static const double quantiles[3] = {0.5, 0.95, 0.99};
+	static t_freenect_stream_stats stats;
+	pthread_t workers[MAX_THREADS];
+	double start, clock_ns, update_ns, exact, approx, worst = 0.;
+	uint64_t now = 0, total = 0;
+	uint32_t seed = 4321;
+	volatile uint64_t sink = 0;
+	int failed = 0, i;
+
+	threads = threads < 1 ? 1 : (threads > MAX_THREADS ? MAX_THREADS : threads);
+
+	start = bench_now();
+	for(i=0;i<ITERATIONS;i++){
+		sink += freenect_now_ns();
+	}
+	clock_ns = (bench_now() - start) * 1e9 / ITERATIONS;
+
+	// One received and one output update per frame, with 33 ms between frames
+	freenect_stats_clear(&stats);
+	start = bench_now();
+	for(i=0;i<ITERATIONS;i++){
+		now += 33333333;
+		freenect_stats_received(&stats, now);
+		freenect_stats_output(&stats, now, now + 2000000 + (i & 0xFFFF) * 50);
+	}
+	update_ns = (bench_now() - start) * 1e9 / ITERATIONS;
+	if((freenect_stats_get(&stats.received) != ITERATIONS) || (fabs(freenect_stats_fps(&stats) - 30.) > 0.01)){
+		fprintf(stderr, "FAIL: %llu received at %.3f fps\n", (unsigned long long)stats.received, freenect_stats_fps(&stats));
+		failed = 1;
+	}
+
+	// Log-normal latencies around 3 ms, with a long tail
+	freenect_stats_clear(&stats);
+	for(i=0;i<SAMPLES;i++){
+		double u1, u2;
+		seed = seed * 1103515245u + 12345u;
+		u1 = ((seed >> 8) + 1.) / 16777217.;
+		seed = seed * 1103515245u + 12345u;
+		u2 = (seed >> 8) / 16777216.;
+		samples[i] = 3e6 * exp(0.8 * sqrt(-2. * log(u1)) * cos(2. * M_PI * u2));
+		freenect_stats_output(&stats, 0, (uint64_t)samples[i]);
+	}
+	bench_stats(samples, SAMPLES);
+	for(i=0;i<3;i++){
+		exact = samples[(long)(quantiles[i] * (SAMPLES - 1))];
+		approx = freenect_hist_quantile(&stats.latency, quantiles[i]);
+		if(fabs(approx / exact - 1.) > worst){
+			worst = fabs(approx / exact - 1.);
+		}
+	}
+	if(worst > 0.125){
+		fprintf(stderr, "FAIL: quantiles off by %.1f%%\n", worst * 100.);
+		failed = 1;
+	}
+
+	freenect_stats_clear(&shared);
+	for(i=0;i<threads;i++){
+		pthread_create(&workers[i], NULL, update_threadproc, (void *)(long)(i + 1));
+	}
+	for(i=0;i<threads;i++){
+		pthread_join(workers[i], NULL);
+	}
+	for(i=0;i<FREENECT_HIST_BUCKETS;i++){
+		total += shared.latency.counts[i];
+	}
+	if((shared.output != (uint64_t)threads * PER_THREAD) || (total != shared.output) ||
+	   (shared.dropped != shared.output) || (shared.copy_ns != shared.output * 10)){
+		fprintf(stderr, "FAIL: lost concurrent updates\n");
+		failed = 1;
+	}
+
+	printf("{\"bench\":\"stats\",\"clock_ns\":%.1f,\"frame_update_ns\":%.1f,\"quantile_error_pct\":%.1f,\"threads\":%d,\"ok\":%s}\n",
+		   clock_ns, update_ns, worst * 100., threads, failed ? "false" : "true");
+	return failed;
+}
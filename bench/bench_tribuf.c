@@ -0,0 +1,143 @@
+/*
+ Stress test and benchmark for the lock-free triple buffer in jit.freenect.sync.h.
+
+ A producer thread fills and publishes frames as fast as it can while a
+ consumer acquires them, either polling (like matrix_calc) or woken by the
+ semaphore (like the async worker). Every acquired frame is checked for
+ tearing and ordering. Build with "make tsan" to run it under ThreadSanitizer.
+
+   bench_tribuf [seconds]
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "jit.freenect.sync.h"
+#include "bench_util.h"
+
+#define FRAME_WORDS 4096
+#define MAX_SAMPLES 1000000
+
+typedef struct {
+	uint64_t    seq;
+	double      published;
+	uint64_t    words[FRAME_WORDS];
+} t_frame;
+
+static t_frame frames[3];
+static t_freenect_tribuf tb;
+static t_freenect_sem sem;
+static int use_sem;
+static int stop;
+static uint64_t published, dropped;
+static double latency[MAX_SAMPLES];
+static long nlatency;
+
+static void *producer(void *arg){
+	uint64_t seq = 0;
+	long i;
+
+	while(!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)){
+		t_frame *f = (t_frame *)freenect_tribuf_back(&tb);
+		seq++;
+		for(i=0;i<FRAME_WORDS;i++){
+			f->words[i] = seq;
+		}
+		f->seq = seq;
+		f->published = bench_now();
+		dropped += freenect_tribuf_publish(&tb);
+		if(use_sem){
+			freenect_sem_post(&sem);
+		}
+	}
+	published = seq;
+	if(use_sem){
+		freenect_sem_post(&sem);
+	}
+	return NULL;
+}
+
+static int consume(uint64_t *last, uint64_t *consumed){
+	t_frame *f;
+	long i;
+
+	if(!freenect_tribuf_acquire(&tb)){
+		return 0;
+	}
+	f = (t_frame *)freenect_tribuf_front(&tb);
+	if(nlatency < MAX_SAMPLES){
+		latency[nlatency++] = bench_now() - f->published;
+	}
+	if(f->seq <= *last){
+		fprintf(stderr, "FAIL: frame %llu acquired after %llu\n", (unsigned long long)f->seq, (unsigned long long)*last);
+		return -1;
+	}
+	for(i=0;i<FRAME_WORDS;i++){
+		if(f->words[i] != f->seq){
+			fprintf(stderr, "FAIL: torn frame %llu (word %ld is %llu)\n", (unsigned long long)f->seq, i, (unsigned long long)f->words[i]);
+			return -1;
+		}
+	}
+	*last = f->seq;
+	(*consumed)++;
+	return 1;
+}
+
+static int cmp_double(const void *a, const void *b){
+	double d = *(const double *)a - *(const double *)b;
+	return (d > 0) - (d < 0);
+}
+
+static int run(int with_sem, double seconds){
+	pthread_t thread;
+	uint64_t last = 0, consumed = 0;
+	double start, elapsed;
+	int failed = 0;
+
+	memset(frames, 0, sizeof(frames));
+	freenect_tribuf_init(&tb, &frames[0], &frames[1], &frames[2]);
+	use_sem = with_sem;
+	stop = 0;
+	published = dropped = 0;
+	nlatency = 0;
+	if(use_sem){
+		freenect_sem_init(&sem);
+	}
+
+	start = bench_now();
+	pthread_create(&thread, NULL, producer, NULL);
+	while(!failed){
+		if(bench_now() - start >= seconds){
+			__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+			break;
+		}
+		if(use_sem){
+			freenect_sem_wait(&sem);
+		}
+		failed = consume(&last, &consumed) < 0;
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	elapsed = bench_now() - start;
+	if(use_sem){
+		freenect_sem_destroy(&sem);
+	}
+
+	qsort(latency, nlatency, sizeof(double), cmp_double);
+	printf("{\"bench\":\"tribuf\",\"wake\":\"%s\",\"published\":%llu,\"consumed\":%llu,\"dropped\":%llu,"
+		   "\"publish_per_s\":%.0f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"ok\":%s}\n",
+		   use_sem ? "semaphore" : "poll", (unsigned long long)published, (unsigned long long)consumed,
+		   (unsigned long long)dropped, published / elapsed,
+		   nlatency ? latency[nlatency/2] * 1e6 : 0., nlatency ? latency[nlatency*99/100] * 1e6 : 0.,
+		   failed ? "false" : "true");
+	return failed;
+}
+
+int main(int argc, char **argv){
+	double seconds = argc > 1 ? atof(argv[1]) : 1.;
+	int failed = 0;
+
+	failed |= run(0, seconds);
+	failed |= run(1, seconds);
+	return failed;
+}
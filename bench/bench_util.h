@@ -0,0 +1,71 @@
+/*
+ Shared helpers for the jit.freenect.grab benchmarks.
+*/
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline double bench_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Deterministic 11-bit depth frame: a smooth ramp with some invalid (0x7FF) holes
+static inline void bench_fill_depth(uint16_t *d, long n){
+	uint32_t seed = 12345;
+	long i;
+	for(i=0;i<n;i++){
+		seed = seed * 1103515245u + 12345u;
+		if(((seed >> 16) & 0x1F) == 0){
+			d[i] = 0x7FF;
+		}
+		else{
+			d[i] = (uint16_t)(400 + (i % 640) + ((seed >> 20) & 0x7));
+		}
+	}
+}
+
+static inline void bench_fill_bytes(uint8_t *p, long n){
+	uint32_t seed = 6789;
+	long i;
+	for(i=0;i<n;i++){
+		seed = seed * 1103515245u + 12345u;
+		p[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+typedef struct {
+	double  mean;
+	double  p50;
+	double  p99;
+} t_bench_stats;
+
+static inline int bench_cmp_double(const void *a, const void *b){
+	double d = *(const double *)a - *(const double *)b;
+	return (d > 0) - (d < 0);
+}
+
+// Sorts samples in place
+static inline t_bench_stats bench_stats(double *samples, long n){
+	t_bench_stats st = {0., 0., 0.};
+	long i;
+
+	if(n <= 0){
+		return st;
+	}
+	for(i=0;i<n;i++){
+		st.mean += samples[i];
+	}
+	st.mean /= n;
+	qsort(samples, n, sizeof(double), bench_cmp_double);
+	st.p50 = samples[n/2];
+	st.p99 = samples[n*99/100];
+	return st;
+}
+
+#endif
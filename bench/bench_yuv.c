@@ -0,0 +1,123 @@
+/*
+ UYVY output benchmark for jit.freenect.yuv.c.
+
+ Both layouts are checked at every kernel level against a straightforward
+ version, for whole frames and for windows that are decimated, start on an
+ odd column or have an odd width. Then a 640x480 frame is timed in both
+ layouts next to the ARGB conversion that format rgb goes through, with the
+ bytes each one writes.
+
+   bench_yuv
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "jit.freenect.yuv.h"
+#include "bench_util.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define NPIX (WIDTH*HEIGHT)
+#define FRAMES 200
+
+static uint8_t uyvy[NPIX * 2], rgb[NPIX * 3], out[NPIX * 4], expected[NPIX * 4];
+
+static uint8_t luma(long x, long y){
+	return uyvy[(y * WIDTH + x) * 2 + 1];
+}
+
+// U of the pair holding x, or V with v set
+static uint8_t chroma(long x, long y, int v){
+	return uyvy[(y * WIDTH + (x & ~1L)) * 2 + (v ? 2 : 0)];
+}
+
+static long reference(const t_freenect_window *w, long planes){
+	long row, col, a, b, y, n = 0;
+
+	for(row=0;row<w->height;row++){
+		y = w->y + row * w->factor;
+		for(col=0;col<freenect_yuv_width(w->width, planes);col++){
+			if(planes == 4){
+				a = w->x + col * 2 * w->factor;
+				b = (a + w->factor < WIDTH) ? a + w->factor : a;
+				expected[n++] = chroma(a, y, 0);
+				expected[n++] = luma(a, y);
+				expected[n++] = chroma(a, y, 1);
+				expected[n++] = luma(b, y);
+			}
+			else{
+				a = w->x + col * w->factor;
+				expected[n++] = luma(a, y);
+				expected[n++] = chroma(a, y, (int)(col & 1));
+			}
+		}
+	}
+	return n;
+}
+
+static int check(const t_freenect_window *w, long planes, t_freenect_cpu_level level){
+	long row, n = reference(w, planes), stride = freenect_yuv_width(w->width, planes) * planes;
+
+	memset(out, 0, n);
+	for(row=0;row<w->height;row++){
+		freenect_yuv_row_level(w, uyvy, WIDTH, planes, row, out + row * stride, level);
+	}
+	if(memcmp(out, expected, n)){
+		fprintf(stderr, "MISMATCH: %s, %ld planes, window %ld %ld %ldx%ld factor %ld\n", freenect_cpu_level_name(level),
+				planes, w->x, w->y, w->width, w->height, w->factor);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void){
+	// x, y, width, height
+	static const long rois[5][4] = {{0, 0, 0, 0}, {1, 3, 101, 40}, {2, 0, 37, 9}, {600, 470, 0, 0}, {637, 0, 0, 0}};
+	t_freenect_cpu_level best = freenect_cpu_detect(), level;
+	t_freenect_window w;
+	long planes, factor, row;
+	int failed = 0, r, f;
+	double t;
+
+	freenect_kernels_init();
+	bench_fill_bytes(uyvy, NPIX * 2);
+	bench_fill_bytes(rgb, NPIX * 3);
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		for(planes=2;planes<=4;planes+=2){
+			for(r=0;r<5;r++){
+				for(factor=1;factor<=FREENECT_DECIMATE_MAX;factor*=2){
+					freenect_window_init(&w, WIDTH, HEIGHT, rois[r], factor, 0);
+					failed |= check(&w, planes, level);
+				}
+			}
+		}
+	}
+
+	freenect_window_init(&w, WIDTH, HEIGHT, rois[0], 1, 0);
+	for(level=FREENECT_CPU_SCALAR;level<=best;level++){
+		// No SSSE3 versions
+		if(level == FREENECT_CPU_SSSE3){
+			continue;
+		}
+		for(planes=2;planes<=4;planes+=2){
+			t = bench_now();
+			for(f=0;f<FRAMES;f++){
+				for(row=0;row<HEIGHT;row++){
+					freenect_yuv_row_level(&w, uyvy, WIDTH, planes, row, out + row * WIDTH * 2, level);
+				}
+			}
+			t = (bench_now() - t) * 1e3 / FRAMES;
+			printf("{\"bench\":\"yuv\",\"level\":\"%s\",\"planes\":%ld,\"ms\":%.3f,\"bytes_out\":%d}\n", freenect_cpu_level_name(level),
+				   planes, t, NPIX * 2);
+		}
+	}
+	t = bench_now();
+	for(f=0;f<FRAMES;f++){
+		freenect_convert_rgb_rows(rgb, WIDTH, (char *)out, WIDTH * 4, 4, 0, HEIGHT);
+	}
+	t = (bench_now() - t) * 1e3 / FRAMES;
+	printf("{\"bench\":\"yuv\",\"level\":\"%s\",\"argb_ms\":%.3f,\"bytes_out\":%d}\n", freenect_cpu_level_name(best), t, NPIX * 4);
+
+	printf("{\"bench\":\"yuv\",\"ok\":%s}\n", failed ? "false" : "true");
+	return failed;
+}
@@ -0,0 +1,220 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+#include "jit.freenect.background.h"
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+#define BACKGROUND_ALIGN    64
+
+int freenect_background_init(t_freenect_background *b, long width, long height, uint16_t invalid){
+	void *model = NULL;
+
+	if(b->model && (b->width == width) && (b->height == height)){
+		return 0;
+	}
+	if(posix_memalign(&model, BACKGROUND_ALIGN, width * height * sizeof(uint16_t))){
+		return -1;
+	}
+	freenect_background_free(b);
+	b->model = (uint16_t *)model;
+	b->width = width;
+	b->height = height;
+	freenect_background_clear(b, invalid);
+	return 0;
+}
+
+void freenect_background_free(t_freenect_background *b){
+	free(b->model);
+	b->model = NULL;
+	b->width = b->height = 0;
+}
+
+void freenect_background_clear(t_freenect_background *b, uint16_t invalid){
+	long i, n = b->width * b->height;
+
+	b->invalid = invalid;
+	for(i=0;i<n && b->model;i++){
+		b->model[i] = FREENECT_BACKGROUND_NONE;
+	}
+}
+
+#pragma mark - Scalar
+
+static void learn_scalar(uint16_t *model, const uint16_t *depth, long i, long end, uint16_t bias){
+	uint16_t v;
+
+	for(;i<end;i++){
+		v = (uint16_t)(depth[i] - bias);
+		model[i] = (v < model[i]) ? v : model[i];
+	}
+}
+
+// Pixels [col, width) of a row, step source pixels apart. model may be NULL.
+static void mask_scalar(const uint16_t *model, const uint16_t *depth, long step, long col, long width,
+						uint16_t bias, uint16_t tolerance, uint8_t *mask){
+	uint32_t near;
+	uint16_t m;
+
+	for(;col<width;col++){
+		// A missing reading is 0xFFFF, which is never nearer than anything
+		near = (uint32_t)(uint16_t)(depth[col * step] - bias) + tolerance;
+		m = model ? model[col * step] : FREENECT_BACKGROUND_NONE;
+		mask[col] = (near < m) ? FREENECT_FOREGROUND : 0;
+	}
+}
+
+#if FREENECT_X86
+
+#pragma mark - SSE2
+
+// SSE2 has no unsigned 16-bit minimum: a - (a - b saturated) instead
+FREENECT_TARGET("sse2")
+static void learn_sse2(uint16_t *model, const uint16_t *depth, long i, long end, uint16_t bias){
+	const __m128i b = _mm_set1_epi16((short)bias);
+	__m128i m, v;
+
+	for(;i + 8 <= end;i+=8){
+		m = _mm_loadu_si128((const __m128i *)(model + i));
+		v = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(depth + i)), b);
+		_mm_storeu_si128((__m128i *)(model + i), _mm_sub_epi16(m, _mm_subs_epu16(m, v)));
+	}
+	learn_scalar(model, depth, i, end, bias);
+}
+
+// Foreground where the model is still above the reading plus the tolerance,
+// i.e. where taking one from the other leaves something
+FREENECT_TARGET("sse2")
+static void mask_sse2(const uint16_t *model, const uint16_t *depth, long width, uint16_t bias, uint16_t tolerance, uint8_t *mask){
+	const __m128i b = _mm_set1_epi16((short)bias), tol = _mm_set1_epi16((short)tolerance);
+	const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi8(-1);
+	__m128i back[2], near;
+	long col, k;
+
+	for(col=0;col + 16 <= width;col+=16){
+		for(k=0;k<2;k++){
+			near = _mm_adds_epu16(_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(depth + col + k * 8)), b), tol);
+			back[k] = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_loadu_si128((const __m128i *)(model + col + k * 8)), near), zero);
+		}
+		_mm_storeu_si128((__m128i *)(mask + col), _mm_xor_si128(_mm_packs_epi16(back[0], back[1]), ones));
+	}
+	mask_scalar(model, depth, 1, col, width, bias, tolerance, mask);
+}
+
+#pragma mark - AVX2
+
+FREENECT_TARGET("avx2")
+static void learn_avx2(uint16_t *model, const uint16_t *depth, long i, long end, uint16_t bias){
+	const __m256i b = _mm256_set1_epi16((short)bias);
+	__m256i v;
+
+	for(;i + 16 <= end;i+=16){
+		v = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(depth + i)), b);
+		_mm256_storeu_si256((__m256i *)(model + i), _mm256_min_epu16(_mm256_loadu_si256((const __m256i *)(model + i)), v));
+	}
+	learn_scalar(model, depth, i, end, bias);
+}
+
+FREENECT_TARGET("avx2")
+static void mask_avx2(const uint16_t *model, const uint16_t *depth, long width, uint16_t bias, uint16_t tolerance, uint8_t *mask){
+	const __m256i b = _mm256_set1_epi16((short)bias), tol = _mm256_set1_epi16((short)tolerance);
+	const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi8(-1);
+	__m256i back[2], near;
+	long col, k;
+
+	for(col=0;col + 32 <= width;col+=32){
+		for(k=0;k<2;k++){
+			near = _mm256_adds_epu16(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(depth + col + k * 16)), b), tol);
+			back[k] = _mm256_cmpeq_epi16(_mm256_subs_epu16(_mm256_loadu_si256((const __m256i *)(model + col + k * 16)), near), zero);
+		}
+		// packs works within 128-bit halves, the permute puts the quarters back in order
+		_mm256_storeu_si256((__m256i *)(mask + col),
+							_mm256_xor_si256(_mm256_permute4x64_epi64(_mm256_packs_epi16(back[0], back[1]), 0xD8), ones));
+	}
+	mask_scalar(model, depth, 1, col, width, bias, tolerance, mask);
+}
+
+#endif // FREENECT_X86
+
+#pragma mark - Dispatch
+
+void freenect_background_learn_rows_level(t_freenect_background *b, const uint16_t *depth, long begin, long end,
+										  t_freenect_cpu_level level){
+	long i = begin * b->width, n = end * b->width;
+	uint16_t bias = (uint16_t)(b->invalid + 1);
+
+	if(!b->model){
+		return;
+	}
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+#if FREENECT_X86
+	if(level >= FREENECT_CPU_AVX2){
+		learn_avx2(b->model, depth, i, n, bias);
+		return;
+	}
+	if(level >= FREENECT_CPU_SSE2){
+		learn_sse2(b->model, depth, i, n, bias);
+		return;
+	}
+#endif
+	learn_scalar(b->model, depth, i, n, bias);
+}
+
+void freenect_background_learn_rows(t_freenect_background *b, const uint16_t *depth, long begin, long end){
+	freenect_background_learn_rows_level(b, depth, begin, end, freenect_kernels.level);
+}
+
+void freenect_background_mask_row_level(const t_freenect_background *b, const t_freenect_window *w, const uint16_t *depth,
+										long src_width, long row, uint16_t invalid, uint16_t tolerance, uint8_t *mask,
+										t_freenect_cpu_level level){
+	long offset = (w->y + row * w->factor) * src_width + w->x;
+	const uint16_t *model = (b && b->model) ? b->model + offset : NULL;
+	uint16_t bias = (uint16_t)(invalid + 1);
+
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+#if FREENECT_X86
+	if(model && (w->factor == 1)){
+		if(level >= FREENECT_CPU_AVX2){
+			mask_avx2(model, depth + offset, w->width, bias, tolerance, mask);
+			return;
+		}
+		if(level >= FREENECT_CPU_SSE2){
+			mask_sse2(model, depth + offset, w->width, bias, tolerance, mask);
+			return;
+		}
+	}
+#endif
+	mask_scalar(model, depth + offset, w->factor, 0, w->width, bias, tolerance, mask);
+}
+
+void freenect_background_mask_row(const t_freenect_background *b, const t_freenect_window *w, const uint16_t *depth,
+								  long src_width, long row, uint16_t invalid, uint16_t tolerance, uint8_t *mask){
+	freenect_background_mask_row_level(b, w, depth, src_width, row, invalid, tolerance, mask, freenect_kernels.level);
+}
@@ -0,0 +1,80 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Background model of jit.freenect.grab and the foreground mask it gives.
+
+ While learning, the model keeps the nearest reading each pixel had, so the
+ noise of an empty scene is learnt with it. Afterwards a pixel is foreground
+ when its reading is nearer than the model by more than a tolerance. A pixel
+ that never had a reading while learning is taken as infinitely far: any
+ reading there is foreground, none is not.
+
+ Both raw disparity and registered millimetres grow with distance. Values are
+ kept offset by the value without a reading plus one, which wraps that value
+ to 0xFFFF and keeps the readings in order below it, so learning is a single
+ unsigned minimum and the mask a saturated add and compare. The mask is
+ computed row by row on the window being output, right after the depth row is
+ converted.
+
+ Like the other kernels, nothing here depends on the Max SDK (see bench/).
+*/
+
+#ifndef JIT_FREENECT_BACKGROUND_H
+#define JIT_FREENECT_BACKGROUND_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+#include "jit.freenect.decimate.h"
+
+#define FREENECT_BACKGROUND_NONE    0xFFFF
+#define FREENECT_FOREGROUND         255
+
+typedef struct _freenect_background {
+	long        width;
+	long        height;
+	uint16_t    *model;     // nearest reading learnt, offset; FREENECT_BACKGROUND_NONE for none
+	uint16_t    invalid;    // raw value without a reading the model is learnt from
+} t_freenect_background;
+
+// Allocates a model for width x height frames, cleared for invalid, or keeps the
+// current one when the size did not change. b must be zeroed before the first
+// call. Returns 0 on success.
+int     freenect_background_init(t_freenect_background *b, long width, long height, uint16_t invalid);
+void    freenect_background_free(t_freenect_background *b);
+// Forgets everything learnt, for depth whose value without a reading is invalid
+void    freenect_background_clear(t_freenect_background *b, uint16_t invalid);
+
+// Learns rows [begin, end) of a depth frame of the model's size. Disjoint ranges
+// can be learnt concurrently.
+void    freenect_background_learn_rows(t_freenect_background *b, const uint16_t *depth, long begin, long end);
+void    freenect_background_learn_rows_level(t_freenect_background *b, const uint16_t *depth, long begin, long end,
+											 t_freenect_cpu_level level);
+
+// Output row of the foreground mask of the window of depth, w->width bytes of
+// FREENECT_FOREGROUND or 0. Decimated pixels look at the top left pixel of their
+// block. Without a model (b NULL or never allocated) every reading is foreground.
+void    freenect_background_mask_row(const t_freenect_background *b, const t_freenect_window *w, const uint16_t *depth,
+									 long src_width, long row, uint16_t invalid, uint16_t tolerance, uint8_t *mask);
+void    freenect_background_mask_row_level(const t_freenect_background *b, const t_freenect_window *w, const uint16_t *depth,
+										   long src_width, long row, uint16_t invalid, uint16_t tolerance, uint8_t *mask,
+										   t_freenect_cpu_level level);
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.bayer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+static inline uint8_t bayer_avg(uint8_t a, uint8_t b){
+	return (uint8_t)((a + b + 1) >> 1);
+}
+
+// Mirrored around the border pixel, which keeps the colour of the pattern
+static inline long bayer_reflect(long i, long n){
+	return (i < 0) ? -i : ((i >= n) ? 2 * n - 2 - i : i);
+}
+
+#pragma mark - Scalar
+
+// Pixels [x, end) of row y
+static void bilinear_scalar(const uint8_t *raw, uint8_t *rgb, long width, long height, long y, long x, long end){
+	const uint8_t *up = raw + bayer_reflect(y - 1, height) * width;
+	const uint8_t *cur = raw + y * width;
+	const uint8_t *down = raw + bayer_reflect(y + 1, height) * width;
+	uint8_t *out = rgb + (y * width + x) * 3;
+	uint8_t h, v, cross, diag;
+	long l, r;
+
+	for(;x<end;x++,out+=3){
+		l = bayer_reflect(x - 1, width);
+		r = bayer_reflect(x + 1, width);
+		h = bayer_avg(cur[l], cur[r]);
+		v = bayer_avg(up[x], down[x]);
+		cross = bayer_avg(h, v);
+		diag = bayer_avg(bayer_avg(up[l], up[r]), bayer_avg(down[l], down[r]));
+		if(!(y & 1)){
+			out[0] = (x & 1) ? cur[x] : h;
+			out[1] = (x & 1) ? cross : cur[x];
+			out[2] = (x & 1) ? diag : v;
+		}
+		else{
+			out[0] = (x & 1) ? v : diag;
+			out[1] = (x & 1) ? cur[x] : cross;
+			out[2] = (x & 1) ? h : cur[x];
+		}
+	}
+}
+
+// Pixels [x, end) of row y, x even
+static void superpixel_scalar(const uint8_t *raw, uint8_t *rgb, long width, long y, long x, long end){
+	const uint8_t *top = raw + (y & ~1L) * width;
+	const uint8_t *bottom = top + width;
+	uint8_t *out = rgb + (y * width + x) * 3;
+	long c;
+
+	for(;x<end;x++,out+=3){
+		c = x & ~1L;
+		out[0] = top[c + 1];
+		out[1] = bayer_avg(top[c], bottom[c + 1]);
+		out[2] = bottom[c];
+	}
+}
+
+#if FREENECT_X86
+
+#pragma mark - SSSE3
+
+// Interleaves 16 pixels of red, green and blue into 48 bytes
+FREENECT_TARGET("ssse3")
+static inline void store_rgb_ssse3(uint8_t *out, __m128i r, __m128i g, __m128i b){
+	_mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128, 5)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(-128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128, -128))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-128, -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128))));
+	_mm_storeu_si128((__m128i *)(out + 16), _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10, -128)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128, 10))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(-128, 5, -128, -128, 6, -128, -128, 7, -128, -128, 8, -128, -128, 9, -128, -128))));
+	_mm_storeu_si128((__m128i *)(out + 32), _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128, -128)),
+		_mm_shuffle_epi8(g, _mm_setr_epi8(-128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15, -128))),
+		_mm_shuffle_epi8(b, _mm_setr_epi8(10, -128, -128, 11, -128, -128, 12, -128, -128, 13, -128, -128, 14, -128, -128, 15))));
+}
+
+FREENECT_TARGET("ssse3")
+static inline __m128i select_ssse3(__m128i even, __m128i a, __m128i b){
+	return _mm_or_si128(_mm_and_si128(even, a), _mm_andnot_si128(even, b));
+}
+
+FREENECT_TARGET("ssse3")
+static void bilinear_ssse3(const uint8_t *raw, uint8_t *rgb, long width, long height, long y){
+	const uint8_t *up = raw + bayer_reflect(y - 1, height) * width;
+	const uint8_t *cur = raw + y * width;
+	const uint8_t *down = raw + bayer_reflect(y + 1, height) * width;
+	const __m128i even = _mm_set1_epi16(0x00FF);
+	__m128i c, h, v, cross, diag;
+	long x;
+
+	// The first pixel reads its mirrored left neighbour, the SIMD loop starts on an even one after it
+	bilinear_scalar(raw, rgb, width, height, y, 0, 2);
+	for(x=2;x+17<=width;x+=16){
+		c = _mm_loadu_si128((const __m128i *)(cur + x));
+		h = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(cur + x - 1)), _mm_loadu_si128((const __m128i *)(cur + x + 1)));
+		v = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(up + x)), _mm_loadu_si128((const __m128i *)(down + x)));
+		cross = _mm_avg_epu8(h, v);
+		diag = _mm_avg_epu8(_mm_avg_epu8(_mm_loadu_si128((const __m128i *)(up + x - 1)), _mm_loadu_si128((const __m128i *)(up + x + 1))),
+							_mm_avg_epu8(_mm_loadu_si128((const __m128i *)(down + x - 1)), _mm_loadu_si128((const __m128i *)(down + x + 1))));
+		if(!(y & 1)){
+			store_rgb_ssse3(rgb + (y * width + x) * 3, select_ssse3(even, h, c), select_ssse3(even, c, cross), select_ssse3(even, v, diag));
+		}
+		else{
+			store_rgb_ssse3(rgb + (y * width + x) * 3, select_ssse3(even, diag, v), select_ssse3(even, cross, c), select_ssse3(even, c, h));
+		}
+	}
+	bilinear_scalar(raw, rgb, width, height, y, x, width);
+}
+
+FREENECT_TARGET("ssse3")
+static void superpixel_ssse3(const uint8_t *raw, uint8_t *rgb, long width, long y){
+	const uint8_t *top = raw + (y & ~1L) * width;
+	const uint8_t *bottom = top + width;
+	const __m128i left = _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14);
+	const __m128i right = _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15);
+	__m128i t, b;
+	long x;
+
+	for(x=0;x+16<=width;x+=16){
+		t = _mm_loadu_si128((const __m128i *)(top + x));
+		b = _mm_loadu_si128((const __m128i *)(bottom + x));
+		store_rgb_ssse3(rgb + (y * width + x) * 3, _mm_shuffle_epi8(t, right),
+						_mm_avg_epu8(_mm_shuffle_epi8(t, left), _mm_shuffle_epi8(b, right)), _mm_shuffle_epi8(b, left));
+	}
+	superpixel_scalar(raw, rgb, width, y, x, width);
+}
+
+#pragma mark - AVX2
+
+// 32 pixels per iteration, interleaved 16 at a time
+FREENECT_TARGET("avx2")
+static void bilinear_avx2(const uint8_t *raw, uint8_t *rgb, long width, long height, long y){
+	const uint8_t *up = raw + bayer_reflect(y - 1, height) * width;
+	const uint8_t *cur = raw + y * width;
+	const uint8_t *down = raw + bayer_reflect(y + 1, height) * width;
+	const __m256i even = _mm256_set1_epi16(0x00FF);
+	__m256i c, h, v, cross, diag, r, g, b;
+	uint8_t *out;
+	long x;
+
+	bilinear_scalar(raw, rgb, width, height, y, 0, 2);
+	for(x=2;x+33<=width;x+=32){
+		c = _mm256_loadu_si256((const __m256i *)(cur + x));
+		h = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(cur + x - 1)), _mm256_loadu_si256((const __m256i *)(cur + x + 1)));
+		v = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(up + x)), _mm256_loadu_si256((const __m256i *)(down + x)));
+		cross = _mm256_avg_epu8(h, v);
+		diag = _mm256_avg_epu8(_mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(up + x - 1)), _mm256_loadu_si256((const __m256i *)(up + x + 1))),
+							   _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(down + x - 1)), _mm256_loadu_si256((const __m256i *)(down + x + 1))));
+		if(!(y & 1)){
+			r = _mm256_blendv_epi8(c, h, even);
+			g = _mm256_blendv_epi8(cross, c, even);
+			b = _mm256_blendv_epi8(diag, v, even);
+		}
+		else{
+			r = _mm256_blendv_epi8(v, diag, even);
+			g = _mm256_blendv_epi8(c, cross, even);
+			b = _mm256_blendv_epi8(h, c, even);
+		}
+		out = rgb + (y * width + x) * 3;
+		store_rgb_ssse3(out, _mm256_castsi256_si128(r), _mm256_castsi256_si128(g), _mm256_castsi256_si128(b));
+		store_rgb_ssse3(out + 48, _mm256_extracti128_si256(r, 1), _mm256_extracti128_si256(g, 1), _mm256_extracti128_si256(b, 1));
+	}
+	bilinear_scalar(raw, rgb, width, height, y, x, width);
+}
+
+#endif
+
+#pragma mark - Dispatch
+
+void freenect_bayer_rows_level(const uint8_t *raw, uint8_t *rgb, long width, long height, int method, long begin, long end,
+							   t_freenect_cpu_level level){
+	long y;
+
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+	for(y=begin;y<end;y++){
+#if FREENECT_X86
+		// Superpixel is bound by its stores, AVX2 would not help
+		if(method == FREENECT_BAYER_SUPERPIXEL){
+			if(level >= FREENECT_CPU_SSSE3){
+				superpixel_ssse3(raw, rgb, width, y);
+				continue;
+			}
+		}
+		else if(level >= FREENECT_CPU_AVX2){
+			bilinear_avx2(raw, rgb, width, height, y);
+			continue;
+		}
+		else if(level >= FREENECT_CPU_SSSE3){
+			bilinear_ssse3(raw, rgb, width, height, y);
+			continue;
+		}
+#endif
+		if(method == FREENECT_BAYER_SUPERPIXEL){
+			superpixel_scalar(raw, rgb, width, y, 0, width);
+		}
+		else{
+			bilinear_scalar(raw, rgb, width, height, y, 0, width);
+		}
+	}
+}
+
+void freenect_bayer_rows(const uint8_t *raw, uint8_t *rgb, long width, long height, int method, long begin, long end){
+	freenect_bayer_rows_level(raw, rgb, width, height, method, begin, end, freenect_kernels.level);
+}
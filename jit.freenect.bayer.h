@@ -0,0 +1,62 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Demosaicing of the Kinect's raw Bayer video (format bayer).
+
+ Asked for RGB, libfreenect demosaics every frame on the USB event thread
+ that all devices share. Asked for the raw mosaic, it only copies one byte per
+ pixel, and the frame is demosaiced here with the rest of the conversion, on
+ the shared pool or on the conversion worker.
+
+ The sensor's filters are laid out
+
+   G R G R ...
+   B G B G ...
+
+ Bilinear gives each pixel the mean of its nearest neighbours of the missing
+ colours, mirrored at the borders so the pattern carries on. Every mean is a
+ rounded average of two, as SIMD computes them, so a mean of four is the
+ average of two averages. Superpixel gives the four pixels of each 2x2 cell
+ the cell's own red, blue and mean green: half the resolution, no
+ interpolation, and nearly no work, which suits decimate 2 and more.
+
+ Like the other kernels, nothing here depends on the Max SDK (see bench/).
+*/
+
+#ifndef JIT_FREENECT_BAYER_H
+#define JIT_FREENECT_BAYER_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+
+typedef enum _freenect_bayer_method {
+	FREENECT_BAYER_BILINEAR = 0,
+	FREENECT_BAYER_SUPERPIXEL
+} t_freenect_bayer_method;
+
+// Rows [begin, end) of the width x height mosaic raw, both even, demosaiced into
+// rgb (3 bytes per pixel, same size). Disjoint ranges can be demosaiced
+// concurrently.
+void    freenect_bayer_rows(const uint8_t *raw, uint8_t *rgb, long width, long height, int method, long begin, long end);
+void    freenect_bayer_rows_level(const uint8_t *raw, uint8_t *rgb, long width, long height, int method, long begin, long end,
+								  t_freenect_cpu_level level);
+
+#endif
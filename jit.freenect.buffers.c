@@ -0,0 +1,188 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+#include "jit.freenect.buffers.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// Kept out of the buffers so that their alignment is exactly what was asked for
+typedef struct _buffer {
+	void            *data;
+	size_t          size;
+	int             in_use;
+	uint64_t        given_back;     // order in which idle buffers were given back, oldest is freed first
+	struct _buffer  *link;
+} t_buffer;
+
+// Everything below is guarded by buffers_mutex
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static t_buffer *buffers = NULL;
+static int buffers_huge = 0;
+static uint64_t buffers_returns = 0;
+static uint64_t buffers_used = 0;
+static uint64_t buffers_idle = 0;
+static long buffers_count = 0;
+
+static size_t reserved_size(size_t bytes, int huge){
+	size_t align = (huge && (bytes >= FREENECT_BUFFER_HUGE_PAGE)) ? FREENECT_BUFFER_HUGE_PAGE : FREENECT_BUFFER_ALIGN;
+	return (bytes + align - 1) & ~(align - 1);
+}
+
+static void *allocate(size_t size){
+	size_t align = (buffers_huge && !(size % FREENECT_BUFFER_HUGE_PAGE)) ? FREENECT_BUFFER_HUGE_PAGE : FREENECT_BUFFER_ALIGN;
+	void *data;
+
+	if(posix_memalign(&data, align, size)){
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if(align == FREENECT_BUFFER_HUGE_PAGE){
+		madvise(data, size, MADV_HUGEPAGE);
+	}
+#endif
+	return data;
+}
+
+// Frees the idle buffers given back first until at most keep bytes are idle. Called locked.
+static void release_idle(uint64_t keep){
+	t_buffer **b, **oldest;
+	t_buffer *r;
+
+	while(buffers_idle > keep){
+		oldest = NULL;
+		for(b=&buffers;*b;b=&(*b)->link){
+			if(!(*b)->in_use && (!oldest || ((*b)->given_back < (*oldest)->given_back))){
+				oldest = b;
+			}
+		}
+		if(!oldest){
+			break;
+		}
+		r = *oldest;
+		*oldest = r->link;
+		buffers_idle -= r->size;
+		free(r->data);
+		free(r);
+	}
+}
+
+void *freenect_buffer_get(size_t bytes){
+	t_buffer *b, *reuse = NULL;
+	size_t size;
+
+	if(!bytes){
+		return NULL;
+	}
+	pthread_mutex_lock(&buffers_mutex);
+	size = reserved_size(bytes, buffers_huge);
+	// The buffer given back last is the likeliest to still be in cache
+	for(b=buffers;b;b=b->link){
+		if(!b->in_use && (b->size == size) && (!reuse || (b->given_back > reuse->given_back))){
+			reuse = b;
+		}
+	}
+	if(reuse){
+		buffers_idle -= size;
+	}
+	else{
+		reuse = (t_buffer *)malloc(sizeof(t_buffer));
+		if(reuse && !(reuse->data = allocate(size))){
+			free(reuse);
+			reuse = NULL;
+		}
+		if(!reuse){
+			pthread_mutex_unlock(&buffers_mutex);
+			return NULL;
+		}
+		reuse->size = size;
+		reuse->link = buffers;
+		buffers = reuse;
+	}
+	reuse->in_use = 1;
+	buffers_used += size;
+	buffers_count++;
+	pthread_mutex_unlock(&buffers_mutex);
+	return reuse->data;
+}
+
+void freenect_buffer_put(void *p){
+	t_buffer *b;
+
+	if(!p){
+		return;
+	}
+	pthread_mutex_lock(&buffers_mutex);
+	for(b=buffers;b;b=b->link){
+		if((b->data == p) && b->in_use){
+			b->in_use = 0;
+			b->given_back = ++buffers_returns;
+			buffers_used -= b->size;
+			buffers_idle += b->size;
+			buffers_count--;
+			release_idle(FREENECT_BUFFER_IDLE_MAX);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&buffers_mutex);
+}
+
+size_t freenect_buffer_size(const void *p){
+	t_buffer *b;
+	size_t size = 0;
+
+	pthread_mutex_lock(&buffers_mutex);
+	for(b=buffers;b;b=b->link){
+		if(b->data == p){
+			size = b->size;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&buffers_mutex);
+	return size;
+}
+
+void freenect_buffers_set_huge(int on){
+	pthread_mutex_lock(&buffers_mutex);
+	buffers_huge = on != 0;
+	pthread_mutex_unlock(&buffers_mutex);
+}
+
+int freenect_buffers_huge(void){
+	int on;
+
+	pthread_mutex_lock(&buffers_mutex);
+	on = buffers_huge;
+	pthread_mutex_unlock(&buffers_mutex);
+	return on;
+}
+
+void freenect_buffers_footprint(t_freenect_buffer_footprint *f){
+	pthread_mutex_lock(&buffers_mutex);
+	f->used = buffers_used;
+	f->idle = buffers_idle;
+	f->buffers = buffers_count;
+	pthread_mutex_unlock(&buffers_mutex);
+}
+
+void freenect_buffers_trim(void){
+	pthread_mutex_lock(&buffers_mutex);
+	release_idle(0);
+	pthread_mutex_unlock(&buffers_mutex);
+}
@@ -0,0 +1,67 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+/*
+ Frame buffer pool shared by all jit.freenect.grab instances.
+
+ Instances take their frame buffers from here when a source opens, sized
+ from its frame modes, and give them back when it closes, so a patch full of
+ idle grabbers holds no frame memory. Buffers given back stay in the pool
+ for the next open of the same size, up to FREENECT_BUFFER_IDLE_MAX bytes,
+ beyond which the oldest are freed.
+
+ Every buffer is aligned to a cache line, so SIMD kernels never split a load
+ on the first pixel of a row. With huge pages on, buffers of at least
+ FREENECT_BUFFER_HUGE_PAGE bytes are aligned and rounded to that size and
+ the kernel is asked to back them with huge pages (Linux only), which cuts
+ TLB misses when a frame is walked. Like the other kernels, nothing here
+ depends on the Max SDK (see bench/).
+*/
+
+#ifndef JIT_FREENECT_BUFFERS_H
+#define JIT_FREENECT_BUFFERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FREENECT_BUFFER_ALIGN       64
+#define FREENECT_BUFFER_HUGE_PAGE   (2 << 20)
+#define FREENECT_BUFFER_IDLE_MAX    (32 << 20)  // bytes kept for reuse once given back
+
+typedef struct _freenect_buffer_footprint {
+	uint64_t    used;       // bytes handed out
+	uint64_t    idle;       // bytes given back and kept for reuse
+	long        buffers;    // handed out
+} t_freenect_buffer_footprint;
+
+// A buffer of at least bytes, reused from the pool when one of that size is idle. NULL when out of memory.
+void    *freenect_buffer_get(size_t bytes);
+// Gives a buffer back to the pool, NULL is ignored
+void    freenect_buffer_put(void *p);
+// Bytes actually reserved for a buffer handed out, after rounding
+size_t  freenect_buffer_size(const void *p);
+
+// Applies to buffers allocated from then on
+void    freenect_buffers_set_huge(int on);
+int     freenect_buffers_huge(void);
+void    freenect_buffers_footprint(t_freenect_buffer_footprint *f);
+// Frees every idle buffer
+void    freenect_buffers_trim(void);
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.cloud.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+#define CLOUD_MM        0.001f
+#define CLOUD_COLOR     (1.f / 255.f)
+
+const t_freenect_intrinsics freenect_depth_intrinsics = {594.21434f, 591.04054f, 339.30781f, 242.73914f};
+const t_freenect_intrinsics freenect_video_intrinsics = {529.21508f, 525.56394f, 328.94272f, 267.48068f};
+
+int freenect_cloud_init(t_freenect_cloud *c, long width, long height, const t_freenect_intrinsics *k, const float *metres){
+	void *ray_x, *ray_y;
+	long i, j;
+
+	c->metres = metres;
+	if(c->ray_x && (c->width == width) && (c->height == height) && !memcmp(&c->intrinsics, k, sizeof(t_freenect_intrinsics))){
+		return 0;
+	}
+	freenect_cloud_free(c);
+	if(posix_memalign(&ray_x, FREENECT_CLOUD_ALIGN, width * height * sizeof(float))){
+		return -1;
+	}
+	if(posix_memalign(&ray_y, FREENECT_CLOUD_ALIGN, width * height * sizeof(float))){
+		free(ray_x);
+		return -1;
+	}
+	c->ray_x = (float *)ray_x;
+	c->ray_y = (float *)ray_y;
+	c->width = width;
+	c->height = height;
+	c->intrinsics = *k;
+	for(i=0;i<height;i++){
+		for(j=0;j<width;j++){
+			c->ray_x[i * width + j] = ((float)j - k->cx) / k->fx;
+			c->ray_y[i * width + j] = -((float)i - k->cy) / k->fy;
+		}
+	}
+	return 0;
+}
+
+void freenect_cloud_free(t_freenect_cloud *c){
+	free(c->ray_x);
+	free(c->ray_y);
+	c->ray_x = NULL;
+	c->ray_y = NULL;
+	c->width = 0;
+	c->height = 0;
+}
+
+#pragma mark - Scalar
+
+// Metres in front of the camera, 0 without a reading
+static inline float depth_metres(uint16_t raw, const float *metres){
+	if(!metres){
+		return (float)raw * CLOUD_MM;
+	}
+	return metres[raw > FREENECT_DEPTH_MAX ? FREENECT_DEPTH_MAX : raw];
+}
+
+// depth and video point at the first pixel of the row, the rays are per frame
+static inline void point_scalar(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+								float *out, long planes, long row, long col){
+	long p = row * c->width + col;
+	const uint8_t *rgb;
+	float z = depth_metres(depth[col], c->metres);
+
+	out[0] = c->ray_x[p] * z;
+	out[1] = c->ray_y[p] * z;
+	out[2] = -z;
+	if(planes < 5){
+		return;
+	}
+	out[3] = (float)col * (1.f / (float)c->width);
+	out[4] = (float)row * (1.f / (float)c->height);
+	if(planes < 8){
+		return;
+	}
+	if(!video){
+		out[5] = out[6] = out[7] = 0.f;
+		return;
+	}
+	rgb = video + col * video_bpp;
+	out[5] = (float)rgb[0] * CLOUD_COLOR;
+	out[6] = (float)rgb[video_bpp > 1 ? 1 : 0] * CLOUD_COLOR;
+	out[7] = (float)rgb[video_bpp > 2 ? 2 : 0] * CLOUD_COLOR;
+}
+
+static void row_scalar(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+					   float *out, long planes, long row, long col){
+	for(;col<c->width;col++){
+		point_scalar(c, depth, video, video_bpp, out + col * planes, planes, row, col);
+	}
+}
+
+#if FREENECT_X86
+
+#pragma mark - SSE2
+
+// Writes 4 points. The 3 and 5 plane layouts are written with overlapping 4-float
+// stores, each spilling into the next point, which is written afterwards: the
+// caller must leave at least one point of the row to be written after these.
+FREENECT_TARGET("sse2")
+static inline void store_points_sse2(float *out, long planes, __m128 x, __m128 y, __m128 z, __m128 u,
+									 __m128 v, __m128 r, __m128 g, __m128 b){
+	long k;
+	__m128 lo[4], hi[4];
+
+	lo[0] = x; lo[1] = y; lo[2] = z; lo[3] = u;
+	_MM_TRANSPOSE4_PS(lo[0], lo[1], lo[2], lo[3]);
+	if(planes < 5){
+		for(k=0;k<4;k++){
+			_mm_storeu_ps(out + k * 3, lo[k]);
+		}
+		return;
+	}
+	hi[0] = v; hi[1] = r; hi[2] = g; hi[3] = b;
+	_MM_TRANSPOSE4_PS(hi[0], hi[1], hi[2], hi[3]);
+	for(k=0;k<4;k++){
+		_mm_storeu_ps(out + k * planes, lo[k]);
+		_mm_storeu_ps(out + k * planes + 4, hi[k]);
+	}
+}
+
+// Same as depth_metres() on 4 samples, no gather before AVX2
+FREENECT_TARGET("sse2")
+static inline __m128 depth_metres_sse2(__m128i raw, const float *metres){
+	__m128i v;
+
+	if(!metres){
+		return _mm_mul_ps(_mm_cvtepi32_ps(raw), _mm_set1_ps(CLOUD_MM));
+	}
+	// SSE2 has no unsigned 16-bit min: a - (a -sat b) == min(a,b), the zero high halves stay zero
+	v = _mm_sub_epi16(raw, _mm_subs_epu16(raw, _mm_set1_epi32(FREENECT_DEPTH_MAX)));
+	return _mm_setr_ps(metres[_mm_extract_epi16(v, 0)], metres[_mm_extract_epi16(v, 2)],
+					   metres[_mm_extract_epi16(v, 4)], metres[_mm_extract_epi16(v, 6)]);
+}
+
+// Video of pixels col to col + 3 of the row as floats, one channel per vector
+FREENECT_TARGET("sse2")
+static inline void colors_sse2(const uint8_t *video, long video_bpp, long col, __m128 *r, __m128 *g, __m128 *b){
+	const uint8_t *c = video + col * video_bpp;
+	long s = video_bpp, o1 = video_bpp > 1 ? 1 : 0, o2 = video_bpp > 2 ? 2 : 0;
+	__m128 scale = _mm_set1_ps(CLOUD_COLOR);
+
+	if(!video){
+		*r = *g = *b = _mm_setzero_ps();
+		return;
+	}
+	*r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_setr_epi32(c[0], c[s], c[2 * s], c[3 * s])), scale);
+	*g = _mm_mul_ps(_mm_cvtepi32_ps(_mm_setr_epi32(c[o1], c[s + o1], c[2 * s + o1], c[3 * s + o1])), scale);
+	*b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_setr_epi32(c[o2], c[s + o2], c[2 * s + o2], c[3 * s + o2])), scale);
+}
+
+FREENECT_TARGET("sse2")
+static void row_sse2(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+					 float *out, long planes, long row){
+	const float *ray_x = c->ray_x, *ray_y = c->ray_y;
+	long col, p = row * c->width, width = c->width;
+	const float *metres = c->metres;
+	__m128 sign = _mm_set1_ps(-0.f), zero = _mm_setzero_ps();
+	__m128 inv_w = _mm_set1_ps(1.f / (float)width);
+	__m128 v = _mm_set1_ps((float)row * (1.f / (float)c->height));
+	__m128 x, y, z, u, r, g, b;
+	__m128i raw;
+
+	// Stops short of the last point, see store_points_sse2()
+	for(col=0;col + 4 < width;col+=4,p+=4){
+		raw = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(depth + col)), _mm_setzero_si128());
+		z = depth_metres_sse2(raw, metres);
+		x = _mm_mul_ps(_mm_loadu_ps(ray_x + p), z);
+		y = _mm_mul_ps(_mm_loadu_ps(ray_y + p), z);
+		z = _mm_xor_ps(z, sign);
+		u = zero;
+		r = g = b = zero;
+		if(planes >= 5){
+			u = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32((int)col), _mm_setr_epi32(0, 1, 2, 3))), inv_w);
+		}
+		if(planes >= 8){
+			colors_sse2(video, video_bpp, col, &r, &g, &b);
+		}
+		store_points_sse2(out + col * planes, planes, x, y, z, u, v, r, g, b);
+	}
+	row_scalar(c, depth, video, video_bpp, out, planes, row, col);
+}
+
+#pragma mark - AVX2
+
+FREENECT_TARGET("avx2")
+static inline __m256 depth_metres_avx2(__m256i raw, const float *metres){
+	if(!metres){
+		return _mm256_mul_ps(_mm256_cvtepi32_ps(raw), _mm256_set1_ps(CLOUD_MM));
+	}
+	return _mm256_i32gather_ps(metres, _mm256_min_epi32(raw, _mm256_set1_epi32(FREENECT_DEPTH_MAX)), 4);
+}
+
+// Video of pixels col to col + 7 of the row as floats, one channel per vector. RGB is
+// loaded as two overlapping 16-byte halves, the second ending on the last byte of
+// pixel col + 7, and spread with pshufb. Other layouts go through colors_sse2().
+FREENECT_TARGET("avx2")
+static inline void colors_avx2(const uint8_t *video, long video_bpp, long col, __m256 *r, __m256 *g, __m256 *b){
+	const uint8_t *c = video + col * video_bpp;
+	__m256 scale = _mm256_set1_ps(CLOUD_COLOR);
+	__m256i rgb;
+	__m128 r0, g0, b0, r1, g1, b1;
+
+	if(!video){
+		*r = *g = *b = _mm256_setzero_ps();
+		return;
+	}
+	if(video_bpp == 1){
+		*r = *g = *b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)c))), scale);
+		return;
+	}
+	if(video_bpp != 3){
+		colors_sse2(video, video_bpp, col, &r0, &g0, &b0);
+		colors_sse2(video, video_bpp, col + 4, &r1, &g1, &b1);
+		*r = _mm256_insertf128_ps(_mm256_castps128_ps256(r0), r1, 1);
+		*g = _mm256_insertf128_ps(_mm256_castps128_ps256(g0), g1, 1);
+		*b = _mm256_insertf128_ps(_mm256_castps128_ps256(b0), b1, 1);
+		return;
+	}
+	// Pixels 0-3 start at byte 0 of the low half, pixels 4-7 at byte 4 of the high half
+	rgb = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)c)),
+								  _mm_loadu_si128((const __m128i *)(c + 8)), 1);
+	*r = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_shuffle_epi8(rgb, _mm256_setr_epi8(
+		0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1,
+		4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1, 13, -1, -1, -1))), scale);
+	*g = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_shuffle_epi8(rgb, _mm256_setr_epi8(
+		1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+		5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1, 14, -1, -1, -1))), scale);
+	*b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_shuffle_epi8(rgb, _mm256_setr_epi8(
+		2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+		6, -1, -1, -1, 9, -1, -1, -1, 12, -1, -1, -1, 15, -1, -1, -1))), scale);
+}
+
+// Writes 8 points of 8 planes: one vector per plane in, one vector per point out
+FREENECT_TARGET("avx2")
+static inline void store_points8_avx2(float *out, __m256 x, __m256 y, __m256 z, __m256 u,
+									  __m256 v, __m256 r, __m256 g, __m256 b){
+	__m256 t0, t1, t2, t3, t4, t5, t6, t7, s0, s1, s2, s3, s4, s5, s6, s7;
+
+	t0 = _mm256_unpacklo_ps(x, y);
+	t1 = _mm256_unpackhi_ps(x, y);
+	t2 = _mm256_unpacklo_ps(z, u);
+	t3 = _mm256_unpackhi_ps(z, u);
+	t4 = _mm256_unpacklo_ps(v, r);
+	t5 = _mm256_unpackhi_ps(v, r);
+	t6 = _mm256_unpacklo_ps(g, b);
+	t7 = _mm256_unpackhi_ps(g, b);
+	s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+	s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+	s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+	s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+	s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+	s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+	s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+	_mm256_storeu_ps(out, _mm256_permute2f128_ps(s0, s4, 0x20));
+	_mm256_storeu_ps(out + 8, _mm256_permute2f128_ps(s1, s5, 0x20));
+	_mm256_storeu_ps(out + 16, _mm256_permute2f128_ps(s2, s6, 0x20));
+	_mm256_storeu_ps(out + 24, _mm256_permute2f128_ps(s3, s7, 0x20));
+	_mm256_storeu_ps(out + 32, _mm256_permute2f128_ps(s0, s4, 0x31));
+	_mm256_storeu_ps(out + 40, _mm256_permute2f128_ps(s1, s5, 0x31));
+	_mm256_storeu_ps(out + 48, _mm256_permute2f128_ps(s2, s6, 0x31));
+	_mm256_storeu_ps(out + 56, _mm256_permute2f128_ps(s3, s7, 0x31));
+}
+
+// 8 points at a time, 8 planes transposed in registers, 3 and 5 stored as two groups of 4
+FREENECT_TARGET("avx2")
+static void row_avx2(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+					 float *out, long planes, long row){
+	const float *ray_x = c->ray_x, *ray_y = c->ray_y;
+	long col, p = row * c->width, width = c->width;
+	const float *metres = c->metres;
+	__m256 sign = _mm256_set1_ps(-0.f);
+	__m256 inv_w = _mm256_set1_ps(1.f / (float)width);
+	__m128 v = _mm_set1_ps((float)row * (1.f / (float)c->height)), zero = _mm_setzero_ps();
+	__m256 x, y, z, u = _mm256_setzero_ps(), r, g, b;
+
+	for(col=0;col + 8 < width;col+=8,p+=8){
+		z = depth_metres_avx2(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(depth + col))), metres);
+		x = _mm256_mul_ps(_mm256_loadu_ps(ray_x + p), z);
+		y = _mm256_mul_ps(_mm256_loadu_ps(ray_y + p), z);
+		z = _mm256_xor_ps(z, sign);
+		if(planes >= 5){
+			u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32((int)col), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))), inv_w);
+		}
+		if(planes >= 8){
+			colors_avx2(video, video_bpp, col, &r, &g, &b);
+			store_points8_avx2(out + col * planes, x, y, z, u, _mm256_set1_ps(_mm_cvtss_f32(v)), r, g, b);
+			continue;
+		}
+		store_points_sse2(out + col * planes, planes, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y),
+						  _mm256_castps256_ps128(z), _mm256_castps256_ps128(u), v, zero, zero, zero);
+		store_points_sse2(out + (col + 4) * planes, planes, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1),
+						  _mm256_extractf128_ps(z, 1), _mm256_extractf128_ps(u, 1), v, zero, zero, zero);
+	}
+	row_scalar(c, depth, video, video_bpp, out, planes, row, col);
+}
+
+#endif // FREENECT_X86
+
+#pragma mark - Dispatch
+
+static void cloud_row(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+					  float *out, long planes, long row, t_freenect_cpu_level level){
+	planes = planes >= 8 ? 8 : (planes >= 5 ? 5 : 3);
+#if FREENECT_X86
+	if(level >= FREENECT_CPU_AVX2){
+		row_avx2(c, depth, video, video_bpp, out, planes, row);
+		return;
+	}
+	if(level >= FREENECT_CPU_SSE2){
+		row_sse2(c, depth, video, video_bpp, out, planes, row);
+		return;
+	}
+#endif
+	row_scalar(c, depth, video, video_bpp, out, planes, row, 0);
+}
+
+void freenect_cloud_rows_level(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+							   char *out, long out_stride, long planes, long begin, long end, t_freenect_cpu_level level){
+	long row;
+
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+	for(row=begin;row<end;row++){
+		cloud_row(c, depth + row * c->width, video ? video + row * c->width * video_bpp : NULL, video_bpp,
+				  (float *)(out + out_stride * row), planes, row, level);
+	}
+}
+
+void freenect_cloud_rows(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+						 char *out, long out_stride, long planes, long begin, long end){
+	freenect_cloud_rows_level(c, depth, video, video_bpp, out, out_stride, planes, begin, end, freenect_kernels.level);
+}
+
+void freenect_cloud_row(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+						float *out, long planes, long row){
+	cloud_row(c, depth, video, video_bpp, out, planes, row, freenect_kernels.level);
+}
@@ -0,0 +1,85 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Organized point clouds from depth frames (mode 4 of jit.freenect.grab).
+
+ Every depth pixel becomes one cell of a float32 matrix of the same size, so
+ neighbours in the image stay neighbours in the cloud and nothing is ever
+ reallocated. A cell holds, depending on the plane count:
+
+   3   x y z            metres, OpenGL camera: x right, y up, looking down -z
+   5   x y z u v        plus the pixel's normalized texture coordinates
+   8   x y z u v r g b  plus the video pixel, 0 to 1
+
+ Pixels without a depth reading are at 0 0 0. The ray through each pixel is
+ precomputed from the camera intrinsics, so a point is its ray scaled by the
+ pixel's depth. Raw 11-bit depth is turned into metres with a table, the
+ mode 4 float32 table of jit.freenect.lut.h, so the calibration applies;
+ registered depth is already in millimetres.
+*/
+
+#ifndef JIT_FREENECT_CLOUD_H
+#define JIT_FREENECT_CLOUD_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+
+#define FREENECT_CLOUD_MAX_PLANES   8
+#define FREENECT_CLOUD_ALIGN        64
+
+typedef struct _freenect_intrinsics {
+	float   fx, fy;     // focal lengths, pixels
+	float   cx, cy;     // principal point, pixels
+} t_freenect_intrinsics;
+
+// Nicolas Burrus' calibration of the Kinect's depth and video cameras
+extern const t_freenect_intrinsics freenect_depth_intrinsics;
+extern const t_freenect_intrinsics freenect_video_intrinsics;
+
+typedef struct _freenect_cloud {
+	long                    width;
+	long                    height;
+	const float             *metres;        // raw depth to metres, NULL when depth is registered, in mm
+	t_freenect_intrinsics   intrinsics;
+	float                   *ray_x;         // per pixel, FREENECT_CLOUD_ALIGN aligned
+	float                   *ray_y;         // already negated, image rows go down
+} t_freenect_cloud;
+
+// Builds the ray tables, or keeps them when nothing changed. Returns 0 on success.
+// c must be zeroed before the first call. metres (FREENECT_DEPTH_LUT_SIZE entries,
+// 0 without a reading) is not copied and must outlive its use by the cloud.
+int     freenect_cloud_init(t_freenect_cloud *c, long width, long height, const t_freenect_intrinsics *k, const float *metres);
+void    freenect_cloud_free(t_freenect_cloud *c);
+
+// Rows [begin, end) of the cloud, written at out + out_stride * row, so disjoint
+// ranges can be converted concurrently. planes is 3, 5 or 8. video holds
+// video_bpp (3, or 1 for IR) bytes per pixel and is only read for 8 planes,
+// where NULL gives black.
+void    freenect_cloud_rows(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+							char *out, long out_stride, long planes, long begin, long end);
+void    freenect_cloud_rows_level(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+								  char *out, long out_stride, long planes, long begin, long end, t_freenect_cpu_level level);
+// A single row, from depth and video pointing at that row's pixels, for callers
+// that produce the input row by row
+void    freenect_cloud_row(const t_freenect_cloud *c, const uint16_t *depth, const uint8_t *video, long video_bpp,
+						   float *out, long planes, long row);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+// Decodes one block of 8 valid samples packed in bits bytes, returns the last sample
+typedef uint16_t (*t_block_decoder)(const uint8_t *in, unsigned bits, uint16_t prev, uint16_t *out);
+
+#define FREENECT_INLINE inline __attribute__((always_inline))
+
+static inline uint16_t zigzag(uint16_t value, uint16_t prev){
+	int16_t d = (int16_t)(uint16_t)(value - prev);
+	return (uint16_t)((d << 1) ^ (d >> 15));
+}
+
+static inline uint16_t unzigzag(uint16_t z){
+	return (uint16_t)((z >> 1) ^ (0 - (z & 1)));
+}
+
+#pragma mark - Encoder
+
+long freenect_depth_encode_bound(long n){
+	// Header, mask and 16-bit samples for every block
+	return 2 + (n + FREENECT_CODEC_BLOCK - 1) / FREENECT_CODEC_BLOCK * (2 + FREENECT_CODEC_BLOCK * 2);
+}
+
+static uint8_t *put_run(uint8_t *out, long run){
+	if(run == 1){
+		*out++ = FREENECT_CODEC_EMPTY;
+	}
+	else{
+		*out++ = FREENECT_CODEC_RUN;
+		*out++ = (uint8_t)run;
+	}
+	return out;
+}
+
+long freenect_depth_encode(const uint16_t *in, long n, uint16_t invalid, uint8_t *out){
+	uint8_t *p = out;
+	uint16_t prev = 0, z[FREENECT_CODEC_BLOCK];
+	unsigned mask, bits, any;
+	long i, j, k, count, run = 0;
+	uint32_t acc;
+	int nacc;
+
+	*p++ = (uint8_t)invalid;
+	*p++ = (uint8_t)(invalid >> 8);
+	for(i=0;i<n;i+=FREENECT_CODEC_BLOCK){
+		k = n - i < FREENECT_CODEC_BLOCK ? n - i : FREENECT_CODEC_BLOCK;
+		mask = 0;
+		for(j=0;j<k;j++){
+			mask |= (unsigned)(in[i + j] != invalid) << j;
+		}
+		if(!mask){
+			if(++run == 255){
+				p = put_run(p, run);
+				run = 0;
+			}
+			continue;
+		}
+		if(run){
+			p = put_run(p, run);
+			run = 0;
+		}
+
+		any = 0;
+		count = 0;
+		for(j=0;j<k;j++){
+			if(mask & (1u << j)){
+				z[count] = zigzag(in[i + j], prev);
+				any |= z[count++];
+				prev = in[i + j];
+			}
+		}
+		bits = any ? 32 - __builtin_clz(any) : 0;
+		if(mask != 0xFF){
+			*p++ = (uint8_t)(FREENECT_CODEC_MASKED | bits);
+			*p++ = (uint8_t)mask;
+		}
+		else{
+			*p++ = (uint8_t)bits;
+		}
+
+		acc = 0;
+		nacc = 0;
+		for(j=0;j<count;j++){
+			acc |= (uint32_t)z[j] << nacc;
+			nacc += bits;
+			while(nacc >= 8){
+				*p++ = (uint8_t)acc;
+				acc >>= 8;
+				nacc -= 8;
+			}
+		}
+		if(nacc){
+			*p++ = (uint8_t)acc;
+		}
+	}
+	if(run){
+		p = put_run(p, run);
+	}
+	return p - out;
+}
+
+#pragma mark - Decoder
+
+static void unpack_scalar(const uint8_t *in, unsigned bits, long count, uint16_t *z){
+	uint32_t acc = 0, m = (1u << bits) - 1;
+	unsigned nacc = 0;
+	long j;
+
+	for(j=0;j<count;j++){
+		while(nacc < bits){
+			acc |= (uint32_t)*in++ << nacc;
+			nacc += 8;
+		}
+		z[j] = (uint16_t)(acc & m);
+		acc >>= bits;
+		nacc -= bits;
+	}
+}
+
+static uint16_t block_scalar(const uint8_t *in, unsigned bits, uint16_t prev, uint16_t *out){
+	uint16_t z[FREENECT_CODEC_BLOCK];
+	long j;
+
+	unpack_scalar(in, bits, FREENECT_CODEC_BLOCK, z);
+	for(j=0;j<FREENECT_CODEC_BLOCK;j++){
+		prev += unzigzag(z[j]);
+		out[j] = prev;
+	}
+	return prev;
+}
+
+// Inlined into one copy per block decoder, so the block is not an indirect call
+static FREENECT_INLINE int decode(const uint8_t *in, long size, uint16_t *out, long n, t_block_decoder full, long slack){
+	const uint8_t *end = in + size;
+	uint16_t invalid, prev = 0, z[FREENECT_CODEC_BLOCK];
+	unsigned h, bits, mask;
+	long i = 0, j, k, count, bytes;
+
+	if(size < 2){
+		return -1;
+	}
+	invalid = (uint16_t)(in[0] | (in[1] << 8));
+	in += 2;
+
+	while(i < n){
+		if(in >= end){
+			return -1;
+		}
+		h = *in++;
+		k = n - i < FREENECT_CODEC_BLOCK ? n - i : FREENECT_CODEC_BLOCK;
+
+		if(h >= FREENECT_CODEC_RUN){
+			if(h == FREENECT_CODEC_RUN){
+				if(in >= end){
+					return -1;
+				}
+				k = *in++ * FREENECT_CODEC_BLOCK;
+				if(k > n - i){
+					k = n - i;
+				}
+			}
+			for(j=0;j<k;j++){
+				out[i + j] = invalid;
+			}
+			i += k;
+			continue;
+		}
+
+		bits = h & FREENECT_CODEC_BITS;
+		if((bits > 16) || (h & ~(FREENECT_CODEC_BITS | FREENECT_CODEC_MASKED))){
+			return -1;
+		}
+
+		if(!(h & FREENECT_CODEC_MASKED)){
+			// Only whole blocks are stored without a mask
+			if((k < FREENECT_CODEC_BLOCK) || (end - in < bits)){
+				return -1;
+			}
+			prev = (end - in >= slack) ? full(in, bits, prev, out + i) : block_scalar(in, bits, prev, out + i);
+			in += bits;
+			i += FREENECT_CODEC_BLOCK;
+			continue;
+		}
+
+		if(in >= end){
+			return -1;
+		}
+		mask = *in++;
+		count = __builtin_popcount(mask);
+		bytes = (count * bits + 7) >> 3;
+		if(end - in < bytes){
+			return -1;
+		}
+		unpack_scalar(in, bits, count, z);
+		in += bytes;
+		for(j=0,count=0;j<k;j++){
+			if(mask & (1u << j)){
+				prev += unzigzag(z[count++]);
+				out[i + j] = prev;
+			}
+			else{
+				out[i + j] = invalid;
+			}
+		}
+		i += k;
+	}
+	return 0;
+}
+
+static int decode_scalar(const uint8_t *in, long size, uint16_t *out, long n){
+	return decode(in, size, out, n, block_scalar, 0);
+}
+
+#if FREENECT_X86
+
+#pragma mark - SSE2
+
+// Zigzag to signed, then an inclusive prefix sum across the 8 lanes, starting from prev
+FREENECT_TARGET("sse2")
+static inline __m128i undelta_sse2(__m128i z, uint16_t prev){
+	__m128i d = _mm_xor_si128(_mm_srli_epi16(z, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(z, _mm_set1_epi16(1))));
+	d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+	d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+	d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+	return _mm_add_epi16(d, _mm_set1_epi16((short)prev));
+}
+
+FREENECT_TARGET("sse2")
+static uint16_t block_sse2(const uint8_t *in, unsigned bits, uint16_t prev, uint16_t *out){
+	uint16_t z[FREENECT_CODEC_BLOCK] __attribute__((aligned(16)));
+	__m128i v;
+
+	unpack_scalar(in, bits, FREENECT_CODEC_BLOCK, z);
+	v = undelta_sse2(_mm_load_si128((const __m128i *)z), prev);
+	_mm_storeu_si128((__m128i *)out, v);
+	return (uint16_t)_mm_extract_epi16(v, 7);
+}
+
+FREENECT_TARGET("sse2")
+static int decode_sse2(const uint8_t *in, long size, uint16_t *out, long n){
+	return decode(in, size, out, n, block_sse2, 0);
+}
+
+#pragma mark - AVX2
+
+// Sample i of a block starts at bit i * bits: gather the 4 bytes from that bit's
+// byte into 32-bit lane i, then shift by the remaining bit offset. Only the first
+// 3 bytes can matter, bytes past the 16 loaded wrap around and are masked off.
+#define UNPACK_SHUFFLE(b, i)    ((int32_t)((((i) * (b)) >> 3) * 0x01010101u + 0x03020100u))
+#define UNPACK_SHIFT(b, i)      (((i) * (b)) & 7)
+#define UNPACK_ROW(f, b)        {f(b, 0), f(b, 1), f(b, 2), f(b, 3), f(b, 4), f(b, 5), f(b, 6), f(b, 7)}
+#define UNPACK_TABLE(f)         {UNPACK_ROW(f, 0), UNPACK_ROW(f, 1), UNPACK_ROW(f, 2), UNPACK_ROW(f, 3), \
+								 UNPACK_ROW(f, 4), UNPACK_ROW(f, 5), UNPACK_ROW(f, 6), UNPACK_ROW(f, 7), \
+								 UNPACK_ROW(f, 8), UNPACK_ROW(f, 9), UNPACK_ROW(f, 10), UNPACK_ROW(f, 11), \
+								 UNPACK_ROW(f, 12), UNPACK_ROW(f, 13), UNPACK_ROW(f, 14), UNPACK_ROW(f, 15), \
+								 UNPACK_ROW(f, 16)}
+
+static const int32_t unpack_shuffle[17][8] __attribute__((aligned(32))) = UNPACK_TABLE(UNPACK_SHUFFLE);
+static const int32_t unpack_shift[17][8] __attribute__((aligned(32))) = UNPACK_TABLE(UNPACK_SHIFT);
+
+// Reads 16 bytes from in, the caller makes sure they are there
+FREENECT_TARGET("avx2")
+static uint16_t block_avx2(const uint8_t *in, unsigned bits, uint16_t prev, uint16_t *out){
+	__m256i v = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)in));
+	__m128i z;
+
+	v = _mm256_shuffle_epi8(v, _mm256_load_si256((const __m256i *)unpack_shuffle[bits]));
+	v = _mm256_srlv_epi32(v, _mm256_load_si256((const __m256i *)unpack_shift[bits]));
+	v = _mm256_and_si256(v, _mm256_set1_epi32((1 << bits) - 1));
+	z = undelta_sse2(_mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)), prev);
+	_mm_storeu_si128((__m128i *)out, z);
+	return (uint16_t)_mm_extract_epi16(z, 7);
+}
+
+FREENECT_TARGET("avx2")
+static int decode_avx2(const uint8_t *in, long size, uint16_t *out, long n){
+	return decode(in, size, out, n, block_avx2, 16);
+}
+
+#endif // FREENECT_X86
+
+#pragma mark - Dispatch
+
+int freenect_depth_decode_level(const uint8_t *in, long size, uint16_t *out, long n, t_freenect_cpu_level level){
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+#if FREENECT_X86
+	if(level >= FREENECT_CPU_AVX2){
+		return decode_avx2(in, size, out, n);
+	}
+	if(level >= FREENECT_CPU_SSE2){
+		return decode_sse2(in, size, out, n);
+	}
+#endif
+	return decode_scalar(in, size, out, n);
+}
+
+int freenect_depth_decode(const uint8_t *in, long size, uint16_t *out, long n){
+	return freenect_depth_decode_level(in, size, out, n, freenect_kernels.level);
+}
@@ -0,0 +1,60 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Lossless codec for depth frames, used by jit.freenect.record.
+
+ Kinect depth is mostly smooth surfaces broken up by patches of the invalid
+ value (0x7FF, or 0 for registered depth). Samples are taken 8 at a time, in
+ raster order. Each block starts with a byte:
+
+   0xFF             all 8 samples are invalid
+   0xFE n           n blocks in a row are invalid
+   0x20 | bits, m   m has bit i set when sample i is valid, then the valid samples
+   bits             all 8 samples are valid
+
+ followed by the valid samples as differences from the previous valid sample,
+ zigzag mapped to unsigned and packed LSB first in bits (0 to 16) bits each.
+ A block of 8 valid samples is therefore exactly bits bytes long, which lets
+ the decoder unpack it and undo the differences with a few SIMD instructions.
+ The stream starts with the invalid value, 2 bytes little endian.
+*/
+
+#ifndef JIT_FREENECT_CODEC_H
+#define JIT_FREENECT_CODEC_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+
+#define FREENECT_CODEC_BLOCK    8
+#define FREENECT_CODEC_EMPTY    0xFF
+#define FREENECT_CODEC_RUN      0xFE
+#define FREENECT_CODEC_MASKED   0x20
+#define FREENECT_CODEC_BITS     0x1F
+
+// Largest encoding of n samples
+long    freenect_depth_encode_bound(long n);
+// Encodes n samples into out, which holds freenect_depth_encode_bound(n) bytes. Returns the size.
+long    freenect_depth_encode(const uint16_t *in, long n, uint16_t invalid, uint8_t *out);
+// Decodes exactly n samples with the active kernel level. Returns 0, or -1 if in is malformed.
+int     freenect_depth_decode(const uint8_t *in, long size, uint16_t *out, long n);
+int     freenect_depth_decode_level(const uint8_t *in, long size, uint16_t *out, long n, t_freenect_cpu_level level);
+
+#endif
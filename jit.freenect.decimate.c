@@ -0,0 +1,475 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+#include "jit.freenect.decimate.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+// Samples per axis of a median block at most: larger blocks take every other pixel
+// (every factor / 4th) of every other row, which keeps the median of a factor 8 block
+// to 16 readings like that of a factor 4 one
+#define SAMPLES 4
+
+// Median selection networks for 4 and 16 samples: Batcher's odd-even merge sort pruned
+// to the comparators that reach output 1 and 7, the lower middle ones. LO and HI are
+// comparators of which only the lower or the upper output is used. L(index) loads a
+// sample just before it is first needed, and each half of the 16 is sorted before the
+// merge, which keeps few of them live at a time.
+#define MEDIAN4(CE, LO, HI) \
+	CE(0,1) CE(2,3) HI(0,2) LO(1,3) LO(1,2)
+
+#define MEDIAN16(L, CE, LO, HI) \
+	L(0) L(1) CE(0,1) L(2) L(3) CE(2,3) L(4) L(5) CE(4,5) L(6) L(7) CE(6,7) CE(0,2) CE(1,3) \
+	CE(4,6) CE(5,7) CE(1,2) CE(5,6) CE(0,4) CE(1,5) CE(2,6) CE(3,7) CE(2,4) CE(3,5) CE(1,2) \
+	CE(3,4) CE(5,6) L(8) L(9) CE(8,9) L(10) L(11) CE(10,11) L(12) L(13) CE(12,13) L(14) L(15) \
+	CE(14,15) CE(8,10) CE(9,11) CE(12,14) CE(13,15) CE(9,10) CE(13,14) CE(8,12) CE(9,13) CE(10,14) \
+	CE(11,15) CE(10,12) CE(11,13) CE(9,10) CE(11,12) CE(13,14) HI(0,8) HI(1,9) HI(2,10) HI(3,11) \
+	LO(4,12) LO(5,13) LO(6,14) LO(7,15) HI(4,8) HI(5,9) LO(6,10) LO(7,11) HI(6,8) LO(7,9) LO(7,8)
+
+void freenect_window_init(t_freenect_window *w, long src_width, long src_height,
+						  const long *roi, long factor, int method){
+	long x = roi ? roi[0] : 0, y = roi ? roi[1] : 0;
+	long width = roi ? roi[2] : 0, height = roi ? roi[3] : 0;
+
+	factor = (factor >= 8) ? 8 : ((factor >= 4) ? 4 : ((factor >= 2) ? 2 : 1));
+	x = (x < 0) ? 0 : ((x >= src_width) ? src_width - 1 : x);
+	y = (y < 0) ? 0 : ((y >= src_height) ? src_height - 1 : y);
+	if((width <= 0) || (x + width > src_width)){
+		width = src_width - x;
+	}
+	if((height <= 0) || (y + height > src_height)){
+		height = src_height - y;
+	}
+	// At least one block, moved back inside the frame when it sticks out
+	if(width < factor){
+		width = factor;
+		x = (x + width > src_width) ? src_width - width : x;
+	}
+	if(height < factor){
+		height = factor;
+		y = (y + height > src_height) ? src_height - height : y;
+	}
+
+	w->x = x;
+	w->y = y;
+	w->width = width / factor;
+	w->height = height / factor;
+	w->factor = factor;
+	w->method = (method < FREENECT_DECIMATE_NEAREST) ? FREENECT_DECIMATE_NEAREST :
+		((method > FREENECT_DECIMATE_MEDIAN) ? FREENECT_DECIMATE_MEDIAN : method);
+}
+
+int freenect_window_is_full(const t_freenect_window *w, long src_width, long src_height){
+	return (w->factor == 1) && !w->x && !w->y && (w->width == src_width) && (w->height == src_height);
+}
+
+#pragma mark - Scalar
+
+// Readings are offset by invalid + 1 so that a missing one wraps around to 0xFFFF,
+// above every reading, whether it was 0 or FREENECT_DEPTH_MAX
+static void min_row_scalar(const uint16_t *block, long src_width, long factor, uint16_t *out,
+						   long col, long width, uint16_t bias){
+	const uint16_t *s;
+	uint16_t m, v;
+	long i, j;
+
+	for(;col<width;col++){
+		s = block + col * factor;
+		m = 0xFFFF;
+		for(i=0;i<factor;i++){
+			for(j=0;j<factor;j++){
+				v = (uint16_t)(s[i * src_width + j] - bias);
+				m = (v < m) ? v : m;
+			}
+		}
+		out[col] = (uint16_t)(m + bias);
+	}
+}
+
+// k-th smallest of v[0..n), reorders v
+static uint16_t select_kth(uint16_t *v, long n, long k){
+	long lo = 0, hi = n - 1, i, j;
+	uint16_t pivot, t;
+
+	while(lo < hi){
+		pivot = v[(lo + hi) / 2];
+		i = lo;
+		j = hi;
+		while(i <= j){
+			while(v[i] < pivot){
+				i++;
+			}
+			while(v[j] > pivot){
+				j--;
+			}
+			if(i <= j){
+				t = v[i];
+				v[i] = v[j];
+				v[j] = t;
+				i++;
+				j--;
+			}
+		}
+		if(k <= j){
+			hi = j;
+		}
+		else if(k >= i){
+			lo = i;
+		}
+		else{
+			break;
+		}
+	}
+	return v[k];
+}
+
+// Lower median of the readings among the block's samples
+static void median_row_scalar(const uint16_t *block, long src_width, long factor, uint16_t *out,
+							  long col, long width, uint16_t invalid){
+	uint16_t v[SAMPLES * SAMPLES];
+	const uint16_t *s;
+	long i, j, n, step = (factor > SAMPLES) ? factor / SAMPLES : 1;
+
+	for(;col<width;col++){
+		s = block + col * factor;
+		n = 0;
+		for(i=0;i<factor;i+=step){
+			for(j=0;j<factor;j+=step){
+				if(s[i * src_width + j] != invalid){
+					v[n++] = s[i * src_width + j];
+				}
+			}
+		}
+		out[col] = n ? select_kth(v, n, (n - 1) / 2) : invalid;
+	}
+}
+
+#if FREENECT_X86
+
+#pragma mark - SSE2
+
+// 8 source pixels per vector. SSE2 only has a signed 16-bit min, the offset
+// readings have their sign bit flipped to keep their unsigned order.
+FREENECT_TARGET("sse2")
+static void min_row_sse2(const uint16_t *block, long src_width, long factor, uint16_t *out,
+						 long width, uint16_t bias){
+	const __m128i b = _mm_set1_epi16((short)bias), flip = _mm_set1_epi16((short)0x8000);
+	long col, i, per = 8 / factor;
+	__m128i m;
+
+	for(col=0;col + per <= width;col+=per){
+		const uint16_t *s = block + col * factor;
+		m = _mm_set1_epi16(0x7FFF);
+		for(i=0;i<factor;i++){
+			m = _mm_min_epi16(m, _mm_xor_si128(_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(s + i * src_width)), b), flip));
+		}
+		// Fold each block into its first lane
+		m = _mm_min_epi16(m, _mm_srli_epi32(m, 16));
+		if(factor == 2){
+			m = _mm_srai_epi32(_mm_slli_epi32(m, 16), 16);
+			m = _mm_add_epi16(_mm_xor_si128(_mm_packs_epi32(m, m), flip), b);
+			_mm_storel_epi64((__m128i *)(out + col), m);
+			continue;
+		}
+		m = _mm_min_epi16(m, _mm_srli_epi64(m, 32));
+		if(factor == 4){
+			out[col] = (uint16_t)((_mm_extract_epi16(m, 0) ^ 0x8000) + bias);
+			out[col + 1] = (uint16_t)((_mm_extract_epi16(m, 4) ^ 0x8000) + bias);
+			continue;
+		}
+		m = _mm_min_epi16(m, _mm_srli_si128(m, 8));
+		out[col] = (uint16_t)((_mm_extract_epi16(m, 0) ^ 0x8000) + bias);
+	}
+	min_row_scalar(block, src_width, factor, out, col, width, bias);
+}
+
+// The even and the odd ones of the 16 samples at lo and hi, in order. The sign-extended
+// halves of the 32-bit lanes pack back losslessly.
+FREENECT_TARGET("sse2")
+static inline void deinterleave_sse2(__m128i lo, __m128i hi, __m128i *even, __m128i *odd){
+	*even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16), _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+	*odd = _mm_packs_epi32(_mm_srai_epi32(lo, 16), _mm_srai_epi32(hi, 16));
+}
+
+// The samples of a row of 8 blocks of factor 4 or 8 at s, one vector per column of
+// samples. The pixels of a factor 8 row first lose their odd ones.
+FREENECT_TARGET("sse2")
+static inline void samples_sse2(const uint16_t *s, long factor, __m128i b, __m128i flip, __m128i *v){
+	__m128i q[FREENECT_DECIMATE_MAX], e[2], o[2];
+	long k;
+
+	for(k=0;k<factor;k++){
+		q[k] = _mm_xor_si128(_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(s + k * 8)), b), flip);
+	}
+	if(factor == 8){
+		for(k=0;k<4;k++){
+			deinterleave_sse2(q[k * 2], q[k * 2 + 1], &q[k], &e[0]);
+		}
+	}
+	deinterleave_sse2(q[0], q[1], &e[0], &o[0]);
+	deinterleave_sse2(q[2], q[3], &e[1], &o[1]);
+	deinterleave_sse2(e[0], e[1], &v[0], &v[2]);
+	deinterleave_sse2(o[0], o[1], &v[1], &v[3]);
+}
+
+// 8 blocks at once, one vector per sample with a lane per block. Missing readings
+// become 0x7FFF and alternate between that and 0x8000, first above then below: with
+// floor(missing / 2) of them below, the lower middle output of the network is the
+// lower median of the readings alone. Only a block without any reading gives 0x7FFF
+// for certain, so those are picked out separately.
+FREENECT_TARGET("sse2")
+static void median_row_sse2(const uint16_t *block, long src_width, long factor, uint16_t *out,
+							long width, uint16_t invalid){
+	const __m128i b = _mm_set1_epi16((short)(uint16_t)(invalid + 1)), flip = _mm_set1_epi16((short)0x8000);
+	const __m128i none = _mm_set1_epi16(0x7FFF);
+	__m128i v[SAMPLES * SAMPLES], missing, parity, all, median;
+	long col, a, step = (factor > SAMPLES) ? factor / SAMPLES : 1;
+
+#define ALTERNATE_SSE2(k) \
+	missing = _mm_cmpeq_epi16(v[k], none); \
+	v[k] = _mm_xor_si128(v[k], _mm_and_si128(parity, missing)); \
+	parity = _mm_xor_si128(parity, missing); \
+	all = _mm_and_si128(all, missing);
+#define LOAD_SSE2(k) \
+	if(!((k) % SAMPLES)){ \
+		samples_sse2(s + ((k) / SAMPLES) * step * src_width, factor, b, flip, v + (k)); \
+	} \
+	ALTERNATE_SSE2(k)
+#define CE_SSE2(a, b) { __m128i t = _mm_min_epi16(v[a], v[b]); v[b] = _mm_max_epi16(v[a], v[b]); v[a] = t; }
+#define LO_SSE2(a, b) v[a] = _mm_min_epi16(v[a], v[b]);
+#define HI_SSE2(a, b) v[b] = _mm_max_epi16(v[a], v[b]);
+	for(col=0;col + 8 <= width;col+=8){
+		const uint16_t *s = block + col * factor;
+		parity = _mm_setzero_si128();
+		all = _mm_set1_epi16(-1);
+		if(factor == 2){
+			for(a=0;a<2;a++){
+				deinterleave_sse2(_mm_xor_si128(_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(s + a * src_width)), b), flip),
+								  _mm_xor_si128(_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(s + a * src_width + 8)), b), flip),
+								  &v[a * 2], &v[a * 2 + 1]);
+			}
+			ALTERNATE_SSE2(0) ALTERNATE_SSE2(1) ALTERNATE_SSE2(2) ALTERNATE_SSE2(3)
+			MEDIAN4(CE_SSE2, LO_SSE2, HI_SSE2)
+			median = v[1];
+		}
+		else{
+			MEDIAN16(LOAD_SSE2, CE_SSE2, LO_SSE2, HI_SSE2)
+			median = v[7];
+		}
+		median = _mm_or_si128(_mm_andnot_si128(all, median), _mm_and_si128(all, none));
+		_mm_storeu_si128((__m128i *)(out + col), _mm_add_epi16(_mm_xor_si128(median, flip), b));
+	}
+	median_row_scalar(block, src_width, factor, out, col, width, invalid);
+}
+
+#pragma mark - AVX2
+
+// 16 source pixels per vector, blocks never straddle the 128-bit halves
+FREENECT_TARGET("avx2")
+static void min_row_avx2(const uint16_t *block, long src_width, long factor, uint16_t *out,
+						 long width, uint16_t bias){
+	const __m256i b = _mm256_set1_epi16((short)bias);
+	long col, i, per = 16 / factor;
+	__m256i m;
+
+	for(col=0;col + per <= width;col+=per){
+		const uint16_t *s = block + col * factor;
+		m = _mm256_set1_epi16((short)0xFFFF);
+		for(i=0;i<factor;i++){
+			m = _mm256_min_epu16(m, _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(s + i * src_width)), b));
+		}
+		m = _mm256_min_epu16(m, _mm256_srli_epi32(m, 16));
+		if(factor == 2){
+			m = _mm256_and_si256(m, _mm256_set1_epi32(0xFFFF));
+			m = _mm256_permute4x64_epi64(_mm256_packus_epi32(m, m), 0x08);
+			_mm_storeu_si128((__m128i *)(out + col), _mm_add_epi16(_mm256_castsi256_si128(m), _mm256_castsi256_si128(b)));
+			continue;
+		}
+		m = _mm256_min_epu16(m, _mm256_srli_epi64(m, 32));
+		if(factor == 4){
+			out[col] = (uint16_t)(_mm256_extract_epi16(m, 0) + bias);
+			out[col + 1] = (uint16_t)(_mm256_extract_epi16(m, 4) + bias);
+			out[col + 2] = (uint16_t)(_mm256_extract_epi16(m, 8) + bias);
+			out[col + 3] = (uint16_t)(_mm256_extract_epi16(m, 12) + bias);
+			continue;
+		}
+		m = _mm256_min_epu16(m, _mm256_bsrli_epi128(m, 8));
+		out[col] = (uint16_t)(_mm256_extract_epi16(m, 0) + bias);
+		out[col + 1] = (uint16_t)(_mm256_extract_epi16(m, 8) + bias);
+	}
+	min_row_scalar(block, src_width, factor, out, col, width, bias);
+}
+
+// deinterleave_sse2() on 32 samples. packs works within 128-bit halves, the permute
+// puts the 64-bit quarters back in order.
+FREENECT_TARGET("avx2")
+static inline void deinterleave_avx2(__m256i lo, __m256i hi, __m256i *even, __m256i *odd){
+	*even = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(lo, 16), 16),
+														_mm256_srai_epi32(_mm256_slli_epi32(hi, 16), 16)), 0xD8);
+	*odd = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_srai_epi32(lo, 16), _mm256_srai_epi32(hi, 16)), 0xD8);
+}
+
+FREENECT_TARGET("avx2")
+static inline void samples_avx2(const uint16_t *s, long factor, __m256i b, __m256i flip, __m256i *v){
+	__m256i q[FREENECT_DECIMATE_MAX], e[2], o[2];
+	long k;
+
+	for(k=0;k<factor;k++){
+		q[k] = _mm256_xor_si256(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(s + k * 16)), b), flip);
+	}
+	if(factor == 8){
+		for(k=0;k<4;k++){
+			deinterleave_avx2(q[k * 2], q[k * 2 + 1], &q[k], &e[0]);
+		}
+	}
+	deinterleave_avx2(q[0], q[1], &e[0], &o[0]);
+	deinterleave_avx2(q[2], q[3], &e[1], &o[1]);
+	deinterleave_avx2(e[0], e[1], &v[0], &v[2]);
+	deinterleave_avx2(o[0], o[1], &v[1], &v[3]);
+}
+
+// median_row_sse2() on 16 blocks
+FREENECT_TARGET("avx2")
+static void median_row_avx2(const uint16_t *block, long src_width, long factor, uint16_t *out,
+							long width, uint16_t invalid){
+	const __m256i b = _mm256_set1_epi16((short)(uint16_t)(invalid + 1)), flip = _mm256_set1_epi16((short)0x8000);
+	const __m256i none = _mm256_set1_epi16(0x7FFF);
+	__m256i v[SAMPLES * SAMPLES], missing, parity, all, median;
+	long col, a, step = (factor > SAMPLES) ? factor / SAMPLES : 1;
+
+#define ALTERNATE_AVX2(k) \
+	missing = _mm256_cmpeq_epi16(v[k], none); \
+	v[k] = _mm256_xor_si256(v[k], _mm256_and_si256(parity, missing)); \
+	parity = _mm256_xor_si256(parity, missing); \
+	all = _mm256_and_si256(all, missing);
+#define LOAD_AVX2(k) \
+	if(!((k) % SAMPLES)){ \
+		samples_avx2(s + ((k) / SAMPLES) * step * src_width, factor, b, flip, v + (k)); \
+	} \
+	ALTERNATE_AVX2(k)
+#define CE_AVX2(a, b) { __m256i t = _mm256_min_epi16(v[a], v[b]); v[b] = _mm256_max_epi16(v[a], v[b]); v[a] = t; }
+#define LO_AVX2(a, b) v[a] = _mm256_min_epi16(v[a], v[b]);
+#define HI_AVX2(a, b) v[b] = _mm256_max_epi16(v[a], v[b]);
+	for(col=0;col + 16 <= width;col+=16){
+		const uint16_t *s = block + col * factor;
+		parity = _mm256_setzero_si256();
+		all = _mm256_set1_epi16(-1);
+		if(factor == 2){
+			for(a=0;a<2;a++){
+				deinterleave_avx2(_mm256_xor_si256(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(s + a * src_width)), b), flip),
+								  _mm256_xor_si256(_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(s + a * src_width + 16)), b), flip),
+								  &v[a * 2], &v[a * 2 + 1]);
+			}
+			ALTERNATE_AVX2(0) ALTERNATE_AVX2(1) ALTERNATE_AVX2(2) ALTERNATE_AVX2(3)
+			MEDIAN4(CE_AVX2, LO_AVX2, HI_AVX2)
+			median = v[1];
+		}
+		else{
+			MEDIAN16(LOAD_AVX2, CE_AVX2, LO_AVX2, HI_AVX2)
+			median = v[7];
+		}
+		median = _mm256_blendv_epi8(median, none, all);
+		_mm256_storeu_si256((__m256i *)(out + col), _mm256_add_epi16(_mm256_xor_si256(median, flip), b));
+	}
+	median_row_scalar(block, src_width, factor, out, col, width, invalid);
+}
+
+#endif // FREENECT_X86
+
+#pragma mark - Rows
+
+const uint16_t *freenect_decimate_depth_row_level(const t_freenect_window *w, const uint16_t *src, long src_width,
+												  uint16_t *scratch, long row, uint16_t invalid, t_freenect_cpu_level level){
+	const uint16_t *block = src + (w->y + row * w->factor) * src_width + w->x;
+	uint16_t bias = (uint16_t)(invalid + 1);
+	long col;
+
+	if(w->factor == 1){
+		return block;
+	}
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+	switch(w->method){
+		case FREENECT_DECIMATE_MIN:
+#if FREENECT_X86
+			if(level >= FREENECT_CPU_AVX2){
+				min_row_avx2(block, src_width, w->factor, scratch, w->width, bias);
+				break;
+			}
+			if(level >= FREENECT_CPU_SSE2){
+				min_row_sse2(block, src_width, w->factor, scratch, w->width, bias);
+				break;
+			}
+#endif
+			min_row_scalar(block, src_width, w->factor, scratch, 0, w->width, bias);
+			break;
+		case FREENECT_DECIMATE_MEDIAN:
+#if FREENECT_X86
+			if(level >= FREENECT_CPU_AVX2){
+				median_row_avx2(block, src_width, w->factor, scratch, w->width, invalid);
+				break;
+			}
+			if(level >= FREENECT_CPU_SSE2){
+				median_row_sse2(block, src_width, w->factor, scratch, w->width, invalid);
+				break;
+			}
+#endif
+			median_row_scalar(block, src_width, w->factor, scratch, 0, w->width, invalid);
+			break;
+		default:
+			for(col=0;col<w->width;col++){
+				scratch[col] = block[col * w->factor];
+			}
+			break;
+	}
+	return scratch;
+}
+
+const uint16_t *freenect_decimate_depth_row(const t_freenect_window *w, const uint16_t *src, long src_width,
+											uint16_t *scratch, long row, uint16_t invalid){
+	return freenect_decimate_depth_row_level(w, src, src_width, scratch, row, invalid, freenect_kernels.level);
+}
+
+const uint8_t *freenect_decimate_video_row(const t_freenect_window *w, const uint8_t *src, long src_width, long bpp,
+										   uint8_t *scratch, long row){
+	const uint8_t *block = src + ((w->y + row * w->factor) * src_width + w->x) * bpp;
+	long col, step = w->factor * bpp;
+
+	if(w->factor == 1){
+		return block;
+	}
+	if(bpp == 1){
+		for(col=0;col<w->width;col++){
+			scratch[col] = block[col * step];
+		}
+		return scratch;
+	}
+	for(col=0;col<w->width;col++){
+		memcpy(scratch + col * bpp, block + col * step, bpp);
+	}
+	return scratch;
+}
@@ -0,0 +1,78 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+/*
+ Region of interest and decimation of frames, applied while they are converted.
+
+ A window selects a rectangle of the source frame and keeps one output pixel
+ for every factor x factor block of it, so a patch that only wants a quarter
+ resolution crop pays for that much conversion and no more. Video pixels are
+ always the top left pixel of their block. Depth blocks can instead give the
+ smallest reading (the nearest surface) or the median reading; both ignore
+ pixels without a reading and only give none when the whole block has none.
+ The median of an 8x8 block is that of a 4x4 grid of samples across it.
+
+ Like the other kernels, nothing here depends on the Max SDK (see bench/).
+*/
+
+#ifndef JIT_FREENECT_DECIMATE_H
+#define JIT_FREENECT_DECIMATE_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+
+#define FREENECT_DECIMATE_MAX   8
+
+typedef enum _freenect_decimate_method {
+	FREENECT_DECIMATE_NEAREST = 0,
+	FREENECT_DECIMATE_MIN,
+	FREENECT_DECIMATE_MEDIAN
+} t_freenect_decimate_method;
+
+typedef struct _freenect_window {
+	long    x, y;           // top left corner in the source frame
+	long    width, height;  // output size
+	long    factor;         // 1, 2, 4 or 8 source pixels per output pixel and axis
+	int     method;         // t_freenect_decimate_method, depth only
+} t_freenect_window;
+
+// Fits roi (x, y, width, height in source pixels, a width or height of 0 meaning
+// up to the edge) into a src_width x src_height frame and rounds its size down
+// to whole blocks. factor is rounded down to a power of two, at most
+// FREENECT_DECIMATE_MAX. The output is never smaller than one pixel.
+void    freenect_window_init(t_freenect_window *w, long src_width, long src_height,
+							 const long *roi, long factor, int method);
+// True when the window passes the whole frame through untouched
+int     freenect_window_is_full(const t_freenect_window *w, long src_width, long src_height);
+
+// Output row of depth, w->width samples from the block row of src (src_width
+// pixels per row). Without decimation the row is returned in place, otherwise
+// it is written to scratch, which holds at least w->width samples, and
+// scratch is returned. invalid is the value without a reading,
+// FREENECT_DEPTH_MAX for raw disparity and 0 for registered depth; it must
+// sort below or above every reading.
+const uint16_t  *freenect_decimate_depth_row(const t_freenect_window *w, const uint16_t *src, long src_width,
+											 uint16_t *scratch, long row, uint16_t invalid);
+const uint16_t  *freenect_decimate_depth_row_level(const t_freenect_window *w, const uint16_t *src, long src_width,
+												   uint16_t *scratch, long row, uint16_t invalid, t_freenect_cpu_level level);
+// Output row of video with bpp bytes per pixel, returned in place or in scratch the same way
+const uint8_t   *freenect_decimate_video_row(const t_freenect_window *w, const uint8_t *src, long src_width, long bpp,
+											 uint8_t *scratch, long row);
+
+#endif
@@ -0,0 +1,542 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+#include "jit.freenect.filter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+#define FILTER_INLINE inline __attribute__((always_inline))
+
+// Median selection network for the pixels at the edges of the frame: Batcher's
+// odd-even merge sort of 16 inputs, the inputs past 9 taken as +infinity, pruned to
+// the comparators that reach the middle output (4). LO and HI are comparators of
+// which only the lower or the upper output is used. The comparators are in the sort's
+// depth-first order, and L(index, row, column) loads each position of the window just
+// before it is first needed, which keeps few of them live at a time.
+#define MEDIAN9(L, CE, LO, HI) \
+	L(0,-1,-1) L(1,-1,0) CE(0,1) L(2,-1,1) L(3,0,-1) CE(2,3) CE(0,2) CE(1,3) CE(1,2) L(4,0,0) \
+	L(5,0,1) CE(4,5) L(6,1,-1) L(7,1,0) CE(6,7) CE(4,6) CE(5,7) CE(5,6) CE(0,4) CE(2,6) CE(2,4) \
+	CE(1,5) LO(3,7) CE(3,5) HI(1,2) CE(3,4) LO(5,6) L(8,1,1) HI(0,8) LO(4,8) HI(2,4) LO(3,5) \
+	HI(3,4)
+
+int freenect_filter_init(t_freenect_filter *f, long width, long height){
+	void *average, *last, *age, *temporal, *median;
+	long n = width * height;
+
+	if(f->average && (f->width == width) && (f->height == height)){
+		return 0;
+	}
+	freenect_filter_free(f);
+	average = last = age = temporal = median = NULL;
+	if(posix_memalign(&average, FREENECT_FILTER_ALIGN, n * sizeof(float)) ||
+	   posix_memalign(&last, FREENECT_FILTER_ALIGN, n * sizeof(uint16_t)) ||
+	   posix_memalign(&age, FREENECT_FILTER_ALIGN, n * sizeof(uint16_t)) ||
+	   posix_memalign(&temporal, FREENECT_FILTER_ALIGN, n * sizeof(uint16_t)) ||
+	   posix_memalign(&median, FREENECT_FILTER_ALIGN, n * sizeof(uint16_t))){
+		free(average);
+		free(last);
+		free(age);
+		free(temporal);
+		free(median);
+		return -1;
+	}
+	f->average = (float *)average;
+	f->last = (uint16_t *)last;
+	f->age = (uint16_t *)age;
+	f->temporal = (uint16_t *)temporal;
+	f->median = (uint16_t *)median;
+	f->width = width;
+	f->height = height;
+	freenect_filter_reset(f);
+	return 0;
+}
+
+void freenect_filter_free(t_freenect_filter *f){
+	free(f->average);
+	free(f->last);
+	free(f->age);
+	free(f->temporal);
+	free(f->median);
+	memset(f, 0, sizeof(t_freenect_filter));
+}
+
+void freenect_filter_reset(t_freenect_filter *f){
+	long i, n = f->width * f->height;
+
+	if(!f->average){
+		return;
+	}
+	for(i=0;i<n;i++){
+		f->average[i] = -1.f;
+		f->age[i] = 0xFFFF;
+	}
+	memset(f->last, 0, n * sizeof(uint16_t));
+}
+
+int freenect_filter_temporal_enabled(const t_freenect_filter_params *p){
+	return (p->smooth > 0.f) || (p->holefill > 0);
+}
+
+int freenect_filter_median_enabled(const t_freenect_filter_params *p){
+	return p->median == 3;
+}
+
+static inline uint16_t holefill_limit(const t_freenect_filter_params *p){
+	return (uint16_t)((p->holefill > 0xFFFE) ? 0xFFFE : p->holefill);
+}
+
+#pragma mark - Scalar
+
+// Pixels [i, end) of the frame
+static void temporal_scalar(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *src, long i, long end){
+	float a = 1.f - p->smooth, h, v;
+	uint16_t limit = holefill_limit(p), invalid = p->invalid, d;
+	int smooth = p->smooth > 0.f, fill = p->holefill > 0;
+
+	for(;i<end;i++){
+		d = src[i];
+		if(smooth && (d != invalid)){
+			v = (float)d;
+			h = f->average[i];
+			h = ((h >= 0.f) && (fabsf(v - h) <= p->threshold)) ? h + a * (v - h) : v;
+			f->average[i] = h;
+			d = (uint16_t)(int32_t)(h + 0.5f);
+		}
+		if(fill){
+			if(d != invalid){
+				f->last[i] = d;
+				f->age[i] = 0;
+			}
+			else{
+				f->age[i] += (f->age[i] != 0xFFFF);
+				if(f->age[i] <= limit){
+					d = f->last[i];
+				}
+			}
+		}
+		f->temporal[i] = d;
+	}
+}
+
+// Readings are offset by invalid + 1, so a missing one becomes 0xFFFF and sorts last.
+// Alternate missing ones are moved to 0 instead: with as many of them below the
+// readings as above, the middle of the window is the median of the readings alone.
+static uint16_t median_scalar(const uint16_t *d, long width, long height, long x, long y, uint16_t invalid){
+	uint16_t v[9], s, bias = (uint16_t)(invalid + 1);
+	int low = 1, none = 1;
+
+#define LOAD_SCALAR(k, i, j) { \
+	s = ((y + (i) >= 0) && (y + (i) < height) && (x + (j) >= 0) && (x + (j) < width)) ? \
+		(uint16_t)(d[(y + (i)) * width + x + (j)] - bias) : 0xFFFF; \
+	if(s == 0xFFFF){ \
+		s = low ? 0 : s; \
+		low = !low; \
+	} \
+	else{ \
+		none = 0; \
+	} \
+	v[k] = s; }
+#define CE_SCALAR(a, b) { uint16_t t = (v[a] < v[b]) ? v[a] : v[b]; v[b] = (v[a] < v[b]) ? v[b] : v[a]; v[a] = t; }
+#define LO_SCALAR(a, b) v[a] = (v[a] < v[b]) ? v[a] : v[b];
+#define HI_SCALAR(a, b) v[b] = (v[a] < v[b]) ? v[b] : v[a];
+	MEDIAN9(LOAD_SCALAR, CE_SCALAR, LO_SCALAR, HI_SCALAR)
+	s = v[4];
+	return none ? invalid : (uint16_t)(s + bias);
+}
+
+static void median_row_scalar(const uint16_t *d, long width, long height, uint16_t *out, long y,
+							  long x, long end, uint16_t invalid){
+	for(;x<end;x++){
+		out[x] = median_scalar(d, width, height, x, y, invalid);
+	}
+}
+
+#if FREENECT_X86
+
+#pragma mark - SSE2
+
+// Pixels [i, end), 8 at a time. SSE2 packs 32-bit lanes with signed saturation,
+// so they are moved to the signed range and back.
+FREENECT_TARGET("sse2")
+static void temporal_sse2(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *src, long i, long end){
+	const __m128 a = _mm_set1_ps(1.f - p->smooth), thr = _mm_set1_ps(p->threshold), half = _mm_set1_ps(0.5f);
+	const __m128 zero = _mm_setzero_ps(), sign = _mm_set1_ps(-0.f), invf = _mm_set1_ps((float)p->invalid);
+	const __m128i inv = _mm_set1_epi16((short)p->invalid), limit = _mm_set1_epi16((short)holefill_limit(p));
+	const __m128i one = _mm_set1_epi16(1), shift = _mm_set1_epi32(0x8000), flip = _mm_set1_epi16((short)0x8000);
+	int smooth = p->smooth > 0.f, fill = p->holefill > 0;
+	__m128i raw, half32[2], missing, last, age;
+	__m128 v, h, nh, near, valid;
+	long k;
+
+	for(;i + 8 <= end;i+=8){
+		raw = _mm_loadu_si128((const __m128i *)(src + i));
+		if(smooth){
+			half32[0] = _mm_unpacklo_epi16(raw, _mm_setzero_si128());
+			half32[1] = _mm_unpackhi_epi16(raw, _mm_setzero_si128());
+			for(k=0;k<2;k++){
+				v = _mm_cvtepi32_ps(half32[k]);
+				h = _mm_loadu_ps(f->average + i + k * 4);
+				valid = _mm_cmpneq_ps(v, invf);
+				near = _mm_and_ps(_mm_cmpge_ps(h, zero), _mm_cmple_ps(_mm_andnot_ps(sign, _mm_sub_ps(v, h)), thr));
+				nh = _mm_or_ps(_mm_and_ps(near, _mm_add_ps(h, _mm_mul_ps(a, _mm_sub_ps(v, h)))), _mm_andnot_ps(near, v));
+				h = _mm_or_ps(_mm_and_ps(valid, nh), _mm_andnot_ps(valid, h));
+				_mm_storeu_ps(f->average + i + k * 4, h);
+				half32[k] = _mm_or_si128(_mm_and_si128(_mm_castps_si128(valid), _mm_cvttps_epi32(_mm_add_ps(h, half))),
+										 _mm_andnot_si128(_mm_castps_si128(valid), half32[k]));
+			}
+			raw = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(half32[0], shift), _mm_sub_epi32(half32[1], shift)), flip);
+		}
+		if(fill){
+			missing = _mm_cmpeq_epi16(raw, inv);
+			last = _mm_loadu_si128((const __m128i *)(f->last + i));
+			age = _mm_loadu_si128((const __m128i *)(f->age + i));
+			last = _mm_or_si128(_mm_and_si128(missing, last), _mm_andnot_si128(missing, raw));
+			age = _mm_and_si128(missing, _mm_adds_epu16(age, one));
+			// age <= limit: nothing left when limit is taken from it
+			missing = _mm_and_si128(missing, _mm_cmpeq_epi16(_mm_subs_epu16(age, limit), _mm_setzero_si128()));
+			raw = _mm_or_si128(_mm_and_si128(missing, last), _mm_andnot_si128(missing, raw));
+			_mm_storeu_si128((__m128i *)(f->last + i), last);
+			_mm_storeu_si128((__m128i *)(f->age + i), age);
+		}
+		_mm_storeu_si128((__m128i *)(f->temporal + i), raw);
+	}
+	temporal_scalar(f, p, src, i, end);
+}
+
+// The columns of three readings around row y at d and the 7 columns after it, in the
+// signed range: offset is the bias of median_scalar() less 0x8000, so that missing
+// readings become 0x7FFF, or 0x8000 (its complement) when moved below. The missing
+// readings of a column go alternately below and above from the top, then the column is
+// sorted into c[0..2]. c[3] marks the columns with an odd count of missing readings and
+// c[4] those without any reading.
+FREENECT_TARGET("sse2")
+static FILTER_INLINE void column_sse2(const uint16_t *d, long width, __m128i offset, __m128i *c){
+	const __m128i none = _mm_set1_epi16(0x7FFF);
+	__m128i s, missing;
+
+	c[3] = _mm_setzero_si128();
+	c[4] = _mm_set1_epi16(-1);
+#define COLUMN_SSE2(i) { \
+	s = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(d + ((i) - 1) * width)), offset); \
+	missing = _mm_cmpeq_epi16(s, none); \
+	c[i] = _mm_xor_si128(s, _mm_andnot_si128(c[3], missing)); \
+	c[3] = _mm_xor_si128(c[3], missing); \
+	c[4] = _mm_and_si128(c[4], missing); }
+	COLUMN_SSE2(0) COLUMN_SSE2(1) COLUMN_SSE2(2)
+	s = _mm_min_epi16(c[0], c[1]);
+	c[1] = _mm_max_epi16(c[0], c[1]);
+	c[0] = s;
+	s = _mm_min_epi16(c[1], c[2]);
+	c[2] = _mm_max_epi16(c[1], c[2]);
+	c[1] = _mm_max_epi16(c[0], s);
+	c[0] = _mm_min_epi16(c[0], s);
+}
+
+// A column that comes after an odd count of missing readings, in the window, has its
+// first one go above instead: with an odd count of its own that is one less below and
+// one more above, its sorted readings moved down by one. shift is 0x7FFF for those
+// columns and 0x8000 for the others.
+FREENECT_TARGET("sse2")
+static FILTER_INLINE void shift_column_sse2(const __m128i *c, __m128i shift, __m128i *v){
+	v[0] = _mm_max_epi16(c[0], _mm_min_epi16(c[1], shift));
+	v[1] = _mm_max_epi16(c[1], _mm_min_epi16(c[2], shift));
+	v[2] = _mm_max_epi16(c[2], shift);
+}
+
+FREENECT_TARGET("sse2")
+static FILTER_INLINE __m128i median3_sse2(__m128i a, __m128i b, __m128i c){
+	return _mm_max_epi16(_mm_min_epi16(a, b), _mm_min_epi16(_mm_max_epi16(a, b), c));
+}
+
+// median_scalar() on the 8 windows made of the columns l, c and r, left to right. With
+// the missing readings taken column by column there are as many below as in
+// median_scalar(), which is all the median depends on. Of 9 readings in sorted
+// columns, the median is that of the largest lowest one, the middle one of the middle
+// ones and the smallest highest one.
+FREENECT_TARGET("sse2")
+static FILTER_INLINE __m128i window_sse2(const __m128i *l, const __m128i *c, const __m128i *r, __m128i offset){
+	const __m128i none = _mm_set1_epi16(0x7FFF), below = _mm_set1_epi16((short)0x8000);
+	__m128i vc[3], vr[3], lo, mid, hi, s, all;
+
+	shift_column_sse2(c, _mm_xor_si128(_mm_and_si128(c[3], l[3]), below), vc);
+	shift_column_sse2(r, _mm_xor_si128(_mm_and_si128(r[3], _mm_xor_si128(l[3], c[3])), below), vr);
+	lo = _mm_max_epi16(_mm_max_epi16(l[0], vc[0]), vr[0]);
+	mid = median3_sse2(l[1], vc[1], vr[1]);
+	hi = _mm_min_epi16(_mm_min_epi16(l[2], vc[2]), vr[2]);
+	s = median3_sse2(lo, mid, hi);
+	all = _mm_and_si128(_mm_and_si128(l[4], c[4]), r[4]);
+	s = _mm_or_si128(_mm_andnot_si128(all, s), _mm_and_si128(all, none));
+	return _mm_add_epi16(s, offset);
+}
+
+// Pixels [x, end) of an inner row, whose windows lie within the frame. Each step sorts
+// the 8 columns after its own once, and shifts them in with its own for the middle and
+// right columns of its windows. The last steps, whose next columns are past the row,
+// sort all three, and the last one overlaps the one before it.
+FREENECT_TARGET("sse2")
+static void median_row_sse2(const uint16_t *d, long width, long height, uint16_t *out, long y,
+							long x, long end, uint16_t invalid){
+	const __m128i offset = _mm_set1_epi16((short)(uint16_t)(invalid + 1 - 0x8000));
+	const uint16_t *row = d + y * width;
+	__m128i l[5], c[5], r[5], next[5];
+
+	if(x + 8 > end){
+		median_row_scalar(d, width, height, out, y, x, end, invalid);
+		return;
+	}
+	column_sse2(row + x - 1, width, offset, l);
+	for(;(x + 8 <= end) && (x + 15 <= width);x+=8){
+		column_sse2(row + x + 7, width, offset, next);
+#define SHIFT_SSE2(k) \
+	c[k] = _mm_or_si128(_mm_srli_si128(l[k], 2), _mm_slli_si128(next[k], 14)); \
+	r[k] = _mm_or_si128(_mm_srli_si128(l[k], 4), _mm_slli_si128(next[k], 12));
+		SHIFT_SSE2(0) SHIFT_SSE2(1) SHIFT_SSE2(2) SHIFT_SSE2(3) SHIFT_SSE2(4)
+		_mm_storeu_si128((__m128i *)(out + x), window_sse2(l, c, r, offset));
+		l[0] = next[0];
+		l[1] = next[1];
+		l[2] = next[2];
+		l[3] = next[3];
+		l[4] = next[4];
+	}
+	for(;x<end;x+=8){
+		if(x + 8 > end){
+			x = end - 8;
+		}
+		column_sse2(row + x - 1, width, offset, l);
+		column_sse2(row + x, width, offset, c);
+		column_sse2(row + x + 1, width, offset, r);
+		_mm_storeu_si128((__m128i *)(out + x), window_sse2(l, c, r, offset));
+	}
+}
+
+#pragma mark - AVX2
+
+// temporal_sse2() on 16 pixels, whose halves go through the floats separately
+FREENECT_TARGET("avx2")
+static void temporal_avx2(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *src, long i, long end){
+	const __m256 a = _mm256_set1_ps(1.f - p->smooth), thr = _mm256_set1_ps(p->threshold), half = _mm256_set1_ps(0.5f);
+	const __m256 zero = _mm256_setzero_ps(), sign = _mm256_set1_ps(-0.f), invf = _mm256_set1_ps((float)p->invalid);
+	const __m256i inv = _mm256_set1_epi16((short)p->invalid), limit = _mm256_set1_epi16((short)holefill_limit(p));
+	const __m256i one = _mm256_set1_epi16(1);
+	int smooth = p->smooth > 0.f, fill = p->holefill > 0;
+	__m256i raw, half32[2], missing, last, age;
+	__m256 v, h, nh, near, valid;
+	long k;
+
+	for(;i + 16 <= end;i+=16){
+		raw = _mm256_loadu_si256((const __m256i *)(src + i));
+		if(smooth){
+			half32[0] = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(raw));
+			half32[1] = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(raw, 1));
+			for(k=0;k<2;k++){
+				v = _mm256_cvtepi32_ps(half32[k]);
+				h = _mm256_loadu_ps(f->average + i + k * 8);
+				valid = _mm256_cmp_ps(v, invf, _CMP_NEQ_OQ);
+				near = _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_GE_OQ),
+									 _mm256_cmp_ps(_mm256_andnot_ps(sign, _mm256_sub_ps(v, h)), thr, _CMP_LE_OQ));
+				nh = _mm256_blendv_ps(v, _mm256_add_ps(h, _mm256_mul_ps(a, _mm256_sub_ps(v, h))), near);
+				h = _mm256_blendv_ps(h, nh, valid);
+				_mm256_storeu_ps(f->average + i + k * 8, h);
+				half32[k] = _mm256_blendv_epi8(half32[k], _mm256_cvttps_epi32(_mm256_add_ps(h, half)), _mm256_castps_si256(valid));
+			}
+			// packus works within 128-bit halves, the permute puts the quarters back in order
+			raw = _mm256_permute4x64_epi64(_mm256_packus_epi32(half32[0], half32[1]), 0xD8);
+		}
+		if(fill){
+			missing = _mm256_cmpeq_epi16(raw, inv);
+			last = _mm256_loadu_si256((const __m256i *)(f->last + i));
+			age = _mm256_loadu_si256((const __m256i *)(f->age + i));
+			last = _mm256_blendv_epi8(raw, last, missing);
+			age = _mm256_and_si256(missing, _mm256_adds_epu16(age, one));
+			missing = _mm256_and_si256(missing, _mm256_cmpeq_epi16(_mm256_min_epu16(age, limit), age));
+			raw = _mm256_blendv_epi8(raw, last, missing);
+			_mm256_storeu_si256((__m256i *)(f->last + i), last);
+			_mm256_storeu_si256((__m256i *)(f->age + i), age);
+		}
+		_mm256_storeu_si256((__m256i *)(f->temporal + i), raw);
+	}
+	temporal_scalar(f, p, src, i, end);
+}
+
+// column_sse2() on 16 columns
+FREENECT_TARGET("avx2")
+static FILTER_INLINE void column_avx2(const uint16_t *d, long width, __m256i offset, __m256i *c){
+	const __m256i none = _mm256_set1_epi16(0x7FFF);
+	__m256i s, missing;
+
+	c[3] = _mm256_setzero_si256();
+	c[4] = _mm256_set1_epi16(-1);
+#define COLUMN_AVX2(i) { \
+	s = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)(d + ((i) - 1) * width)), offset); \
+	missing = _mm256_cmpeq_epi16(s, none); \
+	c[i] = _mm256_xor_si256(s, _mm256_andnot_si256(c[3], missing)); \
+	c[3] = _mm256_xor_si256(c[3], missing); \
+	c[4] = _mm256_and_si256(c[4], missing); }
+	COLUMN_AVX2(0) COLUMN_AVX2(1) COLUMN_AVX2(2)
+	s = _mm256_min_epi16(c[0], c[1]);
+	c[1] = _mm256_max_epi16(c[0], c[1]);
+	c[0] = s;
+	s = _mm256_min_epi16(c[1], c[2]);
+	c[2] = _mm256_max_epi16(c[1], c[2]);
+	c[1] = _mm256_max_epi16(c[0], s);
+	c[0] = _mm256_min_epi16(c[0], s);
+}
+
+FREENECT_TARGET("avx2")
+static FILTER_INLINE void shift_column_avx2(const __m256i *c, __m256i shift, __m256i *v){
+	v[0] = _mm256_max_epi16(c[0], _mm256_min_epi16(c[1], shift));
+	v[1] = _mm256_max_epi16(c[1], _mm256_min_epi16(c[2], shift));
+	v[2] = _mm256_max_epi16(c[2], shift);
+}
+
+FREENECT_TARGET("avx2")
+static FILTER_INLINE __m256i median3_avx2(__m256i a, __m256i b, __m256i c){
+	return _mm256_max_epi16(_mm256_min_epi16(a, b), _mm256_min_epi16(_mm256_max_epi16(a, b), c));
+}
+
+FREENECT_TARGET("avx2")
+static FILTER_INLINE __m256i window_avx2(const __m256i *l, const __m256i *c, const __m256i *r, __m256i offset){
+	const __m256i none = _mm256_set1_epi16(0x7FFF), below = _mm256_set1_epi16((short)0x8000);
+	__m256i vc[3], vr[3], lo, mid, hi, s;
+
+	shift_column_avx2(c, _mm256_xor_si256(_mm256_and_si256(c[3], l[3]), below), vc);
+	shift_column_avx2(r, _mm256_xor_si256(_mm256_and_si256(r[3], _mm256_xor_si256(l[3], c[3])), below), vr);
+	lo = _mm256_max_epi16(_mm256_max_epi16(l[0], vc[0]), vr[0]);
+	mid = median3_avx2(l[1], vc[1], vr[1]);
+	hi = _mm256_min_epi16(_mm256_min_epi16(l[2], vc[2]), vr[2]);
+	s = median3_avx2(lo, mid, hi);
+	s = _mm256_blendv_epi8(s, none, _mm256_and_si256(_mm256_and_si256(l[4], c[4]), r[4]));
+	return _mm256_add_epi16(s, offset);
+}
+
+// median_row_sse2() 16 pixels at a time. alignr shifts within 128-bit halves, so the
+// permute first pairs the upper half of a step's columns with the lower one of the next.
+FREENECT_TARGET("avx2")
+static void median_row_avx2(const uint16_t *d, long width, long height, uint16_t *out, long y,
+							long x, long end, uint16_t invalid){
+	const __m256i offset = _mm256_set1_epi16((short)(uint16_t)(invalid + 1 - 0x8000));
+	const uint16_t *row = d + y * width;
+	__m256i l[5], c[5], r[5], next[5], t;
+
+	if(x + 16 > end){
+		median_row_scalar(d, width, height, out, y, x, end, invalid);
+		return;
+	}
+	column_avx2(row + x - 1, width, offset, l);
+	for(;(x + 16 <= end) && (x + 31 <= width);x+=16){
+		column_avx2(row + x + 15, width, offset, next);
+#define SHIFT_AVX2(k) \
+	t = _mm256_permute2x128_si256(l[k], next[k], 0x21); \
+	c[k] = _mm256_alignr_epi8(t, l[k], 2); \
+	r[k] = _mm256_alignr_epi8(t, l[k], 4);
+		SHIFT_AVX2(0) SHIFT_AVX2(1) SHIFT_AVX2(2) SHIFT_AVX2(3) SHIFT_AVX2(4)
+		_mm256_storeu_si256((__m256i *)(out + x), window_avx2(l, c, r, offset));
+		l[0] = next[0];
+		l[1] = next[1];
+		l[2] = next[2];
+		l[3] = next[3];
+		l[4] = next[4];
+	}
+	for(;x<end;x+=16){
+		if(x + 16 > end){
+			x = end - 16;
+		}
+		column_avx2(row + x - 1, width, offset, l);
+		column_avx2(row + x, width, offset, c);
+		column_avx2(row + x + 1, width, offset, r);
+		_mm256_storeu_si256((__m256i *)(out + x), window_avx2(l, c, r, offset));
+	}
+}
+
+#endif // FREENECT_X86
+
+#pragma mark - Dispatch
+
+void freenect_filter_temporal_rows_level(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *depth,
+										 long begin, long end, t_freenect_cpu_level level){
+	long i = begin * f->width, n = end * f->width;
+
+	if(!freenect_filter_temporal_enabled(p)){
+		return;
+	}
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+#if FREENECT_X86
+	if(level >= FREENECT_CPU_AVX2){
+		temporal_avx2(f, p, depth, i, n);
+		return;
+	}
+	if(level >= FREENECT_CPU_SSE2){
+		temporal_sse2(f, p, depth, i, n);
+		return;
+	}
+#endif
+	temporal_scalar(f, p, depth, i, n);
+}
+
+void freenect_filter_temporal_rows(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *depth, long begin, long end){
+	freenect_filter_temporal_rows_level(f, p, depth, begin, end, freenect_kernels.level);
+}
+
+void freenect_filter_median_rows_level(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *depth,
+									   long begin, long end, t_freenect_cpu_level level){
+	long y, width = f->width, height = f->height;
+	uint16_t *out;
+
+	if(!freenect_filter_median_enabled(p)){
+		return;
+	}
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+	for(y=begin;y<end;y++){
+		out = f->median + y * width;
+		// Windows reaching past the frame are done one pixel at a time
+		if((y < 1) || (y >= height - 1) || (width < 18)){
+			median_row_scalar(depth, width, height, out, y, 0, width, p->invalid);
+			continue;
+		}
+		median_row_scalar(depth, width, height, out, y, 0, 1, p->invalid);
+#if FREENECT_X86
+		if(level >= FREENECT_CPU_AVX2){
+			median_row_avx2(depth, width, height, out, y, 1, width - 1, p->invalid);
+		}
+		else if(level >= FREENECT_CPU_SSE2){
+			median_row_sse2(depth, width, height, out, y, 1, width - 1, p->invalid);
+		}
+		else
+#endif
+		median_row_scalar(depth, width, height, out, y, 1, width - 1, p->invalid);
+		median_row_scalar(depth, width, height, out, y, width - 1, width, p->invalid);
+	}
+}
+
+void freenect_filter_median_rows(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *depth, long begin, long end){
+	freenect_filter_median_rows_level(f, p, depth, begin, end, freenect_kernels.level);
+}
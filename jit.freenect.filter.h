@@ -0,0 +1,87 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+/*
+ Depth filters of jit.freenect.grab, run on the raw 16-bit frame before it is
+ converted, so every output type and mode sees the filtered depth.
+
+ The temporal stages keep their history here, and write to a buffer of their
+ own so that the frame can be handed out again unchanged (replay loops over
+ the same frames):
+ - smoothing averages each pixel over time, exponentially, but lets changes
+   larger than a threshold through at once so that moving things do not trail;
+ - hole filling gives a pixel that lost its reading the last one it had, for
+   a limited number of frames.
+ The spatial stage is a 3x3 median of the readings around each pixel,
+ written to a buffer of its own; a pixel only stays without a reading when
+ none of its neighbours has one.
+
+ Every stage has a scalar version and SSE2 and AVX2 versions, which give
+ identical results. Like the other kernels, nothing here depends on the Max
+ SDK (see bench/).
+*/
+
+#ifndef JIT_FREENECT_FILTER_H
+#define JIT_FREENECT_FILTER_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+
+#define FREENECT_FILTER_ALIGN   64
+
+typedef struct _freenect_filter_params {
+	float       smooth;     // weight of the past in [0, 1), 0 turns smoothing off
+	float       threshold;  // larger changes, in raw units, are motion and not smoothed
+	long        holefill;   // frames a hole keeps the last reading, 0 turns filling off
+	long        median;     // 3 for a 3x3 median, 0 for none
+	uint16_t    invalid;    // raw value without a reading, FREENECT_DEPTH_MAX or 0 for registered depth
+} t_freenect_filter_params;
+
+typedef struct _freenect_filter {
+	long        width;
+	long        height;
+	float       *average;   // smoothed depth, negative before the first reading
+	uint16_t    *last;      // last reading output, for hole filling
+	uint16_t    *age;       // frames since that reading
+	uint16_t    *temporal;  // output of smoothing and hole filling
+	uint16_t    *median;    // output of the spatial median
+} t_freenect_filter;
+
+// Allocates the history for width x height frames and clears it, or keeps it when
+// the size did not change. f must be zeroed before the first call. Returns 0 on success.
+int     freenect_filter_init(t_freenect_filter *f, long width, long height);
+void    freenect_filter_free(t_freenect_filter *f);
+// Forgets the history, for a new source or a change of depth format
+void    freenect_filter_reset(t_freenect_filter *f);
+
+int     freenect_filter_temporal_enabled(const t_freenect_filter_params *p);
+int     freenect_filter_median_enabled(const t_freenect_filter_params *p);
+
+// Smoothing then hole filling of rows [begin, end) of depth into f->temporal.
+// Disjoint ranges can be filtered concurrently.
+void    freenect_filter_temporal_rows(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *depth, long begin, long end);
+void    freenect_filter_temporal_rows_level(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *depth,
+											long begin, long end, t_freenect_cpu_level level);
+// Median of rows [begin, end) of depth into f->median. depth must not change until
+// every row is done, neighbouring rows are read.
+void    freenect_filter_median_rows(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *depth, long begin, long end);
+void    freenect_filter_median_rows_level(t_freenect_filter *f, const t_freenect_filter_params *p, const uint16_t *depth,
+										  long begin, long end, t_freenect_cpu_level level);
+
+#endif
@@ -23,15 +23,32 @@
 #include "ext_obex.h"
 #include <libusb.h>
 #include "libfreenect.h"
+#include "libfreenect_registration.h"
 #include "freenect_internal.h"
+#include "jit.freenect.kernels.h"
+#include "jit.freenect.sync.h"
+#include "jit.freenect.pool.h"
+#include "jit.freenect.sim.h"
+#include "jit.freenect.record.h"
+#include "jit.freenect.codec.h"
+#include "jit.freenect.pair.h"
+#include "jit.freenect.stats.h"
+#include "jit.freenect.replay.h"
+#include "jit.freenect.cloud.h"
+#include "jit.freenect.lut.h"
+#include "jit.freenect.decimate.h"
+#include "jit.freenect.filter.h"
+#include "jit.freenect.background.h"
+#include "jit.freenect.register.h"
+#include "jit.freenect.bayer.h"
+#include "jit.freenect.yuv.h"
+#include "jit.freenect.buffers.h"
 #include <time.h>
-#warning is the depth/rgb size correct? one of them is not 640x480
-#define DEPTH_WIDTH 640
-#define DEPTH_HEIGHT 480
-#define DEPTH_BPP 4 // bytes per pixel
-#define RGB_WIDTH 640
-#define RGB_HEIGHT 480
+#define MEDIUM_WIDTH 640 // frame size until a source is opened, and the simulator's
+#define MEDIUM_HEIGHT 480
 #define RGB_BPP 3 // bytes per pixel
+#define TILT_PENDING 0x100 // flags tilt_pending, the low byte holds the angle
+#define STREAMS_PENDING 0x4 // flags streams_pending, bits 0 and 1 hold depth and video
 #define MAX_DEVICES 8
 
 #define DISTANCE_THRESH 10.f * 10.f
@@ -57,11 +74,28 @@
 
 #define DEBUG_TIMESTAMP __DATE__" "__TIME__"\x0"
 
-typedef union _lookup_data{
-	long *l_ptr;
-	float *f_ptr;
-	double *d_ptr;
-}t_lookup;
+// An output frame converted by the worker thread, ready to be referenced by a matrix
+typedef struct _converted_frame{
+	char        *data;
+	long        size;       // allocated bytes
+	t_symbol    *type;
+	long        planecount;
+	long        cellbytes;
+	long        rowbytes;
+	long        width;
+	long        height;
+	char        *mask;      // depth frames: the foreground mask, after the data
+	uint32_t    timestamp;  // device time of the raw frame
+	uint64_t    arrival;    // host time the raw frame arrived
+}t_converted_frame;
+
+// Where the frames of an open object come from
+enum frame_source{
+	SOURCE_NONE = 0,
+	SOURCE_KINECT,
+	SOURCE_SIM,
+	SOURCE_REPLAY
+};
 
 enum thread_mess_type{
 	NONE,
@@ -75,6 +109,9 @@ typedef struct _jit_freenect_grab
 	t_object         ob;
 	char             unique;
 	char             aligndepth;
+	char             alpha;
+	char             zerocopy;
+	char             rgb_referenced;
 	char             mode;
 	float            threshold;
 	char             has_frames;
@@ -82,33 +119,156 @@ typedef struct _jit_freenect_grab
 	long             ndevices;
 	t_atom           format;
 	freenect_device  *device;
+	char             source;              // frame_source
+	int              video_format;        // freenect_video_format of the open source
+	int              depth_format;        // freenect_depth_format of the open source
+	t_freenect_sim   sim;
+	t_freenect_replay replay;             // stays mapped after close, outputs may reference it
+	t_freenect_replay replay_parked;      // the one before, until matrix_calc lets go of its frames
+	void             *raw_depth[3];       // our own raw buffers, replay swaps in pointers to its mapping
+	void             *raw_rgb[3];
+	long             raw_depth_bytes;     // of each raw buffer, sized when a source opens
+	long             raw_rgb_bytes;
+	
+	// frame sizes of the open source, from its freenect_frame_mode or its recording
+	long             resolution;          // video resolution asked for, a freenect_resolution
+	long             depth_width;
+	long             depth_height;
+	long             video_width;         // IR is 8 rows taller than depth, high resolution video larger still
+	long             video_height;
+	t_freenect_recorder *recorder;       // swapped atomically, see record_frame()
+	int              record_busy;         // capture thread is inside record_frame()
 	uint32_t         timestamp;
-	t_lookup         lut;
-	t_symbol         *lut_type;
+	const t_freenect_lut *lut;            // shared table of matrix_calc, see jit.freenect.lut.h
+	t_freenect_calibration *calibration;  // NULL for the default curve, swapped under output_mutex
 	long             tilt;
 	long             accelcount;
 	double           mks_accel[3];
+	
+	// motor and accelerometer: the capture thread talks to USB, getters only read its cache
+	long             motor_interval;      // ms between refreshes, 0 to stop refreshing
+	struct _jit_freenect_grab *motor_next; // list the capture thread polls, guarded by motor_mutex
+	uint64_t         motor_polled;        // capture thread only
+	int              tilt_pending;        // TILT_PENDING | degrees, swapped atomically, 0 when none
+	int              streams_pending;     // STREAMS_PENDING | streams wanted, swapped atomically, 0 when none
+	int              streams_started;     // capture thread only once open, 1 depth, 2 video
+	t_systhread_mutex motor_state_mutex;  // guards the cached values below
+	double           motor_tilt;
+	double           motor_accel[3];
+	uint64_t         motor_time;          // freenect_now_ns() of the last refresh, 0 before the first
+	double           motor_age;           // ms, storage of the motorage attribute
 	//uint8_t          *rgb_data;
 	//uint16_t         *depth_data;
-	// back: owned by libfreenect (implicit for depth)
-	// mid: owned by callbacks, "latest frame ready"
-	// front: owned by GL, "currently being drawn"
-	uint16_t *depth_mid, *depth_front,*depth_back;
-	uint8_t *rgb_back, *rgb_mid, *rgb_front;
-	uint32_t         rgb_timestamp;
+	// back: owned by libfreenect, being filled
+	// middle: latest complete frame, exchanged atomically by the callbacks
+	// front: owned by matrix_calc (or the worker in async mode), "currently being output"
+	t_freenect_tribuf depth_frames;       // uint16_t buffers
+	t_freenect_tribuf rgb_frames;         // uint8_t buffers
+	uint32_t         depth_stamps[3];     // device time of each raw tribuf slot, set with the slot
+	uint32_t         rgb_stamps[3];
+	uint64_t         depth_arrivals[3];   // host time each raw tribuf slot arrived, for latency
+	uint64_t         rgb_arrivals[3];
+	uint32_t         rgb_timestamp;       // of the frames last output
 	uint32_t         depth_timestamp;
-	int got_rgb;
-	int got_depth;
+	
+	// pairing (pair 1): the capture thread matches depth and video by device time
+	// and publishes pairs instead of the raw tribufs
+	char             pair;
+	char             pairing;             // pair as latched when the source opened
+	float            pair_tolerance;      // ms
+	float            skew;                // ms, video minus depth of the last output
+	t_freenect_pairer pairer;             // buffers given back with the raw ones, see return_frames
+	
+	// A disabled stream is stopped at its source, nothing of it is received, copied or converted
+	char             depth_enable;
+	char             video_enable;
+	
+	// statistics since the source opened, updated from every thread without locking
+	t_freenect_stream_stats depth_stats;
+	t_freenect_stream_stats rgb_stats;
+	long             fpscount;            // storage of the read-only statistics attributes,
+	double           fps[2];              // {depth, rgb}, filled in by their getters
+	long             receivedcount;
+	long             frames_received[2];
+	long             outputcount;
+	long             frames_output[2];
+	long             droppedcount;
+	long             frames_dropped[2];
+	long             latencycount;
+	double           latency[6];          // ms, depth p50 p95 p99 then rgb
+	long             copytimecount;
+	double           copytime[2];         // ms per frame
+	long             footprintcount;
+	double           footprint[3];        // MB of frame buffers: this object's, all objects', idle in the pool
 	boolean_t			 is_open;
 	char             have_depth_frames;
 	char             have_rgb_frames;
 	char             clear_depth;
 	t_symbol         *type;
-	float            *rgb;
-	freenect_raw_tilt_state *state;
 	
-					// thread reference
-	t_systhread_mutex backbuffer_mutex;
+	// conversion worker (async 1): converts raw frames as they arrive,
+	// matrix_calc only swaps the ready frames to the front
+	char             async;
+	char             depth_referenced;
+	t_systhread      worker;
+	boolean_t        worker_cancel;
+	t_freenect_sem   frame_sem;           // posted by the callbacks for every frame
+	t_systhread_mutex output_mutex;       // guards the requested output format
+	t_converted_frame converted_depth[3];
+	t_converted_frame converted_rgb[3];
+	t_freenect_tribuf converted_depth_frames; // worker -> matrix_calc
+	t_freenect_tribuf converted_rgb_frames;
+	t_symbol         *worker_type;        // output format requested by the last matrix_calc
+	long             worker_planecount;
+	const t_freenect_lut *worker_lut;     // the worker's table, x->lut belongs to matrix_calc
+	
+	// mode 4: an organized cloud of cloud_planes floats per pixel
+	long             cloud_planes;        // 3 xyz, 5 + uv, 8 + rgb
+	t_freenect_cloud cloud;               // ray tables of matrix_calc
+	t_freenect_cloud worker_cloud;        // and of the worker
+	
+	// decimate and roi: only part of the frames is converted and output
+	long             decimate;            // 1, 2, 4 or 8 source pixels per output pixel and axis
+	char             decimate_mode;       // t_freenect_decimate_method, for depth
+	long             roicount;
+	long             roi[4];              // x y width height in depth pixels, 0 sizes reach the edge
+	t_freenect_window worker_window;      // windows requested by the last matrix_calc
+	t_freenect_window worker_video_window;
+	
+	// depth filters, run on the raw frame before conversion; threshold is the motion threshold
+	float            smooth;              // weight of the past, 0 turns smoothing off
+	long             holefill;            // frames a hole keeps its last reading
+	long             median;              // 0 or 3
+	t_freenect_filter filter;             // history of whoever converts, matrix_calc or the worker
+	char             filter_failed;       // out of memory for the filters, they stay off until the next open
+	
+	// background model and the foreground mask, output from dumpout when mask is on
+	t_freenect_background background;     // of whoever converts, like the filters
+	long             bg_learn;            // frames left to learn, -1 until freeze, 0 frozen
+	int              bg_clear;            // learn asked for a new model
+	long             bg_tolerance;        // raw units nearer than the background for foreground
+	char             mask;
+	void             *mask_matrix;        // not a mop output, so the outlets stay as they were
+	t_symbol         *mask_name;
+	char             mask_referenced;
+	
+	// software registration of raw depth, see jit.freenect.register.h
+	long             registration;        // 0 off, 1 depth into the video camera, 2 video into the depth camera
+	t_freenect_register registrar;        // tables and frames of whoever converts
+	char             register_failed;     // out of memory for them, registration stays off until the next open
+	freenect_registration kinect_registration; // the open Kinect's own, tables NULL for other sources
+	uint64_t         register_ns;         // wall time, updated atomically like the statistics
+	uint64_t         register_frames;
+	double           register_time;       // ms, storage of the registertime attribute
+	
+	// format bayer: the raw mosaic is demosaiced with the rest of the conversion
+	char             demosaic;            // t_freenect_bayer_method
+	uint8_t          *demosaiced;         // RGB frame of whoever converts, taken from the pool on first use
+	long             demosaiced_bytes;
+	long             yuv_planes;          // format yuv: 4 packed UYVY, two pixels per cell, 2 luma and chroma
+	long             threads;             // conversion threads, shared by all instances
+	char             hugepages;           // frame buffers, shared by all instances
+	char             frames_parked;       // closed while an output referenced a frame, see return_frames
 
 	int				x_sleeptime;	
 	int				id;
@@ -129,6 +289,9 @@ void *_jit_freenect_grab_class;
 #pragma mark - Globals 
 t_symbol *s_rgb, *s_RGB;
 t_symbol *s_ir, *s_IR;
+t_symbol *s_bayer, *s_BAYER;
+t_symbol *s_yuv, *s_YUV;
+t_symbol *s_sim;
 
 //int object_count = 0;
 
@@ -137,6 +300,8 @@ int global_id;
 freenect_context *f_ctx;
 t_systhread		x_systhread;
 boolean_t		x_systhread_cancel;				// thread cancel flag
+t_systhread_mutex motor_mutex;					// guards motor_first and the devices on it
+t_jit_freenect_grab *motor_first;				// open devices, polled by the capture thread
 boolean_t		freenect_active;
 int open_device_count;
 
@@ -148,22 +313,54 @@ void                    jit_freenect_grab_free(t_jit_freenect_grab *x);
 
 void                    jit_freenect_grab_open(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
 void                    jit_freenect_grab_close(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
+void                    jit_freenect_grab_open_sim(t_jit_freenect_grab *x, long argc, t_atom *argv);
+void                    jit_freenect_grab_open_replay(t_jit_freenect_grab *x, long argc, t_atom *argv);
+void                    jit_freenect_grab_record(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
+void                    jit_freenect_grab_record_stop(t_jit_freenect_grab *x);
+void                    jit_freenect_grab_calibration(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
+void                    jit_freenect_grab_learn(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
+void                    jit_freenect_grab_freeze(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv);
 
 t_jit_err               jit_freenect_grab_get_ndevices(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
 t_jit_err               jit_freenect_grab_get_accel(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
 t_jit_err               jit_freenect_grab_get_tilt(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err               jit_freenect_grab_get_motor_age(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+static void             motor_register(t_jit_freenect_grab *x);
+static void             motor_unregister(t_jit_freenect_grab *x);
+static void             motor_poll(void);
 void					jit_freenect_grab_set_tilt(t_jit_freenect_grab *x,  void *attr, long argc, t_atom *argv);
 void					jit_freenect_grab_set_format(t_jit_freenect_grab *x,  void *attr, long argc, t_atom *argv);
 
 t_jit_err               jit_freenect_grab_set_mode(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_cloud_planes(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_decimate(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_roi(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_median(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err               jit_freenect_grab_set_yuvplanes(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+static int              update_lut(t_jit_freenect_grab *x, const t_freenect_lut **lut, t_symbol *type, int mode);
+static int              update_cloud(t_jit_freenect_grab *x, t_freenect_cloud *cloud, const t_freenect_lut *metres, const t_freenect_window *window);
 
 t_jit_err               jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, void *outputs);
-void                    copy_depth_data(uint16_t *source, char *out_bp, t_jit_matrix_info *dest_info, t_lookup *lut);
-//void                    build_geometry(t_jit_freenect_grab *x, void *matrix, char *out_bp, t_jit_matrix_info *dest_info);
-void                    copy_rgb_data(uint8_t *source, char *out_bp, t_jit_matrix_info *dest_info);
+void                    copy_depth_data(uint16_t *source, long src_width, long src_height, char *out_bp, t_jit_matrix_info *dest_info,
+										const t_freenect_lut *lut, const t_freenect_window *window, uint16_t invalid);
+void                    copy_rgb_data(uint8_t *source, long src_width, long src_height, char *out_bp, t_jit_matrix_info *dest_info,
+									  const t_freenect_window *window);
+static void             copy_depth_rows(uint16_t *source, long src_width, long src_height, char *out_bp, t_jit_matrix_info *dest_info,
+										const t_freenect_lut *lut, const t_freenect_window *window, uint16_t invalid, long begin, long end);
+static void             copy_rgb_rows(uint8_t *source, long src_width, long src_height, char *out_bp, t_jit_matrix_info *dest_info,
+									  const t_freenect_window *window, long begin, long end);
+static void             copy_yuv_rows(uint8_t *source, long src_width, char *out_bp, t_jit_matrix_info *dest_info,
+									  const t_freenect_window *window, long begin, long end);
+void                    convert_frames(uint16_t *depth_source, char *depth_bp, t_jit_matrix_info *depth_info, char *mask_bp, long mask_stride,
+									   const t_freenect_lut *lut, t_freenect_cloud *cloud, uint8_t *rgb_source, char *rgb_bp, t_jit_matrix_info *rgb_info,
+									   const t_freenect_window *window, const t_freenect_window *video_window, t_jit_freenect_grab *x);
 
 void                    rgb_callback(freenect_device *dev, void *pixels, uint32_t timestamp);
 void                    depth_callback(freenect_device *dev, void *pixels, uint32_t timestamp);
+static void             *sim_rgb_callback(void *user, void *pixels, uint32_t timestamp);
+static void             *sim_depth_callback(void *user, void *pixels, uint32_t timestamp);
+static void             replay_rgb_callback(void *user, void *payload, const t_freenect_rec_index *frame);
+static void             replay_depth_callback(void *user, void *payload, const t_freenect_rec_index *frame);
 
 void *jit_freenect_capture_threadproc();//t_jit_freenect_grab *x);
 long jit_freenect_restart_thread(t_jit_freenect_grab *x);
@@ -171,218 +368,125 @@ void jit_freenect_thread_sleeptime(t_jit_freenect_grab *x, long sleeptime);
 void jit_freenect_thread_stop(t_jit_freenect_grab *x);
 void jit_freenect_thread_cancel(t_jit_freenect_grab *x);
 
+t_jit_err jit_freenect_grab_set_async(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+void *jit_freenect_worker_threadproc(t_jit_freenect_grab *x);
+void jit_freenect_worker_start(t_jit_freenect_grab *x);
+void jit_freenect_worker_stop(t_jit_freenect_grab *x);
+t_jit_err jit_freenect_grab_get_threads(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_set_threads(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err jit_freenect_grab_set_pair(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err jit_freenect_grab_set_pair_tolerance(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err jit_freenect_grab_set_depth_enable(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+t_jit_err jit_freenect_grab_set_video_enable(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+static void pairing_begin(t_jit_freenect_grab *x);
+static void pairing_end(t_jit_freenect_grab *x);
+static void set_output_timestamps(t_jit_freenect_grab *x, uint32_t depth_stamp, uint32_t rgb_stamp);
+static void stats_begin(t_jit_freenect_grab *x);
+static void output_stats(t_jit_freenect_grab *x, int new_depth, uint64_t depth_arrival, int new_rgb, uint64_t rgb_arrival);
+t_jit_err jit_freenect_grab_get_fps(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_get_frames_received(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_get_frames_output(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_get_frames_dropped(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_get_latency(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_get_copytime(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_get_registertime(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_get_footprint(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_get_hugepages(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av);
+t_jit_err jit_freenect_grab_set_hugepages(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av);
+static void return_frames(t_jit_freenect_grab *x);
+static void close_frames(t_jit_freenect_grab *x);
+static int enabled_streams(t_jit_freenect_grab *x);
+
 //pthread_t capture_thread;
 //int       terminate_thread;
 
 
 
-/*
-
-static int grow_cloud(t_cloud *cloud){
-	t_point3D *temp = (t_point3D *)realloc(cloud->points, (cloud->size + CLOUD_BLOCK)*sizeof(t_point3D));
-	if(!temp){
-		error("Out of memory, cannot grow cloud.");
-		return 1;
-	}
-	cloud->points = temp;
-	cloud->size += CLOUD_BLOCK;
-	return 0;
-}
-
-static void push_cloud_point(t_cloud *cloud, float x, float y, float z, float tx, float ty, 
-							 float nx, float ny, float nz, float r, float g, float b, float a){
-	if(cloud->count == cloud->size){
-		if(grow_cloud(cloud))return; //Out of memory
-	}
-	cloud->points[cloud->count].x = x;
-	cloud->points[cloud->count].y = y;
-	cloud->points[cloud->count].z = z;
-	cloud->points[cloud->count].tex_x = tx;
-	cloud->points[cloud->count].tex_y = ty;
-	cloud->points[cloud->count].nx = nx;
-	cloud->points[cloud->count].ny = ny;
-	cloud->points[cloud->count].nz = nz;
-	cloud->points[cloud->count].r = r;
-	cloud->points[cloud->count].g = g;
-	cloud->points[cloud->count].b = b;
-	cloud->points[cloud->count].a = a;
-	cloud->count++;
-}
-
-static void start_cloud_point(t_cloud *cloud, float x, float y, float z, float tx, float ty, 
-							  float nx, float ny, float nz, float r, float g, float b, float a){
-	if(cloud->count > (cloud->size - 2)){
-		if(grow_cloud(cloud))return; //Out of memory
-	}
-	cloud->points[cloud->count].x = x;
-	cloud->points[cloud->count].y = y;
-	cloud->points[cloud->count].z = z;
-	cloud->points[cloud->count].tex_x = tx;
-	cloud->points[cloud->count].tex_y = ty;
-	cloud->points[cloud->count].nx = nx;
-	cloud->points[cloud->count].ny = ny;
-	cloud->points[cloud->count].nz = nz;
-	cloud->points[cloud->count].r = r;
-	cloud->points[cloud->count].g = g;
-	cloud->points[cloud->count].b = b;
-	cloud->points[cloud->count].a = a;
-	cloud->count++;
-	cloud->points[cloud->count] = cloud->points[cloud->count-1];
-	cloud->count++;
-}
-
-static void terminate_cloud_point(t_cloud *cloud){
-	if(cloud->count == cloud->size){
-		if(grow_cloud(cloud))return; //Out of memory
-	}
-	cloud->points[cloud->count] = cloud->points[cloud->count-1];
-	cloud->count++;
-}
-
-static void release_cloud(t_cloud *cloud){
-	free(cloud->points);
-	cloud->points = NULL;
-	cloud->count = 0;
-}
-
-static void allocate_cloud(t_cloud *cloud){
-	if(!cloud->points){
-		cloud->points = (t_point3D *)malloc(CLOUD_SIZE*sizeof(t_point3D));
-		if(!cloud->points){
-			cloud->size = 0;
-			cloud->count = 0;
-			error("Out of memory, could not allocate cloud.");
-		}
-		cloud->size = CLOUD_SIZE;
-		cloud->count = 0; 
+// Bytes per pixel of the open source's video as it arrives: IR and the Bayer mosaic have one, UYVY two
+static long raw_video_bpp(t_jit_freenect_grab *x){
+	if(x->video_format == FREENECT_VIDEO_YUV_RAW){
+		return FREENECT_YUV_BPP;
 	}
+	return ((x->video_format == FREENECT_VIDEO_IR_8BIT) || (x->video_format == FREENECT_VIDEO_BAYER)) ? 1 : RGB_BPP;
 }
-  
-*/
 
-void calculate_lut(t_lookup *lut, t_symbol *type, int mode){
-	long i;
+static long video_frame_bytes(t_jit_freenect_grab *x)
+{
+	return x->video_width * x->video_height * raw_video_bpp(x);
+}
+
+// The video window: roi is in depth pixels, scaled to the video frame when it is
+// larger, so that both outputs show about the same part of the scene
+static void video_window_init(t_jit_freenect_grab *x, t_freenect_window *w){
+	long roi[4], i;
 	
-	if(type == _jit_sym_float32){
-		float *f_lut;
-		f_lut = (float *)realloc(lut->f_ptr, sizeof(float) * 0x800);
-		if(!f_lut){
-			error("Out of memory!");
-			return;
-		}
-		lut->f_ptr = f_lut;
-		
-		switch(mode){
-			case 0:
-				for(i=0;i<0x800;i++){
-					lut->f_ptr[i] = (float)i;
-				}
-				break;
-			case 1:
-				for(i=0;i<0x800;i++){
-					lut->f_ptr[i] = (float)i * (1.f / (float)0x7FF);
-				}
-				break;
-			case 2:
-				for(i=0;i<0x800;i++){
-					lut->f_ptr[i] = 1.f - ((float)i * (1.f / (float)0x7FF));
-				}
-				break;
-			case 3:
-				postNesa("making mode 3 lut\n"); //TODO: remove
-				for(i=0;i<0x7FF;i++){
-					lut->f_ptr[i] =  (float)i*0.01f;//(float)(-10.f / (3.33f + (float)i * -0.00307f));
-				}
-				lut->f_ptr[0x800]=-1.f;
-				break;
-			case 4:
-				postNesa("making mode 4 lut\n"); //TODO: remove
-				for(i=0;i<0x800;i++){
-					lut->f_ptr[i] = 10.f / (3.33f + (float)i * -0.00307f);
-				} 
-				break;
-		}
+	for(i=0;i<4;i++){
+		roi[i] = x->roi[i] * x->video_width / x->depth_width;
 	}
-	else if(type == _jit_sym_long){
-		long *l_lut;
-		l_lut = (long *)realloc(lut->l_ptr, sizeof(long) * 0x800);
-		if(!l_lut){
-			error("Out of memory!");
-			return;
-		}
-		lut->l_ptr = l_lut;
-		
-		switch(mode){
-			case 0:
-			case 1:
-				for(i=0;i<0x800;i++){
-					lut->l_ptr[i] = i;
-				}
-				break;
-			case 2:
-				for(i=0;i<0x800;i++){
-					lut->l_ptr[i] = 0x7FF - i;
-				}
-				break;
-			case 3:
-				for(i=0;i<0x800;i++){
-					lut->l_ptr[i] = (long)(-10.f / (3.33f + (float)i * -0.00307f));
-				} 
-				break;
-			case 4:
-				for(i=0;i<0x800;i++){
-					lut->l_ptr[i] = (long)(-10.f / (3.33f + (float)i * -0.00307f));
-				} 
-				break;
-		}
+	freenect_window_init(w, x->video_width, x->video_height, roi, x->decimate, x->decimate_mode);
+}
+
+// Video the cloud can be coloured from: pixels line up with depth's only when rows
+// are as wide, which leaves out high resolution video
+static int video_colours_depth(t_jit_freenect_grab *x){
+	return (x->video_width == x->depth_width) && (x->video_height >= x->depth_height);
+}
+
+// Cells per row of the video output, packed UYVY holds two pixels in each
+static long video_output_width(t_jit_freenect_grab *x, long planecount, const t_freenect_window *window){
+	if(x->video_format == FREENECT_VIDEO_YUV_RAW){
+		return freenect_yuv_width(window->width, planecount);
 	}
-	else if(type == _jit_sym_float64){
-		double *d_lut;
-		d_lut = (double *)realloc(lut->d_ptr, sizeof(double) * 0x800);
-		if(!d_lut){
-			error("Out of memory!");
-			return;
-		}
-		lut->d_ptr = d_lut;
-		
-		switch(mode){
-			case 0:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = (double)i;
-				}
-				break;
-			case 1:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = (double)i * (1.0 / (double)0x7FF);
-				}
-				break;
-			case 2:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = 1.0 - ((double)i * (1.0 / (double)0x7FF));
-				}
-				break;
-			case 3:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = -10.0 / (3.33 + (double)i * -0.00307);
-				} 
-				break;
-			case 4:
-				for(i=0;i<0x800;i++){
-					lut->d_ptr[i] = -10.0 / (3.33 + (double)i * -0.00307);
-				} 
-				break;
-		}
+	return window->width;
+}
+
+// The register attribute as it applies to the open source: depth registered by the
+// device already is in the video camera, IR video comes from the depth camera,
+// only RGB video can be warped into the depth camera, and only video of depth's size.
+// Off once the registrar ran out of memory, the attribute keeps the user's choice.
+static long register_mode(t_jit_freenect_grab *x){
+	if(x->register_failed || (x->depth_format == FREENECT_DEPTH_REGISTERED) || (x->video_format == FREENECT_VIDEO_IR_8BIT)){
+		return 0;
 	}
-	else if(type == NULL){
-		if(lut->f_ptr){
-			free(lut->f_ptr);
-			lut->f_ptr = NULL;
-		}
+	if((x->registration == 2) && (x->video_format == FREENECT_VIDEO_YUV_RAW)){
+		return 0;
 	}
-	else{
-		error("Invalid type for lookup table calculation. char not supported.");
-		return;
+	// The tables map between frames of the same size
+	if((x->video_width != x->depth_width) || (x->video_height != x->depth_height)){
+		return 0;
+	}
+	return x->registration;
+}
+
+// Jitter type of a depth output to the kernels' cell type, char is not supported
+static t_freenect_depth_type depth_type(t_symbol *type){
+	if(type == _jit_sym_float64){
+		return FREENECT_DEPTH_FLOAT64;
+	}
+	else if(type == _jit_sym_long){
+		return FREENECT_DEPTH_LONG;
+	}
+	return FREENECT_DEPTH_FLOAT32;
+}
+
+// Points *lut at the shared table for type and mode with x's calibration, which
+// may be swapped meanwhile by the calibration message. Registered depth is in
+// millimetres and gets a millimetre table instead.
+static int update_lut(t_jit_freenect_grab *x, const t_freenect_lut **lut, t_symbol *type, int mode){
+	t_freenect_depth_type cells = depth_type(type);
+	int mm = (x->depth_format == FREENECT_DEPTH_REGISTERED);
+	
+	systhread_mutex_lock(x->output_mutex);
+	if(!freenect_lut_matches(*lut, cells, mode, mm, x->calibration)){
+		freenect_lut_release(*lut);
+		*lut = freenect_lut_acquire(cells, mode, mm, x->calibration);
 	}
+	systhread_mutex_unlock(x->output_mutex);
+	if(!*lut){
+		error("Out of memory, cannot build the depth table.");
+		return 0;
+	}
+	return 1;
 }
 
 
@@ -397,13 +501,22 @@ t_jit_err jit_freenect_grab_init(void)
 	global_id=0;
 	x_systhread = NULL;
 	x_systhread_cancel=FALSE;
+	systhread_mutex_new(&motor_mutex, 0);
+	motor_first = NULL;
 	freenect_active=FALSE;
 	open_device_count=0;
 	
+	freenect_kernels_init();
+	
 	s_rgb = gensym("rgb");
 	s_RGB = gensym("RGB");
 	s_ir = gensym("ir");
 	s_IR = gensym("IR");
+	s_bayer = gensym("bayer");
+	s_BAYER = gensym("BAYER");
+	s_yuv = gensym("yuv");
+	s_YUV = gensym("YUV");
+	s_sim = gensym("sim");
 	
 	_jit_freenect_grab_class = jit_class_new("jit_freenect_grab",(method)jit_freenect_grab_new,
 											 (method)jit_freenect_grab_free, sizeof(t_jit_freenect_grab),0L);
@@ -419,11 +532,7 @@ t_jit_err jit_freenect_grab_init(void)
 	jit_atom_setsym(a+2,_jit_sym_float64);
 	jit_object_method(output,_jit_sym_types,3,a);
 	
-	jit_atom_setlong(&a[0], DEPTH_WIDTH);
-	jit_atom_setlong(&a[1], DEPTH_HEIGHT);
-	
-	jit_object_method(output, _jit_sym_mindim, 2, a);  //Two dimensions, sizes in atom array
-	jit_object_method(output, _jit_sym_maxdim, 2, a);
+	// No mindim/maxdim: matrix_calc sizes the outputs from the source's frame sizes, roi and decimate
 	
 	//Prepare RGB image
 	output = jit_object_method(mop,_jit_sym_getoutput,2);
@@ -431,20 +540,19 @@ t_jit_err jit_freenect_grab_init(void)
 	jit_atom_setsym(a,_jit_sym_char); //default
 	jit_object_method(output,_jit_sym_types,1,a);
 	
-	jit_attr_setlong(output,_jit_sym_minplanecount,4);
+	jit_attr_setlong(output,_jit_sym_minplanecount,1); // 1: IR, 3: RGB without alpha
+
 	jit_attr_setlong(output,_jit_sym_maxplanecount,4);
 	
-	jit_atom_setlong(&a[0], RGB_WIDTH);
-	jit_atom_setlong(&a[1], RGB_HEIGHT);
-	
-	jit_object_method(output, _jit_sym_mindim, 2, a);
-	jit_object_method(output, _jit_sym_maxdim, 2, a);
-	
 	jit_class_addadornment(_jit_freenect_grab_class,mop);
 	
 	//add methods
 	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_open, "open", A_GIMME, 0L);
 	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_close, "close", A_GIMME, 0L);
+	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_record, "record", A_GIMME, 0L);
+	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_calibration, "calibration", A_GIMME, 0L);
+	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_learn, "learn", A_GIMME, 0L);
+	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_freeze, "freeze", A_GIMME, 0L);
 	
 	jit_class_addmethod(_jit_freenect_grab_class, (method)jit_freenect_grab_matrix_calc, "matrix_calc", A_CANT, 0L);
 	
@@ -455,6 +563,7 @@ t_jit_err jit_freenect_grab_init(void)
 	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	//threshold: depth changes larger than this, in raw units, are motion and not smoothed
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"threshold",_jit_sym_float32,
 										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,threshold));
 	jit_attr_addfilterset_clip(attr,0,0,TRUE,FALSE);
@@ -470,6 +579,83 @@ t_jit_err jit_freenect_grab_init(void)
 										  attrflags,(method)NULL,(method)jit_freenect_grab_set_mode,calcoffset(t_jit_freenect_grab,mode));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	//cloudplanes: floats per point in mode 4, 3 (xyz), 5 (+ texture uv) or 8 (+ rgb)
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"cloudplanes",_jit_sym_long,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_cloud_planes,calcoffset(t_jit_freenect_grab,cloud_planes));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//decimate: output one pixel per block of 1, 2, 4 or 8 pixels squared
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"decimate",_jit_sym_long,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_decimate,calcoffset(t_jit_freenect_grab,decimate));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//decimatemode: depth of a block, 0: top left pixel, 1: nearest reading, 2: median reading (of every other pixel at decimate 8)
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"decimatemode",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,decimate_mode));
+	jit_attr_addfilterset_clip(attr,0,2,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//roi: x y width height of the part of the frames to output, in depth pixels (scaled for larger video), a 0 size reaches the edge
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "roi", _jit_sym_long, 4, 
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_roi,
+										  calcoffset(t_jit_freenect_grab, roicount),calcoffset(t_jit_freenect_grab,roi));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//smooth: temporal smoothing of depth, the weight of the past from 0 (off) to 0.99
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"smooth",_jit_sym_float32,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,smooth));
+	jit_attr_addfilterset_clip(attr,0,0.99,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//holefill: frames during which a pixel that lost its reading keeps the last one, 0 for none
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"holefill",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,holefill));
+	jit_attr_addfilterset_clip(attr,0,0,TRUE,FALSE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//median: 3 for a median of the readings in the 3x3 square around each pixel, 0 for none
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"median",_jit_sym_long,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_median,calcoffset(t_jit_freenect_grab,median));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//bgtolerance: how much nearer than the learnt background, in raw units, depth has to be to show in the mask
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"bgtolerance",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,bg_tolerance));
+	jit_attr_addfilterset_clip(attr,0,0xFFFF,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//mask 1 computes the foreground mask, a 1-plane char matrix of the depth output's size, 255 where depth
+	//is in front of the learnt background. It is output from dumpout as "mask jit_matrix <name>", before the outputs.
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"mask",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,mask));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//demosaic: format bayer's demosaic, 0 bilinear, 1 superpixel (a colour per 2x2 cell, for decimated output)
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"demosaic",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,demosaic));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//yuvplanes: format yuv's output, 4 for packed UYVY at half width, 2 for luma and chroma (U on even columns, V on odd)
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"yuvplanes",_jit_sym_long,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_yuvplanes,calcoffset(t_jit_freenect_grab,yuv_planes));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//register: 1 warps raw depth into the video camera, 2 warps video into the depth camera, 0 neither
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"register",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,registration));
+	jit_attr_addfilterset_clip(attr,0,2,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//resolution: video resolution, 0 low, 1 medium (640x480), 2 high (1280x1024), takes effect on open.
+	//Formats the Kinect has no such mode for open at medium, and depth is always medium.
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"resolution",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,resolution));
+	jit_attr_addfilterset_clip(attr,FREENECT_RESOLUTION_LOW,FREENECT_RESOLUTION_HIGH,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//format: rgb, ir, bayer (raw mosaic, demosaiced here instead of on the USB thread) or yuv (raw UYVY, see yuvplanes), takes effect on open
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"format",_jit_sym_atom,
 										  attrflags,(method)NULL,(method)jit_freenect_grab_set_format,calcoffset(t_jit_freenect_grab,format));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
@@ -479,11 +665,66 @@ t_jit_err jit_freenect_grab_init(void)
 										  calcoffset(t_jit_freenect_grab,tilt));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	//motorinterval: ms between reads of the tilt and accelerometer, 0 to stop reading them
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"motorinterval",_jit_sym_long,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,motor_interval));
+	jit_attr_addfilterset_clip(attr,0,0,TRUE,FALSE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"aligndepth",_jit_sym_char,
 										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,aligndepth));
 	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	//alpha 0 outputs RGB as a 3-plane matrix, saving the constant alpha plane
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"alpha",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,alpha));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//zerocopy 1 makes the outputs reference our frame buffers when no conversion is needed
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"zerocopy",_jit_sym_char,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,zerocopy));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//async 1 converts frames on a worker thread, outputs then reference the converted frames
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"async",_jit_sym_char,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_async,calcoffset(t_jit_freenect_grab,async));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//threads splits conversion rows across a pool shared by all instances, setting it on one sets it for all: 0 = one per CPU, 1 = off
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"threads",_jit_sym_long,
+										  attrflags,(method)jit_freenect_grab_get_threads,(method)jit_freenect_grab_set_threads,calcoffset(t_jit_freenect_grab,threads));
+	jit_attr_addfilterset_clip(attr,0,FREENECT_POOL_MAX_THREADS,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//hugepages 1 backs frame buffers of 2 MB and more with huge pages (Linux), shared by all instances, takes effect on open
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"hugepages",_jit_sym_char,
+										  attrflags,(method)jit_freenect_grab_get_hugepages,(method)jit_freenect_grab_set_hugepages,calcoffset(t_jit_freenect_grab,hugepages));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//depth_enable and video_enable 0 stop a stream, also while open: a Kinect stops sending it, which leaves its USB bandwidth to other devices
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"depth_enable",_jit_sym_char,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_depth_enable,calcoffset(t_jit_freenect_grab,depth_enable));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"video_enable",_jit_sym_char,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_video_enable,calcoffset(t_jit_freenect_grab,video_enable));
+	jit_attr_addfilterset_clip(attr,0,1,TRUE,TRUE);
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//pair 1 only outputs depth and video captured within pairtolerance ms of each other, takes effect on open
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"pair",_jit_sym_char,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_pair,calcoffset(t_jit_freenect_grab,pair));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"pairtolerance",_jit_sym_float32,
+										  attrflags,(method)NULL,(method)jit_freenect_grab_set_pair_tolerance,calcoffset(t_jit_freenect_grab,pair_tolerance));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
 	attrflags = JIT_ATTR_GET_DEFER_LOW | JIT_ATTR_SET_OPAQUE;
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"index",_jit_sym_long,
 										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,index));
@@ -493,16 +734,73 @@ t_jit_err jit_freenect_grab_init(void)
 										  attrflags,(method)jit_freenect_grab_get_ndevices,(method)NULL,calcoffset(t_jit_freenect_grab,ndevices));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
+	//skew: video minus depth device time of the last output, in ms
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"skew",_jit_sym_float32,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,skew));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "accel", _jit_sym_float64, 3, 
 										  attrflags, (method)jit_freenect_grab_get_accel,(method)NULL, 
 										  calcoffset(t_jit_freenect_grab, accelcount),calcoffset(t_jit_freenect_grab,mks_accel));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//motorage: ms since tilt and accel were read from the device, -1 if never
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"motorage",_jit_sym_float64,
+										  attrflags,(method)jit_freenect_grab_get_motor_age,(method)NULL,calcoffset(t_jit_freenect_grab,motor_age));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//statistics since the device was opened, each as {depth, rgb}
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "fps", _jit_sym_float64, 2, 
+										  attrflags, (method)jit_freenect_grab_get_fps,(method)NULL, 
+										  calcoffset(t_jit_freenect_grab, fpscount),calcoffset(t_jit_freenect_grab,fps));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "framesreceived", _jit_sym_long, 2, 
+										  attrflags, (method)jit_freenect_grab_get_frames_received,(method)NULL, 
+										  calcoffset(t_jit_freenect_grab, receivedcount),calcoffset(t_jit_freenect_grab,frames_received));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "framesoutput", _jit_sym_long, 2, 
+										  attrflags, (method)jit_freenect_grab_get_frames_output,(method)NULL, 
+										  calcoffset(t_jit_freenect_grab, outputcount),calcoffset(t_jit_freenect_grab,frames_output));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "framesdropped", _jit_sym_long, 2, 
+										  attrflags, (method)jit_freenect_grab_get_frames_dropped,(method)NULL, 
+										  calcoffset(t_jit_freenect_grab, droppedcount),calcoffset(t_jit_freenect_grab,frames_dropped));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//latency: ms from the device callback to the output, depth p50 p95 p99 then rgb p50 p95 p99
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "latency", _jit_sym_float64, 6, 
+										  attrflags, (method)jit_freenect_grab_get_latency,(method)NULL, 
+										  calcoffset(t_jit_freenect_grab, latencycount),calcoffset(t_jit_freenect_grab,latency));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//copytime: average ms spent converting a frame, summed over all threads
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "copytime", _jit_sym_float64, 2, 
+										  attrflags, (method)jit_freenect_grab_get_copytime,(method)NULL, 
+										  calcoffset(t_jit_freenect_grab, copytimecount),calcoffset(t_jit_freenect_grab,copytime));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//registertime: average ms a depth frame spends in software registration, video included
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"registertime",_jit_sym_float64,
+										  attrflags,(method)jit_freenect_grab_get_registertime,(method)NULL,calcoffset(t_jit_freenect_grab,register_time));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
+	
+	//footprint: MB of frame buffers held by this object, by all objects, and kept idle for the next open
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset_array, "footprint", _jit_sym_float64, 3, 
+										  attrflags, (method)jit_freenect_grab_get_footprint,(method)NULL, 
+										  calcoffset(t_jit_freenect_grab, footprintcount),calcoffset(t_jit_freenect_grab,footprint));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
 
 	
 	attrflags = JIT_ATTR_GET_OPAQUE_USER | JIT_ATTR_SET_OPAQUE_USER;
 	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"has_frames",_jit_sym_char,
 										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,has_frames));
 	jit_class_addattr(_jit_freenect_grab_class,attr);
+	attr = (t_jit_object *)jit_object_new(_jit_sym_jit_attr_offset,"mask_name",_jit_sym_symbol,
+										  attrflags,(method)NULL,(method)NULL,calcoffset(t_jit_freenect_grab,mask_name));
+	jit_class_addattr(_jit_freenect_grab_class,attr);
 	
 	jit_class_register(_jit_freenect_grab_class);
 	
@@ -513,45 +811,133 @@ t_jit_err jit_freenect_grab_init(void)
 t_jit_freenect_grab *jit_freenect_grab_new(void)
 {
 	t_jit_freenect_grab *x;
+	t_jit_matrix_info info;
+	int i;
 	
 	if ((x=(t_jit_freenect_grab *)jit_object_alloc(_jit_freenect_grab_class)))
 	{
 		x->device = NULL;
+		x->source = SOURCE_NONE;
+		x->video_format = FREENECT_VIDEO_RGB;
+		x->depth_format = FREENECT_DEPTH_11BIT;
+		memset(&x->sim, 0, sizeof(x->sim));
+		memset(&x->replay, 0, sizeof(x->replay));
+		memset(&x->replay_parked, 0, sizeof(x->replay_parked));
+		x->recorder = NULL;
+		x->record_busy = 0;
 		x->timestamp = 0;
+		x->rgb_timestamp = 0;
+		x->depth_timestamp = 0;
+		memset(x->depth_stamps, 0, sizeof(x->depth_stamps));
+		memset(x->rgb_stamps, 0, sizeof(x->rgb_stamps));
+		x->pair = 0;
+		x->pairing = 0;
+		x->pair_tolerance = 16.f;
+		x->depth_enable = 1;
+		x->video_enable = 1;
+		x->skew = 0.f;
+		memset(&x->pairer, 0, sizeof(x->pairer));
+		memset(x->depth_arrivals, 0, sizeof(x->depth_arrivals));
+		memset(x->rgb_arrivals, 0, sizeof(x->rgb_arrivals));
+		freenect_stats_clear(&x->depth_stats);
+		freenect_stats_clear(&x->rgb_stats);
 		x->unique = 0;
 		x->aligndepth = 0;
+		x->alpha = 1;
+		x->zerocopy = 0;
+		x->rgb_referenced = 0;
 		x->mode = 3;
 		x->has_frames = 0;
 		x->ndevices = 0;
-		x->lut.f_ptr = NULL;
-		x->lut_type = NULL;
+		x->lut = NULL;
+		x->calibration = NULL;
 		x->tilt = 0;
-		x->state = NULL;
+		x->motor_interval = 100;
+		x->motor_next = NULL;
+		x->motor_polled = 0;
+		x->tilt_pending = 0;
+		x->streams_pending = 0;
+		x->streams_started = 0;
+		x->motor_state_mutex = NULL;
+		systhread_mutex_new(&x->motor_state_mutex, 0);
+		x->motor_tilt = 0;
+		memset(x->motor_accel, 0, sizeof(x->motor_accel));
+		x->motor_time = 0;
+		x->motor_age = -1;
 		x->clear_depth = 0;
 		x->type = NULL;
 		x->threshold = 2.f;
-		x->rgb = NULL;
         
 		//x->x_systhread = NULL;
-		x->backbuffer_mutex = NULL;
 		x->x_sleeptime = 10;
-		systhread_mutex_new(&x->backbuffer_mutex, 0);
-		x->got_rgb=0;
-		x->got_depth=0;
-		x->depth_mid=NULL;
-		x->depth_front=NULL;
-		x->rgb_front=NULL;
-		x->rgb_back=NULL;
-		x->rgb_mid=NULL;
-		x->depth_back=NULL;
 		
+		x->async = 0;
+		x->depth_referenced = 0;
+		x->worker = NULL;
+		x->worker_cancel = FALSE;
+		x->output_mutex = NULL;
+		x->threads = 0;
+		freenect_sem_init(&x->frame_sem);
+		systhread_mutex_new(&x->output_mutex, 0);
+		memset(x->converted_depth, 0, sizeof(x->converted_depth));
+		memset(x->converted_rgb, 0, sizeof(x->converted_rgb));
+		freenect_tribuf_init(&x->converted_depth_frames, &x->converted_depth[0], &x->converted_depth[1], &x->converted_depth[2]);
+		freenect_tribuf_init(&x->converted_rgb_frames, &x->converted_rgb[0], &x->converted_rgb[1], &x->converted_rgb[2]);
+		x->worker_type = NULL;
+		x->worker_planecount = 4;
+		x->worker_lut = NULL;
+		x->cloud_planes = 3;
+		memset(&x->cloud, 0, sizeof(x->cloud));
+		memset(&x->worker_cloud, 0, sizeof(x->worker_cloud));
+		x->decimate = 1;
+		x->decimate_mode = FREENECT_DECIMATE_NEAREST;
+		x->roicount = 4;
+		memset(x->roi, 0, sizeof(x->roi));
+		x->resolution = FREENECT_RESOLUTION_MEDIUM;
+		x->depth_width = x->video_width = MEDIUM_WIDTH;
+		x->depth_height = x->video_height = MEDIUM_HEIGHT;
+		freenect_window_init(&x->worker_window, x->depth_width, x->depth_height, x->roi, x->decimate, x->decimate_mode);
+		x->worker_video_window = x->worker_window;
+		x->smooth = 0;
+		x->holefill = 0;
+		x->median = 0;
+		memset(&x->filter, 0, sizeof(x->filter));
+		x->filter_failed = 0;
+		memset(&x->background, 0, sizeof(x->background));
+		x->bg_learn = 0;
+		x->bg_clear = 0;
+		x->bg_tolerance = 10;
+		x->mask = 0;
+		jit_matrix_info_default(&info);
+		info.type = _jit_sym_char;
+		info.planecount = 1;
+		info.dimcount = 2;
+		info.dim[0] = info.dim[1] = 1;
+		x->mask_name = jit_symbol_unique();
+		x->mask_matrix = jit_object_register(jit_object_new(_jit_sym_jit_matrix, &info), x->mask_name);
+		x->mask_referenced = 0;
+		x->registration = 0;
+		memset(&x->registrar, 0, sizeof(x->registrar));
+		x->register_failed = 0;
+		memset(&x->kinect_registration, 0, sizeof(x->kinect_registration));
+		x->register_ns = 0;
+		x->register_frames = 0;
+		x->register_time = 0;
+		x->demosaic = FREENECT_BAYER_BILINEAR;
+		x->demosaiced = NULL;
+		x->demosaiced_bytes = 0;
+		x->yuv_planes = 4;
+		x->hugepages = (char)freenect_buffers_huge();
+		x->frames_parked = 0;
 		
-		x->depth_back = (uint16_t*)malloc(DEPTH_WIDTH*DEPTH_HEIGHT*DEPTH_BPP);
-		x->depth_mid = (uint16_t*)malloc(DEPTH_WIDTH*DEPTH_HEIGHT*DEPTH_BPP);
-		x->depth_front = (uint16_t*)malloc(DEPTH_WIDTH*DEPTH_HEIGHT*DEPTH_BPP);
-		x->rgb_back = (uint8_t*)malloc(RGB_WIDTH*RGB_HEIGHT*RGB_BPP);
-		x->rgb_mid = (uint8_t*)malloc(RGB_WIDTH*RGB_HEIGHT*RGB_BPP);
-		x->rgb_front = (uint8_t*)malloc(RGB_WIDTH*RGB_HEIGHT*RGB_BPP);
+		// Frame buffers are taken from the shared pool when a source opens, sized by its frame modes
+		for(i=0;i<3;i++){
+			x->raw_depth[i] = NULL;
+			x->raw_rgb[i] = NULL;
+		}
+		x->raw_depth_bytes = x->raw_rgb_bytes = 0;
+		freenect_tribuf_init(&x->depth_frames, x->raw_depth[0], x->raw_depth[1], x->raw_depth[2]);
+		freenect_tribuf_init(&x->rgb_frames, x->raw_rgb[0], x->raw_rgb[1], x->raw_rgb[2]);
 		
 		x->is_open=FALSE;
 		x->id=++global_id;
@@ -574,22 +960,33 @@ void jit_freenect_grab_free(t_jit_freenect_grab *x)
 	jit_freenect_grab_close(x, NULL, 0, NULL);
 	
 	jit_freenect_thread_stop(x);
+	// close leaves it running when it finds nothing to close, it waits on frame_sem
+	jit_freenect_worker_stop(x);
+	freenect_replay_close(&x->replay);
+	freenect_replay_close(&x->replay_parked);
+	// The outputs are gone, whatever close parked can go back
+	if(x->mask_matrix){
+		jit_object_free(x->mask_matrix);
+	}
+	return_frames(x);
 
 	// free out mutex
-	if (x->backbuffer_mutex)
-		systhread_mutex_free(x->backbuffer_mutex);
-
-	if (x->depth_mid) free(x->depth_mid);
-	if (x->depth_front) free(x->depth_front);
-	if (x->rgb_back) free(x->rgb_back);
-	if (x->rgb_mid) free(x->rgb_mid);
-	if (x->rgb_front) free(x->rgb_front);
-			
-	if(x->lut.f_ptr){
-		free(x->lut.f_ptr);
+	if (x->output_mutex)
+		systhread_mutex_free(x->output_mutex);
+	if (x->motor_state_mutex)
+		systhread_mutex_free(x->motor_state_mutex);
+	freenect_sem_destroy(&x->frame_sem);
+	
+	freenect_lut_release(x->worker_lut);
+	freenect_lut_release(x->lut);
+	if(x->calibration){
+		free(x->calibration);
 	}
-	
-	//release_cloud(&x->cloud);
+	freenect_cloud_free(&x->cloud);
+	freenect_cloud_free(&x->worker_cloud);
+	freenect_filter_free(&x->filter);
+	freenect_background_free(&x->background);
+	freenect_register_free(&x->registrar);
 }
 
 t_jit_err jit_freenect_grab_get_ndevices(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av){
@@ -627,6 +1024,12 @@ void jit_freenect_grab_set_format(t_jit_freenect_grab *x,  void *attr, long argc
 			else if((argv->a_w.w_sym == s_ir)||((argv->a_w.w_sym == s_IR))){
 				jit_atom_setsym(&a, s_ir);
 			}
+			else if((argv->a_w.w_sym == s_bayer)||((argv->a_w.w_sym == s_BAYER))){
+				jit_atom_setsym(&a, s_bayer);
+			}
+			else if((argv->a_w.w_sym == s_yuv)||((argv->a_w.w_sym == s_YUV))){
+				jit_atom_setsym(&a, s_yuv);
+			}
 			else{
 				error("Invalid output format: %s", argv->a_w.w_sym->s_name);
 				return;
@@ -637,15 +1040,21 @@ void jit_freenect_grab_set_format(t_jit_freenect_grab *x,  void *attr, long argc
 			if(v <= 0){
 				jit_atom_setsym(&a, s_rgb);
 			}
-			else{
+			else if(v == 1){
 				jit_atom_setsym(&a, s_ir);
 			}
+			else if(v == 2){
+				jit_atom_setsym(&a, s_bayer);
+			}
+			else{
+				jit_atom_setsym(&a, s_yuv);
+			}
 		}
 		if(argv->a_w.w_sym == x->format.a_w.w_sym)return;
 		
 		x->format = a;
 		
-		if(x->device){
+		if(x->source){
 			/*
 			if(x->format.a_w.w_sym == s_ir){
 				freenect_set_video_format(x->device, FREENECT_VIDEO_IR_8BIT);
@@ -681,12 +1090,12 @@ t_jit_err jit_freenect_grab_get_accel(t_jit_freenect_grab *x, void *attr, long *
 		}
 	}
 
-	if(x->device){
-		freenect_update_tilt_state(x->device);
-		x->state = freenect_get_tilt_state(x->device);
-		if (x->state)
-			freenect_get_mks_accel(x->state, &ax, &ay, &az);
-	}
+	// Cached by the capture thread, see motor_refresh()
+	systhread_mutex_lock(x->motor_state_mutex);
+	ax = x->motor_accel[0];
+	ay = x->motor_accel[1];
+	az = x->motor_accel[2];
+	systhread_mutex_unlock(x->motor_state_mutex);
 	
 	jit_atom_setfloat(*av, ax);
 	jit_atom_setfloat(*av +1, ay);
@@ -709,16 +1118,35 @@ t_jit_err jit_freenect_grab_get_tilt(t_jit_freenect_grab *x, void *attr, long *a
 		}
 	}
 	
-	if(x->device){
-		freenect_update_tilt_state(x->device);
-		x->state = freenect_get_tilt_state(x->device);
-		if (x->state)
-			tilt = freenect_get_tilt_degs(x->state);
+	systhread_mutex_lock(x->motor_state_mutex);
+	tilt = x->motor_tilt;
+	systhread_mutex_unlock(x->motor_state_mutex);
+	
+	jit_atom_setfloat(*av, tilt);
+	
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_motor_age(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av){
+	uint64_t time;
+	
+	if ((*ac)&&(*av)) {
 		
+	} else {
+		*ac = 1;
+		if (!(*av = jit_getbytes(sizeof(t_atom)*(*ac)))) {
+			*ac = 0;
+			return JIT_ERR_OUT_OF_MEM;
+		}
 	}
 	
-	jit_atom_setfloat(*av, tilt);
+	systhread_mutex_lock(x->motor_state_mutex);
+	time = x->motor_time;
+	systhread_mutex_unlock(x->motor_state_mutex);
 	
+	x->motor_age = time ? (freenect_now_ns() - time) * 1e-6 : -1;
+	jit_atom_setfloat(*av, x->motor_age);
 	
 	return JIT_ERR_NONE;
 }
@@ -731,37 +1159,91 @@ t_jit_err jit_freenect_grab_set_mode(t_jit_freenect_grab *x, void *attr, long ac
 	if(x->mode != jit_atom_getlong(av)){
 		long mode = jit_atom_getlong(av);
 		
-		// TODO: add FREENECT_DEPTH_REGISTERED
-		CLIP_ASSIGN(mode, 0, 3);  // <-- See explanation in build_geometry implementation as to why I'm blocking point cloud output for now - jmp 2011-01-11
-		/*
-		if(mode == 4){
-			if(!x->cloud.points){
-				allocate_cloud(&x->cloud);
-			}
-			if(!x->rgb){
-				x->rgb = malloc(DEPTH_WIDTH*DEPTH_HEIGHT*3*sizeof(float));
-				if(!x->rgb){
-					return JIT_ERR_OUT_OF_MEM;
-				}
-			}
-		}
-		else{
-			release_cloud(&x->cloud);
-			if(x->rgb){
-				free(x->rgb);
-				x->rgb = NULL;
-			}
-		}
-		*/
-		
-		calculate_lut(&x->lut, x->lut_type, mode);
+		// 4 is the point cloud, see jit.freenect.cloud.h
+		CLIP_ASSIGN(mode, 0, 4);
 		
+		// matrix_calc and the worker pick up the matching table
 		x->mode = mode;
 	}
 	
     return JIT_ERR_NONE;
 }
 
+t_jit_err jit_freenect_grab_set_cloud_planes(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long planes;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	planes = jit_atom_getlong(av);
+	x->cloud_planes = (planes >= 8) ? 8 : ((planes >= 5) ? 5 : 3);
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_decimate(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long factor;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	factor = jit_atom_getlong(av);
+	x->decimate = (factor >= 8) ? 8 : ((factor >= 4) ? 4 : ((factor >= 2) ? 2 : 1));
+	return JIT_ERR_NONE;
+}
+
+// Missing values are 0, so "roi 100 100" crops to the bottom right of 100 100
+t_jit_err jit_freenect_grab_set_roi(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long i;
+	
+	for(i=0;i<4;i++){
+		x->roi[i] = (i < ac) ? MAX(jit_atom_getlong(av + i), 0) : 0;
+	}
+	x->roicount = 4;
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_median(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	long size;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	size = jit_atom_getlong(av);
+	x->median = (size >= 2) ? 3 : 0;
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_yuvplanes(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av){
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	x->yuv_planes = (jit_atom_getlong(av) >= 3) ? 4 : 2;
+	return JIT_ERR_NONE;
+}
+
+// Ray tables for the open source's depth: registered depth is in millimetres and
+// seen through the video camera, raw disparity through the IR camera (or the video
+// one once registered in software) and turned into metres by the mode 4 float32
+// table. Decimated pixels see through the top left pixel of their block.
+static int update_cloud(t_jit_freenect_grab *x, t_freenect_cloud *cloud, const t_freenect_lut *metres, const t_freenect_window *window){
+	int registered = (x->depth_format == FREENECT_DEPTH_REGISTERED);
+	t_freenect_intrinsics k = (registered || (register_mode(x) == 1)) ? freenect_video_intrinsics : freenect_depth_intrinsics;
+	
+	k.fx /= (float)window->factor;
+	k.fy /= (float)window->factor;
+	k.cx = (k.cx - (float)window->x) / (float)window->factor;
+	k.cy = (k.cy - (float)window->y) / (float)window->factor;
+	if(freenect_cloud_init(cloud, window->width, window->height, &k, registered ? NULL : (const float *)metres->table)){
+		error("Out of memory, cannot allocate the point cloud tables.");
+		return 0;
+	}
+	return 1;
+}
+
 void jit_freenect_grab_set_tilt(t_jit_freenect_grab *x,  void *attr, long argc, t_atom *argv)
 {
 	if(argv){
@@ -769,10 +1251,77 @@ void jit_freenect_grab_set_tilt(t_jit_freenect_grab *x,  void *attr, long argc,
 		
 		CLIP_ASSIGN(x->tilt, -30, 30);
 		
+		// Queued for the capture thread, only the latest angle matters
 		if(x->device){
-			freenect_set_tilt_degs(x->device,x->tilt);
+			__atomic_store_n(&x->tilt_pending, TILT_PENDING | (x->tilt & 0xFF), __ATOMIC_RELEASE);
+		}
+	}
+}
+
+// Takes the raw buffers for the frame sizes of the source being opened from the pool.
+// A stream's buffers are kept while its size stays the same, which includes buffers
+// parked by the last close. Returns 0 when out of memory.
+static int reserve_raw_frames(t_jit_freenect_grab *x)
+{
+	long depth_bytes = x->depth_width * x->depth_height * sizeof(uint16_t);
+	long rgb_bytes = video_frame_bytes(x);
+	int i, ok = 1;
+	
+	for(i=0;i<3;i++){
+		if(depth_bytes != x->raw_depth_bytes){
+			freenect_buffer_put(x->raw_depth[i]);
+			x->raw_depth[i] = freenect_buffer_get(depth_bytes);
+			ok = ok && x->raw_depth[i];
 		}
+		if(rgb_bytes != x->raw_rgb_bytes){
+			freenect_buffer_put(x->raw_rgb[i]);
+			x->raw_rgb[i] = freenect_buffer_get(rgb_bytes);
+			ok = ok && x->raw_rgb[i];
+		}
+	}
+	x->frames_parked = 0;
+	// Failed sizes are retried on the next open
+	x->raw_depth_bytes = ok ? depth_bytes : 0;
+	x->raw_rgb_bytes = ok ? rgb_bytes : 0;
+	freenect_tribuf_init(&x->depth_frames, x->raw_depth[0], x->raw_depth[1], x->raw_depth[2]);
+	freenect_tribuf_init(&x->rgb_frames, x->raw_rgb[0], x->raw_rgb[1], x->raw_rgb[2]);
+	return ok;
+}
+
+// Gives every frame buffer back to the pool, so that a closed object holds none. Nothing
+// may be filling, converting or referencing them.
+static void return_frames(t_jit_freenect_grab *x)
+{
+	int i;
+	
+	for(i=0;i<3;i++){
+		freenect_buffer_put(x->raw_depth[i]);
+		freenect_buffer_put(x->raw_rgb[i]);
+		freenect_buffer_put(x->converted_depth[i].data);
+		freenect_buffer_put(x->converted_rgb[i].data);
+		x->raw_depth[i] = x->raw_rgb[i] = NULL;
+		x->converted_depth[i].data = x->converted_rgb[i].data = NULL;
+		x->converted_depth[i].size = x->converted_rgb[i].size = 0;
+	}
+	x->raw_depth_bytes = x->raw_rgb_bytes = 0;
+	freenect_tribuf_init(&x->depth_frames, NULL, NULL, NULL);
+	freenect_tribuf_init(&x->rgb_frames, NULL, NULL, NULL);
+	freenect_pairer_free(&x->pairer);
+	freenect_buffer_put(x->demosaiced);
+	x->demosaiced = NULL;
+	x->demosaiced_bytes = 0;
+	x->frames_parked = 0;
+}
+
+// Once the source and the worker have stopped. An output still referencing a frame keeps
+// them all until matrix_calc has let go of it.
+static void close_frames(t_jit_freenect_grab *x)
+{
+	if(x->depth_referenced || x->rgb_referenced || x->mask_referenced){
+		x->frames_parked = 1;
+		return;
 	}
+	return_frames(x);
 }
 
 void jit_freenect_grab_open(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_atom *argv)
@@ -780,14 +1329,24 @@ void jit_freenect_grab_open(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_a
 	int ndevices, devices_left, dev_ndx;
 	t_jit_freenect_grab *y;
 	freenect_device *dev;
+	freenect_frame_mode depth_mode, video_mode;
 	
 	postNesa("opening device...\n");//TODO: remove
 	
-	if(x->device){
+	if(x->source){
 		error("A device is already open.");
 		return;
 	}
 	x->is_open = FALSE;
+	
+	if(argc && (jit_atom_getsym(argv) == s_sim)){
+		jit_freenect_grab_open_sim(x, argc-1, argv+1);
+		return;
+	}
+	if(argc && (argv->a_type == A_SYM)){
+		jit_freenect_grab_open_replay(x, argc, argv);
+		return;
+	}
 	if(!f_ctx){
 		
 		postNesa("!f_ctx is null, opening a new device\n");//TODO: remove
@@ -880,21 +1439,28 @@ void jit_freenect_grab_open(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_a
 		error("Could not open Kinect device %d", dev_ndx);
 		x->index = 0;
 		x->device = NULL;
+		return;
 	}
 		else {
 			postNesa("device open");//TODO: remove
 		}
 
-	//freenect_set_depth_buffer(x->device, x->depth_back);
-	//freenect_set_video_buffer(x->device, x->rgb_back);
-	
-	freenect_set_depth_callback(x->device, depth_callback);
-	freenect_set_video_callback(x->device, rgb_callback);
 	if(x->format.a_w.w_sym == s_ir){
-		freenect_set_video_mode(x->device, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_IR_8BIT));
+		x->video_format = FREENECT_VIDEO_IR_8BIT;
+	}
+	else if(x->format.a_w.w_sym == s_bayer){
+		x->video_format = FREENECT_VIDEO_BAYER;
+	}
+	else if(x->format.a_w.w_sym == s_yuv){
+		x->video_format = FREENECT_VIDEO_YUV_RAW;
 	}
 	else{
-		freenect_set_video_mode(x->device, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB));
+		x->video_format = FREENECT_VIDEO_RGB;
+	}
+	video_mode = freenect_find_video_mode((freenect_resolution)x->resolution, x->video_format);
+	if(!video_mode.is_valid){
+		error("The Kinect has no %s video at this resolution, opening it at 640x480.", x->format.a_w.w_sym->s_name);
+		video_mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, x->video_format);
 	}
 	
 	//TODO: add FREENECT_DEPTH_REGISTERED mode
@@ -903,12 +1469,40 @@ void jit_freenect_grab_open(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_a
 	if (x->aligndepth==1)
 	{
 	postNesa("Depth is aligned to color");
-		freenect_set_depth_mode(x->device, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_REGISTERED));
+		x->depth_format = FREENECT_DEPTH_REGISTERED;
 	}
 	else 
 	{
-		freenect_set_depth_mode(x->device, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
+		x->depth_format = FREENECT_DEPTH_11BIT;
+	}
+	depth_mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, x->depth_format);
+	
+	// Buffers, outputs and copies all follow the modes' frame sizes
+	x->depth_width = depth_mode.width;
+	x->depth_height = depth_mode.height;
+	x->video_width = video_mode.width;
+	x->video_height = video_mode.height;
+	if(!reserve_raw_frames(x)){
+		error("Out of memory, cannot open Kinect device %d", dev_ndx);
+		freenect_close_device(x->device);
+		x->index = 0;
+		x->device = NULL;
+		return;
 	}
+	
+	// libfreenect reads the registration from the device when it opens it
+	x->kinect_registration = freenect_copy_registration(x->device);
+	
+	// libfreenect fills our back buffers, the callbacks then rotate them
+	stats_begin(x);
+	pairing_begin(x);
+	freenect_set_depth_buffer(x->device, freenect_tribuf_back(&x->depth_frames));
+	freenect_set_video_buffer(x->device, freenect_tribuf_back(&x->rgb_frames));
+	
+	freenect_set_depth_callback(x->device, depth_callback);
+	freenect_set_video_callback(x->device, rgb_callback);
+	freenect_set_video_mode(x->device, video_mode);
+	freenect_set_depth_mode(x->device, depth_mode);
 		//freenect_set_video_buffer(x->device, rgb_back);
 	
 	//Store a pointer to this object in the freenect device struct (for use in callbacks)
@@ -918,19 +1512,199 @@ void jit_freenect_grab_open(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_a
 	
 	//freenect_set_tilt_degs(x->device,x->tilt);
 	
-	freenect_start_depth(x->device);
-	freenect_start_video(x->device);
+	if(x->depth_enable){
+		freenect_start_depth(x->device);
+	}
+	if(x->video_enable){
+		freenect_start_video(x->device);
+	}
+	x->streams_started = enabled_streams(x);
 	
-	x->is_open = TRUE;
+	if(x->async){
+		jit_freenect_worker_start(x);
+	}
+	
+	x->source = SOURCE_KINECT;
+	x->is_open = TRUE;
+	motor_register(x);
 	open_device_count++;
 	freenect_active=TRUE;
 }
 
+// Max path to a POSIX path for the C library, returns 0 if s is not a usable name
+static int native_path(t_symbol *s, char *out)
+{
+	if(!s || (s == _jit_sym_nothing) || !s->s_name[0]){
+		return 0;
+	}
+	if(path_nameconform(s->s_name, out, PATH_STYLE_NATIVE, PATH_TYPE_BOOT)){
+		strncpy(out, s->s_name, MAX_PATH_CHARS - 1);
+		out[MAX_PATH_CHARS - 1] = 0;
+	}
+	return 1;
+}
+
+// open <file> [speed]: plays a recording back, speed 1 at the recorded pace, 0 as fast as possible
+void jit_freenect_grab_open_replay(t_jit_freenect_grab *x, long argc, t_atom *argv)
+{
+	char path[MAX_PATH_CHARS];
+	double speed = 1.;
+	t_freenect_rec_header *header;
+	
+	if(!native_path(jit_atom_getsym(argv), path)){
+		return;
+	}
+	if(argc > 1){
+		speed = jit_atom_getfloat(argv+1);
+	}
+	
+	// An output may still reference a frame in the last recording's mapping: it is parked
+	// until matrix_calc has let go of it. One already parked has not been let go of yet,
+	// so nothing can have gone out of the last recording since.
+	if(!x->replay_parked.map && (x->depth_referenced || x->rgb_referenced || x->mask_referenced)){
+		x->replay_parked = x->replay;
+		memset(&x->replay, 0, sizeof(x->replay));
+	}
+	freenect_replay_close(&x->replay);
+	if(freenect_replay_open(&x->replay, path)){
+		error("Could not open recording %s", path);
+		return;
+	}
+	header = &x->replay.header;
+	if(!header->depth_width || !header->depth_height || !header->video_width || !header->video_height){
+		error("Recording %s has an unsupported frame size.", path);
+		freenect_replay_close(&x->replay);
+		return;
+	}
+	if((header->video_format == FREENECT_VIDEO_IR_8BIT) || (header->video_format == FREENECT_VIDEO_BAYER) ||
+	   (header->video_format == FREENECT_VIDEO_YUV_RAW)){
+		x->video_format = header->video_format;
+	}
+	else{
+		x->video_format = FREENECT_VIDEO_RGB;
+	}
+	if(header->video_bpp != raw_video_bpp(x)){
+		error("Recording %s has an unsupported video format.", path);
+		freenect_replay_close(&x->replay);
+		return;
+	}
+	x->depth_format = (header->depth_format == FREENECT_DEPTH_REGISTERED) ? FREENECT_DEPTH_REGISTERED : FREENECT_DEPTH_11BIT;
+	x->depth_width = header->depth_width;
+	x->depth_height = header->depth_height;
+	x->video_width = header->video_width;
+	x->video_height = header->video_height;
+	// Depth is decoded into the raw buffers, raw frames are played from the mapping
+	if(!reserve_raw_frames(x)){
+		error("Out of memory, cannot play %s", path);
+		freenect_replay_close(&x->replay);
+		return;
+	}
+	
+	stats_begin(x);
+	pairing_begin(x);
+	if(x->async){
+		jit_freenect_worker_start(x);
+	}
+	
+	x->source = SOURCE_REPLAY;
+	x->is_open = TRUE;
+	if(freenect_replay_start(&x->replay, speed, x, replay_depth_callback, replay_rgb_callback)){
+		error("Failed to create replay thread.");
+		jit_freenect_grab_close(x, NULL, 0, NULL);
+	}
+}
+
+// open sim [fps] [depth file] [video file]: frames from jit.freenect.sim instead of a Kinect
+void jit_freenect_grab_open_sim(t_jit_freenect_grab *x, long argc, t_atom *argv)
+{
+	double fps = FREENECT_SIM_DEFAULT_FPS;
+	char depth_file[MAX_PATH_CHARS], video_file[MAX_PATH_CHARS];
+	const char *depth_path = NULL, *video_path = NULL;
+	
+	if(argc > 0){
+		fps = jit_atom_getfloat(argv);
+	}
+	if((argc > 1) && native_path(jit_atom_getsym(argv+1), depth_file)){
+		depth_path = depth_file;
+	}
+	if((argc > 2) && native_path(jit_atom_getsym(argv+2), video_file)){
+		video_path = video_file;
+	}
+	
+	if(x->format.a_w.w_sym == s_ir){
+		x->video_format = FREENECT_VIDEO_IR_8BIT;
+	}
+	else if(x->format.a_w.w_sym == s_bayer){
+		x->video_format = FREENECT_VIDEO_BAYER;
+	}
+	else if(x->format.a_w.w_sym == s_yuv){
+		x->video_format = FREENECT_VIDEO_YUV_RAW;
+	}
+	else{
+		x->video_format = FREENECT_VIDEO_RGB;
+	}
+	
+	x->depth_format = FREENECT_DEPTH_11BIT;
+	x->depth_width = x->video_width = MEDIUM_WIDTH;
+	x->depth_height = x->video_height = MEDIUM_HEIGHT;
+	if(!reserve_raw_frames(x)){
+		error("Out of memory, cannot open the simulator.");
+		return;
+	}
+	freenect_sim_init(&x->sim, x->depth_width, x->depth_height, raw_video_bpp(x));
+	freenect_sim_enable(&x->sim, x->depth_enable, x->video_enable);
+	if(freenect_sim_load(&x->sim, depth_path, video_path)){
+		error("Could not load simulated frames from %s", depth_path ? depth_path : video_path);
+		freenect_sim_free(&x->sim);
+		return;
+	}
+	stats_begin(x);
+	pairing_begin(x);
+	freenect_sim_set_buffers(&x->sim, freenect_tribuf_back(&x->depth_frames), freenect_tribuf_back(&x->rgb_frames));
+	
+	if(x->async){
+		jit_freenect_worker_start(x);
+	}
+	
+	x->source = SOURCE_SIM;
+	x->is_open = TRUE;
+	if(freenect_sim_start(&x->sim, fps, x, sim_depth_callback, sim_rgb_callback)){
+		error("Failed to create simulation thread.");
+		jit_freenect_grab_close(x, NULL, 0, NULL);
+	}
+}
+
 void jit_freenect_grab_close(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_atom *argv)
 {
 	
 	postNesa("closing device: start...");//TODO:r
 	
+	jit_freenect_grab_record_stop(x);
+	
+	if(x->source == SOURCE_SIM){
+		// Stop producing before the worker goes away
+		freenect_sim_free(&x->sim);
+		jit_freenect_worker_stop(x);
+		pairing_end(x);
+		close_frames(x);
+		x->source = SOURCE_NONE;
+		x->is_open = FALSE;
+		return;
+	}
+	
+	if(x->source == SOURCE_REPLAY){
+		// The mapping is kept until the next replay or free, an output may still reference a frame
+		freenect_replay_stop(&x->replay);
+		jit_freenect_worker_stop(x);
+		pairing_end(x);
+		freenect_tribuf_init(&x->depth_frames, x->raw_depth[0], x->raw_depth[1], x->raw_depth[2]);
+		freenect_tribuf_init(&x->rgb_frames, x->raw_rgb[0], x->raw_rgb[1], x->raw_rgb[2]);
+		close_frames(x);
+		x->source = SOURCE_NONE;
+		x->is_open = FALSE;
+		return;
+	}
+	
 	if(f_ctx)
 	{
 		postNesa("closing device:f_ctx is valid.");//TODO:r
@@ -947,11 +1721,21 @@ void jit_freenect_grab_close(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_
 			return;
 		}
 		else {
+			jit_freenect_worker_stop(x);
+			motor_unregister(x);
 			//freenect_stop_depth(x->device);
 			//freenect_stop_video(x->device);
 			freenect_set_led(x->device,LED_BLINK_GREEN);
 			freenect_close_device(x->device);
+			pairing_end(x);
+			close_frames(x);
+			// The tables built from the registration go with it
+			freenect_register_free(&x->registrar);
+			freenect_destroy_registration(&x->kinect_registration);
+			memset(&x->kinect_registration, 0, sizeof(x->kinect_registration));
 			x->device = NULL;
+			x->source = SOURCE_NONE;
+			x->is_open = FALSE;
 			open_device_count--;
 		}
 
@@ -966,50 +1750,89 @@ void jit_freenect_grab_close(t_jit_freenect_grab *x,  t_symbol *s, long argc, t_
 postNesa("closing device:done\n");//TODO:r	
 }
 
+// Points matrix at a buffer we own instead of copying into its own data
+static void reference_matrix_data(void *matrix, t_jit_matrix_info *info, void *data, long cellbytes, long rowbytes)
+{
+	info->flags = JIT_MATRIX_DATA_REFERENCE | JIT_MATRIX_DATA_FLAGS_USE;
+	info->dimstride[0] = cellbytes;
+	info->dimstride[1] = rowbytes;
+	jit_object_method(matrix,_jit_sym_setinfo_ex,info);
+	jit_object_method(matrix,_jit_sym_data,data);
+}
+
+// Gives a referencing matrix its own data back
+static void release_matrix_data(void *matrix, t_jit_matrix_info *info)
+{
+	info->flags = 0;
+	jit_object_method(matrix,_jit_sym_setinfo_ex,info);
+	jit_object_method(matrix,_jit_sym_getinfo,info);
+}
+
 t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, void *outputs)
 {
 	t_jit_err err=JIT_ERR_NONE;
-	long depth_savelock=0,rgb_savelock=0;
-	t_jit_matrix_info depth_minfo,rgb_minfo;
-	void *depth_matrix,*rgb_matrix;
-	char *depth_bp, *rgb_bp;
-	
-	uint8_t *tmp8;
-	uint16_t *tmp16;
+	long depth_savelock=0,rgb_savelock=0,mask_savelock=0;
+	t_jit_matrix_info depth_minfo,rgb_minfo,mask_minfo;
+	void *depth_matrix,*rgb_matrix,*mask_matrix;
+	char *depth_bp = NULL, *rgb_bp = NULL, *mask_bp = NULL;
 	
 	int has_new_frame = 0;
 	int sync_to_depth = 0;
+	int new_rgb = 0;
+	int rgb_zerocopy = 0;
+	long rgb_planecount, rgb_width;
+	t_converted_frame *depth_frame, *rgb_frame;
+	t_freenect_pair *pair;
+	void *depth_src = NULL, *rgb_src = NULL;
+	uint32_t depth_stamp = 0, rgb_stamp = 0;
+	uint64_t depth_arrival = 0, rgb_arrival = 0;
+	t_freenect_window window, video_window;
 	
 	
 
 	
 	depth_matrix = jit_object_method(outputs,_jit_sym_getindex,0);
 	rgb_matrix = jit_object_method(outputs,_jit_sym_getindex,1); 
+	mask_matrix = x->mask_matrix;
 	
-	if (x && depth_matrix && rgb_matrix) {
+	if (x && depth_matrix && rgb_matrix && mask_matrix) {
 		
 		postNesaFlood("matrixcalc:isopem=%i",x->is_open);
-		if (x->is_open)
+		if (x->is_open && !x->worker && x->pairing)
 		{
-			systhread_mutex_lock(x->backbuffer_mutex);
-			
-			if (x->got_depth>0) {
-				tmp16 = x->depth_front;
-				x->depth_front = x->depth_mid;
-				x->depth_mid = tmp16;
-				x->got_depth = 0;
+			if (freenect_pairer_acquire(&x->pairer)) {
+				has_new_frame=1;
+				sync_to_depth=1;
+				new_rgb=1;
+			}
+			pair = freenect_pairer_front(&x->pairer);
+			depth_src = pair->depth.data;
+			rgb_src = pair->video.data;
+			depth_stamp = pair->depth.timestamp;
+			rgb_stamp = pair->video.timestamp;
+			depth_arrival = pair->depth.arrival;
+			rgb_arrival = pair->video.arrival;
+		}
+		else if (x->is_open && !x->worker)
+		{
+			if (x->depth_enable && freenect_tribuf_acquire(&x->depth_frames)) {
 				has_new_frame=1;
 				sync_to_depth=1;
 			}
 			
-			if (x->got_rgb>0) {
-				tmp8 = x->rgb_front;
-				x->rgb_front = x->rgb_mid;
-				x->rgb_mid = tmp8;
-				x->got_rgb = 0;
+			// RGB is only rotated when a frame goes out, so the front buffer stays put
+			// while an output matrix may still be referencing it (zerocopy). Without depth,
+			// video goes out on its own.
+			if ((sync_to_depth || !x->depth_enable) && freenect_tribuf_acquire(&x->rgb_frames)) {
 				has_new_frame=1;
+				new_rgb=1;
 			}
-			systhread_mutex_unlock(x->backbuffer_mutex);
+			depth_src = freenect_tribuf_front(&x->depth_frames);
+			rgb_src = freenect_tribuf_front(&x->rgb_frames);
+			depth_stamp = x->depth_stamps[x->depth_frames.front];
+			rgb_stamp = x->rgb_stamps[x->rgb_frames.front];
+			depth_arrival = x->depth_arrivals[x->depth_frames.front];
+			rgb_arrival = x->rgb_arrivals[x->rgb_frames.front];
 		}
 		else {
 			postNesaFlood("matrixcalc:device not open");
@@ -1017,13 +1840,39 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 		
 		depth_savelock = (long) jit_object_method(depth_matrix,_jit_sym_lock,1);
 		rgb_savelock = (long) jit_object_method(rgb_matrix,_jit_sym_lock,1);
+		mask_savelock = (long) jit_object_method(mask_matrix,_jit_sym_lock,1);
+		
+		// The frames of a closed object go back to the pool, and a parked recording is
+		// unmapped, once the outputs have their own data
+		if(x->frames_parked || x->replay_parked.map){
+			if(x->depth_referenced){
+				jit_object_method(depth_matrix,_jit_sym_getinfo,&depth_minfo);
+				release_matrix_data(depth_matrix, &depth_minfo);
+				x->depth_referenced = 0;
+			}
+			if(x->rgb_referenced){
+				jit_object_method(rgb_matrix,_jit_sym_getinfo,&rgb_minfo);
+				release_matrix_data(rgb_matrix, &rgb_minfo);
+				x->rgb_referenced = 0;
+			}
+			if(x->mask_referenced){
+				jit_object_method(mask_matrix,_jit_sym_getinfo,&mask_minfo);
+				release_matrix_data(mask_matrix, &mask_minfo);
+				x->mask_referenced = 0;
+			}
+			if(x->frames_parked){
+				return_frames(x);
+			}
+			freenect_replay_close(&x->replay_parked);
+		}
 		
-		if(!x->device){
+		if(!x->source){
 			goto out;
 		}
 		
 		jit_object_method(depth_matrix,_jit_sym_getinfo,&depth_minfo);
 		jit_object_method(rgb_matrix,_jit_sym_getinfo,&rgb_minfo);
+		jit_object_method(mask_matrix,_jit_sym_getinfo,&mask_minfo);
 		
 		if ((depth_minfo.type == _jit_sym_char) || (rgb_minfo.type != _jit_sym_char)) 
 		{
@@ -1031,19 +1880,45 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 			goto out;
 		}
 		
-		if(x->device->video_format == FREENECT_VIDEO_IR_8BIT){
-			if(rgb_minfo.planecount != 1){
-				rgb_minfo.planecount = 1;
-				jit_object_method(rgb_matrix, _jit_sym_setinfo, &rgb_minfo);
-				jit_object_method(rgb_matrix, _jit_sym_getinfo, &rgb_minfo);
-			}
+		if(x->video_format == FREENECT_VIDEO_IR_8BIT){
+			rgb_planecount = 1;
+		}
+		else if(x->video_format == FREENECT_VIDEO_YUV_RAW){
+			rgb_planecount = x->yuv_planes;
 		}
 		else{
-			if(rgb_minfo.planecount != 4){
-				rgb_minfo.planecount = 4;
-				jit_object_method(rgb_matrix, _jit_sym_setinfo, &rgb_minfo);
-				jit_object_method(rgb_matrix, _jit_sym_getinfo, &rgb_minfo);
-			}
+			rgb_planecount = x->alpha ? 4 : 3;
+		}
+		
+		// Both outputs cover the same part of the scene, each at the size of its frames
+		freenect_window_init(&window, x->depth_width, x->depth_height, x->roi, x->decimate, x->decimate_mode);
+		video_window_init(x, &video_window);
+		rgb_width = video_output_width(x, rgb_planecount, &video_window);
+		
+		// Raw depth is 16-bit, which Jitter has no type for, so only video can be referenced,
+		// and not once decimated, registered or demosaiced. Packed UYVY is referenced as it
+		// arrives when its cells line up with the window. The worker's converted frames are always referenced.
+		if(x->video_format == FREENECT_VIDEO_YUV_RAW){
+			rgb_zerocopy = (rgb_planecount == 4) && !(video_window.x & 1);
+		}
+		else{
+			rgb_zerocopy = (rgb_planecount != 4) && (register_mode(x) != 2) && (x->video_format != FREENECT_VIDEO_BAYER);
+		}
+		rgb_zerocopy = (x->zerocopy && rgb_zerocopy && (video_window.factor == 1)) || x->worker;
+		if(x->rgb_referenced && (!rgb_zerocopy || (rgb_minfo.planecount != rgb_planecount) ||
+								 (rgb_minfo.dim[0] != rgb_width) || (rgb_minfo.dim[1] != video_window.height))){
+			release_matrix_data(rgb_matrix, &rgb_minfo);
+			x->rgb_referenced = 0;
+		}
+		
+		if((rgb_minfo.planecount != rgb_planecount) || (rgb_minfo.dimcount != 2) ||
+		   (rgb_minfo.dim[0] != rgb_width) || (rgb_minfo.dim[1] != video_window.height)){
+			rgb_minfo.planecount = rgb_planecount;
+			rgb_minfo.dimcount = 2;
+			rgb_minfo.dim[0] = rgb_width;
+			rgb_minfo.dim[1] = video_window.height;
+			jit_object_method(rgb_matrix, _jit_sym_setinfo, &rgb_minfo);
+			jit_object_method(rgb_matrix, _jit_sym_getinfo, &rgb_minfo);
 		}
 		
 		/*
@@ -1062,8 +1937,26 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 			depth_minfo.planecount = 1;
 			depth_minfo.type = x->type;
 			depth_minfo.dimcount = 2;
-			depth_minfo.dim[0] = DEPTH_WIDTH;
-			depth_minfo.dim[1] = DEPTH_HEIGHT;
+			depth_minfo.dim[0] = window.width;
+			depth_minfo.dim[1] = window.height;
+			depth_minfo.flags = 0L;
+			jit_object_method(depth_matrix,_jit_sym_setinfo_ex,&depth_minfo);
+			jit_object_method(depth_matrix,_jit_sym_getinfo,&depth_minfo);
+		}
+		else if((x->mode == 4)&&((depth_minfo.planecount != x->cloud_planes)||(depth_minfo.type != _jit_sym_float32))){
+			depth_minfo.planecount = x->cloud_planes;
+			depth_minfo.type = _jit_sym_float32;
+			depth_minfo.dimcount = 2;
+			depth_minfo.dim[0] = window.width;
+			depth_minfo.dim[1] = window.height;
+			depth_minfo.flags = 0L;
+			jit_object_method(depth_matrix,_jit_sym_setinfo_ex,&depth_minfo);
+			jit_object_method(depth_matrix,_jit_sym_getinfo,&depth_minfo);
+		}
+		else if((depth_minfo.dimcount != 2) || (depth_minfo.dim[0] != window.width) || (depth_minfo.dim[1] != window.height)){
+			depth_minfo.dimcount = 2;
+			depth_minfo.dim[0] = window.width;
+			depth_minfo.dim[1] = window.height;
 			depth_minfo.flags = 0L;
 			jit_object_method(depth_matrix,_jit_sym_setinfo_ex,&depth_minfo);
 			jit_object_method(depth_matrix,_jit_sym_getinfo,&depth_minfo);
@@ -1073,15 +1966,97 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 			x->type = depth_minfo.type;
 		}
 		
+		if(x->depth_referenced && !x->worker){
+			release_matrix_data(depth_matrix, &depth_minfo);
+			x->depth_referenced = 0;
+		}
+		
+		// The foreground mask covers the depth window, a char per pixel
+		if(x->mask_referenced && (!x->worker || !x->mask)){
+			release_matrix_data(mask_matrix, &mask_minfo);
+			x->mask_referenced = 0;
+		}
+		if((mask_minfo.type != _jit_sym_char) || (mask_minfo.planecount != 1) || (mask_minfo.dimcount != 2) ||
+		   (mask_minfo.dim[0] != window.width) || (mask_minfo.dim[1] != window.height)){
+			mask_minfo.type = _jit_sym_char;
+			mask_minfo.planecount = 1;
+			mask_minfo.dimcount = 2;
+			mask_minfo.dim[0] = window.width;
+			mask_minfo.dim[1] = window.height;
+			mask_minfo.flags = 0L;
+			jit_object_method(mask_matrix,_jit_sym_setinfo_ex,&mask_minfo);
+			jit_object_method(mask_matrix,_jit_sym_getinfo,&mask_minfo);
+		}
+		
+		if (x->is_open && x->worker)
+		{
+			// All conversion happened on the worker thread, just hand over its latest frames
+			systhread_mutex_lock(x->output_mutex);
+			x->worker_type = depth_minfo.type;
+			x->worker_planecount = rgb_planecount;
+			x->worker_window = window;
+			x->worker_video_window = video_window;
+			systhread_mutex_unlock(x->output_mutex);
+			
+			if(x->depth_enable){
+				if(freenect_tribuf_acquire(&x->converted_depth_frames)){
+					sync_to_depth = 1;
+					new_rgb = freenect_tribuf_acquire(&x->converted_rgb_frames);
+				}
+			}
+			else{
+				new_rgb = freenect_tribuf_acquire(&x->converted_rgb_frames);
+			}
+			depth_frame = (t_converted_frame *)freenect_tribuf_front(&x->converted_depth_frames);
+			rgb_frame = (t_converted_frame *)freenect_tribuf_front(&x->converted_rgb_frames);
+			
+			// A frame converted before a type or size change is dropped, the next one will match
+			if(sync_to_depth && !((depth_frame->type == depth_minfo.type) && (depth_frame->planecount == depth_minfo.planecount) &&
+								  (depth_frame->width == window.width) && (depth_frame->height == window.height))){
+				sync_to_depth = new_rgb = 0;
+			}
+			if(sync_to_depth){
+				reference_matrix_data(depth_matrix, &depth_minfo, depth_frame->data, depth_frame->cellbytes, depth_frame->rowbytes);
+				x->depth_referenced = 1;
+				if(x->mask){
+					reference_matrix_data(mask_matrix, &mask_minfo, depth_frame->mask, 1, depth_frame->width);
+					x->mask_referenced = 1;
+				}
+			}
+			if((sync_to_depth || new_rgb) && rgb_frame->data && (rgb_frame->planecount == rgb_planecount) &&
+			   (rgb_frame->width == rgb_width) && (rgb_frame->height == video_window.height)){
+				reference_matrix_data(rgb_matrix, &rgb_minfo, rgb_frame->data, rgb_frame->cellbytes, rgb_frame->rowbytes);
+				x->rgb_referenced = 1;
+			}
+			else{
+				new_rgb = 0;
+			}
+			x->has_frames = sync_to_depth || new_rgb;
+			if(x->has_frames){
+				set_output_timestamps(x, depth_frame->timestamp, rgb_frame->timestamp);
+				output_stats(x, sync_to_depth, depth_frame->arrival, new_rgb, rgb_frame->arrival);
+			}
+			goto out;
+		}
+		
 		jit_object_method(depth_matrix,_jit_sym_getdata,&depth_bp);
 		if (!depth_bp) { err=JIT_ERR_INVALID_OUTPUT; goto out;}
 		
-		jit_object_method(rgb_matrix,_jit_sym_getdata,&rgb_bp);
-		if (!rgb_bp) { err=JIT_ERR_INVALID_OUTPUT; goto out;}
+		if(x->mask){
+			jit_object_method(mask_matrix,_jit_sym_getdata,&mask_bp);
+			if (!mask_bp) { err=JIT_ERR_INVALID_OUTPUT; goto out;}
+		}
+		
+		// Disabled video is not converted, its output keeps the last frame
+		if(!rgb_zerocopy && x->video_enable){
+			jit_object_method(rgb_matrix,_jit_sym_getdata,&rgb_bp);
+			if (!rgb_bp) { err=JIT_ERR_INVALID_OUTPUT; goto out;}
+		}
 		
-		if((depth_minfo.type != x->lut_type) || !x->lut.f_ptr){
-			calculate_lut(&x->lut, depth_minfo.type, x->mode);
-			x->lut_type = depth_minfo.type;
+		if(!update_lut(x, &x->lut, depth_minfo.type, x->mode) ||
+		   ((x->mode == 4) && !update_cloud(x, &x->cloud, x->lut, &window))){
+			err = JIT_ERR_OUT_OF_MEM;
+			goto out;
 		}
 		 
 		//Grab and copy matrices
@@ -1101,7 +2076,7 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 				//	build_geometry(x, depth_matrix, depth_bp, &depth_minfo);
 				//}
 				//else{
-					copy_depth_data(x->depth_data, depth_bp, &depth_minfo, &x->lut);
+					copy_depth_data(x->depth_data, depth_bp, &depth_minfo, x->lut);
 				//}
 				x->have_depth_frames = 0;
 				x->has_frames = 1;
@@ -1116,10 +2091,20 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 		
 		if (x->is_open)
 		{
-			x->has_frames=sync_to_depth;//has_new_frame;
-			if (sync_to_depth>0) {
-			copy_rgb_data(x->rgb_front, rgb_bp, &rgb_minfo);
-			copy_depth_data(x->depth_front, depth_bp, &depth_minfo, &x->lut);
+			x->has_frames=sync_to_depth || new_rgb;//has_new_frame;
+			if (x->has_frames) {
+			if(rgb_zerocopy){
+				// A region of interest is the frame seen through an offset and its row stride
+				reference_matrix_data(rgb_matrix, &rgb_minfo, (uint8_t *)rgb_src + (video_window.y * x->video_width + video_window.x) * raw_video_bpp(x),
+									  rgb_minfo.planecount, x->video_width * raw_video_bpp(x));
+				x->rgb_referenced = 1;
+			}
+			// rgb_bp stays NULL when referenced, so only depth is converted
+			// depth_src is the old front when only video is new
+			convert_frames(sync_to_depth ? (uint16_t *)depth_src : NULL, depth_bp, &depth_minfo, mask_bp, mask_minfo.dimstride[1], x->lut, (x->mode == 4) ? &x->cloud : NULL,
+						   x->video_enable ? (uint8_t *)rgb_src : NULL, rgb_bp, &rgb_minfo, &window, &video_window, x);
+			set_output_timestamps(x, depth_stamp, rgb_stamp);
+			output_stats(x, sync_to_depth, depth_arrival, new_rgb, rgb_arrival);
 			}
 		}
 		else {
@@ -1134,16 +2119,14 @@ t_jit_err jit_freenect_grab_matrix_calc(t_jit_freenect_grab *x, void *inputs, vo
 out:
 	jit_object_method(depth_matrix,gensym("lock"),depth_savelock);
 	jit_object_method(rgb_matrix,gensym("lock"),rgb_savelock);
+	jit_object_method(mask_matrix,gensym("lock"),mask_savelock);
 	//systhread_mutex_unlock(x->x_mutex);
 	return err;
 }
 
-void copy_depth_data(uint16_t *source, char *out_bp, t_jit_matrix_info *dest_info, t_lookup *lut)
+void copy_depth_data(uint16_t *source, long src_width, long src_height, char *out_bp, t_jit_matrix_info *dest_info,
+					 const t_freenect_lut *lut, const t_freenect_window *window, uint16_t invalid)
 {
-	int i,j;
-	uint16_t *in;
-	
-	
 	if(!source){
 		return;	
 	}
@@ -1153,287 +2136,1518 @@ void copy_depth_data(uint16_t *source, char *out_bp, t_jit_matrix_info *dest_inf
 		return;
 	}
 	
-	in = source;
+	copy_depth_rows(source, src_width, src_height, out_bp, dest_info, lut, window, invalid, 0, window->height);
+}
+
+// Converts output rows [begin, end) of a src_width x src_height frame, safe to call concurrently on disjoint
+// ranges. Only the window's pixels are read, decimated ones are gathered into a row first.
+static void copy_depth_rows(uint16_t *source, long src_width, long src_height, char *out_bp, t_jit_matrix_info *dest_info,
+							const t_freenect_lut *lut, const t_freenect_window *window, uint16_t invalid, long begin, long end)
+{
+	uint16_t scratch[window->width];
+	const uint16_t *row;
+	long i;
 	
-	if(dest_info->type == _jit_sym_float32){
-		float *out;
-		for(i=0;i<DEPTH_HEIGHT;i++){
-			out = (float *)(out_bp + dest_info->dimstride[1] * i);
-			for(j=0;j<DEPTH_WIDTH;j++){
-				out[j] = *in*0.01f; //TODO: check lut generator
-				//out[j]=*in;
-				//out[j] = lut->f_ptr[*in];
-				in++;
-			}
-		}
+	if((dest_info->type != _jit_sym_float32) && (dest_info->type != _jit_sym_float64) && (dest_info->type != _jit_sym_long)){
+		return;
 	}
-	else if(dest_info->type == _jit_sym_float64){
-		double *out;
-		for(i=0;i<DEPTH_HEIGHT;i++){
-			out = (double *)(out_bp + dest_info->dimstride[1] * i);
-			for(j=0;j<DEPTH_WIDTH;j++){
-				out[j] = lut->d_ptr[*in];
-				in++;
-			}
-		}
+	if(freenect_window_is_full(window, src_width, src_height)){
+		freenect_convert_depth_rows(source, src_width, out_bp, dest_info->dimstride[1], depth_type(dest_info->type), lut->table, lut->max, begin, end);
+		return;
 	}
-	else if(dest_info->type == _jit_sym_long){
-		long *out;
-		for(i=0;i<DEPTH_HEIGHT;i++){
-			out = (long *)(out_bp + dest_info->dimstride[1] * i);
-			for(j=0;j<DEPTH_WIDTH;j++){
-				out[j] = lut->l_ptr[*in];
-				in++;
-			}
-		}
+	for(i=begin;i<end;i++){
+		row = freenect_decimate_depth_row(window, source, src_width, scratch, i, invalid);
+		freenect_convert_depth_rows(row, window->width, out_bp + dest_info->dimstride[1] * i, dest_info->dimstride[1],
+									depth_type(dest_info->type), lut->table, lut->max, 0, 1);
 	}
 }
 
-/*
- 
- Note: The code below works but frame rate in Max is devilishly slow. Shark reports significant load from
- jit_matrix_frommatrix_2d_float32. Frame rate on the OpenGL side is also sluggish, more than it should be.
- It would be better to have a separate external write directly to OpenGL instead of bothering with this
- point cloud matrix. This is why, for the moment I'm leaving the code, but leaving it unaccessible, as it's
- near useless as it is. jmp - 2011-01-10
-*/
-/*
-void build_geometry(t_jit_freenect_grab *x, void *matrix, char *out_bp, t_jit_matrix_info *dest_info){
-	int i,i2,j;
-	uint16_t *in, *in2;
-	float d=0, d2, pd=0, dd;
-	int valid = 0;
-	uint16_t *source = x->depth_data;
-	uint8_t *c, *rgb = x->rgb_data;
-	t_lookup *lut = &x->lut;
-	t_cloud *cloud = &x->cloud;
-	float threshold = x->threshold;
-	float *f, *f2, *frgb = x->rgb;
-	float4 vec;
-	
-	const float xscale = 1.f/DEPTH_WIDTH;
-	const float yscale = 1.f/DEPTH_HEIGHT;
-	const float colscale = 1.f / 255.f;
-	
+void copy_rgb_data(uint8_t *source, long src_width, long src_height, char *out_bp, t_jit_matrix_info *dest_info,
+				   const t_freenect_window *window)
+{
 	if(!source){
-		return;	
+		return;
 	}
 	
 	if(!out_bp || !dest_info){
-		error("Invalid pointer in copy_depth_data.");
+		error("Invalid pointer in copy_rgb_data.");
 		return;
 	}
 	
-	in = source;
-	in2 = source + DEPTH_WIDTH;
-	
-	cloud->count = 0;
-	
-	threshold *= threshold;
-	
-	c = rgb;
-	f = frgb;
-	
+	copy_rgb_rows(source, src_width, src_height, out_bp, dest_info, window, 0, window->height);
+}
+
+static void copy_rgb_rows(uint8_t *source, long src_width, long src_height, char *out_bp, t_jit_matrix_info *dest_info,
+						  const t_freenect_window *window, long begin, long end)
+{
+	uint8_t scratch[window->width * RGB_BPP];
+	const uint8_t *row;
+	long i, bpp = (dest_info->planecount == 1) ? 1 : RGB_BPP;
 	
-	for(i=0;i<DEPTH_HEIGHT;i++){
-		for(j=0;j<(DEPTH_WIDTH*3);j+=4){
-			vec[0] = (float)c[0];
-			vec[1] = (float)c[1];
-			vec[2] = (float)c[2];
-			vec[3] = (float)c[3];
-			mult_scalar_float4(vec, colscale, f);
-			c+=4;
-			f+=4;
-		}
+	if(freenect_window_is_full(window, src_width, src_height)){
+		freenect_convert_rgb_rows(source, src_width, out_bp, dest_info->dimstride[1], dest_info->planecount, begin, end);
+		return;
 	}
-	
-	f = frgb;
-	f2 = frgb + (3 * DEPTH_WIDTH);
-		
-	for(i=0,i2=1;i<(DEPTH_HEIGHT-1);i++,i2++){
-		
-		valid = 0;
-		
-		for(j=0;j<DEPTH_WIDTH;j++){
-			
-			if(*in != 0x7FF){
-				pd = d;
-				d = lut->f_ptr[*in];
-				if(valid){
-					dd = pd - d; dd*=dd;
-					if(dd < threshold){
-						push_cloud_point(cloud, xlut[j] * d, ylut[i] * d, d * -1.f, 
-										 (float)j*xscale, (float)i*yscale,
-										 0.f,0.f,-1.f,
-										 f[0],f[1],f[2],1.f);
-					}
-					else{
-						terminate_cloud_point(cloud);
-						start_cloud_point(cloud, xlut[j] * d, ylut[i] * d, d * -1.f, 
-										  (float)j*xscale, (float)i*yscale,
-										  0.f,0.f,-1.f,
-										  f[0],f[1],f[2],1.f);
-					}
-				}
-				else{
-					start_cloud_point(cloud, xlut[j] * d, ylut[i] * d, d * -1.f, 
-									  (float)j*xscale, (float)i*yscale,
-									  0.f,0.f,-1.f,
-									  f[0],f[1],f[2],1.f);
-					valid = 1;
-				}
-				if(*in2 != 0x7FF){
-					d2 = lut->f_ptr[*in2];
-					dd = d2 - d; dd*=dd;
-					if(dd < threshold){
-						push_cloud_point(cloud, xlut[j] * d2, ylut[i2] * d2, d2 * -1.f, 
-										 (float)j*xscale, (float)i*yscale,
-										 0.f,0.f,-1.f,
-										 f2[0],f2[1],f2[2],1.f);
-					}
-					else{
-						terminate_cloud_point(cloud);
-					}
-				}
-				else{
-					terminate_cloud_point(cloud);
-				}
-			}
-			else if(valid){
-				terminate_cloud_point(cloud);
-				valid = 0;
-			}
-			in++;
-			in2++;
-			f+=3;
-			f2+=3;
-		}
-		
-		if(cloud->count && valid)terminate_cloud_point(cloud);
+	for(i=begin;i<end;i++){
+		row = freenect_decimate_video_row(window, source, src_width, bpp, scratch, i);
+		freenect_convert_rgb_rows(row, window->width, out_bp + dest_info->dimstride[1] * i, dest_info->dimstride[1],
+								  dest_info->planecount, 0, 1);
 	}
-	 	
-	dest_info->type = _jit_sym_float32;
-	dest_info->planecount = 12;
-	dest_info->dimcount = 1;
-	dest_info->dim[0] = cloud->count;
-	dest_info->dimstride[0] = sizeof(t_point3D);
-	dest_info->flags = JIT_MATRIX_DATA_REFERENCE | JIT_MATRIX_DATA_FLAGS_USE;
-	jit_object_method(matrix,_jit_sym_setinfo_ex,dest_info);
-	jit_object_method(matrix,_jit_sym_data,cloud->points);
-	
 }
-*/
 
-void copy_rgb_data(uint8_t *source, char *out_bp, t_jit_matrix_info *dest_info)
+// UYVY rows of the window, packed or as luma and chroma depending on the output's planes
+static void copy_yuv_rows(uint8_t *source, long src_width, char *out_bp, t_jit_matrix_info *dest_info,
+						  const t_freenect_window *window, long begin, long end)
 {
-	int i,j;
-	
-	char *out;
-	uint8_t *in;
+	long i;
 	
-	if(!source){
-		return;
+	for(i=begin;i<end;i++){
+		freenect_yuv_row(window, source, src_width, dest_info->planecount, i, (uint8_t *)out_bp + dest_info->dimstride[1] * i);
 	}
+}
+
+// Cloud rows of the window, coloured from the same pixels of the video, whose rows are as wide
+static void cloud_rows(t_freenect_cloud *cloud, uint16_t *source, long src_width, long src_height, uint8_t *video, long video_bpp,
+					   char *out_bp, t_jit_matrix_info *dest_info, const t_freenect_window *window, uint16_t invalid, long begin, long end)
+{
+	uint16_t scratch[window->width];
+	uint8_t video_scratch[window->width * RGB_BPP];
+	const uint16_t *row;
+	const uint8_t *video_row;
+	long i;
 	
-	if(!out_bp || !dest_info){
-		error("Invalid pointer in copy_depth_data.");
+	if(freenect_window_is_full(window, src_width, src_height)){
+		freenect_cloud_rows(cloud, source, video, video_bpp, out_bp, dest_info->dimstride[1], dest_info->planecount, begin, end);
 		return;
 	}
+	for(i=begin;i<end;i++){
+		row = freenect_decimate_depth_row(window, source, src_width, scratch, i, invalid);
+		video_row = video ? freenect_decimate_video_row(window, video, src_width, video_bpp, video_scratch, i) : NULL;
+		freenect_cloud_row(cloud, row, video_row, video_bpp, (float *)(out_bp + dest_info->dimstride[1] * i), dest_info->planecount, i);
+	}
+}
+
+#pragma mark - Parallel Conversion
+
+typedef struct _depth_job{
+	uint16_t            *source;
+	long                src_width;
+	long                src_height;
+	char                *out_bp;
+	t_jit_matrix_info   *info;
+	const t_freenect_lut *lut;
+	t_freenect_cloud    *cloud;     // mode 4, in place of the table
+	uint8_t             *video;     // colours of the cloud, may be NULL
+	long                video_bpp;
+	const t_freenect_window *window;
+	uint16_t            invalid;    // raw value without a reading
+	uint8_t             *mask_bp;   // foreground mask of the window, may be NULL
+	long                mask_stride;
+	const t_freenect_background *background;
+	uint16_t            tolerance;
+	t_freenect_stream_stats *stats;
+}t_depth_job;
+
+typedef struct _rgb_job{
+	uint8_t             *source;
+	long                src_width;
+	long                src_height;
+	char                *out_bp;
+	t_jit_matrix_info   *info;
+	const t_freenect_window *window;
+	int                 yuv;
+	t_freenect_stream_stats *stats;
+}t_rgb_job;
+
+static void depth_job_rows(void *ctx, long begin, long end)
+{
+	t_depth_job *job = (t_depth_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	long i;
 	
-	in = source;
-	
-	if(dest_info->planecount == 4){
-		for(i=0;i<RGB_HEIGHT;i++){
-			out = out_bp + dest_info->dimstride[1] * i;
-			for(j=0;j<RGB_WIDTH;j++){
-				out[0] = 0xFF;
-				out[1] = in[0];
-				out[2] = in[1];
-				out[3] = in[2];
-				
-				out += 4;
-				in += 3;
-			}
-		}
+	if(job->cloud){
+		cloud_rows(job->cloud, job->source, job->src_width, job->src_height, job->video, job->video_bpp, job->out_bp, job->info,
+				   job->window, job->invalid, begin, end);
 	}
-	else if(dest_info->planecount == 1){
-		for(i=0;i<RGB_HEIGHT;i++){
-			out = out_bp + dest_info->dimstride[1] * i;
-			for(j=0;j<RGB_WIDTH;j++){
-				*out = *in;
-				
-				out ++;
-				in ++;
-			}
+	else{
+		copy_depth_rows(job->source, job->src_width, job->src_height, job->out_bp, job->info, job->lut, job->window, job->invalid, begin, end);
+	}
+	// The rows of depth just converted are still in cache
+	if(job->mask_bp){
+		for(i=begin;i<end;i++){
+			freenect_background_mask_row(job->background, job->window, job->source, job->src_width, i, job->invalid,
+										 job->tolerance, job->mask_bp + job->mask_stride * i);
 		}
 	}
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
 }
 
-void rgb_callback(freenect_device *dev, void *pixels, uint32_t timestamp){
-	t_jit_freenect_grab *x;
-	
-	x = freenect_get_user(dev);
-	
-	if(!x)	
-	{
-		error("Invalid max object supplied in rgb_callback\n");// TODO:should print only in debug mode
-		return;
-    }
-		
-	
+static void rgb_job_rows(void *ctx, long begin, long end)
+{
+	t_rgb_job *job = (t_rgb_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	if(job->yuv){
+		copy_yuv_rows(job->source, job->src_width, job->out_bp, job->info, job->window, begin, end);
+	}
+	else{
+		copy_rgb_rows(job->source, job->src_width, job->src_height, job->out_bp, job->info, job->window, begin, end);
+	}
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
+}
 
-	if (x->is_open)
-	{
-	systhread_mutex_lock(x->backbuffer_mutex);
-	//pthread_mutex_lock(&x->cb_mutex);
-	
-	/*
-	x->rgb_data = pixels;
-	x->rgb_timestamp = timestamp;
-	x->have_rgb_frames++;
-	*/
+typedef struct _filter_job{
+	t_freenect_filter   *filter;
+	const t_freenect_filter_params *params;
+	const uint16_t      *source;
+	t_freenect_stream_stats *stats;
+}t_filter_job;
+
+static void filter_temporal_rows(void *ctx, long begin, long end)
+{
+	t_filter_job *job = (t_filter_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	freenect_filter_temporal_rows(job->filter, job->params, job->source, begin, end);
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
+}
+
+static void filter_median_rows(void *ctx, long begin, long end)
+{
+	t_filter_job *job = (t_filter_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	freenect_filter_median_rows(job->filter, job->params, job->source, begin, end);
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
+}
+
+// Runs the enabled filters over the whole depth frame, whatever the window, so that
+// their history does not depend on it. The median reads the rows around its own, so
+// it starts once the temporal stages are done everywhere. Returns the filtered frame,
+// which belongs to x->filter, or source when there is nothing to do.
+static uint16_t *filter_depth(t_jit_freenect_grab *x, uint16_t *source)
+{
+	t_freenect_filter_params params;
+	t_freenect_job job;
+	t_filter_job filter_job;
+	
+	params.smooth = x->smooth;
+	params.threshold = x->threshold;
+	params.holefill = x->holefill;
+	params.median = x->median;
+	params.invalid = (x->depth_format == FREENECT_DEPTH_REGISTERED) ? 0 : FREENECT_DEPTH_MAX;
+	if(x->filter_failed || (!freenect_filter_temporal_enabled(&params) && !freenect_filter_median_enabled(&params))){
+		return source;
+	}
+	// The attributes are the user's, only whoever converts sees this flag
+	if(freenect_filter_init(&x->filter, x->depth_width, x->depth_height)){
+		error("jit.freenect.grab: Not enough memory to filter depth, outputting it unfiltered.");
+		x->filter_failed = 1;
+		return source;
+	}
 	
-	//assert(x->rgb_back == pixels);
-	x->rgb_back = x->rgb_mid;
-	freenect_set_video_buffer(dev, x->rgb_back);
-	x->rgb_mid = (uint8_t*)pixels;
-	x->got_rgb++;
+	filter_job.filter = &x->filter;
+	filter_job.params = &params;
+	filter_job.stats = &x->depth_stats;
+	job.ctx = &filter_job;
+	job.rows = x->depth_height;
+	job.bytes = x->depth_width * x->depth_height * sizeof(uint16_t);
+	if(freenect_filter_temporal_enabled(&params)){
+		filter_job.source = source;
+		job.fn = filter_temporal_rows;
+		freenect_pool_run(&job, 1);
+		source = x->filter.temporal;
+	}
+	if(freenect_filter_median_enabled(&params)){
+		filter_job.source = source;
+		job.fn = filter_median_rows;
+		freenect_pool_run(&job, 1);
+		source = x->filter.median;
+	}
+	return source;
+}
+
+typedef struct _background_job{
+	t_freenect_background *background;
+	const uint16_t      *source;
+	t_freenect_stream_stats *stats;
+}t_background_job;
+
+static void background_learn_rows(void *ctx, long begin, long end)
+{
+	t_background_job *job = (t_background_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	freenect_background_learn_rows(job->background, job->source, begin, end);
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
+}
+
+// Learns the (filtered) depth frame into the background while learn is on. Like the
+// filters it covers the whole frame, so that a window set later still has a model.
+// Returns the model to mask with, NULL when there is none yet.
+static const t_freenect_background *learn_background(t_jit_freenect_grab *x, const uint16_t *source, uint16_t invalid)
+{
+	t_freenect_job job;
+	t_background_job background_job;
+	long learn = __atomic_load_n(&x->bg_learn, __ATOMIC_ACQUIRE);
 	
-    systhread_mutex_unlock(x->backbuffer_mutex);
+	// A model learnt from another depth format would mean nothing
+	if(x->background.model && (x->background.invalid != invalid)){
+		freenect_background_clear(&x->background, invalid);
+	}
+	if(!learn){
+		return x->background.model ? &x->background : NULL;
+	}
+	if(freenect_background_init(&x->background, x->depth_width, x->depth_height, invalid)){
+		error("jit.freenect.grab: Not enough memory to learn the background.");
+		__atomic_store_n(&x->bg_learn, 0, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	if(__atomic_exchange_n(&x->bg_clear, 0, __ATOMIC_ACQ_REL)){
+		freenect_background_clear(&x->background, invalid);
 	}
-    //pthread_mutex_unlock(&x->cb_mutex);
 	
+	background_job.background = &x->background;
+	background_job.source = source;
+	background_job.stats = &x->depth_stats;
+	job.fn = background_learn_rows;
+	job.ctx = &background_job;
+	job.rows = x->depth_height;
+	job.bytes = x->depth_width * x->depth_height * sizeof(uint16_t);
+	freenect_pool_run(&job, 1);
+	
+	// Counts down learn's frames, unless a new learn or freeze came in meanwhile
+	if(learn > 0){
+		__atomic_compare_exchange_n(&x->bg_learn, &learn, learn - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	}
+	return &x->background;
 }
 
-void depth_callback(freenect_device *dev, void *pixels, uint32_t timestamp){
-	t_jit_freenect_grab *x;
-	
-	x = freenect_get_user(dev);
+typedef struct _bayer_job{
+	const uint8_t       *raw;
+	uint8_t             *rgb;
+	long                width;
+	long                height;
+	int                 method;
+	t_freenect_stream_stats *stats;
+}t_bayer_job;
+
+static void bayer_rows(void *ctx, long begin, long end)
+{
+	t_bayer_job *job = (t_bayer_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	freenect_bayer_rows(job->raw, job->rgb, job->width, job->height, job->method, begin, end);
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
+}
+
+// Demosaics the whole Bayer frame, whatever the window: registration and the cloud
+// read video anywhere. Returns the RGB frame, which belongs to whoever converts,
+// or source when video is not Bayer.
+static uint8_t *demosaic_video(t_jit_freenect_grab *x, uint8_t *source)
+{
+	t_freenect_job job;
+	t_bayer_job bayer_job;
+	long bytes = x->video_width * x->video_height * RGB_BPP;
 	
-	if(!x)	
-	{
-		error("Invalid max object supplied in depth_callback\n");// TODO:should print only in debug mode
-		return;
+	if(x->video_format != FREENECT_VIDEO_BAYER){
+		return source;
+	}
+	if(x->demosaiced_bytes != bytes){
+		freenect_buffer_put(x->demosaiced);
+		x->demosaiced = (uint8_t *)freenect_buffer_get(bytes);
+		x->demosaiced_bytes = x->demosaiced ? bytes : 0;
+		if(!x->demosaiced){
+			error("Out of memory, cannot demosaic video.");
+			return NULL;
+		}
+	}
+	bayer_job.raw = source;
+	bayer_job.rgb = x->demosaiced;
+	bayer_job.width = x->video_width;
+	bayer_job.height = x->video_height;
+	bayer_job.method = x->demosaic;
+	bayer_job.stats = &x->rgb_stats;
+	job.fn = bayer_rows;
+	job.ctx = &bayer_job;
+	job.rows = x->video_height;
+	job.bytes = bytes;
+	freenect_pool_run(&job, 1);
+	return x->demosaiced;
+}
+
+typedef struct _register_job{
+	t_freenect_register *registrar;
+	const uint16_t      *depth;
+	const uint8_t       *video;
+	long                video_bpp;
+	int                 phase;
+	t_freenect_stream_stats *stats;
+}t_register_job;
+
+static void register_depth_bands(void *ctx, long begin, long end)
+{
+	t_register_job *job = (t_register_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	freenect_register_depth_bands(job->registrar, job->depth, job->phase, begin, end);
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
+}
+
+static void register_occlude_rows(void *ctx, long begin, long end)
+{
+	t_register_job *job = (t_register_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	freenect_register_occlude_rows(job->registrar, job->depth, begin, end);
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
+}
+
+static void register_video_rows(void *ctx, long begin, long end)
+{
+	t_register_job *job = (t_register_job *)ctx;
+	uint64_t start = freenect_now_ns();
+	freenect_register_video_rows(job->registrar, job->video, job->video_bpp, begin, end);
+	freenect_stats_copied(job->stats, freenect_now_ns() - start);
+}
+
+// Warps the whole (filtered) depth frame into the video camera, z-buffered. The two
+// phases of bands run one after the other, the bands of a phase concurrently. For
+// register 2 the depth frame only gives the video its targets, and stays as it is.
+// Returns the depth frame to convert, which may belong to x->registrar.
+static uint16_t *register_depth(t_jit_freenect_grab *x, uint16_t *source)
+{
+	long mode = register_mode(x);
+	uint64_t start;
+	t_freenect_job job;
+	t_register_job register_job;
+	t_freenect_register_device device;
+	int err;
+	
+	if(!mode){
+		return source;
+	}
+	// Tables depend on the calibration, which the calibration message may swap
+	systhread_mutex_lock(x->output_mutex);
+	if(x->kinect_registration.registration_table && x->kinect_registration.depth_to_rgb_shift && x->kinect_registration.raw_to_mm_shift &&
+	   (x->depth_width == MEDIUM_WIDTH) && (x->depth_height == MEDIUM_HEIGHT)){
+		device.table = (const int32_t (*)[2])x->kinect_registration.registration_table;
+		device.shift = x->kinect_registration.depth_to_rgb_shift;
+		device.mm = x->kinect_registration.raw_to_mm_shift;
+		device.start_lines = x->kinect_registration.reg_pad_info.start_lines;
+		err = freenect_register_init_device(&x->registrar, x->depth_width, x->depth_height, &device, x->calibration);
+	}
+	else{
+		// Recordings and the simulator have no registration, a typical Kinect's stands in
+		err = freenect_register_init(&x->registrar, x->depth_width, x->depth_height, &freenect_depth_intrinsics, &freenect_video_intrinsics,
+									 FREENECT_REGISTER_BASELINE, x->calibration);
+	}
+	systhread_mutex_unlock(x->output_mutex);
+	if(err){
+		error("jit.freenect.grab: Not enough memory to register depth, outputting it unregistered.");
+		x->register_failed = 1;
+		return source;
+	}
+	
+	start = freenect_now_ns();
+	register_job.registrar = &x->registrar;
+	register_job.depth = source;
+	register_job.stats = &x->depth_stats;
+	job.ctx = &register_job;
+	job.bytes = x->depth_width * x->depth_height * sizeof(uint16_t) / 2;
+	freenect_register_depth_clear(&x->registrar);
+	for(register_job.phase=0;register_job.phase<2;register_job.phase++){
+		job.fn = register_depth_bands;
+		job.rows = freenect_register_bands(&x->registrar, register_job.phase);
+		freenect_pool_run(&job, 1);
+	}
+	if(mode == 2){
+		job.fn = register_occlude_rows;
+		job.rows = x->depth_height;
+		job.bytes = x->depth_width * x->depth_height * sizeof(int32_t);
+		freenect_pool_run(&job, 1);
+	}
+	__atomic_add_fetch(&x->register_ns, freenect_now_ns() - start, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&x->register_frames, 1, __ATOMIC_RELAXED);
+	return (mode == 1) ? x->registrar.depth : source;
+}
+
+// For register 2, warps the video frame into the depth camera through the targets
+// of the last depth frame registered; until there is one, video stays as it is.
+// Returns the video frame to convert, which may belong to x->registrar.
+static uint8_t *register_video(t_jit_freenect_grab *x, uint8_t *source)
+{
+	uint64_t start;
+	t_freenect_job job;
+	t_register_job register_job;
+	
+	if((register_mode(x) != 2) || !x->registrar.video){
+		return source;
+	}
+	start = freenect_now_ns();
+	register_job.registrar = &x->registrar;
+	register_job.video = source;
+	register_job.video_bpp = RGB_BPP;
+	register_job.stats = &x->rgb_stats;
+	job.fn = register_video_rows;
+	job.ctx = &register_job;
+	job.rows = x->depth_height;
+	job.bytes = x->depth_width * x->depth_height * RGB_BPP;
+	freenect_pool_run(&job, 1);
+	__atomic_add_fetch(&x->register_ns, freenect_now_ns() - start, __ATOMIC_RELAXED);
+	return x->registrar.video;
+}
+
+// Converts the windows of a depth and a video frame at once, their rows spread over the shared pool.
+// Depth goes through the filters first, Bayer video through the demosaic, then both through registration. Pass a NULL source or out_bp to skip either one. The time spent goes to the streams' statistics.
+// With a cloud, depth becomes points coloured from rgb_source, even when rgb_bp is NULL.
+// The foreground mask of the depth window goes to mask_bp, rows mask_stride apart, unless it is NULL.
+void convert_frames(uint16_t *depth_source, char *depth_bp, t_jit_matrix_info *depth_info, char *mask_bp, long mask_stride,
+					const t_freenect_lut *lut, t_freenect_cloud *cloud, uint8_t *rgb_source, char *rgb_bp, t_jit_matrix_info *rgb_info,
+					const t_freenect_window *window, const t_freenect_window *video_window, t_jit_freenect_grab *x)
+{
+	t_freenect_job jobs[2];
+	t_depth_job depth_job;
+	t_rgb_job rgb_job;
+	long njobs = 0;
+	
+	if(depth_source && depth_bp){
+		depth_source = filter_depth(x, depth_source);
+		depth_source = register_depth(x, depth_source);
+	}
+	// The cloud is coloured from the video even when it is not output
+	if(rgb_source && (rgb_bp || (depth_source && depth_bp && cloud))){
+		rgb_source = demosaic_video(x, rgb_source);
+		rgb_source = rgb_source ? register_video(x, rgb_source) : NULL;
+	}
+	if(depth_source && depth_bp){
+		depth_job.source = depth_source;
+		depth_job.src_width = x->depth_width;
+		depth_job.src_height = x->depth_height;
+		depth_job.out_bp = depth_bp;
+		depth_job.info = depth_info;
+		depth_job.lut = lut;
+		depth_job.cloud = cloud;
+		depth_job.video = ((x->video_format == FREENECT_VIDEO_YUV_RAW) || !video_colours_depth(x)) ? NULL : rgb_source;    // points stay black
+		depth_job.video_bpp = (x->video_format == FREENECT_VIDEO_IR_8BIT) ? 1 : RGB_BPP;
+		depth_job.window = window;
+		depth_job.invalid = (x->depth_format == FREENECT_DEPTH_REGISTERED) ? 0 : FREENECT_DEPTH_MAX;
+		depth_job.background = learn_background(x, depth_source, depth_job.invalid);
+		depth_job.mask_bp = (uint8_t *)mask_bp;
+		depth_job.mask_stride = mask_stride;
+		depth_job.tolerance = (uint16_t)x->bg_tolerance;    // clipped by the attribute
+		depth_job.stats = &x->depth_stats;
+		jobs[njobs].fn = depth_job_rows;
+		jobs[njobs].ctx = &depth_job;
+		jobs[njobs].rows = window->height;
+		jobs[njobs].bytes = depth_info->dimstride[1] * window->height;
+		njobs++;
+	}
+	if(rgb_source && rgb_bp){
+		rgb_job.source = rgb_source;
+		rgb_job.src_width = x->video_width;
+		rgb_job.src_height = x->video_height;
+		rgb_job.out_bp = rgb_bp;
+		rgb_job.info = rgb_info;
+		rgb_job.window = video_window;
+		rgb_job.yuv = (x->video_format == FREENECT_VIDEO_YUV_RAW);
+		rgb_job.stats = &x->rgb_stats;
+		jobs[njobs].fn = rgb_job_rows;
+		jobs[njobs].ctx = &rgb_job;
+		jobs[njobs].rows = video_window->height;
+		jobs[njobs].bytes = rgb_info->dimstride[1] * video_window->height;
+		njobs++;
+	}
+	freenect_pool_run(jobs, njobs);
+	if(depth_source && depth_bp){
+		freenect_stats_copy_done(&x->depth_stats);
+	}
+	if(rgb_source && rgb_bp){
+		freenect_stats_copy_done(&x->rgb_stats);
+	}
+}
+
+#pragma mark - Calibration
+
+// A float32 or float64 matrix with a 2-plane cell (raw, metres) per point
+static int calibration_from_matrix(t_freenect_calibration *cal, void *matrix)
+{
+	t_jit_matrix_info info;
+	char *bp = NULL, *cell;
+	double *raw = NULL, *metres = NULL;
+	long savelock, i;
+	int err = -1;
+	
+	savelock = (long)jit_object_method(matrix, _jit_sym_lock, 1);
+	jit_object_method(matrix, _jit_sym_getinfo, &info);
+	jit_object_method(matrix, _jit_sym_getdata, &bp);
+	if(bp && (info.planecount == 2) && ((info.type == _jit_sym_float32) || (info.type == _jit_sym_float64))){
+		raw = (double *)malloc(info.dim[0] * sizeof(double));
+		metres = (double *)malloc(info.dim[0] * sizeof(double));
+	}
+	if(raw && metres){
+		for(i=0;i<info.dim[0];i++){
+			cell = bp + i * info.dimstride[0];
+			if(info.type == _jit_sym_float32){
+				raw[i] = ((float *)cell)[0];
+				metres[i] = ((float *)cell)[1];
+			}
+			else{
+				raw[i] = ((double *)cell)[0];
+				metres[i] = ((double *)cell)[1];
+			}
+		}
+		err = freenect_calibration_from_points(cal, raw, metres, info.dim[0]);
+	}
+	free(raw);
+	free(metres);
+	jit_object_method(matrix, _jit_sym_lock, savelock);
+	return err;
+}
+
+// calibration <file or matrix>: replaces the default raw-to-metres curve of modes 3 and 4
+// with one measured on this Kinect, as "raw metres" lines of a text file or the cells of
+// a 2-plane float matrix. calibration alone restores the default curve.
+void jit_freenect_grab_calibration(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv)
+{
+	t_freenect_calibration *cal = NULL, *old;
+	char path[MAX_PATH_CHARS];
+	t_symbol *name;
+	void *matrix;
+	int err = -1;
+	
+	if(argc){
+		name = jit_atom_getsym(argv);
+		cal = (t_freenect_calibration *)malloc(sizeof(t_freenect_calibration));
+		if(!cal){
+			error("Out of memory, cannot load a calibration.");
+			return;
+		}
+		matrix = jit_object_findregistered(name);
+		if(matrix && jit_object_method(matrix, _jit_sym_class_jit_matrix)){
+			err = calibration_from_matrix(cal, matrix);
+		}
+		else if(native_path(name, path)){
+			err = freenect_calibration_load(cal, path);
+		}
+		if(err){
+			error("Could not load a calibration from %s, it needs at least 2 points of distinct raw depth and positive distance.",
+				  name->s_name);
+			free(cal);
+			return;
+		}
+	}
+	
+	// Tables built from the old curve are copies, it can go as soon as nobody reads it
+	systhread_mutex_lock(x->output_mutex);
+	old = x->calibration;
+	x->calibration = cal;
+	systhread_mutex_unlock(x->output_mutex);
+	if(old){
+		free(old);
+	}
+}
+
+#pragma mark - Background
+
+// learn [frames]: a new background from the next depth frames, until freeze or for
+// that many frames. Whoever converts picks the request up with its next frame.
+void jit_freenect_grab_learn(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv)
+{
+	long frames = (argc > 0) ? jit_atom_getlong(argv) : 0;
+	
+	__atomic_store_n(&x->bg_clear, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&x->bg_learn, (frames > 0) ? frames : -1, __ATOMIC_RELEASE);
+}
+
+// Keeps the background learnt so far
+void jit_freenect_grab_freeze(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv)
+{
+	__atomic_store_n(&x->bg_learn, 0, __ATOMIC_RELEASE);
+}
+
+#pragma mark - Recording
+
+// Capture thread: tees a raw frame into the recorder, if any. Never blocks, the
+// recorder drops the frame when its ring is full.
+static void record_frame(t_jit_freenect_grab *x, int stream, void *data, long size, uint32_t timestamp)
+{
+	t_freenect_recorder *rec;
+	
+	__atomic_add_fetch(&x->record_busy, 1, __ATOMIC_SEQ_CST);
+	rec = __atomic_load_n(&x->recorder, __ATOMIC_SEQ_CST);
+	if(rec){
+		freenect_recorder_push(rec, stream, data, size, timestamp);
+	}
+	__atomic_sub_fetch(&x->record_busy, 1, __ATOMIC_SEQ_CST);
+}
+
+// record <file> [compress]: starts teeing raw frames to file, record with no argument stops.
+// With compress 1 depth frames are stored with the lossless depth codec.
+void jit_freenect_grab_record(t_jit_freenect_grab *x, t_symbol *s, long argc, t_atom *argv)
+{
+	t_freenect_rec_header info;
+	t_freenect_recorder *rec;
+	char path[MAX_PATH_CHARS];
+	
+	jit_freenect_grab_record_stop(x);
+	if(!argc || !native_path(jit_atom_getsym(argv), path)){
+		return;
+	}
+	if(!x->source){
+		error("Open a device before recording.");
+		return;
+	}
+	
+	memset(&info, 0, sizeof(info));
+	info.depth_width = x->depth_width;
+	info.depth_height = x->depth_height;
+	info.depth_format = x->depth_format;
+	info.depth_invalid = (info.depth_format == FREENECT_DEPTH_REGISTERED) ? 0 : FREENECT_DEPTH_MAX;
+	if((argc > 1) && jit_atom_getlong(argv+1)){
+		info.flags |= FREENECT_REC_COMPRESS_DEPTH;
+	}
+	info.video_width = x->video_width;
+	info.video_height = x->video_height;
+	info.video_format = x->video_format;
+	info.video_bpp = raw_video_bpp(x);
+	
+	rec = freenect_recorder_open(path, &info, 0);
+	if(!rec){
+		error("Could not record to %s", path);
+		return;
+	}
+	__atomic_store_n(&x->recorder, rec, __ATOMIC_SEQ_CST);
+}
+
+void jit_freenect_grab_record_stop(t_jit_freenect_grab *x)
+{
+	t_freenect_recorder *rec;
+	uint64_t frames, dropped;
+	
+	rec = __atomic_exchange_n(&x->recorder, NULL, __ATOMIC_SEQ_CST);
+	if(!rec){
+		return;
+	}
+	// The capture thread may still hold the old pointer until it leaves record_frame()
+	while(__atomic_load_n(&x->record_busy, __ATOMIC_SEQ_CST)){
+		systhread_sleep(0);
+	}
+	
+	frames = freenect_recorder_frames(rec);
+	dropped = freenect_recorder_dropped(rec);
+	if(freenect_recorder_close(rec)){
+		error("Recording failed, the file is incomplete.");
+	}
+	else if(dropped){
+		error("Recorded %llu frames, %llu dropped.", (unsigned long long)frames, (unsigned long long)dropped);
+	}
+}
+
+#pragma mark - Statistics
+
+// Called by every open before the source starts. The depth filters' history
+// belongs to the previous source.
+static void stats_begin(t_jit_freenect_grab *x)
+{
+	freenect_stats_clear(&x->depth_stats);
+	freenect_stats_clear(&x->rgb_stats);
+	freenect_filter_reset(&x->filter);
+	x->filter_failed = 0;
+	x->register_failed = 0;
+	__atomic_store_n(&x->register_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&x->register_frames, 0, __ATOMIC_RELAXED);
+}
+
+// A new depth frame, and maybe a new rgb one, just went out
+static void output_stats(t_jit_freenect_grab *x, int new_depth, uint64_t depth_arrival, int new_rgb, uint64_t rgb_arrival)
+{
+	uint64_t now = freenect_now_ns();
+	
+	if(new_depth){
+		freenect_stats_output(&x->depth_stats, depth_arrival, now);
+	}
+	if(new_rgb){
+		freenect_stats_output(&x->rgb_stats, rgb_arrival, now);
+	}
+}
+
+static t_jit_err stats_atoms(long *ac, t_atom **av, long count)
+{
+	if ((*ac)&&(*av)) {
+		
+	} else {
+		*ac = count;
+		if (!(*av = jit_getbytes(sizeof(t_atom)*(*ac)))) {
+			*ac = 0;
+			return JIT_ERR_OUT_OF_MEM;
+		}
+	}
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_fps(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	if(stats_atoms(ac, av, 2)){
+		return JIT_ERR_OUT_OF_MEM;
+	}
+	x->fps[0] = freenect_stats_fps(&x->depth_stats);
+	x->fps[1] = freenect_stats_fps(&x->rgb_stats);
+	jit_atom_setfloat(*av, x->fps[0]);
+	jit_atom_setfloat(*av + 1, x->fps[1]);
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_frames_received(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	if(stats_atoms(ac, av, 2)){
+		return JIT_ERR_OUT_OF_MEM;
+	}
+	x->frames_received[0] = (long)freenect_stats_get(&x->depth_stats.received);
+	x->frames_received[1] = (long)freenect_stats_get(&x->rgb_stats.received);
+	jit_atom_setlong(*av, x->frames_received[0]);
+	jit_atom_setlong(*av + 1, x->frames_received[1]);
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_frames_output(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	if(stats_atoms(ac, av, 2)){
+		return JIT_ERR_OUT_OF_MEM;
+	}
+	x->frames_output[0] = (long)freenect_stats_get(&x->depth_stats.output);
+	x->frames_output[1] = (long)freenect_stats_get(&x->rgb_stats.output);
+	jit_atom_setlong(*av, x->frames_output[0]);
+	jit_atom_setlong(*av + 1, x->frames_output[1]);
+	return JIT_ERR_NONE;
+}
+
+// Frames the pairer discarded are added in when pairing ends
+t_jit_err jit_freenect_grab_get_frames_dropped(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	if(stats_atoms(ac, av, 2)){
+		return JIT_ERR_OUT_OF_MEM;
+	}
+	x->frames_dropped[0] = (long)freenect_stats_get(&x->depth_stats.dropped);
+	x->frames_dropped[1] = (long)freenect_stats_get(&x->rgb_stats.dropped);
+	if(x->pairing){
+		x->frames_dropped[0] += (long)freenect_stats_get(&x->pairer.dropped[FREENECT_PAIR_DEPTH]);
+		x->frames_dropped[1] += (long)freenect_stats_get(&x->pairer.dropped[FREENECT_PAIR_VIDEO]);
+	}
+	jit_atom_setlong(*av, x->frames_dropped[0]);
+	jit_atom_setlong(*av + 1, x->frames_dropped[1]);
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_latency(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	static const double quantiles[3] = {0.5, 0.95, 0.99};
+	int i;
+	
+	if(stats_atoms(ac, av, 6)){
+		return JIT_ERR_OUT_OF_MEM;
+	}
+	for(i=0;i<3;i++){
+		x->latency[i] = freenect_hist_quantile(&x->depth_stats.latency, quantiles[i]) * 1e-6;
+		x->latency[i + 3] = freenect_hist_quantile(&x->rgb_stats.latency, quantiles[i]) * 1e-6;
+	}
+	for(i=0;i<6;i++){
+		jit_atom_setfloat(*av + i, x->latency[i]);
+	}
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_copytime(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	uint64_t copies;
+	
+	if(stats_atoms(ac, av, 2)){
+		return JIT_ERR_OUT_OF_MEM;
+	}
+	copies = freenect_stats_get(&x->depth_stats.copies);
+	x->copytime[0] = copies ? freenect_stats_get(&x->depth_stats.copy_ns) * 1e-6 / copies : 0.;
+	copies = freenect_stats_get(&x->rgb_stats.copies);
+	x->copytime[1] = copies ? freenect_stats_get(&x->rgb_stats.copy_ns) * 1e-6 / copies : 0.;
+	jit_atom_setfloat(*av, x->copytime[0]);
+	jit_atom_setfloat(*av + 1, x->copytime[1]);
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_registertime(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	uint64_t frames;
+	
+	if(stats_atoms(ac, av, 1)){
+		return JIT_ERR_OUT_OF_MEM;
+	}
+	frames = freenect_stats_get(&x->register_frames);
+	x->register_time = frames ? freenect_stats_get(&x->register_ns) * 1e-6 / frames : 0.;
+	jit_atom_setfloat(*av, x->register_time);
+	return JIT_ERR_NONE;
+}
+
+// Bytes reserved in the pool for the frame buffers this object holds
+static uint64_t frame_footprint(t_jit_freenect_grab *x)
+{
+	uint64_t bytes = freenect_buffer_size(x->demosaiced);
+	int i, s;
+	
+	for(i=0;i<3;i++){
+		bytes += freenect_buffer_size(x->raw_depth[i]) + freenect_buffer_size(x->raw_rgb[i]);
+		bytes += freenect_buffer_size(x->converted_depth[i].data) + freenect_buffer_size(x->converted_rgb[i].data);
+	}
+	for(s=0;s<2;s++){
+		for(i=0;i<FREENECT_PAIR_BUFFERS;i++){
+			bytes += freenect_buffer_size(x->pairer.buffers[s][i]);
+		}
+	}
+	return bytes;
+}
+
+t_jit_err jit_freenect_grab_get_footprint(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	t_freenect_buffer_footprint pool;
+	int i;
+	
+	if(stats_atoms(ac, av, 3)){
+		return JIT_ERR_OUT_OF_MEM;
+	}
+	freenect_buffers_footprint(&pool);
+	x->footprint[0] = frame_footprint(x) / 1048576.;
+	x->footprint[1] = pool.used / 1048576.;
+	x->footprint[2] = pool.idle / 1048576.;
+	for(i=0;i<3;i++){
+		jit_atom_setfloat(*av + i, x->footprint[i]);
+	}
+	return JIT_ERR_NONE;
+}
+
+#pragma mark - Pairing
+
+// Called by every open before the source starts: the device then fills the
+// pairer's buffers instead of the raw ones
+static void pairing_begin(t_jit_freenect_grab *x)
+{
+	x->pairing = 0;
+	if(!x->pair){
+		return;
+	}
+	if(!x->depth_enable || !x->video_enable){
+		error("jit.freenect.grab: Pairing needs both depth and video, outputting them unpaired.");
+		return;
+	}
+	// Sized like the raw buffers, a source with other frame sizes needs new ones
+	if(!x->pairer.buffers[0][0] || (x->pairer.bytes[FREENECT_PAIR_DEPTH] != x->raw_depth_bytes) ||
+	   (x->pairer.bytes[FREENECT_PAIR_VIDEO] != x->raw_rgb_bytes)){
+		freenect_pairer_free(&x->pairer);
+		if(freenect_pairer_init(&x->pairer, x->raw_depth_bytes, x->raw_rgb_bytes)){
+			error("jit.freenect.grab: Not enough memory to pair frames, outputting them unpaired.");
+			return;
+		}
+	}
+	freenect_pairer_reset(&x->pairer);
+	freenect_pairer_set_tolerance(&x->pairer, (uint32_t)(x->pair_tolerance * (FREENECT_PAIR_CLOCK / 1000)));
+	freenect_tribuf_set_back(&x->depth_frames, freenect_pairer_fill(&x->pairer, FREENECT_PAIR_DEPTH));
+	freenect_tribuf_set_back(&x->rgb_frames, freenect_pairer_fill(&x->pairer, FREENECT_PAIR_VIDEO));
+	x->pairing = 1;
+}
+
+// Once the source and the worker have stopped. The pairer's buffers go back to the
+// pool with the raw ones, see close_frames.
+static void pairing_end(t_jit_freenect_grab *x)
+{
+	if(!x->pairing){
+		return;
+	}
+	x->pairing = 0;
+	freenect_stats_dropped(&x->depth_stats, x->pairer.dropped[FREENECT_PAIR_DEPTH]);
+	freenect_stats_dropped(&x->rgb_stats, x->pairer.dropped[FREENECT_PAIR_VIDEO]);
+	freenect_tribuf_init(&x->depth_frames, x->raw_depth[0], x->raw_depth[1], x->raw_depth[2]);
+	freenect_tribuf_init(&x->rgb_frames, x->raw_rgb[0], x->raw_rgb[1], x->raw_rgb[2]);
+}
+
+static void set_output_timestamps(t_jit_freenect_grab *x, uint32_t depth_stamp, uint32_t rgb_stamp)
+{
+	x->depth_timestamp = depth_stamp;
+	x->rgb_timestamp = rgb_stamp;
+	x->timestamp = MAX(rgb_stamp, depth_stamp);
+	x->skew = (int32_t)(rgb_stamp - depth_stamp) * 1000.f / FREENECT_PAIR_CLOCK;
+}
+
+// Shared by every frame source: publishes the back buffer just filled and returns
+// the one to fill next. Called on the capture (or simulation) thread, must never block.
+// When pairing, the frame goes to the pairer instead, which publishes complete pairs.
+static void *depth_frame_ready(t_jit_freenect_grab *x, uint32_t timestamp)
+{
+	void *filled = freenect_tribuf_back(&x->depth_frames);
+	uint64_t now = freenect_now_ns();
+	
+	freenect_stats_received(&x->depth_stats, now);
+	record_frame(x, FREENECT_REC_DEPTH, filled, x->depth_width * x->depth_height * sizeof(uint16_t), timestamp);
+	if(x->pairing){
+		freenect_tribuf_set_back(&x->depth_frames, freenect_pairer_push(&x->pairer, FREENECT_PAIR_DEPTH, filled, timestamp, now));
+	}
+	else{
+		x->depth_stamps[x->depth_frames.back] = timestamp;
+		x->depth_arrivals[x->depth_frames.back] = now;
+		if(freenect_tribuf_publish(&x->depth_frames)){
+			freenect_stats_dropped(&x->depth_stats, 1);
+		}
+	}
+	if(x->worker){
+		freenect_sem_post(&x->frame_sem);
+	}
+	return freenect_tribuf_back(&x->depth_frames);
+}
+
+static void *rgb_frame_ready(t_jit_freenect_grab *x, uint32_t timestamp)
+{
+	void *filled = freenect_tribuf_back(&x->rgb_frames);
+	uint64_t now = freenect_now_ns();
+	
+	freenect_stats_received(&x->rgb_stats, now);
+	record_frame(x, FREENECT_REC_VIDEO, filled, video_frame_bytes(x), timestamp);
+	if(x->pairing){
+		freenect_tribuf_set_back(&x->rgb_frames, freenect_pairer_push(&x->pairer, FREENECT_PAIR_VIDEO, filled, timestamp, now));
+	}
+	else{
+		x->rgb_stamps[x->rgb_frames.back] = timestamp;
+		x->rgb_arrivals[x->rgb_frames.back] = now;
+		if(freenect_tribuf_publish(&x->rgb_frames)){
+			freenect_stats_dropped(&x->rgb_stats, 1);
+		}
+	}
+	if(x->worker){
+		freenect_sem_post(&x->frame_sem);
+	}
+	return freenect_tribuf_back(&x->rgb_frames);
+}
+
+// Both callbacks run on the libusb event thread and must never block
+void rgb_callback(freenect_device *dev, void *pixels, uint32_t timestamp){
+	t_jit_freenect_grab *x;
+	
+	x = freenect_get_user(dev);
+	
+	if(!x)	
+	{
+		error("Invalid max object supplied in rgb_callback\n");// TODO:should print only in debug mode
+		return;
+    }
+	
+	if (x->is_open)
+	{
+		//pixels is the back buffer we handed to libfreenect
+		freenect_set_video_buffer(dev, rgb_frame_ready(x, timestamp));
+	}
+}
+
+void depth_callback(freenect_device *dev, void *pixels, uint32_t timestamp){
+	t_jit_freenect_grab *x;
+	
+	x = freenect_get_user(dev);
+	
+	if(!x)	
+	{
+		error("Invalid max object supplied in depth_callback\n");// TODO:should print only in debug mode
+		return;
     }
 	//post("depth_callback called\n");//TODO:r
 	
 	if (x->is_open)
 	{
-	systhread_mutex_lock(x->backbuffer_mutex);
-    
-   // pthread_mutex_lock(&x->cb_mutex);
+		freenect_set_depth_buffer(dev, depth_frame_ready(x, timestamp));
+	}
+}
+
+// Replayed frames are not copied: the back buffer is pointed at the frame in the mapping.
+// Compressed depth is decoded into the back buffer instead.
+static void replay_depth_callback(void *user, void *payload, const t_freenect_rec_index *frame){
+	t_jit_freenect_grab *x = (t_jit_freenect_grab *)user;
+	
+	if(!__atomic_load_n(&x->depth_enable, __ATOMIC_RELAXED) || (frame->raw_size != x->depth_width * x->depth_height * sizeof(uint16_t))){
+		return;
+	}
+	if(frame->codec == FREENECT_REC_PACKED){
+		if(freenect_depth_decode((const uint8_t *)payload, frame->size, (uint16_t *)freenect_tribuf_back(&x->depth_frames), x->depth_width * x->depth_height)){
+			return;
+		}
+	}
+	else if((frame->codec == FREENECT_REC_RAW) && (frame->size == frame->raw_size)){
+		freenect_tribuf_set_back(&x->depth_frames, payload);
+	}
+	else{
+		return;
+	}
+	depth_frame_ready(x, frame->timestamp);
+}
+
+static void replay_rgb_callback(void *user, void *payload, const t_freenect_rec_index *frame){
+	t_jit_freenect_grab *x = (t_jit_freenect_grab *)user;
 	
-	//assert(x->depth_back == pixels);
-//	x->depth_back = x->depth_mid;
+	if(!__atomic_load_n(&x->video_enable, __ATOMIC_RELAXED) || (frame->codec != FREENECT_REC_RAW) || (frame->size != video_frame_bytes(x))){
+		return;
+	}
+	freenect_tribuf_set_back(&x->rgb_frames, payload);
+	rgb_frame_ready(x, frame->timestamp);
+}
+
+// The simulated device only runs while the object is open
+static void *sim_depth_callback(void *user, void *pixels, uint32_t timestamp){
+	return depth_frame_ready((t_jit_freenect_grab *)user, timestamp);
+}
 
-	x->depth_back = x->depth_mid;
-	freenect_set_depth_buffer(dev, x->depth_back);
-	x->depth_mid = (uint16_t*)pixels;
-	x->got_depth++;
+static void *sim_rgb_callback(void *user, void *pixels, uint32_t timestamp){
+	return rgb_frame_ready((t_jit_freenect_grab *)user, timestamp);
+}
+
+#pragma mark - Conversion Worker
+
+t_jit_err jit_freenect_grab_set_async(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av)
+{
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
 	
-	systhread_mutex_unlock(x->backbuffer_mutex);
-    }
-    //pthread_mutex_unlock(&x->cb_mutex);
+	x->async = jit_atom_getlong(av) ? 1 : 0;
+	
+	if(x->source != SOURCE_NONE){
+		if(x->async){
+			jit_freenect_worker_start(x);
+		}
+		else{
+			jit_freenect_worker_stop(x);
+		}
+	}
+	return JIT_ERR_NONE;
+}
+
+void jit_freenect_worker_start(t_jit_freenect_grab *x)
+{
+	if(x->worker){
+		return;
+	}
+	x->worker_cancel = FALSE;
+	if(systhread_create((method)jit_freenect_worker_threadproc, x, 0, 0, 0, &x->worker) != MAX_ERR_NONE){
+		error("Failed to create conversion thread, converting on the Max thread.");
+		x->worker = NULL;
+	}
+}
+
+void jit_freenect_worker_stop(t_jit_freenect_grab *x)
+{
+	unsigned int ret;
+	
+	if(!x->worker){
+		return;
+	}
+	x->worker_cancel = TRUE;
+	freenect_sem_post(&x->frame_sem);
+	
+	systhread_join(x->worker, &ret);
+	x->worker = NULL;
+}
+
+t_jit_err jit_freenect_grab_get_threads(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	if ((*ac)&&(*av)) {
+		
+	} else {
+		*ac = 1;
+		if (!(*av = jit_getbytes(sizeof(t_atom)*(*ac)))) {
+			*ac = 0;
+			return JIT_ERR_OUT_OF_MEM;
+		}
+	}
+	
+	// Report the effective count, i.e. the number of CPUs when set to 0
+	x->threads = freenect_pool_get_threads();
+	jit_atom_setlong(*av,x->threads);
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_threads(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av)
+{
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	x->threads = MIN(MAX(jit_atom_getlong(av), 0), FREENECT_POOL_MAX_THREADS);
+	// There is a single pool, say so when that changes it under the other instances
+	if(freenect_pool_set_threads(x->threads) != x->threads){
+		post("jit.freenect.grab: threads %ld applies to every instance", x->threads);
+	}
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_get_hugepages(t_jit_freenect_grab *x, void *attr, long *ac, t_atom **av)
+{
+	if ((*ac)&&(*av)) {
+		
+	} else {
+		*ac = 1;
+		if (!(*av = jit_getbytes(sizeof(t_atom)*(*ac)))) {
+			*ac = 0;
+			return JIT_ERR_OUT_OF_MEM;
+		}
+	}
+	
+	// Another instance may have changed it
+	x->hugepages = (char)freenect_buffers_huge();
+	jit_atom_setlong(*av,x->hugepages);
+	
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_hugepages(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av)
+{
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	x->hugepages = jit_atom_getlong(av) ? 1 : 0;
+	freenect_buffers_set_huge(x->hugepages);
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_pair(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av)
+{
+	char pair;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	pair = jit_atom_getlong(av) ? 1 : 0;
+	if((pair != x->pair) && x->source){
+		error("jit.freenect.grab: Cannot change pairing while running. Please close and re-open device to activate change.");
+	}
+	x->pair = pair;
+	return JIT_ERR_NONE;
+}
+
+// Applies immediately, the capture thread picks it up with the next frame
+t_jit_err jit_freenect_grab_set_pair_tolerance(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av)
+{
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	x->pair_tolerance = MAX(jit_atom_getfloat(av), 0.f);
+	freenect_pairer_set_tolerance(&x->pairer, (uint32_t)(x->pair_tolerance * (FREENECT_PAIR_CLOCK / 1000)));
+	return JIT_ERR_NONE;
+}
+
+#pragma mark - Streams
+
+// 1 for depth, 2 for video
+static int enabled_streams(t_jit_freenect_grab *x)
+{
+	return (x->depth_enable ? 1 : 0) | (x->video_enable ? 2 : 0);
+}
+
+// Applies the enabled streams to the open source. A Kinect stops sending a disabled one,
+// which frees its share of the USB bandwidth, the simulator stops rendering it and a
+// replay skips it.
+static void enable_streams(t_jit_freenect_grab *x)
+{
+	if(x->source == SOURCE_KINECT){
+		// Queued for the capture thread like tilt, only the latest streams matter
+		__atomic_store_n(&x->streams_pending, STREAMS_PENDING | enabled_streams(x), __ATOMIC_RELEASE);
+	}
+	else if(x->source == SOURCE_SIM){
+		freenect_sim_enable(&x->sim, x->depth_enable, x->video_enable);
+	}
+}
+
+static t_jit_err set_stream_enable(t_jit_freenect_grab *x, char *flag, long ac, t_atom *av)
+{
+	char enable;
+	
+	if(ac < 1){
+		return JIT_ERR_NONE;
+	}
+	
+	enable = jit_atom_getlong(av) ? 1 : 0;
+	if(enable == *flag){
+		return JIT_ERR_NONE;
+	}
+	// Pairs need both streams, a lone one would never be output
+	if(!enable && x->pairing){
+		error("jit.freenect.grab: Cannot disable a stream while pairing. Please set pair 0 and re-open the device first.");
+		return JIT_ERR_NONE;
+	}
+	// Read by the replay thread and the worker
+	__atomic_store_n(flag, enable, __ATOMIC_RELAXED);
+	enable_streams(x);
+	return JIT_ERR_NONE;
+}
+
+t_jit_err jit_freenect_grab_set_depth_enable(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av)
+{
+	return set_stream_enable(x, &x->depth_enable, ac, av);
+}
+
+t_jit_err jit_freenect_grab_set_video_enable(t_jit_freenect_grab *x, void *attr, long ac, t_atom *av)
+{
+	return set_stream_enable(x, &x->video_enable, ac, av);
+}
+
+// Only ever called on the worker's back frame, which no matrix references
+static int reserve_converted_frame(t_converted_frame *frame, long size)
+{
+	if(frame->size < size){
+		freenect_buffer_put(frame->data);
+		frame->data = (char *)freenect_buffer_get(size);
+		if(!frame->data){
+			frame->size = 0;
+			error("Out of memory, cannot allocate converted frame.");
+			return 0;
+		}
+		frame->size = size;
+	}
+	return 1;
+}
+
+// Sizes frame for a depth image of the given type and window and describes it in info
+static int prepare_depth_frame(t_jit_freenect_grab *x, t_converted_frame *frame, t_symbol *type, const t_freenect_window *window, t_jit_matrix_info *info)
+{
+	long cellbytes = (type == _jit_sym_float64) ? sizeof(double) : sizeof(float);
+	long planecount = 1;
+	char mode = x->mode;
+	
+	// A point cloud is always float32, matrix_calc drops it until its matrix matches
+	if(mode == 4){
+		type = _jit_sym_float32;
+		planecount = x->cloud_planes;
+		cellbytes = planecount * sizeof(float);
+	}
+	if(!update_lut(x, &x->worker_lut, type, mode) || ((mode == 4) && !update_cloud(x, &x->worker_cloud, x->worker_lut, window))){
+		return 0;
+	}
+	// The foreground mask follows the depth data, a byte per pixel
+	if(!reserve_converted_frame(frame, window->width * window->height * (cellbytes + 1))){
+		return 0;
+	}
+	
+	info->type = type;
+	info->planecount = planecount;
+	info->dimstride[0] = cellbytes;
+	info->dimstride[1] = window->width * cellbytes;
+	
+	frame->type = type;
+	frame->planecount = planecount;
+	frame->cellbytes = cellbytes;
+	frame->rowbytes = info->dimstride[1];
+	frame->width = window->width;
+	frame->height = window->height;
+	frame->mask = frame->data + window->width * window->height * cellbytes;
+	return 1;
+}
+
+static int prepare_rgb_frame(t_converted_frame *frame, long planecount, long width, const t_freenect_window *window, t_jit_matrix_info *info)
+{
+	if(!reserve_converted_frame(frame, width * window->height * planecount)){
+		return 0;
+	}
+	
+	info->type = _jit_sym_char;
+	info->planecount = planecount;
+	info->dimstride[0] = planecount;
+	info->dimstride[1] = width * planecount;
+	
+	frame->type = _jit_sym_char;
+	frame->planecount = planecount;
+	frame->cellbytes = planecount;
+	frame->rowbytes = info->dimstride[1];
+	frame->width = width;
+	frame->height = window->height;
+	return 1;
+}
+
+void *jit_freenect_worker_threadproc(t_jit_freenect_grab *x)
+{
+	t_symbol *type;
+	long planecount;
+	t_freenect_window window, video_window;
+	int new_depth, new_rgb;
+	t_jit_matrix_info depth_info, rgb_info;
+	t_converted_frame *depth_frame, *rgb_frame;
+	t_freenect_pair *pair;
+	void *depth_src, *rgb_src;
+	uint32_t depth_stamp, rgb_stamp;
+	uint64_t depth_arrival, rgb_arrival;
+	
+	while(1){
+		freenect_sem_wait(&x->frame_sem);
+		if(x->worker_cancel){
+			break;
+		}
+		
+		// In async mode the raw front buffers belong to this thread instead of matrix_calc
+		if(x->pairing){
+			new_depth = new_rgb = freenect_pairer_acquire(&x->pairer);
+			pair = freenect_pairer_front(&x->pairer);
+			depth_src = pair->depth.data;
+			rgb_src = pair->video.data;
+			depth_stamp = pair->depth.timestamp;
+			rgb_stamp = pair->video.timestamp;
+			depth_arrival = pair->depth.arrival;
+			rgb_arrival = pair->video.arrival;
+		}
+		else{
+			new_depth = freenect_tribuf_acquire(&x->depth_frames);
+			new_rgb = freenect_tribuf_acquire(&x->rgb_frames);
+			depth_src = freenect_tribuf_front(&x->depth_frames);
+			rgb_src = freenect_tribuf_front(&x->rgb_frames);
+			depth_stamp = x->depth_stamps[x->depth_frames.front];
+			rgb_stamp = x->rgb_stamps[x->rgb_frames.front];
+			depth_arrival = x->depth_arrivals[x->depth_frames.front];
+			rgb_arrival = x->rgb_arrivals[x->rgb_frames.front];
+		}
+		if(!new_depth && !new_rgb){
+			continue;
+		}
+		
+		systhread_mutex_lock(x->output_mutex);
+		type = x->worker_type;
+		planecount = x->worker_planecount;
+		window = x->worker_window;
+		video_window = x->worker_video_window;
+		systhread_mutex_unlock(x->output_mutex);
+		
+		// Nothing to convert to until matrix_calc has seen the output matrices
+		if(!type){
+			freenect_stats_dropped(&x->depth_stats, new_depth);
+			freenect_stats_dropped(&x->rgb_stats, new_rgb);
+			continue;
+		}
+		
+		depth_frame = (t_converted_frame *)freenect_tribuf_back(&x->converted_depth_frames);
+		rgb_frame = (t_converted_frame *)freenect_tribuf_back(&x->converted_rgb_frames);
+		if(new_depth && !prepare_depth_frame(x, depth_frame, type, &window, &depth_info)){
+			freenect_stats_dropped(&x->depth_stats, 1);
+			new_depth = 0;
+		}
+		if(new_rgb && !prepare_rgb_frame(rgb_frame, planecount, video_output_width(x, planecount, &video_window), &video_window, &rgb_info)){
+			freenect_stats_dropped(&x->rgb_stats, 1);
+			new_rgb = 0;
+		}
+		
+		// The front video colours the cloud even when it is not new, unless video is disabled
+		convert_frames(new_depth ? (uint16_t *)depth_src : NULL, depth_frame->data, &depth_info,
+					   __atomic_load_n(&x->mask, __ATOMIC_RELAXED) ? depth_frame->mask : NULL, window.width, x->worker_lut,
+					   (new_depth && (depth_info.planecount > 1)) ? &x->worker_cloud : NULL,
+					   __atomic_load_n(&x->video_enable, __ATOMIC_RELAXED) ? (uint8_t *)rgb_src : NULL, new_rgb ? rgb_frame->data : NULL,
+					   &rgb_info, &window, &video_window, x);
+		depth_frame->timestamp = depth_stamp;
+		depth_frame->arrival = depth_arrival;
+		rgb_frame->timestamp = rgb_stamp;
+		rgb_frame->arrival = rgb_arrival;
+		
+		// A converted frame matrix_calc never picked up is as lost as a raw one
+		if(new_depth && freenect_tribuf_publish(&x->converted_depth_frames)){
+			freenect_stats_dropped(&x->depth_stats, 1);
+		}
+		if(new_rgb && freenect_tribuf_publish(&x->converted_rgb_frames)){
+			freenect_stats_dropped(&x->rgb_stats, 1);
+		}
+	}
+	
+	systhread_exit(0);
+	return NULL;
+}
+
+#pragma mark - Motor
+
+// Open Kinects join the list the capture thread polls. Leaving it waits for a poll
+// in progress, after which the device may be closed.
+static void motor_register(t_jit_freenect_grab *x)
+{
+	x->motor_polled = 0;
+	__atomic_store_n(&x->tilt_pending, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&x->streams_pending, 0, __ATOMIC_RELAXED);
+	systhread_mutex_lock(motor_mutex);
+	x->motor_next = motor_first;
+	motor_first = x;
+	systhread_mutex_unlock(motor_mutex);
+}
+
+static void motor_unregister(t_jit_freenect_grab *x)
+{
+	t_jit_freenect_grab **link;
+	
+	systhread_mutex_lock(motor_mutex);
+	for(link = &motor_first; *link; link = &(*link)->motor_next){
+		if(*link == x){
+			*link = x->motor_next;
+			break;
+		}
+	}
+	x->motor_next = NULL;
+	systhread_mutex_unlock(motor_mutex);
+}
+
+// Capture thread: starts and stops streams so that those in wanted run. Stopping one
+// tears down its iso transfers, which must not happen under process_events.
+static void motor_streams(t_jit_freenect_grab *x, int wanted)
+{
+	int changed = wanted ^ x->streams_started;
+	
+	if(changed & 1){
+		(wanted & 1) ? freenect_start_depth(x->device) : freenect_stop_depth(x->device);
+	}
+	if(changed & 2){
+		(wanted & 2) ? freenect_start_video(x->device) : freenect_stop_video(x->device);
+	}
+	x->streams_started = wanted;
+}
+
+// Capture thread: sends a queued tilt, applies queued stream changes and reads the motor
+// state when it is due. All are USB transfers, which is why nobody else makes them.
+static void motor_refresh(t_jit_freenect_grab *x, uint64_t now)
+{
+	freenect_raw_tilt_state *state;
+	double tilt, ax, ay, az;
+	int pending;
+	long interval = x->motor_interval;
+	
+	pending = __atomic_exchange_n(&x->tilt_pending, 0, __ATOMIC_ACQUIRE);
+	if(pending){
+		freenect_set_tilt_degs(x->device, (signed char)(pending & 0xFF));
+	}
+	pending = __atomic_exchange_n(&x->streams_pending, 0, __ATOMIC_ACQUIRE);
+	if(pending){
+		motor_streams(x, pending & 3);
+	}
+	
+	if((interval <= 0) || (x->motor_polled && (now - x->motor_polled < (uint64_t)interval * 1000000))){
+		return;
+	}
+	x->motor_polled = now;
+	if(freenect_update_tilt_state(x->device) < 0){
+		return;
+	}
+	state = freenect_get_tilt_state(x->device);
+	if(!state){
+		return;
+	}
+	tilt = freenect_get_tilt_degs(state);
+	freenect_get_mks_accel(state, &ax, &ay, &az);
+	
+	systhread_mutex_lock(x->motor_state_mutex);
+	x->motor_tilt = tilt;
+	x->motor_accel[0] = ax;
+	x->motor_accel[1] = ay;
+	x->motor_accel[2] = az;
+	x->motor_time = now;
+	systhread_mutex_unlock(x->motor_state_mutex);
+}
+
+static void motor_poll(void)
+{
+	t_jit_freenect_grab *x;
+	uint64_t now = freenect_now_ns();
+	
+	systhread_mutex_lock(motor_mutex);
+	for(x = motor_first; x; x = x->motor_next){
+		motor_refresh(x, now);
+	}
+	systhread_mutex_unlock(motor_mutex);
 }
 
 #pragma mark - Threading Stuff
@@ -1516,9 +3730,10 @@ void *jit_freenect_capture_threadproc()//t_jit_freenect_grab *x)
 	
 	f_ctx = context;
 	
+	// Short enough for queued tilt commands and motor refreshes to go out when no frames arrive
 	struct timeval timeout;
-	timeout.tv_sec = 60;
-	timeout.tv_usec = 0;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 50000;
 	
 	// loop until told to stop
 	while (1) {
@@ -1546,6 +3761,7 @@ void *jit_freenect_capture_threadproc()//t_jit_freenect_grab *x)
 				//if (x->x_systhread_cancel) 
 				break;
 			}
+		motor_poll();
 		//}
 		//else {
 		//	postNesa("freenect_active=false\n");
@@ -0,0 +1,549 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.kernels.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+t_freenect_kernels freenect_kernels;
+
+static inline uint16_t clamp_depth(uint16_t v, uint16_t max){
+	return v > max ? max : v;
+}
+
+#pragma mark - Scalar
+
+static void depth_lut_f32_scalar(const uint16_t *in, float *out, long n, const float *lut, uint16_t max){
+	long i;
+	for(i=0;i<n;i++){
+		out[i] = lut[clamp_depth(in[i], max)];
+	}
+}
+
+static void depth_lut_f64_scalar(const uint16_t *in, double *out, long n, const double *lut, uint16_t max){
+	long i;
+	for(i=0;i<n;i++){
+		out[i] = lut[clamp_depth(in[i], max)];
+	}
+}
+
+static void depth_lut_i32_scalar(const uint16_t *in, int32_t *out, long n, const int32_t *lut, uint16_t max){
+	long i;
+	for(i=0;i<n;i++){
+		out[i] = lut[clamp_depth(in[i], max)];
+	}
+}
+
+static void rgb_to_argb_scalar(const uint8_t *in, uint8_t *out, long n){
+	long i;
+	for(i=0;i<n;i++){
+		out[0] = 0xFF;
+		out[1] = in[0];
+		out[2] = in[1];
+		out[3] = in[2];
+		out += 4;
+		in += 3;
+	}
+}
+
+#if FREENECT_X86
+
+#pragma mark - SSE2
+
+// SSE2 has no unsigned 16-bit min: a - (a -sat b) == min(a,b)
+FREENECT_TARGET("sse2")
+static inline __m128i clamp_depth_sse2(__m128i v, __m128i max){
+	return _mm_sub_epi16(v, _mm_subs_epu16(v, max));
+}
+
+// No gather before AVX2: clamp eight indices at once, then unroll the loads.
+FREENECT_TARGET("sse2")
+static void depth_lut_f32_sse2(const uint16_t *in, float *out, long n, const float *lut, uint16_t max){
+	long i = 0;
+	const __m128i vmax = _mm_set1_epi16((short)max);
+
+	for(;i+8<=n;i+=8){
+		__m128i v = clamp_depth_sse2(_mm_loadu_si128((const __m128i *)(in + i)), vmax);
+		_mm_storeu_ps(out + i, _mm_setr_ps(lut[_mm_extract_epi16(v, 0)], lut[_mm_extract_epi16(v, 1)],
+										   lut[_mm_extract_epi16(v, 2)], lut[_mm_extract_epi16(v, 3)]));
+		_mm_storeu_ps(out + i + 4, _mm_setr_ps(lut[_mm_extract_epi16(v, 4)], lut[_mm_extract_epi16(v, 5)],
+											   lut[_mm_extract_epi16(v, 6)], lut[_mm_extract_epi16(v, 7)]));
+	}
+	depth_lut_f32_scalar(in + i, out + i, n - i, lut, max);
+}
+
+FREENECT_TARGET("sse2")
+static void depth_lut_f64_sse2(const uint16_t *in, double *out, long n, const double *lut, uint16_t max){
+	long i = 0;
+	const __m128i vmax = _mm_set1_epi16((short)max);
+
+	for(;i+8<=n;i+=8){
+		__m128i v = clamp_depth_sse2(_mm_loadu_si128((const __m128i *)(in + i)), vmax);
+		_mm_storeu_pd(out + i,     _mm_set_pd(lut[_mm_extract_epi16(v, 1)], lut[_mm_extract_epi16(v, 0)]));
+		_mm_storeu_pd(out + i + 2, _mm_set_pd(lut[_mm_extract_epi16(v, 3)], lut[_mm_extract_epi16(v, 2)]));
+		_mm_storeu_pd(out + i + 4, _mm_set_pd(lut[_mm_extract_epi16(v, 5)], lut[_mm_extract_epi16(v, 4)]));
+		_mm_storeu_pd(out + i + 6, _mm_set_pd(lut[_mm_extract_epi16(v, 7)], lut[_mm_extract_epi16(v, 6)]));
+	}
+	depth_lut_f64_scalar(in + i, out + i, n - i, lut, max);
+}
+
+FREENECT_TARGET("sse2")
+static void depth_lut_i32_sse2(const uint16_t *in, int32_t *out, long n, const int32_t *lut, uint16_t max){
+	long i = 0;
+	const __m128i vmax = _mm_set1_epi16((short)max);
+
+	for(;i+8<=n;i+=8){
+		__m128i v = clamp_depth_sse2(_mm_loadu_si128((const __m128i *)(in + i)), vmax);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_set_epi32(lut[_mm_extract_epi16(v, 3)], lut[_mm_extract_epi16(v, 2)],
+															   lut[_mm_extract_epi16(v, 1)], lut[_mm_extract_epi16(v, 0)]));
+		_mm_storeu_si128((__m128i *)(out + i + 4), _mm_set_epi32(lut[_mm_extract_epi16(v, 7)], lut[_mm_extract_epi16(v, 6)],
+																   lut[_mm_extract_epi16(v, 5)], lut[_mm_extract_epi16(v, 4)]));
+	}
+	depth_lut_i32_scalar(in + i, out + i, n - i, lut, max);
+}
+
+#pragma mark - SSSE3
+
+// Spreads 4 packed RGB pixels (12 bytes) over 16 bytes, leaving a zero byte in front of each
+#define ARGB_SHUFFLE_MASK _mm_setr_epi8(-128, 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11)
+#define ARGB_ALPHA 0x000000FF
+
+FREENECT_TARGET("ssse3")
+static void rgb_to_argb_ssse3(const uint8_t *in, uint8_t *out, long n){
+	const __m128i mask = ARGB_SHUFFLE_MASK;
+	const __m128i alpha = _mm_set1_epi32(ARGB_ALPHA);
+	long i = 0;
+
+	// 16 pixels: 48 bytes in, 64 bytes out
+	for(;i+16<=n;i+=16){
+		__m128i a = _mm_loadu_si128((const __m128i *)in);
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(in + 32));
+		_mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_shuffle_epi8(a, mask), alpha));
+		_mm_storeu_si128((__m128i *)(out + 16), _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), mask), alpha));
+		_mm_storeu_si128((__m128i *)(out + 32), _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), mask), alpha));
+		_mm_storeu_si128((__m128i *)(out + 48), _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c, 4), mask), alpha));
+		in += 48;
+		out += 64;
+	}
+	rgb_to_argb_scalar(in, out, n - i);
+}
+
+#pragma mark - AVX2
+
+FREENECT_TARGET("avx2")
+static inline __m256i load_depth8_avx2(const uint16_t *in, __m128i max){
+	__m128i v = _mm_loadu_si128((const __m128i *)in);
+	return _mm256_cvtepu16_epi32(_mm_min_epu16(v, max));
+}
+
+FREENECT_TARGET("avx2")
+static void depth_lut_f32_avx2(const uint16_t *in, float *out, long n, const float *lut, uint16_t max){
+	long i = 0;
+	const __m128i vmax = _mm_set1_epi16((short)max);
+
+	for(;i+16<=n;i+=16){
+		__m256 a = _mm256_i32gather_ps(lut, load_depth8_avx2(in + i, vmax), 4);
+		__m256 b = _mm256_i32gather_ps(lut, load_depth8_avx2(in + i + 8, vmax), 4);
+		_mm256_storeu_ps(out + i, a);
+		_mm256_storeu_ps(out + i + 8, b);
+	}
+	depth_lut_f32_scalar(in + i, out + i, n - i, lut, max);
+}
+
+FREENECT_TARGET("avx2")
+static void depth_lut_f64_avx2(const uint16_t *in, double *out, long n, const double *lut, uint16_t max){
+	long i = 0;
+	const __m128i vmax = _mm_set1_epi16((short)max);
+
+	for(;i+8<=n;i+=8){
+		__m256i idx = load_depth8_avx2(in + i, vmax);
+		_mm256_storeu_pd(out + i, _mm256_i32gather_pd(lut, _mm256_castsi256_si128(idx), 8));
+		_mm256_storeu_pd(out + i + 4, _mm256_i32gather_pd(lut, _mm256_extracti128_si256(idx, 1), 8));
+	}
+	depth_lut_f64_scalar(in + i, out + i, n - i, lut, max);
+}
+
+FREENECT_TARGET("avx2")
+static void depth_lut_i32_avx2(const uint16_t *in, int32_t *out, long n, const int32_t *lut, uint16_t max){
+	long i = 0;
+	const __m128i vmax = _mm_set1_epi16((short)max);
+
+	for(;i+16<=n;i+=16){
+		__m256i a = _mm256_i32gather_epi32((const int *)lut, load_depth8_avx2(in + i, vmax), 4);
+		__m256i b = _mm256_i32gather_epi32((const int *)lut, load_depth8_avx2(in + i + 8, vmax), 4);
+		_mm256_storeu_si256((__m256i *)(out + i), a);
+		_mm256_storeu_si256((__m256i *)(out + i + 8), b);
+	}
+	depth_lut_i32_scalar(in + i, out + i, n - i, lut, max);
+}
+
+FREENECT_TARGET("avx2")
+static void rgb_to_argb_avx2(const uint8_t *in, uint8_t *out, long n){
+	const __m256i mask = _mm256_broadcastsi128_si256(ARGB_SHUFFLE_MASK);
+	const __m256i alpha = _mm256_set1_epi32(ARGB_ALPHA);
+	long i = 0;
+
+	// Same splitting as the SSSE3 version, shuffling two 4-pixel groups per instruction
+	for(;i+16<=n;i+=16){
+		__m128i a = _mm_loadu_si128((const __m128i *)in);
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(in + 32));
+		__m256i lo = _mm256_inserti128_si256(_mm256_castsi128_si256(a), _mm_alignr_epi8(b, a, 12), 1);
+		__m256i hi = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_alignr_epi8(c, b, 8)), _mm_srli_si128(c, 4), 1);
+		_mm256_storeu_si256((__m256i *)out, _mm256_or_si256(_mm256_shuffle_epi8(lo, mask), alpha));
+		_mm256_storeu_si256((__m256i *)(out + 32), _mm256_or_si256(_mm256_shuffle_epi8(hi, mask), alpha));
+		in += 48;
+		out += 64;
+	}
+	rgb_to_argb_scalar(in, out, n - i);
+}
+
+#endif // FREENECT_X86
+
+#pragma mark - Dispatch
+
+t_freenect_cpu_level freenect_cpu_detect(void){
+#if FREENECT_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		return FREENECT_CPU_AVX2;
+	}
+	if(__builtin_cpu_supports("ssse3")){
+		return FREENECT_CPU_SSSE3;
+	}
+	if(__builtin_cpu_supports("sse2")){
+		return FREENECT_CPU_SSE2;
+	}
+#endif
+	return FREENECT_CPU_SCALAR;
+}
+
+const char *freenect_cpu_level_name(t_freenect_cpu_level level){
+	switch(level){
+		case FREENECT_CPU_SSE2:
+			return "sse2";
+		case FREENECT_CPU_SSSE3:
+			return "ssse3";
+		case FREENECT_CPU_AVX2:
+			return "avx2";
+		default:
+			return "scalar";
+	}
+}
+
+void freenect_kernels_select(t_freenect_kernels *k, t_freenect_cpu_level level){
+	t_freenect_cpu_level supported = freenect_cpu_detect();
+
+	if(level > supported){
+		level = supported;
+	}
+
+	k->level = FREENECT_CPU_SCALAR;
+	k->depth_lut_f32 = depth_lut_f32_scalar;
+	k->depth_lut_f64 = depth_lut_f64_scalar;
+	k->depth_lut_i32 = depth_lut_i32_scalar;
+	k->rgb_to_argb = rgb_to_argb_scalar;
+
+#if FREENECT_X86
+	if(level >= FREENECT_CPU_SSE2){
+		k->level = FREENECT_CPU_SSE2;
+		k->depth_lut_f32 = depth_lut_f32_sse2;
+		k->depth_lut_f64 = depth_lut_f64_sse2;
+		k->depth_lut_i32 = depth_lut_i32_sse2;
+	}
+	if(level >= FREENECT_CPU_SSSE3){
+		k->level = FREENECT_CPU_SSSE3;
+		k->rgb_to_argb = rgb_to_argb_ssse3;
+	}
+	if(level >= FREENECT_CPU_AVX2){
+		k->level = FREENECT_CPU_AVX2;
+		k->depth_lut_f32 = depth_lut_f32_avx2;
+		k->depth_lut_f64 = depth_lut_f64_avx2;
+		k->depth_lut_i32 = depth_lut_i32_avx2;
+		k->rgb_to_argb = rgb_to_argb_avx2;
+	}
+#endif
+}
+
+void freenect_kernels_init(void){
+	freenect_kernels_select(&freenect_kernels, freenect_cpu_detect());
+}
+
+#pragma mark - Lookup Tables
+
+long freenect_depth_cellbytes(t_freenect_depth_type type){
+	switch(type){
+		case FREENECT_DEPTH_FLOAT64:
+			return sizeof(double);
+		case FREENECT_DEPTH_LONG:
+			return sizeof(int32_t);
+		default:
+			return sizeof(float);
+	}
+}
+
+// Burrus' fit of raw disparity to metres: 1 / (DEPTH_FIT_A - DEPTH_FIT_B * raw)
+#define DEPTH_FIT_A 3.3309495
+#define DEPTH_FIT_B 0.0030711016
+
+double freenect_depth_metres(uint16_t d){
+	double inv = DEPTH_FIT_A - DEPTH_FIT_B * (double)d;
+
+	if((d >= FREENECT_DEPTH_MAX) || (inv <= 0.)){
+		return 0.;
+	}
+	return 1. / inv;
+}
+
+static inline double lut_metres(const double *metres, long i){
+	return metres ? metres[i] : freenect_depth_metres((uint16_t)i);
+}
+
+static void depth_lut_fill_f32(float *lut, int mode, const double *metres){
+	long i;
+
+	switch(mode){
+		case 0:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (float)i;
+			}
+			break;
+		case 1:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (float)i * (1.f / (float)FREENECT_DEPTH_MAX);
+			}
+			break;
+		case 2:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = 1.f - ((float)i * (1.f / (float)FREENECT_DEPTH_MAX));
+			}
+			break;
+		case 3:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (float)(lut_metres(metres, i) * 100.);
+			}
+			break;
+		case 4:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (float)lut_metres(metres, i);
+			}
+			break;
+	}
+}
+
+static void depth_lut_fill_f64(double *lut, int mode, const double *metres){
+	long i;
+
+	switch(mode){
+		case 0:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (double)i;
+			}
+			break;
+		case 1:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (double)i * (1.0 / (double)FREENECT_DEPTH_MAX);
+			}
+			break;
+		case 2:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = 1.0 - ((double)i * (1.0 / (double)FREENECT_DEPTH_MAX));
+			}
+			break;
+		case 3:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = lut_metres(metres, i) * 100.;
+			}
+			break;
+		case 4:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = lut_metres(metres, i);
+			}
+			break;
+	}
+}
+
+static void depth_lut_fill_i32(int32_t *lut, int mode, const double *metres){
+	long i;
+
+	switch(mode){
+		case 0:
+		case 1:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (int32_t)i;
+			}
+			break;
+		case 2:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (int32_t)(FREENECT_DEPTH_MAX - i);
+			}
+			break;
+		case 3:
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (int32_t)(lut_metres(metres, i) * 100. + 0.5);
+			}
+			break;
+		case 4:
+			// Millimetres, as registered depth
+			for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+				lut[i] = (int32_t)(lut_metres(metres, i) * 1000. + 0.5);
+			}
+			break;
+	}
+}
+
+void freenect_depth_lut_fill(void *lut, t_freenect_depth_type type, int mode, const double *metres){
+	switch(type){
+		case FREENECT_DEPTH_FLOAT32:
+			depth_lut_fill_f32((float *)lut, mode, metres);
+			break;
+		case FREENECT_DEPTH_FLOAT64:
+			depth_lut_fill_f64((double *)lut, mode, metres);
+			break;
+		case FREENECT_DEPTH_LONG:
+			depth_lut_fill_i32((int32_t *)lut, mode, metres);
+			break;
+	}
+}
+
+// Registered depth, i in millimetres. Inverted keeps 0 without a reading, as raw disparity
+// does at FREENECT_DEPTH_MAX.
+static double depth_mm_value(long i, int mode){
+	switch(mode){
+		case 1:
+			return (double)i * (1.0 / (double)FREENECT_DEPTH_MM_MAX);
+		case 2:
+			return i ? 1.0 - ((double)i * (1.0 / (double)FREENECT_DEPTH_MM_MAX)) : 0.;
+		case 3:
+			return (double)i * 0.1;
+		case 4:
+			return (double)i * 0.001;
+		default:
+			return (double)i;
+	}
+}
+
+static int32_t depth_mm_value_i32(long i, int mode){
+	switch(mode){
+		case 2:
+			return i ? (int32_t)(FREENECT_DEPTH_MM_MAX - i) : 0;
+		case 3:
+			return (int32_t)((i + 5) / 10);
+		default:
+			return (int32_t)i;
+	}
+}
+
+void freenect_depth_mm_lut_fill(void *lut, t_freenect_depth_type type, int mode){
+	long i;
+
+	switch(type){
+		case FREENECT_DEPTH_FLOAT32:
+			for(i=0;i<FREENECT_DEPTH_MM_LUT_SIZE;i++){
+				((float *)lut)[i] = (float)depth_mm_value(i, mode);
+			}
+			break;
+		case FREENECT_DEPTH_FLOAT64:
+			for(i=0;i<FREENECT_DEPTH_MM_LUT_SIZE;i++){
+				((double *)lut)[i] = depth_mm_value(i, mode);
+			}
+			break;
+		case FREENECT_DEPTH_LONG:
+			for(i=0;i<FREENECT_DEPTH_MM_LUT_SIZE;i++){
+				((int32_t *)lut)[i] = depth_mm_value_i32(i, mode);
+			}
+			break;
+	}
+}
+
+#pragma mark - Frame Conversion
+
+void freenect_convert_depth_rows(const uint16_t *in, long width, char *out, long out_stride,
+								 t_freenect_depth_type type, const void *lut, uint16_t max, long begin, long end){
+	long i;
+
+	in += width * begin;
+	out += out_stride * begin;
+
+	switch(type){
+		case FREENECT_DEPTH_FLOAT32:
+			for(i=begin;i<end;i++){
+				freenect_kernels.depth_lut_f32(in, (float *)out, width, (const float *)lut, max);
+				in += width;
+				out += out_stride;
+			}
+			break;
+		case FREENECT_DEPTH_FLOAT64:
+			for(i=begin;i<end;i++){
+				freenect_kernels.depth_lut_f64(in, (double *)out, width, (const double *)lut, max);
+				in += width;
+				out += out_stride;
+			}
+			break;
+		case FREENECT_DEPTH_LONG:
+			for(i=begin;i<end;i++){
+				freenect_kernels.depth_lut_i32(in, (int32_t *)out, width, (const int32_t *)lut, max);
+				in += width;
+				out += out_stride;
+			}
+			break;
+	}
+}
+
+// Copies rows of rowbytes each, as one block when the destination is not padded
+static void copy_rows(const uint8_t *in, long rowbytes, char *out, long out_stride, long rows){
+	long i;
+
+	if(out_stride == rowbytes){
+		memcpy(out, in, rowbytes * rows);
+		return;
+	}
+	for(i=0;i<rows;i++){
+		memcpy(out + out_stride * i, in + rowbytes * i, rowbytes);
+	}
+}
+
+void freenect_convert_rgb_rows(const uint8_t *in, long width, char *out, long out_stride,
+							   long planecount, long begin, long end){
+	long i;
+	long inbytes = (planecount == 1) ? width : width * 3;
+
+	in += inbytes * begin;
+	out += out_stride * begin;
+
+	if(planecount == 4){
+		for(i=begin;i<end;i++){
+			freenect_kernels.rgb_to_argb(in, (uint8_t *)out, width);
+			in += inbytes;
+			out += out_stride;
+		}
+	}
+	else if((planecount == 3) || (planecount == 1)){
+		copy_rows(in, inbytes, out, out_stride, end - begin);
+	}
+}
@@ -0,0 +1,100 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Per-row conversion kernels used by jit.freenect.grab.
+
+ This file does not depend on the Max SDK so the kernels can be built and
+ benchmarked on their own (see bench/). Every kernel has a scalar version and,
+ on x86, SSE2/SSSE3 and AVX2 versions. The best one supported by the host CPU is
+ picked once by freenect_kernels_init(); all versions give identical results.
+*/
+
+#ifndef JIT_FREENECT_KERNELS_H
+#define JIT_FREENECT_KERNELS_H
+
+#include <stdint.h>
+
+#define FREENECT_DEPTH_LUT_SIZE 0x800
+#define FREENECT_DEPTH_MAX      0x7FF
+// Registered depth is in millimetres, up to libfreenect's DEPTH_MAX_METRIC_VALUE
+#define FREENECT_DEPTH_MM_MAX       10000
+#define FREENECT_DEPTH_MM_LUT_SIZE  (FREENECT_DEPTH_MM_MAX + 1)
+
+typedef enum _freenect_cpu_level {
+	FREENECT_CPU_SCALAR = 0,
+	FREENECT_CPU_SSE2,
+	FREENECT_CPU_SSSE3,
+	FREENECT_CPU_AVX2
+} t_freenect_cpu_level;
+
+typedef struct _freenect_kernels {
+	t_freenect_cpu_level level;
+	// out[i] = lut[in[i]], indices are clamped to max, the last entry of lut
+	void (*depth_lut_f32)(const uint16_t *in, float *out, long n, const float *lut, uint16_t max);
+	void (*depth_lut_f64)(const uint16_t *in, double *out, long n, const double *lut, uint16_t max);
+	void (*depth_lut_i32)(const uint16_t *in, int32_t *out, long n, const int32_t *lut, uint16_t max);
+	// packed RGB to ARGB with alpha = 0xFF, n pixels
+	void (*rgb_to_argb)(const uint8_t *in, uint8_t *out, long n);
+} t_freenect_kernels;
+
+// Depth output cell types, matching the Jitter types float32, float64 and long
+typedef enum _freenect_depth_type {
+	FREENECT_DEPTH_FLOAT32 = 0,
+	FREENECT_DEPTH_FLOAT64,
+	FREENECT_DEPTH_LONG
+} t_freenect_depth_type;
+
+#define FREENECT_DEPTH_TYPES 3
+#define FREENECT_DEPTH_MODES 5
+
+// Active kernel table, filled by freenect_kernels_init()
+extern t_freenect_kernels freenect_kernels;
+
+t_freenect_cpu_level    freenect_cpu_detect(void);
+const char              *freenect_cpu_level_name(t_freenect_cpu_level level);
+void                    freenect_kernels_init(void);
+// Fills k with the kernels for level, or for the best level below it the CPU supports.
+void                    freenect_kernels_select(t_freenect_kernels *k, t_freenect_cpu_level level);
+
+long                    freenect_depth_cellbytes(t_freenect_depth_type type);
+// Metres in front of the camera for raw disparity d with the default calibration
+// (Burrus' fit), 0 without a reading
+double                  freenect_depth_metres(uint16_t d);
+// Fills the FREENECT_DEPTH_LUT_SIZE entries of lut for the given output mode:
+// 0 raw, 1 normalized, 2 inverted, 3 centimetres, 4 metres. metres maps raw disparity
+// to distance for modes 3 and 4, 0 without a reading; NULL uses freenect_depth_metres().
+void                    freenect_depth_lut_fill(void *lut, t_freenect_depth_type type, int mode, const double *metres);
+// Same for registered depth: fills the FREENECT_DEPTH_MM_LUT_SIZE entries of lut from
+// millimetres, 0 without a reading. Normalized and inverted span FREENECT_DEPTH_MM_MAX;
+// long output is in millimetres for modes 1 and 4, as raw.
+void                    freenect_depth_mm_lut_fill(void *lut, t_freenect_depth_type type, int mode);
+
+// Whole-row conversions with the active kernels. Rows [begin, end) of a
+// width-pixel frame are written at out + out_stride * row, so disjoint ranges
+// can be converted concurrently. max is the last entry of lut.
+void                    freenect_convert_depth_rows(const uint16_t *in, long width, char *out, long out_stride,
+													t_freenect_depth_type type, const void *lut, uint16_t max,
+													long begin, long end);
+// planecount 4: ARGB, 3: packed RGB, 1: IR. in holds 3 bytes per pixel, or 1 for IR.
+void                    freenect_convert_rgb_rows(const uint8_t *in, long width, char *out, long out_stride,
+												  long planecount, long begin, long end);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.lut.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define CALIBRATION_MAX_POINTS FREENECT_DEPTH_LUT_SIZE
+
+static pthread_mutex_t lut_lock = PTHREAD_MUTEX_INITIALIZER;
+static t_freenect_lut *lut_first;
+
+#pragma mark - Cache
+
+static t_freenect_lut *lut_build(t_freenect_depth_type type, int mode, int mm, const t_freenect_calibration *cal){
+	t_freenect_lut *lut = (t_freenect_lut *)malloc(sizeof(t_freenect_lut));
+	long size = mm ? FREENECT_DEPTH_MM_LUT_SIZE : FREENECT_DEPTH_LUT_SIZE;
+
+	if(!lut){
+		return NULL;
+	}
+	if(posix_memalign(&lut->table, FREENECT_LUT_ALIGN, size * freenect_depth_cellbytes(type))){
+		free(lut);
+		return NULL;
+	}
+	if(mm){
+		freenect_depth_mm_lut_fill(lut->table, type, mode);
+		cal = NULL;
+	}
+	else{
+		freenect_depth_lut_fill(lut->table, type, mode, cal ? cal->metres : NULL);
+	}
+	lut->type = type;
+	lut->mode = mode;
+	lut->mm = mm;
+	lut->max = (uint16_t)(size - 1);
+	lut->key = cal ? cal->key : 0;
+	lut->refs = 1;
+	lut->next = NULL;
+	return lut;
+}
+
+const t_freenect_lut *freenect_lut_acquire(t_freenect_depth_type type, int mode, int mm, const t_freenect_calibration *cal){
+	t_freenect_lut *lut;
+
+	pthread_mutex_lock(&lut_lock);
+	for(lut = lut_first; lut; lut = lut->next){
+		if(freenect_lut_matches(lut, type, mode, mm, cal)){
+			lut->refs++;
+			pthread_mutex_unlock(&lut_lock);
+			return lut;
+		}
+	}
+	// Built under the lock, so two instances asking at once share the result
+	lut = lut_build(type, mode, mm, cal);
+	if(lut){
+		lut->next = lut_first;
+		lut_first = lut;
+	}
+	pthread_mutex_unlock(&lut_lock);
+	return lut;
+}
+
+void freenect_lut_release(const t_freenect_lut *lut){
+	t_freenect_lut **link;
+
+	if(!lut){
+		return;
+	}
+	pthread_mutex_lock(&lut_lock);
+	for(link = &lut_first; *link; link = &(*link)->next){
+		if(*link == lut){
+			if(!--(*link)->refs){
+				*link = lut->next;
+				free(lut->table);
+				free((void *)lut);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lut_lock);
+}
+
+long freenect_lut_count(void){
+	t_freenect_lut *lut;
+	long n = 0;
+
+	pthread_mutex_lock(&lut_lock);
+	for(lut = lut_first; lut; lut = lut->next){
+		n++;
+	}
+	pthread_mutex_unlock(&lut_lock);
+	return n;
+}
+
+#pragma mark - Calibration
+
+typedef struct _calibration_point {
+	double raw;
+	double inverse;     // 1 / metres
+} t_calibration_point;
+
+static int point_compare(const void *a, const void *b){
+	double d = ((const t_calibration_point *)a)->raw - ((const t_calibration_point *)b)->raw;
+	return (d > 0) - (d < 0);
+}
+
+// FNV-1a over the curve, equal curves share their tables
+static uint64_t calibration_key(const t_freenect_calibration *cal){
+	const uint8_t *p = (const uint8_t *)cal->metres;
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t i;
+
+	for(i=0;i<sizeof(cal->metres);i++){
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	}
+	return h ? h : 1;
+}
+
+int freenect_calibration_from_points(t_freenect_calibration *cal, const double *raw, const double *metres, long n){
+	t_calibration_point *points;
+	double inverse;
+	long i, k = 0;
+
+	if((n < 2) || (n > CALIBRATION_MAX_POINTS)){
+		return -1;
+	}
+	points = (t_calibration_point *)malloc(n * sizeof(t_calibration_point));
+	if(!points){
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		if(!(metres[i] > 0.)){
+			free(points);
+			return -1;
+		}
+		points[i].raw = raw[i];
+		points[i].inverse = 1. / metres[i];
+	}
+	qsort(points, n, sizeof(t_calibration_point), point_compare);
+	for(i=1;i<n;i++){
+		if(points[i].raw == points[i-1].raw){
+			free(points);
+			return -1;
+		}
+	}
+
+	// Piecewise linear in inverse depth, the end segments extended past the points
+	for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+		while((k < n - 2) && (i > points[k+1].raw)){
+			k++;
+		}
+		inverse = points[k].inverse + (points[k+1].inverse - points[k].inverse) *
+				  ((double)i - points[k].raw) / (points[k+1].raw - points[k].raw);
+		cal->metres[i] = ((i < FREENECT_DEPTH_MAX) && (inverse > 0.)) ? 1. / inverse : 0.;
+	}
+	free(points);
+	cal->key = calibration_key(cal);
+	return 0;
+}
+
+int freenect_calibration_load(t_freenect_calibration *cal, const char *path){
+	double *raw, *metres;
+	char line[256], *p;
+	long n = 0;
+	int err;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if(!f){
+		return -1;
+	}
+	raw = (double *)malloc(CALIBRATION_MAX_POINTS * sizeof(double));
+	metres = (double *)malloc(CALIBRATION_MAX_POINTS * sizeof(double));
+	if(!raw || !metres){
+		free(raw);
+		free(metres);
+		fclose(f);
+		return -1;
+	}
+	err = 0;
+	while(!err && fgets(line, sizeof(line), f)){
+		if((p = strchr(line, '#'))){
+			*p = 0;
+		}
+		for(p=line;(*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n');p++);
+		if(!*p){
+			continue;
+		}
+		if((n == CALIBRATION_MAX_POINTS) || (sscanf(p, "%lf %lf", &raw[n], &metres[n]) != 2)){
+			err = -1;
+		}
+		n++;
+	}
+	fclose(f);
+	if(!err){
+		err = freenect_calibration_from_points(cal, raw, metres, n);
+	}
+	free(raw);
+	free(metres);
+	return err;
+}
@@ -0,0 +1,81 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Depth lookup tables shared by every jit.freenect.grab instance.
+
+ A table depends only on the output type, the mode, the calibration and
+ whether the input is raw disparity or registered millimetres, so
+ each combination is built once, on first use, and handed out to every
+ instance asking for it. Tables are never modified once built and are freed
+ when the last user releases them; all functions may be called from any
+ thread.
+
+ A calibration maps each raw disparity to metres, 0 without a reading.
+ Instances without one use freenect_depth_metres(), a fit that suits most
+ Kinects; a device-specific curve can be measured as a few (raw, metres)
+ points, which are interpolated in inverse depth, where the Kinect is linear.
+*/
+
+#ifndef JIT_FREENECT_LUT_H
+#define JIT_FREENECT_LUT_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+
+#define FREENECT_LUT_ALIGN 64
+
+typedef struct _freenect_calibration {
+	uint64_t    key;                                // identifies the curve, never 0
+	double      metres[FREENECT_DEPTH_LUT_SIZE];
+} t_freenect_calibration;
+
+typedef struct _freenect_lut {
+	void                    *table;     // max + 1 cells of type
+	t_freenect_depth_type   type;
+	int                     mode;
+	int                     mm;         // indexed by registered millimetres rather than raw disparity
+	uint16_t                max;        // last index, FREENECT_DEPTH_MAX or FREENECT_DEPTH_MM_MAX
+	uint64_t                key;        // of the calibration, 0 for the default one or mm
+	long                    refs;       // guarded by the cache lock
+	struct _freenect_lut    *next;
+} t_freenect_lut;
+
+// Shared table for type, mode and cal (NULL for the default calibration), built on
+// first use. mm tables convert registered depth and ignore cal. Returns NULL when out
+// of memory. Every table acquired must be released.
+const t_freenect_lut    *freenect_lut_acquire(t_freenect_depth_type type, int mode, int mm, const t_freenect_calibration *cal);
+void                    freenect_lut_release(const t_freenect_lut *lut);
+// Tables currently cached
+long                    freenect_lut_count(void);
+
+static inline int freenect_lut_matches(const t_freenect_lut *lut, t_freenect_depth_type type, int mode, int mm,
+									   const t_freenect_calibration *cal){
+	return lut && (lut->type == type) && (lut->mode == mode) && (lut->mm == mm) &&
+		   (lut->key == ((cal && !mm) ? cal->key : 0));
+}
+
+// Builds cal from n points (raw[i], metres[i]), n >= 2, with distinct raw values in
+// any order. Returns 0 on success.
+int     freenect_calibration_from_points(t_freenect_calibration *cal, const double *raw, const double *metres, long n);
+// Same from a text file of "raw metres" pairs, one per line; # starts a comment
+int     freenect_calibration_load(t_freenect_calibration *cal, const char *path);
+
+#endif
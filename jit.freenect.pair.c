@@ -0,0 +1,156 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.pair.h"
+#include "jit.freenect.buffers.h"
+#include <stdlib.h>
+#include <string.h>
+
+int freenect_pairer_init(t_freenect_pairer *p, long depth_bytes, long video_bytes){
+	int i;
+
+	memset(p, 0, sizeof(t_freenect_pairer));
+	p->bytes[FREENECT_PAIR_DEPTH] = depth_bytes;
+	p->bytes[FREENECT_PAIR_VIDEO] = video_bytes;
+	for(i=0;i<FREENECT_PAIR_BUFFERS;i++){
+		p->buffers[FREENECT_PAIR_DEPTH][i] = freenect_buffer_get(depth_bytes);
+		p->buffers[FREENECT_PAIR_VIDEO][i] = freenect_buffer_get(video_bytes);
+		if(!p->buffers[FREENECT_PAIR_DEPTH][i] || !p->buffers[FREENECT_PAIR_VIDEO][i]){
+			freenect_pairer_free(p);
+			return -1;
+		}
+	}
+	freenect_pairer_reset(p);
+	return 0;
+}
+
+void freenect_pairer_free(t_freenect_pairer *p){
+	int i;
+
+	for(i=0;i<FREENECT_PAIR_BUFFERS;i++){
+		freenect_buffer_put(p->buffers[FREENECT_PAIR_DEPTH][i]);
+		freenect_buffer_put(p->buffers[FREENECT_PAIR_VIDEO][i]);
+	}
+	memset(p, 0, sizeof(t_freenect_pairer));
+}
+
+void freenect_pairer_reset(t_freenect_pairer *p){
+	int s, i;
+
+	for(s=0;s<2;s++){
+		for(i=0;i<FREENECT_PAIR_BUFFERS;i++){
+			p->free[s][i] = p->buffers[s][i];
+		}
+		p->nfree[s] = FREENECT_PAIR_BUFFERS - 1;
+		p->fill[s] = p->buffers[s][FREENECT_PAIR_BUFFERS - 1];
+		p->queued[s] = 0;
+		p->dropped[s] = 0;
+	}
+	memset(p->slots, 0, sizeof(p->slots));
+	freenect_tribuf_init(&p->pairs, &p->slots[0], &p->slots[1], &p->slots[2]);
+	p->published = 0;
+}
+
+void *freenect_pairer_fill(t_freenect_pairer *p, int stream){
+	return p->fill[stream];
+}
+
+// Frames from outside the pool (a mapped recording) are simply forgotten
+static void release(t_freenect_pairer *p, int stream, void *data){
+	int i;
+
+	for(i=0;i<FREENECT_PAIR_BUFFERS;i++){
+		if(p->buffers[stream][i] == data){
+			p->free[stream][p->nfree[stream]++] = data;
+			return;
+		}
+	}
+}
+
+static void pop(t_freenect_pairer *p, int stream){
+	memmove(&p->queue[stream][0], &p->queue[stream][1], --p->queued[stream] * sizeof(t_freenect_frame));
+}
+
+static void drop(t_freenect_pairer *p, int stream){
+	release(p, stream, p->queue[stream][0].data);
+	pop(p, stream);
+	__atomic_add_fetch(&p->dropped[stream], 1, __ATOMIC_RELAXED);
+}
+
+static void publish(t_freenect_pairer *p, int32_t skew){
+	t_freenect_pair *slot = (t_freenect_pair *)freenect_tribuf_back(&p->pairs);
+
+	// The back slot's pair was either never read or has been replaced at the front
+	release(p, FREENECT_PAIR_DEPTH, slot->depth.data);
+	release(p, FREENECT_PAIR_VIDEO, slot->video.data);
+	slot->depth = p->queue[FREENECT_PAIR_DEPTH][0];
+	slot->video = p->queue[FREENECT_PAIR_VIDEO][0];
+	slot->skew = skew;
+	pop(p, FREENECT_PAIR_DEPTH);
+	pop(p, FREENECT_PAIR_VIDEO);
+	if(freenect_tribuf_publish(&p->pairs)){
+		// The consumer never saw the pair before this one
+		__atomic_add_fetch(&p->dropped[FREENECT_PAIR_DEPTH], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&p->dropped[FREENECT_PAIR_VIDEO], 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&p->published, 1, __ATOMIC_RELAXED);
+}
+
+// Matches the oldest frames of both queues. When they are too far apart the
+// older one cannot match anything that arrives later and goes.
+static void match(t_freenect_pairer *p){
+	int64_t tolerance = __atomic_load_n(&p->tolerance, __ATOMIC_RELAXED);
+	int32_t skew;
+
+	while(p->queued[FREENECT_PAIR_DEPTH] && p->queued[FREENECT_PAIR_VIDEO]){
+		// Signed difference, so the 32-bit device clock may wrap
+		skew = (int32_t)(p->queue[FREENECT_PAIR_VIDEO][0].timestamp - p->queue[FREENECT_PAIR_DEPTH][0].timestamp);
+		if(((int64_t)skew <= tolerance) && (-(int64_t)skew <= tolerance)){
+			publish(p, skew);
+		}
+		else{
+			drop(p, skew > 0 ? FREENECT_PAIR_DEPTH : FREENECT_PAIR_VIDEO);
+		}
+	}
+}
+
+void *freenect_pairer_push(t_freenect_pairer *p, int stream, void *data, uint32_t timestamp, uint64_t arrival){
+	if(p->queued[stream] == FREENECT_PAIR_QUEUE){
+		drop(p, stream);
+	}
+	p->queue[stream][p->queued[stream]].data = data;
+	p->queue[stream][p->queued[stream]].timestamp = timestamp;
+	p->queue[stream][p->queued[stream]].arrival = arrival;
+	p->queued[stream]++;
+	if(data == p->fill[stream]){
+		p->fill[stream] = NULL;
+	}
+
+	match(p);
+
+	if(!p->fill[stream]){
+		// Cannot happen with FREENECT_PAIR_BUFFERS per stream, but never hand out nothing
+		while(!p->nfree[stream] && p->queued[stream]){
+			drop(p, stream);
+		}
+		p->fill[stream] = p->free[stream][--p->nfree[stream]];
+	}
+	return p->fill[stream];
+}
@@ -0,0 +1,105 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Depth/video pairing by device timestamp.
+
+ Runs on the capture thread, which delivers both streams. Each stream has a
+ short queue of frames waiting for a partner. As soon as the oldest depth and
+ video frames are within the tolerance of each other they are published as a
+ pair through a triple buffer. A frame that is too old to ever be matched is
+ dropped. Nothing is copied: the pairer owns a fixed pool of buffers per
+ stream, hands one out for the device to fill, and takes it back once its
+ frame is dropped or its pair has been overwritten.
+
+ Buffers per stream: one being filled, FREENECT_PAIR_QUEUE waiting and one in
+ each of the three pair slots, so the free list can never run dry.
+*/
+
+#ifndef JIT_FREENECT_PAIR_H
+#define JIT_FREENECT_PAIR_H
+
+#include <stdint.h>
+#include "jit.freenect.sync.h"
+
+#define FREENECT_PAIR_QUEUE     3
+#define FREENECT_PAIR_BUFFERS   (FREENECT_PAIR_QUEUE + 4)
+#define FREENECT_PAIR_CLOCK     60000000    // device timestamp ticks per second
+
+enum freenect_pair_stream{
+	FREENECT_PAIR_DEPTH = 0,
+	FREENECT_PAIR_VIDEO = 1
+};
+
+typedef struct _freenect_frame {
+	void        *data;
+	uint32_t    timestamp;
+	uint64_t    arrival;        // host time, passed through for latency statistics
+} t_freenect_frame;
+
+typedef struct _freenect_pair {
+	t_freenect_frame    depth;
+	t_freenect_frame    video;
+	int32_t             skew;               // video minus depth timestamp
+} t_freenect_pair;
+
+typedef struct _freenect_pairer {
+	void                *buffers[2][FREENECT_PAIR_BUFFERS]; // owned, taken from the buffer pool by init
+	long                bytes[2];                           // of each buffer of a stream
+	void                *free[2][FREENECT_PAIR_BUFFERS];
+	int                 nfree[2];
+	void                *fill[2];                           // handed out to be filled
+	t_freenect_frame    queue[2][FREENECT_PAIR_QUEUE];      // oldest first
+	int                 queued[2];
+	t_freenect_pair     slots[3];
+	t_freenect_tribuf   pairs;                              // of t_freenect_pair, capture thread -> consumer
+	uint32_t            tolerance;                          // ticks, set from any thread
+	uint64_t            published;
+	uint64_t            dropped[2];                         // unmatched, or overwritten before being acquired
+} t_freenect_pairer;
+
+// Takes the buffers of both streams from the shared pool. Returns 0 on success.
+int     freenect_pairer_init(t_freenect_pairer *p, long depth_bytes, long video_bytes);
+void    freenect_pairer_free(t_freenect_pairer *p);
+// Forgets every frame and pair. Neither side may be running.
+void    freenect_pairer_reset(t_freenect_pairer *p);
+
+// Producer: the buffer the next frame of stream should be written to
+void    *freenect_pairer_fill(t_freenect_pairer *p, int stream);
+// Producer: queues a frame and publishes the pair it completes, if any. data is
+// normally the fill buffer, but can be any memory that outlives the pairer (a
+// mapped recording). Returns the buffer to fill next.
+void    *freenect_pairer_push(t_freenect_pairer *p, int stream, void *data, uint32_t timestamp, uint64_t arrival);
+
+static inline void freenect_pairer_set_tolerance(t_freenect_pairer *p, uint32_t ticks){
+	__atomic_store_n(&p->tolerance, ticks, __ATOMIC_RELAXED);
+}
+
+// Consumer: takes the newest pair if one was published since the last call
+static inline int freenect_pairer_acquire(t_freenect_pairer *p){
+	return freenect_tribuf_acquire(&p->pairs);
+}
+
+// Consumer: the pair currently held, valid until the next acquire
+static inline t_freenect_pair *freenect_pairer_front(t_freenect_pairer *p){
+	return (t_freenect_pair *)freenect_tribuf_front(&p->pairs);
+}
+
+#endif
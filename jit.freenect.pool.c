@@ -0,0 +1,242 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.pool.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MAX_BANDS (FREENECT_POOL_MAX_THREADS * 4)
+
+typedef struct _band {
+	t_freenect_job  *job;
+	long            begin;
+	long            end;
+} t_band;
+
+typedef struct _batch {
+	t_band          bands[MAX_BANDS];
+	long            nbands;
+	long            next;       // next band to hand out
+	long            finished;
+	struct _batch   *link;
+} t_batch;
+
+// Everything below is guarded by pool_mutex. Stopping the workers moves their handles
+// out of pool_threads and moves on to a new generation: the old workers quit and are
+// joined by whoever stopped them, while a run may already be starting new ones.
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_threads[FREENECT_POOL_MAX_THREADS];
+static long pool_nthreads = 0;      // workers of the current generation
+static long pool_requested = 0;     // total threads wanted, including callers
+static long pool_generation = 0;
+static t_batch *pool_batches = NULL;
+
+long freenect_pool_cpu_count(void){
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+static long wanted_threads(void){
+	long n = pool_requested ? pool_requested : freenect_pool_cpu_count();
+	if(n > FREENECT_POOL_MAX_THREADS){
+		n = FREENECT_POOL_MAX_THREADS;
+	}
+	return n;
+}
+
+// Hands out the next band of b, or of any pending batch if b is NULL. Called locked.
+static t_band *claim_band(t_batch *b, t_batch **owner){
+	if(!b){
+		for(b=pool_batches;b;b=b->link){
+			if(b->next < b->nbands){
+				break;
+			}
+		}
+	}
+	if(!b || b->next >= b->nbands){
+		return NULL;
+	}
+	*owner = b;
+	return &b->bands[b->next++];
+}
+
+static void run_band(t_band *band, t_batch *owner){
+	band->job->fn(band->job->ctx, band->begin, band->end);
+
+	pthread_mutex_lock(&pool_mutex);
+	if(++owner->finished == owner->nbands){
+		pthread_cond_broadcast(&pool_done);
+	}
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+static void *pool_threadproc(void *arg){
+	long generation = (long)(intptr_t)arg;
+	t_band *band;
+	t_batch *owner;
+
+	pthread_mutex_lock(&pool_mutex);
+	while(generation == pool_generation){
+		band = claim_band(NULL, &owner);
+		if(!band){
+			pthread_cond_wait(&pool_work, &pool_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&pool_mutex);
+		run_band(band, owner);
+		pthread_mutex_lock(&pool_mutex);
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	return NULL;
+}
+
+static void stop_threads(void){
+	pthread_t threads[FREENECT_POOL_MAX_THREADS];
+	long i, n;
+
+	pthread_mutex_lock(&pool_mutex);
+	n = pool_nthreads;
+	for(i=0;i<n;i++){
+		threads[i] = pool_threads[i];
+	}
+	pool_nthreads = 0;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_work);
+	pthread_mutex_unlock(&pool_mutex);
+
+	for(i=0;i<n;i++){
+		pthread_join(threads[i], NULL);
+	}
+}
+
+// The caller is one of the threads, so n threads means n-1 workers. Called locked.
+static void start_threads(long n){
+	while(pool_nthreads < n - 1){
+		if(pthread_create(&pool_threads[pool_nthreads], NULL, pool_threadproc, (void *)(intptr_t)pool_generation)){
+			break;
+		}
+		pool_nthreads++;
+	}
+}
+
+long freenect_pool_set_threads(long n){
+	long previous;
+
+	if(n < 0){
+		n = 0;
+	}
+	pthread_mutex_lock(&pool_mutex);
+	previous = pool_requested;
+	pool_requested = n;
+	pthread_mutex_unlock(&pool_mutex);
+	// Threads are (re)started lazily by the next run
+	if(n != previous){
+		stop_threads();
+	}
+	return previous;
+}
+
+long freenect_pool_get_threads(void){
+	long n;
+	pthread_mutex_lock(&pool_mutex);
+	n = wanted_threads();
+	pthread_mutex_unlock(&pool_mutex);
+	return n;
+}
+
+void freenect_pool_shutdown(void){
+	stop_threads();
+}
+
+static void run_inline(t_freenect_job *jobs, long njobs){
+	long i;
+	for(i=0;i<njobs;i++){
+		if(jobs[i].rows > 0){
+			jobs[i].fn(jobs[i].ctx, 0, jobs[i].rows);
+		}
+	}
+}
+
+void freenect_pool_run(t_freenect_job *jobs, long njobs){
+	t_batch batch, **link;
+	t_band *band;
+	t_batch *owner;
+	long i, j, nthreads, bytes = 0, nbands;
+
+	for(i=0;i<njobs;i++){
+		bytes += jobs[i].bytes;
+	}
+
+	pthread_mutex_lock(&pool_mutex);
+	nthreads = wanted_threads();
+	if((nthreads <= 1) || (bytes < FREENECT_POOL_CUTOFF)){
+		pthread_mutex_unlock(&pool_mutex);
+		run_inline(jobs, njobs);
+		return;
+	}
+	start_threads(nthreads);
+
+	// A couple of bands per thread and job evens out jobs of different cost
+	batch.nbands = 0;
+	batch.next = 0;
+	batch.finished = 0;
+	batch.link = NULL;
+	for(i=0;i<njobs;i++){
+		nbands = nthreads * 2;
+		if(nbands > MAX_BANDS / njobs){
+			nbands = MAX_BANDS / njobs;
+		}
+		if(nbands > jobs[i].rows){
+			nbands = jobs[i].rows;
+		}
+		for(j=0;j<nbands;j++){
+			batch.bands[batch.nbands].job = &jobs[i];
+			batch.bands[batch.nbands].begin = jobs[i].rows * j / nbands;
+			batch.bands[batch.nbands].end = jobs[i].rows * (j + 1) / nbands;
+			batch.nbands++;
+		}
+	}
+	if(!batch.nbands){
+		pthread_mutex_unlock(&pool_mutex);
+		return;
+	}
+
+	for(link=&pool_batches;*link;link=&(*link)->link);
+	*link = &batch;
+	pthread_cond_broadcast(&pool_work);
+
+	// Work on our own batch, then wait for the bands other threads picked up
+	while((band = claim_band(&batch, &owner))){
+		pthread_mutex_unlock(&pool_mutex);
+		run_band(band, owner);
+		pthread_mutex_lock(&pool_mutex);
+	}
+	while(batch.finished < batch.nbands){
+		pthread_cond_wait(&pool_done, &pool_mutex);
+	}
+
+	for(link=&pool_batches;*link!=&batch;link=&(*link)->link);
+	*link = batch.link;
+	pthread_mutex_unlock(&pool_mutex);
+}
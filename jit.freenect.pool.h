@@ -0,0 +1,57 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Persistent thread pool shared by all jit.freenect.grab instances.
+
+ A batch holds one or more row-based jobs (e.g. the depth and the video
+ conversion of a frame). Each job is cut into bands of rows and the bands of
+ all jobs in the batch are handed out to the pool threads and to the calling
+ thread, so the jobs run concurrently. freenect_pool_run() returns once every
+ band is done. Several threads may submit batches at the same time.
+*/
+
+#ifndef JIT_FREENECT_POOL_H
+#define JIT_FREENECT_POOL_H
+
+// Batches writing less than this are not worth waking other threads for
+#define FREENECT_POOL_CUTOFF (256 * 1024)
+#define FREENECT_POOL_MAX_THREADS 64
+
+typedef void (*t_freenect_rows_fn)(void *ctx, long begin, long end);
+
+typedef struct _freenect_job {
+	t_freenect_rows_fn  fn;
+	void                *ctx;
+	long                rows;
+	long                bytes;      // output bytes, for the cutoff
+} t_freenect_job;
+
+// n threads in total, counting the caller; 0 uses one per CPU, 1 disables the pool.
+// There is one pool for the whole process, so this applies to every caller. Returns
+// the previous setting.
+long    freenect_pool_set_threads(long n);
+long    freenect_pool_get_threads(void);
+long    freenect_pool_cpu_count(void);
+void    freenect_pool_run(t_freenect_job *jobs, long njobs);
+// Stops the pool threads; they are restarted on the next run
+void    freenect_pool_shutdown(void);
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.record.h"
+#include "jit.freenect.sync.h"
+#include "jit.freenect.codec.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+// The on-disk structures must keep their size on every compiler
+typedef char rec_header_size_check[(sizeof(t_freenect_rec_header) == 64) ? 1 : -1];
+typedef char rec_frame_size_check[(sizeof(t_freenect_rec_frame) == 64) ? 1 : -1];
+typedef char rec_index_size_check[(sizeof(t_freenect_rec_index) == 32) ? 1 : -1];
+
+struct _freenect_recorder {
+	int                     fd;
+	t_freenect_rec_header   header;
+
+	// Byte ring holding records exactly as they are written. head and tail
+	// count bytes since the start of the recording, so the file offset of
+	// ring position p is sizeof(header) + p.
+	char                    *ring;
+	uint64_t                capacity;
+	uint64_t                head;           // producer
+	uint64_t                tail;           // writer
+
+	// Index entries travel separately, the writer collects them into index
+	t_freenect_rec_index    entries[FREENECT_REC_RING_FRAMES];
+	uint64_t                entry_head;     // producer
+	uint64_t                entry_tail;     // writer
+
+	t_freenect_rec_index    *index;         // writer only
+	uint64_t                index_count;
+	uint64_t                index_size;
+	uint64_t                written;        // bytes after the header, differs from tail when compressing
+
+	// Writer scratch for FREENECT_REC_COMPRESS_DEPTH
+	uint64_t                depth_bytes;
+	uint16_t                *unwrapped;     // a depth payload split by the end of the ring
+	char                    *packed;        // record header, encoded payload and padding
+
+	uint64_t                start_ns;       // producer only
+	uint64_t                frames;
+	uint64_t                dropped;
+	int                     error;
+	int                     stop;
+	t_freenect_sem          sem;
+	pthread_t               thread;
+};
+
+static uint64_t rec_now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int write_all(int fd, const char *data, uint64_t n){
+	ssize_t done;
+
+	while(n){
+		done = write(fd, data, n);
+		if(done < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		data += done;
+		n -= done;
+	}
+	return 0;
+}
+
+static int pwrite_all(int fd, const char *data, uint64_t n, uint64_t offset){
+	ssize_t done;
+
+	while(n){
+		done = pwrite(fd, data, n, offset);
+		if(done < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		data += done;
+		n -= done;
+		offset += done;
+	}
+	return 0;
+}
+
+#pragma mark - Producer
+
+static void ring_write(t_freenect_recorder *rec, uint64_t pos, const void *data, uint64_t n){
+	uint64_t offset = pos % rec->capacity;
+	uint64_t first = rec->capacity - offset;
+
+	if(first >= n){
+		memcpy(rec->ring + offset, data, n);
+	}
+	else{
+		memcpy(rec->ring + offset, data, first);
+		memcpy(rec->ring, (const char *)data + first, n - first);
+	}
+}
+
+int freenect_recorder_push(t_freenect_recorder *rec, int stream, const void *data, long size, uint32_t timestamp){
+	static const char zeros[FREENECT_REC_ALIGN] = {0};
+	t_freenect_rec_frame frame;
+	t_freenect_rec_index *entry;
+	uint64_t head, entry_head, need, now;
+
+	need = sizeof(t_freenect_rec_frame) + freenect_rec_align(size);
+	head = rec->head;
+	entry_head = rec->entry_head;
+	if((need > rec->capacity - (head - __atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE))) ||
+	   (entry_head - __atomic_load_n(&rec->entry_tail, __ATOMIC_ACQUIRE) >= FREENECT_REC_RING_FRAMES)){
+		__atomic_add_fetch(&rec->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	now = rec_now_ns();
+	if(!rec->start_ns){
+		rec->start_ns = now;
+	}
+
+	memset(&frame, 0, sizeof(frame));
+	frame.magic = FREENECT_REC_FRAME_MAGIC;
+	frame.stream = stream;
+	frame.codec = FREENECT_REC_RAW;
+	frame.timestamp = timestamp;
+	frame.time_ns = now - rec->start_ns;
+	frame.size = size;
+	frame.raw_size = size;
+	ring_write(rec, head, &frame, sizeof(frame));
+	ring_write(rec, head + sizeof(frame), data, size);
+	ring_write(rec, head + sizeof(frame) + size, zeros, freenect_rec_align(size) - size);
+
+	entry = &rec->entries[entry_head % FREENECT_REC_RING_FRAMES];
+	entry->offset = sizeof(t_freenect_rec_header) + head + sizeof(frame);
+	entry->time_ns = frame.time_ns;
+	entry->size = (uint32_t)size;
+	entry->timestamp = timestamp;
+	entry->stream = (uint16_t)stream;
+	entry->codec = FREENECT_REC_RAW;
+	entry->raw_size = (uint32_t)size;
+
+	__atomic_store_n(&rec->entry_head, entry_head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&rec->head, head + need, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&rec->frames, 1, __ATOMIC_RELAXED);
+	freenect_sem_post(&rec->sem);
+	return 0;
+}
+
+#pragma mark - Writer
+
+static void append_entry(t_freenect_recorder *rec, const t_freenect_rec_index *entry){
+	t_freenect_rec_index *grown;
+
+	if(rec->index_count == rec->index_size){
+		rec->index_size = rec->index_size ? rec->index_size * 2 : 4096;
+		grown = (t_freenect_rec_index *)realloc(rec->index, rec->index_size * sizeof(t_freenect_rec_index));
+		if(!grown){
+			rec->error = 1;
+			rec->index_size = rec->index_count;
+			return;
+		}
+		rec->index = grown;
+	}
+	rec->index[rec->index_count++] = *entry;
+}
+
+static void collect_entries(t_freenect_recorder *rec){
+	uint64_t head = __atomic_load_n(&rec->entry_head, __ATOMIC_ACQUIRE);
+	uint64_t tail = rec->entry_tail;
+
+	while((tail < head) && !rec->error){
+		append_entry(rec, &rec->entries[tail % FREENECT_REC_RING_FRAMES]);
+		tail++;
+	}
+	// Entries are dropped along with the index if it could not grow
+	__atomic_store_n(&rec->entry_tail, head, __ATOMIC_RELEASE);
+}
+
+// Writes everything published so far, in as few calls as the ring wrap allows
+static void drain_raw(t_freenect_recorder *rec){
+	uint64_t head = __atomic_load_n(&rec->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = rec->tail;
+	uint64_t offset, n;
+
+	while(tail < head){
+		offset = tail % rec->capacity;
+		n = head - tail;
+		if(n > rec->capacity - offset){
+			n = rec->capacity - offset;
+		}
+		if(!rec->error && write_all(rec->fd, rec->ring + offset, n)){
+			// Keep draining so the producer is not stuck with a full ring
+			rec->error = 1;
+		}
+		tail += n;
+		__atomic_store_n(&rec->written, tail, __ATOMIC_RELEASE);
+		__atomic_store_n(&rec->tail, tail, __ATOMIC_RELEASE);
+	}
+	collect_entries(rec);
+}
+
+// Compressing: records are taken one at a time with their index entry, depth
+// payloads are encoded and the file offsets in the entries are moved to match.
+static void drain_packed(t_freenect_recorder *rec){
+	uint64_t head = __atomic_load_n(&rec->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = rec->tail;
+	uint64_t written = rec->written;
+	uint64_t offset, payload, first, need;
+	t_freenect_rec_frame *frame;
+	t_freenect_rec_index entry;
+	const uint16_t *depth;
+	long size;
+
+	while(tail < head){
+		// Records are aligned and so is the capacity, a record header never wraps
+		offset = tail % rec->capacity;
+		frame = (t_freenect_rec_frame *)(rec->ring + offset);
+		need = sizeof(t_freenect_rec_frame) + freenect_rec_align(frame->size);
+		entry = rec->entries[rec->entry_tail % FREENECT_REC_RING_FRAMES];
+		entry.offset = sizeof(t_freenect_rec_header) + written + sizeof(t_freenect_rec_frame);
+
+		if((frame->stream == FREENECT_REC_DEPTH) && (frame->size == rec->depth_bytes)){
+			payload = (offset + sizeof(t_freenect_rec_frame)) % rec->capacity;
+			first = rec->capacity - payload;
+			if(first >= frame->size){
+				depth = (const uint16_t *)(rec->ring + payload);
+			}
+			else{
+				memcpy(rec->unwrapped, rec->ring + payload, first);
+				memcpy((char *)rec->unwrapped + first, rec->ring, frame->size - first);
+				depth = rec->unwrapped;
+			}
+			size = freenect_depth_encode(depth, rec->depth_bytes / sizeof(uint16_t), (uint16_t)rec->header.depth_invalid,
+										 (uint8_t *)rec->packed + sizeof(t_freenect_rec_frame));
+			memcpy(rec->packed, frame, sizeof(t_freenect_rec_frame));
+			((t_freenect_rec_frame *)rec->packed)->codec = FREENECT_REC_PACKED;
+			((t_freenect_rec_frame *)rec->packed)->size = size;
+			memset(rec->packed + sizeof(t_freenect_rec_frame) + size, 0, freenect_rec_align(size) - size);
+			if(!rec->error && write_all(rec->fd, rec->packed, sizeof(t_freenect_rec_frame) + freenect_rec_align(size))){
+				rec->error = 1;
+			}
+			entry.codec = FREENECT_REC_PACKED;
+			entry.size = (uint32_t)size;
+			written += sizeof(t_freenect_rec_frame) + freenect_rec_align(size);
+		}
+		else{
+			first = rec->capacity - offset;
+			if(!rec->error && (write_all(rec->fd, rec->ring + offset, first < need ? first : need) ||
+							   ((first < need) && write_all(rec->fd, rec->ring, need - first)))){
+				rec->error = 1;
+			}
+			written += need;
+		}
+		append_entry(rec, &entry);
+
+		tail += need;
+		__atomic_store_n(&rec->entry_tail, rec->entry_tail + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&rec->written, written, __ATOMIC_RELEASE);
+		__atomic_store_n(&rec->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+static void drain(t_freenect_recorder *rec){
+	if(rec->packed){
+		drain_packed(rec);
+	}
+	else{
+		drain_raw(rec);
+	}
+}
+
+static void *writer_threadproc(void *arg){
+	t_freenect_recorder *rec = (t_freenect_recorder *)arg;
+
+	while(1){
+		freenect_sem_wait(&rec->sem);
+		drain(rec);
+		if(__atomic_load_n(&rec->stop, __ATOMIC_ACQUIRE)){
+			break;
+		}
+	}
+	drain(rec);
+	return NULL;
+}
+
+#pragma mark - Recorder
+
+static void free_recorder(t_freenect_recorder *rec){
+	free(rec->index);
+	free(rec->unwrapped);
+	free(rec->packed);
+	free(rec->ring);
+	free(rec);
+}
+
+t_freenect_recorder *freenect_recorder_open(const char *path, const t_freenect_rec_header *info, long ring_bytes){
+	t_freenect_recorder *rec;
+	long pixels;
+
+	rec = (t_freenect_recorder *)calloc(1, sizeof(t_freenect_recorder));
+	if(!rec){
+		return NULL;
+	}
+	rec->capacity = freenect_rec_align(ring_bytes > 0 ? ring_bytes : FREENECT_REC_RING_BYTES);
+	rec->ring = (char *)malloc(rec->capacity);
+	if(!rec->ring){
+		free_recorder(rec);
+		return NULL;
+	}
+	if(info->flags & FREENECT_REC_COMPRESS_DEPTH){
+		pixels = (long)info->depth_width * info->depth_height;
+		rec->depth_bytes = pixels * sizeof(uint16_t);
+		rec->unwrapped = (uint16_t *)malloc(rec->depth_bytes);
+		rec->packed = (char *)malloc(sizeof(t_freenect_rec_frame) + freenect_rec_align(freenect_depth_encode_bound(pixels)));
+		if(!rec->unwrapped || !rec->packed){
+			free_recorder(rec);
+			return NULL;
+		}
+	}
+	// Fault the pages in now rather than on the capture thread
+	memset(rec->ring, 0, rec->capacity);
+
+	rec->header = *info;
+	memcpy(rec->header.magic, FREENECT_REC_MAGIC, sizeof(rec->header.magic));
+	rec->header.version = FREENECT_REC_VERSION;
+	rec->header.index_offset = 0;
+	rec->header.frame_count = 0;
+
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(rec->fd < 0){
+		free_recorder(rec);
+		return NULL;
+	}
+	if(write_all(rec->fd, (const char *)&rec->header, sizeof(rec->header)) || freenect_sem_init(&rec->sem)){
+		close(rec->fd);
+		free_recorder(rec);
+		return NULL;
+	}
+	if(pthread_create(&rec->thread, NULL, writer_threadproc, rec)){
+		freenect_sem_destroy(&rec->sem);
+		close(rec->fd);
+		free_recorder(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+int freenect_recorder_close(t_freenect_recorder *rec){
+	int failed;
+
+	if(!rec){
+		return -1;
+	}
+	__atomic_store_n(&rec->stop, 1, __ATOMIC_RELEASE);
+	freenect_sem_post(&rec->sem);
+	pthread_join(rec->thread, NULL);
+
+	if(!rec->error){
+		rec->header.index_offset = sizeof(t_freenect_rec_header) + rec->written;
+		rec->header.frame_count = rec->index_count;
+		if(write_all(rec->fd, (const char *)rec->index, rec->index_count * sizeof(t_freenect_rec_index)) ||
+		   pwrite_all(rec->fd, (const char *)&rec->header, sizeof(rec->header), 0)){
+			rec->error = 1;
+		}
+	}
+	if(close(rec->fd)){
+		rec->error = 1;
+	}
+
+	failed = rec->error;
+	freenect_sem_destroy(&rec->sem);
+	free_recorder(rec);
+	return failed ? -1 : 0;
+}
+
+uint64_t freenect_recorder_frames(t_freenect_recorder *rec){
+	return __atomic_load_n(&rec->frames, __ATOMIC_RELAXED);
+}
+
+uint64_t freenect_recorder_dropped(t_freenect_recorder *rec){
+	return __atomic_load_n(&rec->dropped, __ATOMIC_RELAXED);
+}
+
+uint64_t freenect_recorder_bytes(t_freenect_recorder *rec){
+	return __atomic_load_n(&rec->written, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,126 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Raw stream recording.
+
+ The capture thread pushes frames into a lock-free single-producer ring that
+ already holds the bytes exactly as they go to disk. A writer thread drains
+ the ring with large sequential writes, so the capture thread never touches
+ the file and never waits. When the ring is full the frame is dropped and
+ counted instead.
+
+ With FREENECT_REC_COMPRESS_DEPTH in the header flags, the writer thread
+ passes depth frames through jit.freenect.codec on their way to the disk.
+ They are stored with codec FREENECT_REC_PACKED, and raw_size gives their
+ decoded size. The capture thread's cost does not change.
+
+ Container layout, little endian, every block 64-byte aligned:
+
+   t_freenect_rec_header                        file header
+   { t_freenect_rec_frame, payload } ...        one record per frame
+   t_freenect_rec_index[frame_count]            at index_offset, written on close
+
+ Payloads start on a 64-byte boundary so a memory-mapped file can be read in
+ place. A file that was not closed properly has index_offset 0 and can still
+ be read by walking the records.
+*/
+
+#ifndef JIT_FREENECT_RECORD_H
+#define JIT_FREENECT_RECORD_H
+
+#include <stdint.h>
+
+#define FREENECT_REC_MAGIC          "FNCTREC1"
+#define FREENECT_REC_FRAME_MAGIC    0x4D415246  // "FRAM"
+#define FREENECT_REC_VERSION        1
+#define FREENECT_REC_ALIGN          64
+#define FREENECT_REC_RING_BYTES     (64 * 1024 * 1024)
+#define FREENECT_REC_RING_FRAMES    1024
+
+// Header flags
+#define FREENECT_REC_COMPRESS_DEPTH 0x1
+
+enum freenect_rec_stream{
+	FREENECT_REC_DEPTH = 0,
+	FREENECT_REC_VIDEO = 1
+};
+
+enum freenect_rec_codec{
+	FREENECT_REC_RAW = 0,
+	FREENECT_REC_PACKED = 1             // freenect_depth_encode
+};
+
+typedef struct _freenect_rec_header {
+	char        magic[8];
+	uint32_t    version;
+	uint32_t    flags;
+	uint32_t    depth_width;
+	uint32_t    depth_height;
+	uint32_t    depth_format;       // freenect_depth_format
+	uint32_t    video_width;
+	uint32_t    video_height;
+	uint32_t    video_format;       // freenect_video_format
+	uint32_t    video_bpp;          // bytes per pixel of the raw video
+	uint32_t    depth_invalid;      // depth of pixels without a measurement, 0x7FF or 0 when registered
+	uint64_t    index_offset;       // 0 until the recording is closed
+	uint64_t    frame_count;
+} t_freenect_rec_header;
+
+typedef struct _freenect_rec_frame {
+	uint32_t    magic;
+	uint32_t    stream;             // freenect_rec_stream
+	uint32_t    codec;              // freenect_rec_codec
+	uint32_t    timestamp;          // device clock
+	uint64_t    time_ns;            // host monotonic clock, from the first frame
+	uint64_t    size;               // payload bytes as stored
+	uint64_t    raw_size;           // payload bytes once decoded
+	uint8_t     reserved[24];
+} t_freenect_rec_frame;
+
+typedef struct _freenect_rec_index {
+	uint64_t    offset;             // of the payload
+	uint64_t    time_ns;
+	uint32_t    size;
+	uint32_t    timestamp;
+	uint16_t    stream;
+	uint16_t    codec;
+	uint32_t    raw_size;
+} t_freenect_rec_index;
+
+typedef struct _freenect_recorder t_freenect_recorder;
+
+// Creates path and starts the writer thread. ring_bytes 0 uses FREENECT_REC_RING_BYTES.
+t_freenect_recorder *freenect_recorder_open(const char *path, const t_freenect_rec_header *info, long ring_bytes);
+// Producer (capture thread): copies the frame into the ring. Returns 0, or -1 if it was dropped.
+int                 freenect_recorder_push(t_freenect_recorder *rec, int stream, const void *data, long size, uint32_t timestamp);
+// Writes what is left in the ring and the index, then frees rec. Returns 0 if everything reached the disk.
+int                 freenect_recorder_close(t_freenect_recorder *rec);
+
+uint64_t            freenect_recorder_frames(t_freenect_recorder *rec);
+uint64_t            freenect_recorder_dropped(t_freenect_recorder *rec);
+// Bytes of records written so far, after compression
+uint64_t            freenect_recorder_bytes(t_freenect_recorder *rec);
+
+static inline uint64_t freenect_rec_align(uint64_t n){
+	return (n + FREENECT_REC_ALIGN - 1) & ~(uint64_t)(FREENECT_REC_ALIGN - 1);
+}
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.register.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+#define REGISTER_ALIGN      64
+#define REGISTER_FRAC       8               // fraction bits of columns and shifts
+#define REGISTER_OUTSIDE    (-(1 << 28))    // pushes a column out of the frame, twice still fits
+
+static void *register_alloc(size_t bytes){
+	void *p = NULL;
+	// The AVX2 gathers read 32 bits from 16-bit cells, up to the end of the last one
+	if(posix_memalign(&p, REGISTER_ALIGN, bytes + REGISTER_ALIGN)){
+		return NULL;
+	}
+	return p;
+}
+
+static int register_alloc_tables(t_freenect_register *r, long width, long height){
+	long n = width * height, i;
+
+	freenect_register_free(r);
+	r->column = (int32_t *)register_alloc(n * sizeof(int32_t));
+	r->row = (int32_t *)register_alloc(n * sizeof(int32_t));
+	r->target = (int32_t *)register_alloc(n * sizeof(int32_t));
+	r->depth = (uint16_t *)register_alloc(n * sizeof(uint16_t));
+	r->video = (uint8_t *)register_alloc(n * 3);
+	if(!r->column || !r->row || !r->target || !r->depth || !r->video){
+		freenect_register_free(r);
+		return -1;
+	}
+	r->width = width;
+	r->height = height;
+	for(i=0;i<n;i++){
+		r->target[i] = -1;
+	}
+	return 0;
+}
+
+int freenect_register_init(t_freenect_register *r, long width, long height, const t_freenect_intrinsics *depth_k,
+						   const t_freenect_intrinsics *video_k, float baseline, const t_freenect_calibration *cal){
+	uint64_t key = cal ? cal->key : 0;
+	long i, j;
+	double z, row;
+
+	if(r->column && !r->device && (r->width == width) && (r->height == height) && (r->baseline == baseline) && (r->key == key) &&
+	   !memcmp(&r->depth_k, depth_k, sizeof(t_freenect_intrinsics)) && !memcmp(&r->video_k, video_k, sizeof(t_freenect_intrinsics))){
+		return 0;
+	}
+	if(register_alloc_tables(r, width, height)){
+		return -1;
+	}
+	r->depth_k = *depth_k;
+	r->video_k = *video_k;
+	r->baseline = baseline;
+	r->key = key;
+
+	// Rounded to the nearest pixel by the shift that drops the fraction
+	for(i=0;i<height;i++){
+		row = floor(video_k->fy * (i - depth_k->cy) / depth_k->fy + video_k->cy + 0.5);
+		for(j=0;j<width;j++){
+			if((row < 0) || (row >= height)){
+				r->column[i * width + j] = REGISTER_OUTSIDE;
+				r->row[i * width + j] = 0;
+			}
+			else{
+				r->column[i * width + j] = (int32_t)lrint((video_k->fx * (j - depth_k->cx) / depth_k->fx + video_k->cx + 0.5) * (1 << REGISTER_FRAC));
+				r->row[i * width + j] = (int32_t)row * (int32_t)width;
+			}
+		}
+	}
+	for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+		z = cal ? cal->metres[i] : freenect_depth_metres((uint16_t)i);
+		r->shift[i] = (z > 0.) ? (int32_t)lrint(video_k->fx * baseline / z * (1 << REGISTER_FRAC)) : REGISTER_OUTSIDE;
+	}
+	return 0;
+}
+
+// Targets as freenect_apply_registration finds them: the column is the table's plus
+// the parallax at the pixel's depth in mm, the row the table's, offset by the padding
+// rows. Only a column just left of the frame rounds differently, and is dropped.
+int freenect_register_init_device(t_freenect_register *r, long width, long height, const t_freenect_register_device *device,
+								  const t_freenect_calibration *cal){
+	uint64_t key = cal ? cal->key : 0;
+	long n = width * height, i, mm;
+	int64_t target;
+	double z;
+
+	if(r->column && (r->device == device->table) && (r->width == width) && (r->height == height) && (r->key == key)){
+		return 0;
+	}
+	if(register_alloc_tables(r, width, height)){
+		return -1;
+	}
+	r->device = device->table;
+	r->key = key;
+
+	// Same fixed point as libfreenect's REG_X_VAL_SCALE, columns are copied as they are
+	for(i=0;i<n;i++){
+		target = (int64_t)device->table[i][1] * width - height * device->start_lines;
+		if((device->table[i][1] < 0) || (target < 0) || (target + width > n)){
+			r->column[i] = REGISTER_OUTSIDE;
+			r->row[i] = 0;
+		}
+		else{
+			r->column[i] = device->table[i][0];
+			r->row[i] = (int32_t)target;
+		}
+	}
+	for(i=0;i<FREENECT_DEPTH_LUT_SIZE;i++){
+		if(cal){
+			z = cal->metres[i];
+			mm = (z > 0.) ? lrint(z * 1000.) : 0;
+		}
+		else{
+			mm = device->mm[i];
+		}
+		r->shift[i] = ((mm > 0) && (mm < FREENECT_REGISTER_DEVICE_MM)) ? device->shift[mm] : REGISTER_OUTSIDE;
+	}
+	return 0;
+}
+
+void freenect_register_free(t_freenect_register *r){
+	free(r->column);
+	free(r->row);
+	free(r->target);
+	free(r->depth);
+	free(r->video);
+	r->column = r->row = r->target = NULL;
+	r->depth = NULL;
+	r->video = NULL;
+	r->device = NULL;
+	r->width = r->height = 0;
+}
+
+void freenect_register_depth_clear(t_freenect_register *r){
+	long i, n = r->width * r->height;
+
+	for(i=0;i<n;i++){
+		r->depth[i] = FREENECT_DEPTH_MAX;
+	}
+}
+
+long freenect_register_bands(const t_freenect_register *r, int phase){
+	long bands = (r->height + FREENECT_REGISTER_BAND - 1) / FREENECT_REGISTER_BAND;
+	return (bands + 1 - phase) / 2;
+}
+
+#pragma mark - Scalar
+
+static void targets_scalar(const t_freenect_register *r, const uint16_t *depth, long i, long end){
+	uint16_t d;
+	int32_t x;
+
+	for(;i<end;i++){
+		d = (depth[i] > FREENECT_DEPTH_MAX) ? FREENECT_DEPTH_MAX : depth[i];
+		x = (r->column[i] + r->shift[d]) >> REGISTER_FRAC;
+		r->target[i] = ((uint32_t)x < (uint32_t)r->width) ? r->row[i] + x : -1;
+	}
+}
+
+static void occlude_scalar(t_freenect_register *r, const uint16_t *depth, long i, long end){
+	int32_t t;
+
+	for(;i<end;i++){
+		t = r->target[i];
+		if((t >= 0) && (depth[i] > r->depth[t] + FREENECT_REGISTER_OCCLUSION)){
+			r->target[i] = -1;
+		}
+	}
+}
+
+#if FREENECT_X86
+
+#pragma mark - SSE2
+
+// SSE2 has no gather, the shifts are looked up one by one
+FREENECT_TARGET("sse2")
+static void targets_sse2(const t_freenect_register *r, const uint16_t *depth, long i, long end){
+	const __m128i max = _mm_set1_epi16(FREENECT_DEPTH_MAX);
+	const __m128i ones = _mm_set1_epi32(-1);
+	const __m128i width = _mm_set1_epi32((int)r->width);
+	uint16_t d[8];
+	__m128i v, x, inside;
+	long k;
+
+	for(;i+8<=end;i+=8){
+		v = _mm_loadu_si128((const __m128i *)(depth + i));
+		_mm_storeu_si128((__m128i *)d, _mm_sub_epi16(v, _mm_subs_epu16(v, max)));
+		for(k=0;k<8;k+=4){
+			x = _mm_set_epi32(r->shift[d[k + 3]], r->shift[d[k + 2]], r->shift[d[k + 1]], r->shift[d[k]]);
+			x = _mm_srai_epi32(_mm_add_epi32(x, _mm_loadu_si128((const __m128i *)(r->column + i + k))), REGISTER_FRAC);
+			inside = _mm_andnot_si128(_mm_cmplt_epi32(x, _mm_setzero_si128()), _mm_cmplt_epi32(x, width));
+			x = _mm_add_epi32(x, _mm_loadu_si128((const __m128i *)(r->row + i + k)));
+			_mm_storeu_si128((__m128i *)(r->target + i + k), _mm_or_si128(_mm_and_si128(inside, x), _mm_andnot_si128(inside, ones)));
+		}
+	}
+	targets_scalar(r, depth, i, end);
+}
+
+#pragma mark - AVX2
+
+FREENECT_TARGET("avx2")
+static void targets_avx2(const t_freenect_register *r, const uint16_t *depth, long i, long end){
+	const __m256i max = _mm256_set1_epi32(FREENECT_DEPTH_MAX);
+	const __m256i ones = _mm256_set1_epi32(-1);
+	const __m256i width = _mm256_set1_epi32((int)r->width);
+	__m256i d, x, inside;
+
+	for(;i+8<=end;i+=8){
+		d = _mm256_min_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(depth + i))), max);
+		x = _mm256_i32gather_epi32((const int *)r->shift, d, 4);
+		x = _mm256_srai_epi32(_mm256_add_epi32(x, _mm256_loadu_si256((const __m256i *)(r->column + i))), REGISTER_FRAC);
+		inside = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), x), _mm256_cmpgt_epi32(width, x));
+		x = _mm256_add_epi32(x, _mm256_loadu_si256((const __m256i *)(r->row + i)));
+		_mm256_storeu_si256((__m256i *)(r->target + i), _mm256_blendv_epi8(ones, x, inside));
+	}
+	targets_scalar(r, depth, i, end);
+}
+
+// Gathers the z-buffer as 32-bit cells at every target, keeping the low half
+FREENECT_TARGET("avx2")
+static void occlude_avx2(t_freenect_register *r, const uint16_t *depth, long i, long end){
+	const __m256i low = _mm256_set1_epi32(0xFFFF);
+	const __m256i tolerance = _mm256_set1_epi32(FREENECT_REGISTER_OCCLUSION);
+	const __m256i ones = _mm256_set1_epi32(-1);
+	__m256i t, seen, z, d, hidden;
+
+	for(;i+8<=end;i+=8){
+		t = _mm256_loadu_si256((const __m256i *)(r->target + i));
+		seen = _mm256_cmpgt_epi32(t, ones);
+		z = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)r->depth, _mm256_and_si256(t, seen), seen, 2);
+		z = _mm256_add_epi32(_mm256_and_si256(z, low), tolerance);
+		d = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(depth + i)));
+		hidden = _mm256_cmpgt_epi32(d, z);
+		_mm256_storeu_si256((__m256i *)(r->target + i), _mm256_or_si256(t, hidden));
+	}
+	occlude_scalar(r, depth, i, end);
+}
+
+#endif
+
+#pragma mark - Dispatch
+
+static void targets_level(const t_freenect_register *r, const uint16_t *depth, long i, long end, t_freenect_cpu_level level){
+#if FREENECT_X86
+	if(level >= FREENECT_CPU_AVX2){
+		targets_avx2(r, depth, i, end);
+		return;
+	}
+	if(level >= FREENECT_CPU_SSE2){
+		targets_sse2(r, depth, i, end);
+		return;
+	}
+#endif
+	targets_scalar(r, depth, i, end);
+}
+
+// The targets of a band are computed together, then scattered, which no SIMD level has
+void freenect_register_depth_bands_level(t_freenect_register *r, const uint16_t *depth, int phase, long begin, long end,
+										 t_freenect_cpu_level level){
+	long band, i, n;
+	int32_t t;
+
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+	for(band=begin;band<end;band++){
+		i = (band * 2 + phase) * FREENECT_REGISTER_BAND;
+		n = (i + FREENECT_REGISTER_BAND < r->height) ? i + FREENECT_REGISTER_BAND : r->height;
+		i *= r->width;
+		n *= r->width;
+		targets_level(r, depth, i, n, level);
+		for(;i<n;i++){
+			t = r->target[i];
+			if((t >= 0) && (depth[i] < r->depth[t])){
+				r->depth[t] = depth[i];
+			}
+		}
+	}
+}
+
+void freenect_register_depth_bands(t_freenect_register *r, const uint16_t *depth, int phase, long begin, long end){
+	freenect_register_depth_bands_level(r, depth, phase, begin, end, freenect_kernels.level);
+}
+
+void freenect_register_occlude_rows_level(t_freenect_register *r, const uint16_t *depth, long begin, long end,
+										  t_freenect_cpu_level level){
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+#if FREENECT_X86
+	if(level >= FREENECT_CPU_AVX2){
+		occlude_avx2(r, depth, begin * r->width, end * r->width);
+		return;
+	}
+#endif
+	occlude_scalar(r, depth, begin * r->width, end * r->width);
+}
+
+void freenect_register_occlude_rows(t_freenect_register *r, const uint16_t *depth, long begin, long end){
+	freenect_register_occlude_rows_level(r, depth, begin, end, freenect_kernels.level);
+}
+
+void freenect_register_video_rows(t_freenect_register *r, const uint8_t *video, long bpp, long begin, long end){
+	long i = begin * r->width, n = end * r->width;
+	const int32_t *target = r->target;
+	uint8_t *out = r->video;
+	const uint8_t *in;
+	int32_t t;
+
+	if(bpp == 1){
+		for(;i<n;i++){
+			t = target[i];
+			out[i] = (t >= 0) ? video[t] : 0;
+		}
+		return;
+	}
+	for(;i<n;i++){
+		t = target[i];
+		if(t >= 0){
+			in = video + t * 3;
+			out[i * 3] = in[0];
+			out[i * 3 + 1] = in[1];
+			out[i * 3 + 2] = in[2];
+		}
+		else{
+			out[i * 3] = out[i * 3 + 1] = out[i * 3 + 2] = 0;
+		}
+	}
+}
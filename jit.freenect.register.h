@@ -0,0 +1,129 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Software registration of depth and video (the register attribute).
+
+ The depth and the video camera look at the scene from about 2 cm apart, with
+ different lenses. A depth pixel at raw disparity d lands in the video frame
+ at
+
+   column = fxv * (u - cxd) / fxd + cxv + fxv * baseline / z(d)
+   row    = fyv * (v - cyd) / fyd + cyv
+
+ taking the cameras as parallel, which Nicolas Burrus' calibration nearly
+ finds them (the small vertical and forward offsets are left out). Everything
+ but the parallax term depends on the pixel only and goes in a remap table,
+ the parallax depends on d only and goes in a shift table, both built once
+ in fixed point. A pixel's target is then a lookup, an add and a bounds check.
+
+ A Kinect knows its own registration: libfreenect reads it from the device
+ (freenect_copy_registration) as the same two tables, a remap per depth pixel
+ and a parallax per millimetre of depth. Those are used when the source is a
+ Kinect. The intrinsics above, Burrus' for a typical Kinect, are only the
+ fallback for recordings and the simulator.
+
+ Depth is warped into the video camera by scattering every pixel to its
+ target, the nearest reading winning (a z-buffer, raw disparity grows with
+ distance). Targets outside the frame or without a reading are -1. Rows are
+ scattered in bands of FREENECT_REGISTER_BAND, even bands then odd ones: the
+ row mapping shrinks by fyv / fyd, about 0.9, so two bands of a phase never
+ reach the same video row and the bands of a phase can be scattered
+ concurrently.
+
+ Video is warped into the depth camera by gathering each depth pixel's
+ target, once the pixels hidden behind nearer ones in the z-buffer have had
+ their target removed; those, and pixels without one, are black.
+
+ Only raw 11-bit depth is supported: registered depth already is in the
+ video camera. Like the other kernels, nothing here depends on the Max SDK
+ (see bench/).
+*/
+
+#ifndef JIT_FREENECT_REGISTER_H
+#define JIT_FREENECT_REGISTER_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+#include "jit.freenect.cloud.h"
+#include "jit.freenect.lut.h"
+
+#define FREENECT_REGISTER_BAND          16
+#define FREENECT_REGISTER_BASELINE      0.0199852f  // m from the depth to the video camera, Burrus
+#define FREENECT_REGISTER_OCCLUSION     4           // raw units behind the z-buffer that still count as seen
+
+#define FREENECT_REGISTER_DEVICE_MM     10000       // parallax entries of a device, libfreenect's DEPTH_MAX_METRIC_VALUE
+
+// A device's registration, laid out like libfreenect's freenect_registration
+// without depending on it. Columns and parallax are in 1/256 pixel.
+typedef struct _freenect_register_device {
+	const int32_t           (*table)[2];    // per depth pixel, video column at infinity and video row
+	const int32_t           *shift;         // per mm of depth, FREENECT_REGISTER_DEVICE_MM of them
+	const uint16_t          *mm;            // per raw value, depth in mm
+	long                    start_lines;    // padding rows, the targets start height * start_lines later
+} t_freenect_register_device;
+
+typedef struct _freenect_register {
+	long                    width;
+	long                    height;
+	t_freenect_intrinsics   depth_k;
+	t_freenect_intrinsics   video_k;
+	float                   baseline;
+	const void              *device;        // table the remap was copied from, NULL when from the intrinsics
+	uint64_t                key;            // of the calibration, 0 for the default curve
+	int32_t                 *column;        // per depth pixel, target column at infinity, fixed point
+	int32_t                 *row;           // per depth pixel, first video pixel of the target row
+	int32_t                 shift[FREENECT_DEPTH_LUT_SIZE];     // parallax per raw value, fixed point
+	int32_t                 *target;        // per depth pixel, video pixel it lands on or -1
+	uint16_t                *depth;         // depth warped into the video camera
+	uint8_t                 *video;         // video warped into the depth camera, 3 bytes per pixel
+} t_freenect_register;
+
+// Builds the tables for width x height frames (both cameras), or keeps them when
+// nothing changed. r must be zeroed before the first call. cal is NULL for the
+// default curve. Returns 0 on success.
+int     freenect_register_init(t_freenect_register *r, long width, long height, const t_freenect_intrinsics *depth_k,
+							   const t_freenect_intrinsics *video_k, float baseline, const t_freenect_calibration *cal);
+// The same from a device's registration, for frames of its 640x480 depth mode. The
+// device's raw to mm table gives the parallax, unless there is a calibration.
+// Tables copied from a device that has gone must be freed before the next call.
+int     freenect_register_init_device(t_freenect_register *r, long width, long height, const t_freenect_register_device *device,
+									  const t_freenect_calibration *cal);
+void    freenect_register_free(t_freenect_register *r);
+
+// Warping depth: clear, scatter the bands of phase 0 then of phase 1, and r->depth
+// holds the frame. Bands [begin, end) of a phase can be scattered concurrently.
+void    freenect_register_depth_clear(t_freenect_register *r);
+long    freenect_register_bands(const t_freenect_register *r, int phase);
+void    freenect_register_depth_bands(t_freenect_register *r, const uint16_t *depth, int phase, long begin, long end);
+void    freenect_register_depth_bands_level(t_freenect_register *r, const uint16_t *depth, int phase, long begin, long end,
+											t_freenect_cpu_level level);
+
+// Once depth is warped, removes the target of the pixels of rows [begin, end)
+// that are hidden in r->depth
+void    freenect_register_occlude_rows(t_freenect_register *r, const uint16_t *depth, long begin, long end);
+void    freenect_register_occlude_rows_level(t_freenect_register *r, const uint16_t *depth, long begin, long end,
+											 t_freenect_cpu_level level);
+
+// Rows [begin, end) of video (bpp 3, or 1 for IR) warped into r->video through the
+// targets of the last depth frame
+void    freenect_register_video_rows(t_freenect_register *r, const uint8_t *video, long bpp, long begin, long end);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.replay.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint64_t replay_now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void replay_sleep_until(uint64_t due){
+	struct timespec ts;
+	uint64_t now = replay_now_ns();
+
+	if(due <= now){
+		return;
+	}
+	ts.tv_sec = (time_t)((due - now) / 1000000000ull);
+	ts.tv_nsec = (long)((due - now) % 1000000000ull);
+	nanosleep(&ts, NULL);
+}
+
+// For files that were not closed properly: rebuild the index from the record headers
+static int scan_records(t_freenect_replay *r){
+	t_freenect_rec_frame *frame;
+	t_freenect_rec_index *grown;
+	uint64_t offset = sizeof(t_freenect_rec_header), size = 0;
+
+	r->count = 0;
+	r->index = NULL;
+	while(offset + sizeof(t_freenect_rec_frame) <= r->map_size){
+		frame = (t_freenect_rec_frame *)(r->map + offset);
+		if((frame->magic != FREENECT_REC_FRAME_MAGIC) ||
+		   (frame->size > r->map_size - offset - sizeof(t_freenect_rec_frame))){
+			// Torn last record
+			break;
+		}
+		if(r->count == size){
+			size = size ? size * 2 : 4096;
+			grown = (t_freenect_rec_index *)realloc(r->index, size * sizeof(t_freenect_rec_index));
+			if(!grown){
+				free(r->index);
+				r->index = NULL;
+				return -1;
+			}
+			r->index = grown;
+		}
+		r->index[r->count].offset = offset + sizeof(t_freenect_rec_frame);
+		r->index[r->count].time_ns = frame->time_ns;
+		r->index[r->count].size = (uint32_t)frame->size;
+		r->index[r->count].timestamp = frame->timestamp;
+		r->index[r->count].stream = (uint16_t)frame->stream;
+		r->index[r->count].codec = (uint16_t)frame->codec;
+		r->index[r->count].raw_size = (uint32_t)frame->raw_size;
+		r->count++;
+		offset += sizeof(t_freenect_rec_frame) + freenect_rec_align(frame->size);
+	}
+	r->own_index = 1;
+	return r->count ? 0 : -1;
+}
+
+int freenect_replay_open(t_freenect_replay *r, const char *path){
+	struct stat st;
+	uint64_t i;
+	int fd;
+
+	memset(r, 0, sizeof(t_freenect_replay));
+	fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return -1;
+	}
+	if(fstat(fd, &st) || (st.st_size < (off_t)sizeof(t_freenect_rec_header))){
+		close(fd);
+		return -1;
+	}
+	r->map_size = (size_t)st.st_size;
+	// Private and writable: receivers may filter frames in place, the file is never changed
+	r->map = (char *)mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(r->map == MAP_FAILED){
+		r->map = NULL;
+		return -1;
+	}
+	madvise(r->map, r->map_size, MADV_SEQUENTIAL);
+
+	memcpy(&r->header, r->map, sizeof(t_freenect_rec_header));
+	if(memcmp(r->header.magic, FREENECT_REC_MAGIC, sizeof(r->header.magic)) || (r->header.version > FREENECT_REC_VERSION)){
+		freenect_replay_close(r);
+		return -1;
+	}
+
+	// Sizes come from the file, so they are checked without sums or products that could wrap
+	if(r->header.index_offset && (r->header.index_offset <= r->map_size) &&
+	   (r->header.frame_count <= (r->map_size - r->header.index_offset) / sizeof(t_freenect_rec_index))){
+		r->index = (t_freenect_rec_index *)(r->map + r->header.index_offset);
+		r->count = r->header.frame_count;
+	}
+	else if(scan_records(r)){
+		freenect_replay_close(r);
+		return -1;
+	}
+
+	for(i=0;i<r->count;i++){
+		if((r->index[i].offset > r->map_size) || (r->index[i].size > r->map_size - r->index[i].offset)){
+			freenect_replay_close(r);
+			return -1;
+		}
+	}
+	return r->count ? 0 : -1;
+}
+
+static void *replay_threadproc(void *arg){
+	t_freenect_replay *r = (t_freenect_replay *)arg;
+	t_freenect_rec_index *frame;
+	uint64_t i, start;
+
+	while(!__atomic_load_n(&r->cancel, __ATOMIC_ACQUIRE)){
+		start = replay_now_ns();
+		for(i=0;i<r->count;i++){
+			if(__atomic_load_n(&r->cancel, __ATOMIC_ACQUIRE)){
+				break;
+			}
+			frame = &r->index[i];
+			if(r->speed > 0){
+				replay_sleep_until(start + (uint64_t)(frame->time_ns / r->speed));
+			}
+			if(frame->stream == FREENECT_REC_DEPTH){
+				r->depth_cb(r->user, r->map + frame->offset, frame);
+			}
+			else if(frame->stream == FREENECT_REC_VIDEO){
+				r->video_cb(r->user, r->map + frame->offset, frame);
+			}
+			r->played++;
+		}
+	}
+	return NULL;
+}
+
+int freenect_replay_start(t_freenect_replay *r, double speed, void *user,
+						  t_freenect_replay_cb depth_cb, t_freenect_replay_cb video_cb){
+	if(r->running || !r->map){
+		return -1;
+	}
+	r->speed = (speed > 0) ? speed : 0;
+	r->user = user;
+	r->depth_cb = depth_cb;
+	r->video_cb = video_cb;
+	r->played = 0;
+	__atomic_store_n(&r->cancel, 0, __ATOMIC_RELEASE);
+	if(pthread_create(&r->thread, NULL, replay_threadproc, r)){
+		return -1;
+	}
+	r->running = 1;
+	return 0;
+}
+
+void freenect_replay_stop(t_freenect_replay *r){
+	if(!r->running){
+		return;
+	}
+	__atomic_store_n(&r->cancel, 1, __ATOMIC_RELEASE);
+	pthread_join(r->thread, NULL);
+	r->running = 0;
+}
+
+void freenect_replay_close(t_freenect_replay *r){
+	freenect_replay_stop(r);
+	if(r->own_index){
+		free(r->index);
+	}
+	if(r->map){
+		munmap(r->map, r->map_size);
+	}
+	r->map = NULL;
+	r->map_size = 0;
+	r->index = NULL;
+	r->count = 0;
+	r->own_index = 0;
+}
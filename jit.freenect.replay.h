@@ -0,0 +1,69 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Replay of recordings made by jit.freenect.record.
+
+ The file is mapped privately and read/write: frames are handed out as
+ pointers into the mapping, so nothing is copied, and whoever receives them
+ may modify them in place without touching the file (pages are copied on
+ write). A thread walks the index and calls back for each frame, either at
+ the recorded pace (scaled by speed) or as fast as possible, looping at the
+ end of the file.
+*/
+
+#ifndef JIT_FREENECT_REPLAY_H
+#define JIT_FREENECT_REPLAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "jit.freenect.record.h"
+
+// Receives a frame that stays valid until the replay is closed. Frames are passed as
+// stored, FREENECT_REC_PACKED ones have to go through freenect_depth_decode.
+typedef void (*t_freenect_replay_cb)(void *user, void *payload, const t_freenect_rec_index *frame);
+
+typedef struct _freenect_replay {
+	char                    *map;
+	size_t                  map_size;
+	t_freenect_rec_header   header;
+	t_freenect_rec_index    *index;
+	uint64_t                count;
+	int                     own_index;      // index was rebuilt by walking the records
+	double                  speed;          // 1 plays at the recorded pace, 0 as fast as possible
+	void                    *user;
+	t_freenect_replay_cb    depth_cb;
+	t_freenect_replay_cb    video_cb;
+	uint64_t                played;
+	pthread_t               thread;
+	int                     running;
+	int                     cancel;
+} t_freenect_replay;
+
+// Maps path and checks it. Returns 0 on success.
+int     freenect_replay_open(t_freenect_replay *r, const char *path);
+int     freenect_replay_start(t_freenect_replay *r, double speed, void *user,
+							  t_freenect_replay_cb depth_cb, t_freenect_replay_cb video_cb);
+void    freenect_replay_stop(t_freenect_replay *r);
+// Stops and unmaps, every payload handed out becomes invalid
+void    freenect_replay_close(t_freenect_replay *r);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.sim.h"
+#include "jit.freenect.kernels.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define SIM_WALL        1000    // raw depth of the background
+#define SIM_NEAREST     600     // raw depth of the front of the ball
+#define SIM_SHADOW      8       // invalid band on the left, as on a real sensor
+
+static double sim_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void sim_sleep(double seconds){
+	struct timespec ts;
+	if(seconds <= 0){
+		return;
+	}
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+}
+
+#pragma mark - Procedural Frames
+
+// A ball swinging in front of a wall, with the sensor's shadow band and a hole behind the ball
+void freenect_sim_render_depth(uint16_t *out, long width, long height, uint64_t n){
+	long x, y, dx, dy, r2, d2;
+	long cx = width / 2 + (long)(width / 4 * sin(n * 0.05));
+	long cy = height / 2;
+	long radius = height / 4;
+	uint16_t *row;
+
+	r2 = radius * radius;
+	for(y=0;y<height;y++){
+		row = out + width * y;
+		dy = y - cy;
+		for(x=0;x<width;x++){
+			dx = x - cx;
+			d2 = dx * dx + dy * dy;
+			if(x < SIM_SHADOW){
+				row[x] = FREENECT_DEPTH_MAX;
+			}
+			else if(d2 < r2){
+				row[x] = (uint16_t)(SIM_NEAREST + (SIM_WALL - SIM_NEAREST) * d2 / r2 / 2);
+			}
+			else if((dx > 0) && (dx < radius + SIM_SHADOW * 2) && (dy * dy < r2 / 4)){
+				row[x] = FREENECT_DEPTH_MAX;
+			}
+			else{
+				row[x] = (uint16_t)(SIM_WALL + y / 8);
+			}
+		}
+	}
+}
+
+// Scrolling gradients, so tearing or stale frames are easy to spot
+void freenect_sim_render_video(uint8_t *out, long width, long height, long bpp, uint64_t n){
+	long x, y;
+	uint8_t *p = out;
+
+	for(y=0;y<height;y++){
+		for(x=0;x<width;x++){
+			if(bpp == 3){
+				p[0] = (uint8_t)(x + n);
+				p[1] = (uint8_t)(y + n * 2);
+				p[2] = (uint8_t)((x ^ y) + n);
+				p += 3;
+			}
+			else if(bpp == 2){
+				// UYVY: U on even columns, V on odd ones
+				p[0] = (uint8_t)(128 + (((x & 1) ? y : x) + n) % 64 - 32);
+				p[1] = (uint8_t)((x + y + n) & 0xFF);
+				p += 2;
+			}
+			else{
+				*p++ = (uint8_t)((x + y + n) & 0xFF);
+			}
+		}
+	}
+}
+
+#pragma mark - Device
+
+void freenect_sim_init(t_freenect_sim *sim, long width, long height, long video_bpp){
+	memset(sim, 0, sizeof(t_freenect_sim));
+	sim->width = width;
+	sim->height = height;
+	sim->video_bpp = video_bpp;
+	sim->fps = FREENECT_SIM_DEFAULT_FPS;
+	sim->depth_enabled = 1;
+	sim->video_enabled = 1;
+}
+
+// Reads every whole frame of path, returns the frame count or -1
+static long load_frames(const char *path, long frame_bytes, void **data){
+	FILE *f;
+	long size, frames;
+
+	f = fopen(path, "rb");
+	if(!f){
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	frames = size / frame_bytes;
+	if(frames <= 0){
+		fclose(f);
+		return -1;
+	}
+	*data = malloc(frames * frame_bytes);
+	if(!*data || (fread(*data, frame_bytes, frames, f) != (size_t)frames)){
+		free(*data);
+		*data = NULL;
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return frames;
+}
+
+int freenect_sim_load(t_freenect_sim *sim, const char *depth_path, const char *video_path){
+	void *data;
+	long frames;
+
+	if(depth_path){
+		frames = load_frames(depth_path, sim->width * sim->height * sizeof(uint16_t), &data);
+		if(frames < 0){
+			return -1;
+		}
+		free(sim->depth_file);
+		sim->depth_file = (uint16_t *)data;
+		sim->depth_file_frames = frames;
+	}
+	if(video_path){
+		frames = load_frames(video_path, sim->width * sim->height * sim->video_bpp, &data);
+		if(frames < 0){
+			return -1;
+		}
+		free(sim->video_file);
+		sim->video_file = (uint8_t *)data;
+		sim->video_file_frames = frames;
+	}
+	return 0;
+}
+
+void freenect_sim_set_buffers(t_freenect_sim *sim, void *depth_buffer, void *video_buffer){
+	sim->depth_buffer = depth_buffer;
+	sim->video_buffer = video_buffer;
+}
+
+void freenect_sim_enable(t_freenect_sim *sim, int depth, int video){
+	__atomic_store_n(&sim->depth_enabled, depth != 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&sim->video_enabled, video != 0, __ATOMIC_RELAXED);
+}
+
+static void *sim_threadproc(void *arg){
+	t_freenect_sim *sim = (t_freenect_sim *)arg;
+	long depth_bytes = sim->width * sim->height * sizeof(uint16_t);
+	long video_bytes = sim->width * sim->height * sim->video_bpp;
+	double start, next, now, period;
+	uint32_t timestamp;
+	uint64_t n;
+
+	start = next = sim_now();
+	period = (sim->fps > 0) ? 1. / sim->fps : 0.;
+
+	while(!__atomic_load_n(&sim->cancel, __ATOMIC_ACQUIRE)){
+		n = sim->frame++;
+		timestamp = (uint32_t)(uint64_t)((sim_now() - start) * FREENECT_SIM_CLOCK);
+
+		if(sim->depth_buffer && __atomic_load_n(&sim->depth_enabled, __ATOMIC_RELAXED)){
+			if(sim->depth_file){
+				memcpy(sim->depth_buffer, (char *)sim->depth_file + depth_bytes * (n % sim->depth_file_frames), depth_bytes);
+			}
+			else{
+				freenect_sim_render_depth((uint16_t *)sim->depth_buffer, sim->width, sim->height, n);
+			}
+			sim->depth_buffer = sim->depth_cb(sim->user, sim->depth_buffer, timestamp);
+		}
+		if(sim->video_buffer && __atomic_load_n(&sim->video_enabled, __ATOMIC_RELAXED)){
+			if(sim->video_file){
+				memcpy(sim->video_buffer, sim->video_file + video_bytes * (n % sim->video_file_frames), video_bytes);
+			}
+			else{
+				freenect_sim_render_video((uint8_t *)sim->video_buffer, sim->width, sim->height, sim->video_bpp, n);
+			}
+			sim->video_buffer = sim->video_cb(sim->user, sim->video_buffer, timestamp);
+		}
+
+		if(period > 0){
+			next += period;
+			now = sim_now();
+			if(now > next + period){
+				// Fell more than a frame behind, drop the backlog like a real sensor would
+				next = now;
+			}
+			sim_sleep(next - now);
+		}
+	}
+	return NULL;
+}
+
+int freenect_sim_start(t_freenect_sim *sim, double fps, void *user, t_freenect_sim_cb depth_cb, t_freenect_sim_cb video_cb){
+	if(sim->running){
+		return -1;
+	}
+	sim->fps = (fps >= 0) ? fps : FREENECT_SIM_DEFAULT_FPS;
+	sim->user = user;
+	sim->depth_cb = depth_cb;
+	sim->video_cb = video_cb;
+	sim->frame = 0;
+	__atomic_store_n(&sim->cancel, 0, __ATOMIC_RELEASE);
+	if(pthread_create(&sim->thread, NULL, sim_threadproc, sim)){
+		return -1;
+	}
+	sim->running = 1;
+	return 0;
+}
+
+void freenect_sim_stop(t_freenect_sim *sim){
+	if(!sim->running){
+		return;
+	}
+	__atomic_store_n(&sim->cancel, 1, __ATOMIC_RELEASE);
+	pthread_join(sim->thread, NULL);
+	sim->running = 0;
+}
+
+void freenect_sim_free(t_freenect_sim *sim){
+	freenect_sim_stop(sim);
+	free(sim->depth_file);
+	free(sim->video_file);
+	sim->depth_file = NULL;
+	sim->video_file = NULL;
+	sim->depth_file_frames = 0;
+	sim->video_file_frames = 0;
+}
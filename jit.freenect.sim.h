@@ -0,0 +1,83 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Simulated Kinect, used by "open sim" to run the capture pipeline without
+ hardware.
+
+ A thread produces depth and video frames at a fixed rate and hands them over
+ through callbacks shaped like libfreenect's. Like a real device, it fills
+ buffers owned by the caller: each callback returns the buffer to fill next.
+ Frames are procedural, or are read in a loop from raw files holding whole
+ frames back to back (11-bit depth as uint16_t, video as packed RGB, UYVY or
+ 8-bit IR and Bayer). Timestamps use the Kinect's 60 MHz clock.
+
+ Does not depend on the Max SDK so the pipeline can be benchmarked on its own.
+*/
+
+#ifndef JIT_FREENECT_SIM_H
+#define JIT_FREENECT_SIM_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define FREENECT_SIM_CLOCK 60000000     // timestamp ticks per second
+#define FREENECT_SIM_DEFAULT_FPS 30.
+
+// Receives the filled frame, returns the buffer for the next one
+typedef void *(*t_freenect_sim_cb)(void *user, void *pixels, uint32_t timestamp);
+
+typedef struct _freenect_sim {
+	long                width;
+	long                height;
+	long                video_bpp;          // 3 for RGB, 2 for UYVY, 1 for IR and Bayer
+	double              fps;                // 0 runs as fast as possible
+	void                *user;
+	t_freenect_sim_cb   depth_cb;
+	t_freenect_sim_cb   video_cb;
+	void                *depth_buffer;
+	void                *video_buffer;
+	uint16_t            *depth_file;        // frames loaded from disk, or NULL
+	long                depth_file_frames;
+	uint8_t             *video_file;
+	long                video_file_frames;
+	uint64_t            frame;
+	int                 depth_enabled;      // streams produced, set from any thread
+	int                 video_enabled;
+	pthread_t           thread;
+	int                 running;
+	int                 cancel;
+} t_freenect_sim;
+
+void    freenect_sim_init(t_freenect_sim *sim, long width, long height, long video_bpp);
+// Either path may be NULL to keep procedural frames for that stream. Returns 0 on success.
+int     freenect_sim_load(t_freenect_sim *sim, const char *depth_path, const char *video_path);
+void    freenect_sim_set_buffers(t_freenect_sim *sim, void *depth_buffer, void *video_buffer);
+// A disabled stream is neither rendered nor called back, like a stopped Kinect stream. Both start enabled.
+void    freenect_sim_enable(t_freenect_sim *sim, int depth, int video);
+int     freenect_sim_start(t_freenect_sim *sim, double fps, void *user, t_freenect_sim_cb depth_cb, t_freenect_sim_cb video_cb);
+void    freenect_sim_stop(t_freenect_sim *sim);
+void    freenect_sim_free(t_freenect_sim *sim);
+
+// Procedural frame number n
+void    freenect_sim_render_depth(uint16_t *out, long width, long height, uint64_t n);
+void    freenect_sim_render_video(uint8_t *out, long width, long height, long bpp, uint64_t n);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include "jit.freenect.stats.h"
+#include <string.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+#define STATS_INTERVAL_SHIFT 3      // the moving average weighs the newest interval 1/8
+
+uint64_t freenect_now_ns(void){
+#ifdef __APPLE__
+	static mach_timebase_info_data_t timebase;
+	
+	if(!timebase.denom){
+		// Benign race, every thread computes the same value
+		mach_timebase_info(&timebase);
+	}
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#pragma mark - Histogram
+
+// Bucket 0 holds everything below 2^FREENECT_HIST_MIN_SHIFT, then four per power of two
+static int hist_bucket(uint64_t ns){
+	int msb, bucket;
+
+	if(ns < (1ull << FREENECT_HIST_MIN_SHIFT)){
+		return 0;
+	}
+	msb = 63 - __builtin_clzll(ns);
+	bucket = ((msb - FREENECT_HIST_MIN_SHIFT + 1) << 2) | (int)((ns >> (msb - 2)) & 3);
+	return bucket < FREENECT_HIST_BUCKETS ? bucket : FREENECT_HIST_BUCKETS - 1;
+}
+
+// Middle of the bucket's range
+static double hist_value(int bucket){
+	int msb;
+
+	if(bucket < 4){
+		return (double)(1ull << (FREENECT_HIST_MIN_SHIFT - 1));
+	}
+	msb = (bucket >> 2) + FREENECT_HIST_MIN_SHIFT - 1;
+	return (double)((4 + (bucket & 3)) * 2 + 1) * (double)(1ull << (msb - 3));
+}
+
+void freenect_hist_add(t_freenect_hist *h, uint64_t ns){
+	__atomic_add_fetch(&h->counts[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+double freenect_hist_quantile(t_freenect_hist *h, double q){
+	uint64_t counts[FREENECT_HIST_BUCKETS];
+	uint64_t total = 0, rank, seen = 0;
+	int i;
+
+	for(i=0;i<FREENECT_HIST_BUCKETS;i++){
+		counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+		total += counts[i];
+	}
+	if(!total){
+		return 0.;
+	}
+	q = q < 0. ? 0. : (q > 1. ? 1. : q);
+	rank = (uint64_t)(q * (double)(total - 1)) + 1;
+	for(i=0;i<FREENECT_HIST_BUCKETS;i++){
+		seen += counts[i];
+		if(seen >= rank){
+			break;
+		}
+	}
+	return hist_value(i < FREENECT_HIST_BUCKETS ? i : FREENECT_HIST_BUCKETS - 1);
+}
+
+#pragma mark - Streams
+
+void freenect_stats_clear(t_freenect_stream_stats *s){
+	memset(s, 0, sizeof(t_freenect_stream_stats));
+}
+
+void freenect_stats_received(t_freenect_stream_stats *s, uint64_t now){
+	uint64_t interval, delta;
+
+	if(s->last_arrival){
+		delta = now - s->last_arrival;
+		interval = __atomic_load_n(&s->interval, __ATOMIC_RELAXED);
+		interval = interval ? interval - (interval >> STATS_INTERVAL_SHIFT) + (delta >> STATS_INTERVAL_SHIFT) : delta;
+		__atomic_store_n(&s->interval, interval, __ATOMIC_RELAXED);
+	}
+	s->last_arrival = now;
+	__atomic_add_fetch(&s->received, 1, __ATOMIC_RELAXED);
+}
+
+double freenect_stats_fps(t_freenect_stream_stats *s){
+	uint64_t interval = __atomic_load_n(&s->interval, __ATOMIC_RELAXED);
+	return interval ? 1e9 / (double)interval : 0.;
+}
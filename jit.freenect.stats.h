@@ -0,0 +1,95 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Always-on frame statistics.
+
+ Each stream counts the frames received from the device, output to Jitter and
+ dropped along the way, keeps a moving average of the interval between frames,
+ the time spent copying them and a histogram of the delay from the device
+ callback to the output. Every update is one or two relaxed atomic operations
+ on a counter owned by the stream, so any thread may update and any thread may
+ read without taking a lock. Readers see each counter exactly, but not
+ necessarily all of them from the same instant.
+
+ The histogram has four buckets per power of two from 1 us to half an hour,
+ so a quantile is off by at most 12.5%.
+*/
+
+#ifndef JIT_FREENECT_STATS_H
+#define JIT_FREENECT_STATS_H
+
+#include <stdint.h>
+
+#define FREENECT_HIST_MIN_SHIFT  10      // 1024 ns, everything below shares the first bucket
+#define FREENECT_HIST_BUCKETS    128
+
+typedef struct _freenect_hist {
+	uint64_t    counts[FREENECT_HIST_BUCKETS];
+} t_freenect_hist;
+
+typedef struct _freenect_stream_stats {
+	uint64_t        received;       // frames delivered by the device
+	uint64_t        output;         // frames that reached an output matrix
+	uint64_t        dropped;        // frames overwritten or discarded before being output
+	uint64_t        last_arrival;   // ns, capture thread only
+	uint64_t        interval;       // ns between frames, moving average
+	uint64_t        copy_ns;        // summed over every thread taking part in a copy
+	uint64_t        copies;
+	t_freenect_hist latency;        // callback to output
+} t_freenect_stream_stats;
+
+// Monotonic clock in ns, mach_absolute_time() on Apple
+uint64_t    freenect_now_ns(void);
+
+void        freenect_hist_add(t_freenect_hist *h, uint64_t ns);
+// The q-th quantile (0 to 1) in ns, 0 when empty
+double      freenect_hist_quantile(t_freenect_hist *h, double q);
+
+// Not thread safe, only when nothing updates s
+void        freenect_stats_clear(t_freenect_stream_stats *s);
+// Capture thread: a frame arrived at now
+void        freenect_stats_received(t_freenect_stream_stats *s, uint64_t now);
+// Frames per second, from the average interval
+double      freenect_stats_fps(t_freenect_stream_stats *s);
+
+static inline void freenect_stats_dropped(t_freenect_stream_stats *s, uint64_t frames){
+	__atomic_add_fetch(&s->dropped, frames, __ATOMIC_RELAXED);
+}
+
+// A frame that arrived at arrival was output at now
+static inline void freenect_stats_output(t_freenect_stream_stats *s, uint64_t arrival, uint64_t now){
+	__atomic_add_fetch(&s->output, 1, __ATOMIC_RELAXED);
+	freenect_hist_add(&s->latency, now > arrival ? now - arrival : 0);
+}
+
+static inline void freenect_stats_copied(t_freenect_stream_stats *s, uint64_t ns){
+	__atomic_add_fetch(&s->copy_ns, ns, __ATOMIC_RELAXED);
+}
+
+static inline void freenect_stats_copy_done(t_freenect_stream_stats *s){
+	__atomic_add_fetch(&s->copies, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t freenect_stats_get(uint64_t *counter){
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+#endif
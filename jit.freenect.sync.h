@@ -0,0 +1,148 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Non-blocking hand-off between the capture thread and its consumers.
+
+ t_freenect_tribuf is a single-producer, single-consumer triple buffer. The
+ producer owns the back buffer, the consumer owns the front buffer and the
+ middle buffer is exchanged through one atomic word holding its index and a
+ dirty bit. Neither side ever waits for the other.
+
+ t_freenect_sem wakes a consumer thread without taking a lock on the
+ producer side.
+*/
+
+#ifndef JIT_FREENECT_SYNC_H
+#define JIT_FREENECT_SYNC_H
+
+#include <stdint.h>
+
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#endif
+
+#define FREENECT_TRIBUF_INDEX 0x3
+#define FREENECT_TRIBUF_DIRTY 0x4
+
+typedef struct _freenect_tribuf {
+	void        *buffers[3];
+	uint32_t    middle;     // shared: index | FREENECT_TRIBUF_DIRTY, only touched atomically
+	uint32_t    back;       // producer only
+	uint32_t    front;      // consumer only
+} t_freenect_tribuf;
+
+static inline void freenect_tribuf_init(t_freenect_tribuf *tb, void *a, void *b, void *c){
+	tb->buffers[0] = a;
+	tb->buffers[1] = b;
+	tb->buffers[2] = c;
+	tb->back = 0;
+	tb->front = 2;
+	__atomic_store_n(&tb->middle, 1, __ATOMIC_RELEASE);
+}
+
+// Producer: the buffer to fill next
+static inline void *freenect_tribuf_back(t_freenect_tribuf *tb){
+	return tb->buffers[tb->back];
+}
+
+// Producer: replaces the back buffer, to hand out a frame that already sits in memory
+// (e.g. in a mapped recording) instead of filling one
+static inline void freenect_tribuf_set_back(t_freenect_tribuf *tb, void *buffer){
+	tb->buffers[tb->back] = buffer;
+}
+
+// Producer: publishes the back buffer and takes the old middle one as the new back.
+// Returns 1 when the middle buffer had not been read, i.e. a frame was dropped.
+static inline int freenect_tribuf_publish(t_freenect_tribuf *tb){
+	uint32_t prev = __atomic_exchange_n(&tb->middle, tb->back | FREENECT_TRIBUF_DIRTY, __ATOMIC_ACQ_REL);
+	tb->back = prev & FREENECT_TRIBUF_INDEX;
+	return (prev & FREENECT_TRIBUF_DIRTY) != 0;
+}
+
+// Consumer: returns 1 and makes the newest frame the front buffer if one was published
+static inline int freenect_tribuf_acquire(t_freenect_tribuf *tb){
+	uint32_t prev;
+
+	if(!(__atomic_load_n(&tb->middle, __ATOMIC_ACQUIRE) & FREENECT_TRIBUF_DIRTY)){
+		return 0;
+	}
+	prev = __atomic_exchange_n(&tb->middle, tb->front, __ATOMIC_ACQ_REL);
+	tb->front = prev & FREENECT_TRIBUF_INDEX;
+	return 1;
+}
+
+// Consumer: the buffer currently held
+static inline void *freenect_tribuf_front(t_freenect_tribuf *tb){
+	return tb->buffers[tb->front];
+}
+
+// Either side: whether a published frame is waiting
+static inline int freenect_tribuf_pending(t_freenect_tribuf *tb){
+	return (__atomic_load_n(&tb->middle, __ATOMIC_ACQUIRE) & FREENECT_TRIBUF_DIRTY) != 0;
+}
+
+#ifdef __APPLE__
+typedef dispatch_semaphore_t t_freenect_sem;
+
+static inline int freenect_sem_init(t_freenect_sem *sem){
+	*sem = dispatch_semaphore_create(0);
+	return *sem ? 0 : -1;
+}
+
+static inline void freenect_sem_post(t_freenect_sem *sem){
+	dispatch_semaphore_signal(*sem);
+}
+
+static inline void freenect_sem_wait(t_freenect_sem *sem){
+	dispatch_semaphore_wait(*sem, DISPATCH_TIME_FOREVER);
+}
+
+static inline void freenect_sem_destroy(t_freenect_sem *sem){
+	if(*sem){
+		dispatch_release(*sem);
+		*sem = NULL;
+	}
+}
+#else
+typedef sem_t t_freenect_sem;
+
+static inline int freenect_sem_init(t_freenect_sem *sem){
+	return sem_init(sem, 0, 0);
+}
+
+static inline void freenect_sem_post(t_freenect_sem *sem){
+	sem_post(sem);
+}
+
+static inline void freenect_sem_wait(t_freenect_sem *sem){
+	while(sem_wait(sem) != 0){
+		// interrupted by a signal, wait again
+	}
+}
+
+static inline void freenect_sem_destroy(t_freenect_sem *sem){
+	sem_destroy(sem);
+}
+#endif
+
+#endif
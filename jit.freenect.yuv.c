@@ -0,0 +1,139 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+#include <string.h>
+#include "jit.freenect.yuv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FREENECT_X86 1
+#include <immintrin.h>
+#define FREENECT_TARGET(t) __attribute__((target(t)))
+#else
+#define FREENECT_X86 0
+#endif
+
+#pragma mark - Scalar
+
+// Cells [col, cells) of a packed row, source pixels a block apart
+static void packed_scalar(const t_freenect_window *w, const uint8_t *line, long src_width, uint8_t *out, long col, long cells){
+	long a, b, pair;
+
+	for(;col<cells;col++){
+		a = w->x + col * 2 * w->factor;
+		b = a + w->factor;
+		b = (b < src_width) ? b : a;
+		pair = a & ~1L;
+		out[col * 4] = line[pair * 2];
+		out[col * 4 + 1] = line[a * 2 + 1];
+		out[col * 4 + 2] = line[pair * 2 + 2];
+		out[col * 4 + 3] = line[b * 2 + 1];
+	}
+}
+
+// Pixels [col, width) of a luma and chroma row
+static void planar_scalar(const t_freenect_window *w, const uint8_t *line, uint8_t *out, long col){
+	long a;
+
+	for(;col<w->width;col++){
+		a = w->x + col * w->factor;
+		out[col * 2] = line[a * 2 + 1];
+		out[col * 2 + 1] = line[(a & ~1L) * 2 + ((col & 1) ? 2 : 0)];
+	}
+}
+
+// Luma and chroma of an undecimated window starting on an even column are the
+// source with the bytes of each pixel swapped
+static void swap_scalar(const uint8_t *block, uint8_t *out, long i, long width){
+	for(;i<width;i++){
+		out[i * 2] = block[i * 2 + 1];
+		out[i * 2 + 1] = block[i * 2];
+	}
+}
+
+#pragma mark - SIMD
+
+#if FREENECT_X86
+
+FREENECT_TARGET("sse2")
+static void swap_sse2(const uint8_t *block, uint8_t *out, long width){
+	long i;
+	__m128i v;
+
+	for(i=0;i+8<=width;i+=8){
+		v = _mm_loadu_si128((const __m128i *)(block + i * 2));
+		_mm_storeu_si128((__m128i *)(out + i * 2), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+	swap_scalar(block, out, i, width);
+}
+
+FREENECT_TARGET("avx2")
+static void swap_avx2(const uint8_t *block, uint8_t *out, long width){
+	long i;
+	__m256i v;
+
+	for(i=0;i+16<=width;i+=16){
+		v = _mm256_loadu_si256((const __m256i *)(block + i * 2));
+		_mm256_storeu_si256((__m256i *)(out + i * 2), _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8)));
+	}
+	swap_scalar(block, out, i, width);
+}
+
+#endif
+
+#pragma mark - Dispatch
+
+void freenect_yuv_row_level(const t_freenect_window *w, const uint8_t *src, long src_width, long planes, long row,
+							uint8_t *out, t_freenect_cpu_level level){
+	const uint8_t *line = src + (w->y + row * w->factor) * src_width * FREENECT_YUV_BPP;
+	const uint8_t *block = line + w->x * FREENECT_YUV_BPP;
+	int direct = (w->factor == 1) && !(w->x & 1);
+
+	if(level > freenect_cpu_detect()){
+		level = freenect_cpu_detect();
+	}
+	if(planes == 4){
+		if(direct){
+			memcpy(out, block, freenect_yuv_width(w->width, planes) * 4);
+		}
+		else{
+			packed_scalar(w, line, src_width, out, 0, freenect_yuv_width(w->width, planes));
+		}
+		return;
+	}
+	if(!direct){
+		planar_scalar(w, line, out, 0);
+		return;
+	}
+#if FREENECT_X86
+	if(level >= FREENECT_CPU_AVX2){
+		swap_avx2(block, out, w->width);
+		return;
+	}
+	if(level >= FREENECT_CPU_SSE2){
+		swap_sse2(block, out, w->width);
+		return;
+	}
+#endif
+	swap_scalar(block, out, 0, w->width);
+}
+
+void freenect_yuv_row(const t_freenect_window *w, const uint8_t *src, long src_width, long planes, long row, uint8_t *out){
+	freenect_yuv_row_level(w, src, src_width, planes, row, out, freenect_kernels.level);
+}
@@ -0,0 +1,60 @@
+/*
+ Copyright 2010, Jean-Marc Pelletier, Nenad Popov and Andrew Roth
+ jmp@jmpelletier.com
+
+ This file is part of jit.freenect.grab.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+
+ */
+
+/*
+ Output of the Kinect's raw UYVY video (format yuv).
+
+ Asked for YUV_RAW, the camera sends 2 bytes per pixel, U Y V Y for each pair
+ of columns, and libfreenect copies them through untouched. Format rgb turns
+ every pixel into 4 ARGB planes, so a patch that works on luma, or that
+ converts colour on the GPU, moves half the bytes by taking UYVY as is.
+
+ The output is either packed, 4 planes holding U Y0 V Y1 for two pixels per
+ cell, half as wide as the window, or 2 planes per pixel, luma and chroma,
+ with U on even output columns and V on odd ones. Decimated or odd windows
+ give each output pixel the chroma of the source pair it falls in. A packed
+ row of odd width takes the second luma of its last cell from the source
+ pixel after the window, or repeats the last one at the edge of the frame.
+
+ Like the other kernels, nothing here depends on the Max SDK (see bench/).
+*/
+
+#ifndef JIT_FREENECT_YUV_H
+#define JIT_FREENECT_YUV_H
+
+#include <stdint.h>
+#include "jit.freenect.kernels.h"
+#include "jit.freenect.decimate.h"
+
+#define FREENECT_YUV_BPP    2
+
+// Output cells of a window row: two pixels each when packed in 4 planes
+static inline long freenect_yuv_width(long width, long planes){
+	return (planes == 4) ? (width + 1) / 2 : width;
+}
+
+// Output row of the window of the UYVY frame src (src_width pixels per row, even),
+// freenect_yuv_width(w->width, planes) cells of planes bytes written to out.
+// planes is 4 (packed) or 2 (luma and chroma).
+void    freenect_yuv_row(const t_freenect_window *w, const uint8_t *src, long src_width, long planes, long row, uint8_t *out);
+void    freenect_yuv_row_level(const t_freenect_window *w, const uint8_t *src, long src_width, long planes, long row,
+							   uint8_t *out, t_freenect_cpu_level level);
+
+#endif
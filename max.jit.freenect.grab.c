@@ -35,10 +35,11 @@ t_jit_err jit_freenect_grab_init(void);
 void *max_jit_freenect_grab_new(t_symbol *s, long argc, t_atom *argv);
 void max_jit_freenect_grab_free(t_max_jit_freenect_grab *x);
 void max_jit_freenect_grab_outputmatrix(t_max_jit_freenect_grab *x);
+void max_jit_freenect_grab_outputmask(t_max_jit_freenect_grab *x, void *o);
 
 void *max_jit_freenect_grab_class;
 
-t_symbol *ps_gethas_frames, *ps_getunique;
+t_symbol *ps_gethas_frames, *ps_getunique, *ps_mask, *ps_mask_name;
 
 void ext_main(void *r)
 {
@@ -61,6 +62,8 @@ void ext_main(void *r)
 	
 	ps_gethas_frames = gensym("gethas_frames");
 	ps_getunique = gensym("getunique");
+	ps_mask = gensym("mask");
+	ps_mask_name = gensym("mask_name");
 	
 	return 0;
 }
@@ -98,16 +101,33 @@ void max_jit_freenect_grab_outputmatrix(t_max_jit_freenect_grab *x)
 			{
 				jit_error_code(x,err); 
 			} else {
-				if(output)
+				if(output){
+					max_jit_freenect_grab_outputmask(x, o);
 					max_jit_mop_outputmatrix(x);
+				}
 			}
 		} else {
-			if(output)
+			if(output){
+				max_jit_freenect_grab_outputmask(x, o);
 				max_jit_mop_outputmatrix(x);
+			}
 		}
 	}	
 }
 
+// The mask is not a mop output, so that patches keep their outlets: with mask 1 it goes
+// out of dumpout as "mask jit_matrix <name>", right to left before the matrices.
+void max_jit_freenect_grab_outputmask(t_max_jit_freenect_grab *x, void *o)
+{
+	t_atom av[2];
+	
+	if(jit_attr_getlong(o, ps_mask)){
+		jit_atom_setsym(av, _jit_sym_jit_matrix);
+		jit_atom_setsym(av+1, jit_attr_getsym(o, ps_mask_name));
+		max_jit_obex_dumpout(x, ps_mask, 2, av);
+	}
+}
+
 void max_jit_freenect_grab_free(t_max_jit_freenect_grab *x)
 {
 	max_jit_mop_free(x);